@@ -10,11 +10,20 @@
 
 #define _WINSOCKAPI_
 #include <Windows.h>
+#include <sddl.h>
 
 #include <WinSock2.h>
 #include <WS2tcpip.h>
+#include <mstcpip.h>
+#include <afunix.h>
+#include <hvsocket.h>
 #pragma comment(lib, "Ws2_32.lib")
 
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <map>
+
 #include <Mile.Helpers.CppBase.h>
 
 #include <Mile.HyperV.VMBus.h>
@@ -47,1039 +56,11574 @@ namespace
 {
     static SERVICE_STATUS_HANDLE volatile g_ServiceStatusHandle = nullptr;
     static bool volatile g_ServiceIsRunning = true;
+    static bool volatile g_ServiceHandingOff = false;
     static bool volatile g_InteractiveMode = false;
+    static HANDLE g_ServiceStopEvent = nullptr;
+    static HANDLE g_ServiceHandoffEvent = nullptr;
+    static DWORD volatile g_StopRequestedTime = 0;
 }
 
-SOCKET SynthRdpConnectToServer()
+void SynthRdpRequestStop()
 {
-    SOCKET Result = INVALID_SOCKET;
+    g_StopRequestedTime = ::GetTickCount();
+    g_ServiceIsRunning = false;
+    if (g_ServiceStopEvent)
+    {
+        ::SetEvent(g_ServiceStopEvent);
+    }
+}
 
-    std::string ServerHost = "127.0.0.1";
+void SynthRdpReportServiceStopped(
+    _In_ DWORD ExitCode)
+{
+    // The status handle must not be used after the service is reported as
+    // stopped.
+    if (g_ServiceStatusHandle)
     {
-        std::wstring Buffer(32767, L'\0');
-        DWORD Length = static_cast<DWORD>(Buffer.size());
-        if (ERROR_SUCCESS == ::RegGetValueW(
-            HKEY_LOCAL_MACHINE,
-            L"SYSTEM\\CurrentControlSet\\Services\\"
-            L"SynthRdp\\Configurations",
-            L"ServerHost",
-            RRF_RT_REG_SZ | RRF_SUBKEY_WOW6464KEY,
-            nullptr,
-            const_cast<wchar_t*>(Buffer.c_str()),
-            &Length))
-        {
-            Buffer.resize(std::wcslen(Buffer.c_str()));
-            ServerHost = Mile::ToString(CP_UTF8, Buffer);
-        }
+        SERVICE_STATUS ServiceStatus = { 0 };
+        ServiceStatus.dwServiceType = SERVICE_WIN32_OWN_PROCESS;
+        ServiceStatus.dwCurrentState = SERVICE_STOPPED;
+        ServiceStatus.dwControlsAccepted = 0;
+        ServiceStatus.dwWin32ExitCode = ExitCode;
+        ServiceStatus.dwServiceSpecificExitCode = 0;
+        ServiceStatus.dwCheckPoint = 0;
+        ServiceStatus.dwWaitHint = 0;
+        ::SetServiceStatus(g_ServiceStatusHandle, &ServiceStatus);
+        g_ServiceStatusHandle = nullptr;
+    }
+}
+
+DWORD SynthRdpQueryConfigurationDword(
+    _In_ LPCWSTR ValueName,
+    _In_ DWORD DefaultValue)
+{
+    DWORD Data = 0;
+    DWORD Length = sizeof(DWORD);
+    if (ERROR_SUCCESS == ::RegGetValueW(
+        HKEY_LOCAL_MACHINE,
+        L"SYSTEM\\CurrentControlSet\\Services\\"
+        L"SynthRdp\\Configurations",
+        ValueName,
+        RRF_RT_REG_DWORD | RRF_SUBKEY_WOW6464KEY,
+        nullptr,
+        &Data,
+        &Length))
+    {
+        return Data;
     }
 
-    std::string ServerPort = "3389";
+    return DefaultValue;
+}
+
+std::string SynthRdpQueryConfigurationString(
+    _In_ LPCWSTR ValueName,
+    _In_ std::string const& DefaultValue)
+{
+    DWORD Length = 0;
+    if (ERROR_SUCCESS == ::RegGetValueW(
+        HKEY_LOCAL_MACHINE,
+        L"SYSTEM\\CurrentControlSet\\Services\\"
+        L"SynthRdp\\Configurations",
+        ValueName,
+        RRF_RT_REG_SZ | RRF_SUBKEY_WOW6464KEY,
+        nullptr,
+        nullptr,
+        &Length) && Length)
     {
-        DWORD Data = 0;
-        DWORD Length = sizeof(DWORD);
+        std::wstring Buffer(Length / sizeof(wchar_t), L'\0');
         if (ERROR_SUCCESS == ::RegGetValueW(
             HKEY_LOCAL_MACHINE,
             L"SYSTEM\\CurrentControlSet\\Services\\"
             L"SynthRdp\\Configurations",
-            L"ServerPort",
-            RRF_RT_REG_DWORD | RRF_SUBKEY_WOW6464KEY,
+            ValueName,
+            RRF_RT_REG_SZ | RRF_SUBKEY_WOW6464KEY,
             nullptr,
-            &Data,
+            &Buffer[0],
             &Length))
         {
-            ServerPort = Mile::FormatString("%hu", Data);
+            Buffer.resize(std::wcslen(Buffer.c_str()));
+            return Mile::ToString(CP_UTF8, Buffer);
         }
     }
 
-    int LastError = 0;
+    return DefaultValue;
+}
 
-    addrinfo AddressHints = { 0 };
-    AddressHints.ai_family = AF_INET;
-    AddressHints.ai_socktype = SOCK_STREAM;
-    AddressHints.ai_protocol = IPPROTO_TCP;
-    addrinfo* AddressInfo = nullptr;
-    LastError = ::getaddrinfo(
-        ServerHost.c_str(),
-        ServerPort.c_str(),
-        &AddressHints,
-        &AddressInfo);
-    if (0 == LastError)
-    {
-        for (addrinfo* Current = AddressInfo;
-            nullptr != Current;
-            Current = Current->ai_next)
-        {
-            SOCKET Socket = ::WSASocketW(
-                Current->ai_family,
-                Current->ai_socktype,
-                Current->ai_protocol,
-                nullptr,
-                0,
-                WSA_FLAG_OVERLAPPED);
-            if (INVALID_SOCKET == Socket)
-            {
-                LastError = ::WSAGetLastError();
-                continue;
-            }
+struct SynthRdpServerAddress
+{
+    int Family;
+    int SocketType;
+    int Protocol;
+    int AddressLength;
+    sockaddr_storage Address;
+};
 
-            if (SOCKET_ERROR != ::WSAConnect(
-                Socket,
-                Current->ai_addr,
-                static_cast<int>(Current->ai_addrlen),
-                nullptr,
-                nullptr,
-                nullptr,
-                nullptr))
-            {
-                Result = Socket;
-                break;
-            }
+enum class SynthRdpBalancingPolicy : std::uint32_t
+{
+    LeastSessions,
+    Weighted,
+};
 
-            LastError = ::WSAGetLastError();
-            ::closesocket(Socket);
-        }
+// The runtime state of the backend is kept across the configuration reloads,
+// and will never be freed before the service stops.
+struct SynthRdpBackendState
+{
+    // The number of the sessions and the pending connections.
+    LONG volatile ActiveSessions;
+    bool Healthy;
+    LONG CurrentWeight;
+};
 
-        ::freeaddrinfo(AddressInfo);
-    }
+struct SynthRdpBackend
+{
+    std::string Host;
+    std::string Port;
+    DWORD Weight;
+    int ResolveError;
+    std::vector<SynthRdpServerAddress> Addresses;
+    SynthRdpBackendState* State;
+};
 
-    if (INVALID_SOCKET == Result && 0 != LastError)
-    {
-        ::WSASetLastError(LastError);
-    }
+struct SynthRdpServerConfiguration
+{
+    std::vector<SynthRdpBackend> Backends;
+    SynthRdpBalancingPolicy BalancingPolicy;
+    bool TcpNoDelay;
+    bool LoopbackFastPath;
+    DWORD ConnectTimeout;
+    DWORD KeepAliveTime;
+    DWORD KeepAliveInterval;
+    DWORD ResolvedTime;
+    // Changed every time the server endpoints are changed, which makes the
+    // connections to the previous servers can be dropped.
+    DWORD Version;
+};
 
-    return Result;
+// Resolve the server host again in the background after this time even if
+// the configuration is not changed, to follow the DNS record changes.
+const DWORD SynthRdpServerConfigurationMaximumAge = 300000;
+
+// Only the backends which are marked down by the failed connections are
+// probed, in seconds.
+const DWORD SynthRdpDefaultBackendProbeInterval = 10;
+const DWORD SynthRdpBackendProbeTimeout = 2000;
+
+// The TCP keepalive of the connections to the server detects the dead server
+// while the session is idle.
+const DWORD SynthRdpDefaultKeepAliveTime = 60000;
+const DWORD SynthRdpDefaultKeepAliveInterval = 1000;
+
+namespace
+{
+    static CRITICAL_SECTION g_ServerConfigurationLock;
+    static SynthRdpServerConfiguration g_ServerConfiguration;
+    static std::map<std::string, SynthRdpBackendState> g_BackendStates;
+    static bool g_ServerConfigurationClosing = false;
+    static bool g_ServerConfigurationRefreshing = false;
+    static bool g_ServerConfigurationRefreshPending = false;
+    static HANDLE g_ServerConfigurationIdleEvent = nullptr;
+    static HKEY g_ConfigurationsKey = nullptr;
+    static HANDLE g_ConfigurationsChangedEvent = nullptr;
+    static HANDLE g_ConfigurationsWaitHandle = nullptr;
+    static HANDLE g_BackendProbeTimer = nullptr;
+    static LONG volatile g_BackendProbing = 0;
 }
 
-struct SynthRdpServiceConnectionContext
+// The server host with this prefix is the path of the AF_UNIX socket, which
+// bypasses the TCP loopback stack if the server listens on it.
+const char SynthRdpUnixSocketPrefix[] = "unix:";
+
+bool SynthRdpIsUnixSocketHost(
+    _In_ std::string const& Host)
 {
-    std::uint8_t SendBuffer[16384];
-    std::uint8_t RecvBuffer[16384];
-};
+    return 0 == ::_strnicmp(
+        Host.c_str(),
+        SynthRdpUnixSocketPrefix,
+        sizeof(SynthRdpUnixSocketPrefix) - 1);
+}
 
-void SynthRdpRedirectionWorker(
-    _In_ HANDLE PipeHandle)
+SynthRdpBackend SynthRdpMakeBackend(
+    _In_ std::string const& Host,
+    _In_ std::string const& Port,
+    _In_ DWORD Weight)
 {
-    SOCKET Socket = INVALID_SOCKET;
-    SynthRdpServiceConnectionContext* Context = nullptr;
+    SynthRdpBackend Backend;
+    Backend.Host = Host;
+    Backend.Port = Port;
+    Backend.Weight = Weight ? Weight : 1;
+    Backend.ResolveError = 0;
+    Backend.State = nullptr;
+    return Backend;
+}
 
-    do
+void SynthRdpParseBackends(
+    _In_ std::string const& List,
+    _In_ std::string const& DefaultPort,
+    _Out_ std::vector<SynthRdpBackend>& Backends)
+{
+    Backends.clear();
+
+    // The format is "Host[:Port][@Weight];...", and the IPv6 address needs
+    // to be enclosed in square brackets if the port is specified.
+    std::size_t Start = 0;
+    while (Start < List.size())
     {
-        Socket = ::SynthRdpConnectToServer();
-        if (Socket == INVALID_SOCKET)
+        std::size_t End = List.find(';', Start);
+        if (std::string::npos == End)
         {
-            if (g_InteractiveMode)
-            {
-                std::printf(
-                    "[Error] SynthRdpConnectToServer failed (%d).\n",
-                    ::WSAGetLastError());
-            }
-            break;
+            End = List.size();
         }
+        std::string Entry = List.substr(Start, End - Start);
+        Start = End + 1;
 
-        Context = reinterpret_cast<SynthRdpServiceConnectionContext*>(
-            ::MileAllocateMemory(sizeof(SynthRdpServiceConnectionContext)));
-        if (!Context)
+        Entry.erase(0, Entry.find_first_not_of(" \t"));
+        Entry.erase(Entry.find_last_not_of(" \t") + 1);
+        if (Entry.empty())
         {
-            if (g_InteractiveMode)
-            {
-                std::printf(
-                    "[Error] MileAllocateMemory failed.\n");
-            }
-            break;
+            continue;
         }
 
-        // X.224 Connection Request PDU (Patched)
+        DWORD Weight = 1;
+        std::size_t WeightStart = Entry.rfind('@');
+        if (std::string::npos != WeightStart)
         {
-            DWORD NumberOfBytesRead = 0;
-            if (!::MileReadFile(
-                PipeHandle,
-                Context->SendBuffer,
-                static_cast<DWORD>(sizeof(Context->SendBuffer)),
-                &NumberOfBytesRead))
+            Weight = Mile::ToUInt32(Entry.substr(WeightStart + 1));
+            Entry.resize(WeightStart);
+        }
+
+        std::string Host = Entry;
+        std::string Port = DefaultPort;
+        if (::SynthRdpIsUnixSocketHost(Entry))
+        {
+            // The path may contain colons, and there is no port.
+            Port.clear();
+        }
+        else if ('[' == Entry[0])
+        {
+            std::size_t HostEnd = Entry.find(']');
+            if (std::string::npos == HostEnd)
             {
-                if (g_InteractiveMode)
-                {
-                    std::printf(
-                        "[Error] MileReadFile failed (%d).\n",
-                        ::GetLastError());
-                }
-                break;
+                continue;
             }
-
-            // Set requestedProtocols to PROTOCOL_RDP (0x00000000).
-            Context->SendBuffer[15] = 0x00;
-
-            if (g_InteractiveMode)
+            Host = Entry.substr(1, HostEnd - 1);
+            if (HostEnd + 1 < Entry.size() && ':' == Entry[HostEnd + 1])
             {
-                std::wprintf(
-                    L"[Info] MileSocketSend: %d Bytes.\n",
-                    NumberOfBytesRead);
+                Port = Entry.substr(HostEnd + 2);
             }
-
-            DWORD NumberOfBytesSent = 0;
-            DWORD Flags = 0;
-            if (!::MileSocketSend(
-                Socket,
-                Context->SendBuffer,
-                NumberOfBytesRead,
-                &NumberOfBytesSent,
-                Flags))
+        }
+        else
+        {
+            std::size_t PortStart = Entry.find(':');
+            if (std::string::npos != PortStart &&
+                std::string::npos == Entry.find(':', PortStart + 1))
             {
-                if (g_InteractiveMode)
-                {
-                    std::printf(
-                        "[Error] MileSocketSend failed (%d).\n",
-                        ::WSAGetLastError());
-                }
-                break;
+                Host = Entry.substr(0, PortStart);
+                Port = Entry.substr(PortStart + 1);
             }
         }
 
-        bool volatile ShouldRunning = true;
+        Backends.push_back(::SynthRdpMakeBackend(Host, Port, Weight));
+    }
+}
 
-        HANDLE Vmbus2TcpThread = Mile::CreateThread([&]()
-        {
-            for (; ShouldRunning && g_ServiceIsRunning;)
-            {
-                DWORD NumberOfBytesRead = 0;
-                if (!::MileReadFile(
-                    PipeHandle,
-                    Context->SendBuffer,
-                    static_cast<DWORD>(sizeof(Context->SendBuffer)),
-                    &NumberOfBytesRead))
-                {
-                    if (g_InteractiveMode)
-                    {
-                        std::printf(
-                            "[Error] MileReadFile failed (%d).\n",
-                            ::GetLastError());
-                    }
-                    break;
-                }
+void SynthRdpReadServerConfiguration(
+    _Out_ SynthRdpServerConfiguration& Configuration)
+{
+    std::string ServerPort = Mile::FormatString(
+        "%hu",
+        static_cast<std::uint16_t>(::SynthRdpQueryConfigurationDword(
+            L"ServerPort",
+            3389)));
 
-                if (g_InteractiveMode)
-                {
-                    std::printf(
-                        "[Info] MileSocketSend: %d Bytes.\n",
-                        NumberOfBytesRead);
-                }
+    ::SynthRdpParseBackends(
+        ::SynthRdpQueryConfigurationString(L"Backends", std::string()),
+        ServerPort,
+        Configuration.Backends);
+    if (Configuration.Backends.empty())
+    {
+        Configuration.Backends.push_back(::SynthRdpMakeBackend(
+            ::SynthRdpQueryConfigurationString(L"ServerHost", "127.0.0.1"),
+            ServerPort,
+            1));
+    }
 
-                DWORD NumberOfBytesSent = 0;
-                DWORD Flags = 0;
-                if (!::MileSocketSend(
-                    Socket,
-                    Context->SendBuffer,
-                    NumberOfBytesRead,
-                    &NumberOfBytesSent,
-                    Flags))
-                {
-                    if (g_InteractiveMode)
-                    {
-                        std::printf(
-                            "[Error] MileSocketSend failed (%d).\n",
-                            ::WSAGetLastError());
-                    }
-                    break;
-                }
-            }
-        });
+    Configuration.BalancingPolicy = SynthRdpBalancingPolicy::LeastSessions;
+    if (0 == ::_stricmp(::SynthRdpQueryConfigurationString(
+        L"BalancingPolicy",
+        std::string()).c_str(), "Weighted"))
+    {
+        Configuration.BalancingPolicy = SynthRdpBalancingPolicy::Weighted;
+    }
 
-        HANDLE Tcp2VmbusThread = Mile::CreateThread([&]()
-        {
-            for (; ShouldRunning && g_ServiceIsRunning;)
-            {
-                DWORD NumberOfBytesRecvd = 0;
-                DWORD Flags = MSG_PARTIAL;
-                if (!::MileSocketRecv(
-                    Socket,
-                    Context->RecvBuffer,
-                    static_cast<DWORD>(sizeof(Context->RecvBuffer)),
-                    &NumberOfBytesRecvd,
-                    &Flags))
-                {
-                    if (g_InteractiveMode)
-                    {
-                        std::printf(
-                            "[Error] MileSocketRecv failed (%d).\n",
-                            ::WSAGetLastError());
-                    }
-                    break;
-                }
+    Configuration.TcpNoDelay = (0 != ::SynthRdpQueryConfigurationDword(
+        L"TcpNoDelay",
+        TRUE));
 
-                if (g_InteractiveMode)
-                {
-                    std::printf(
-                        "[Info] MileWriteFile: %d Bytes.\n",
-                        NumberOfBytesRecvd);
-                }
+    Configuration.LoopbackFastPath = (0 != ::SynthRdpQueryConfigurationDword(
+        L"LoopbackFastPath",
+        FALSE));
 
-                DWORD NumberOfBytesWritten = 0;
-                if (!::MileWriteFile(
-                    PipeHandle,
-                    Context->RecvBuffer,
-                    NumberOfBytesRecvd,
-                    &NumberOfBytesWritten))
-                {
-                    if (g_InteractiveMode)
-                    {
-                        std::printf(
-                            "[Error] MileWriteFile failed (%d).\n",
-                            ::GetLastError());
-                    }
-                    break;
-                }
-            }
-        });
+    Configuration.ConnectTimeout = ::SynthRdpQueryConfigurationDword(
+        L"ConnectTimeout",
+        10000);
+    if (!Configuration.ConnectTimeout)
+    {
+        Configuration.ConnectTimeout = 10000;
+    }
 
-        for (;;)
+    // Zero disables the TCP keepalive.
+    Configuration.KeepAliveTime = ::SynthRdpQueryConfigurationDword(
+        L"KeepAliveTime",
+        SynthRdpDefaultKeepAliveTime);
+    Configuration.KeepAliveInterval = ::SynthRdpQueryConfigurationDword(
+        L"KeepAliveInterval",
+        SynthRdpDefaultKeepAliveInterval);
+    if (!Configuration.KeepAliveInterval)
+    {
+        Configuration.KeepAliveInterval = SynthRdpDefaultKeepAliveInterval;
+    }
+}
+
+int SynthRdpResolveBackend(
+    _Inout_ SynthRdpBackend& Backend)
+{
+    Backend.Addresses.clear();
+
+    if (::SynthRdpIsUnixSocketHost(Backend.Host))
+    {
+        std::string Path = Backend.Host.substr(
+            sizeof(SynthRdpUnixSocketPrefix) - 1);
+
+        SynthRdpServerAddress Address = { 0 };
+        Address.Family = AF_UNIX;
+        Address.SocketType = SOCK_STREAM;
+        Address.Protocol = 0;
+        Address.AddressLength = sizeof(sockaddr_un);
+        sockaddr_un* UnixAddress =
+            reinterpret_cast<sockaddr_un*>(&Address.Address);
+        UnixAddress->sun_family = AF_UNIX;
+        if (Path.empty() || Path.size() >= sizeof(UnixAddress->sun_path))
         {
-            if (WAIT_TIMEOUT != ::WaitForSingleObject(
-                Vmbus2TcpThread,
-                100))
+            Backend.ResolveError = EAI_FAIL;
+            return Backend.ResolveError;
+        }
+        std::memcpy(UnixAddress->sun_path, Path.c_str(), Path.size());
+
+        Backend.ResolveError = 0;
+        Backend.Addresses.push_back(Address);
+        return Backend.ResolveError;
+    }
+
+    addrinfo AddressHints = { 0 };
+    AddressHints.ai_family = AF_UNSPEC;
+    AddressHints.ai_socktype = SOCK_STREAM;
+    AddressHints.ai_protocol = IPPROTO_TCP;
+    addrinfo* AddressInfo = nullptr;
+    Backend.ResolveError = ::getaddrinfo(
+        Backend.Host.c_str(),
+        Backend.Port.c_str(),
+        &AddressHints,
+        &AddressInfo);
+    if (0 == Backend.ResolveError)
+    {
+        // Interleave the address families for the staggered connection
+        // attempts, which is recommended by RFC 8305.
+        std::vector<SynthRdpServerAddress> PreferredAddresses;
+        std::vector<SynthRdpServerAddress> OtherAddresses;
+        for (addrinfo* Current = AddressInfo;
+            nullptr != Current;
+            Current = Current->ai_next)
+        {
+            SynthRdpServerAddress Address = { 0 };
+            Address.Family = Current->ai_family;
+            Address.SocketType = Current->ai_socktype;
+            Address.Protocol = Current->ai_protocol;
+            Address.AddressLength = static_cast<int>(Current->ai_addrlen);
+            std::memcpy(
+                &Address.Address,
+                Current->ai_addr,
+                Current->ai_addrlen);
+            if (AddressInfo->ai_family == Address.Family)
             {
-                ShouldRunning = false;
-                break;
+                PreferredAddresses.push_back(Address);
             }
-
-            if (WAIT_TIMEOUT != ::WaitForSingleObject(
-                Tcp2VmbusThread,
-                100))
+            else
             {
-                ShouldRunning = false;
-                break;
+                OtherAddresses.push_back(Address);
             }
         }
 
-        if (Vmbus2TcpThread)
-        {
-            ::CloseHandle(Vmbus2TcpThread);
-            Vmbus2TcpThread = nullptr;
-        }
+        ::freeaddrinfo(AddressInfo);
 
-        if (Tcp2VmbusThread)
+        for (std::size_t i = 0;
+            i < PreferredAddresses.size() || i < OtherAddresses.size();
+            ++i)
         {
-            ::CloseHandle(Tcp2VmbusThread);
-            Tcp2VmbusThread = nullptr;
+            if (i < PreferredAddresses.size())
+            {
+                Backend.Addresses.push_back(PreferredAddresses[i]);
+            }
+            if (i < OtherAddresses.size())
+            {
+                Backend.Addresses.push_back(OtherAddresses[i]);
+            }
         }
+    }
 
-    } while (false);
+    return Backend.ResolveError;
+}
+
+bool SynthRdpIsSameServerAddress(
+    _In_ SynthRdpServerAddress const& Left,
+    _In_ SynthRdpServerAddress const& Right)
+{
+    return
+        Left.Family == Right.Family &&
+        Left.SocketType == Right.SocketType &&
+        Left.Protocol == Right.Protocol &&
+        Left.AddressLength == Right.AddressLength &&
+        0 == std::memcmp(&Left.Address, &Right.Address, Left.AddressLength);
+}
 
-    if (Context)
+// The order is ignored because the DNS servers may rotate the records.
+bool SynthRdpIsSameServerAddresses(
+    _In_ std::vector<SynthRdpServerAddress> const& Left,
+    _In_ std::vector<SynthRdpServerAddress> const& Right)
+{
+    if (Left.size() != Right.size())
     {
-        ::MileFreeMemory(Context);
+        return false;
     }
 
-    if (Socket != INVALID_SOCKET)
+    for (SynthRdpServerAddress const& Current : Left)
     {
-        ::closesocket(Socket);
+        bool Found = false;
+        for (SynthRdpServerAddress const& Candidate : Right)
+        {
+            if (::SynthRdpIsSameServerAddress(Current, Candidate))
+            {
+                Found = true;
+                break;
+            }
+        }
+        if (!Found)
+        {
+            return false;
+        }
     }
+
+    return true;
 }
 
-DWORD SynthRdpMain()
+void SynthRdpUpdateServerConfiguration(
+    _Inout_ SynthRdpServerConfiguration& Configuration)
 {
-    WSADATA WSAData = { 0 };
+    for (SynthRdpBackend& Backend : Configuration.Backends)
     {
-        int WSAError = ::WSAStartup(MAKEWORD(2, 2), &WSAData);
-        if (NO_ERROR != WSAError)
-        {
-            if (g_InteractiveMode)
-            {
-                std::printf(
-                    "[Error] WSAStartup failed (%d).\n",
-                    WSAError);
-            }
-            return WSAError;
-        }
+        ::SynthRdpResolveBackend(Backend);
     }
+    Configuration.ResolvedTime = ::GetTickCount();
 
-    DWORD Error = ERROR_SUCCESS;
-
-    HANDLE ControlChannelHandle = INVALID_HANDLE_VALUE;
+    ::EnterCriticalSection(&g_ServerConfigurationLock);
 
-    do
+    bool Changed =
+        Configuration.Backends.size() !=
+        g_ServerConfiguration.Backends.size() ||
+        Configuration.TcpNoDelay != g_ServerConfiguration.TcpNoDelay ||
+        Configuration.LoopbackFastPath !=
+        g_ServerConfiguration.LoopbackFastPath ||
+        Configuration.ConnectTimeout != g_ServerConfiguration.ConnectTimeout ||
+        Configuration.KeepAliveTime != g_ServerConfiguration.KeepAliveTime ||
+        Configuration.KeepAliveInterval !=
+        g_ServerConfiguration.KeepAliveInterval;
+    for (std::size_t i = 0; i < Configuration.Backends.size(); ++i)
     {
-        ControlChannelHandle = ::VmbusPipeClientTryOpenChannel(
-            &SYNTHRDP_CONTROL_CLASS_ID,
-            &SYNTHRDP_CONTROL_INSTANCE_ID,
-            INFINITE,
-            FILE_FLAG_OVERLAPPED);
-        if (INVALID_HANDLE_VALUE == ControlChannelHandle)
-        {
-            Error = ::GetLastError();
-            if (g_InteractiveMode)
-            {
-                std::printf(
-                    "[Error] VmbusPipeClientTryOpenChannel failed (%d).\n",
-                    Error);
-            }
-            break;
-        }
+        SynthRdpBackend& Backend = Configuration.Backends[i];
 
-        SYNTHRDP_VERSION_REQUEST_MESSAGE Request;
-        std::memset(
-            &Request,
-            0,
-            sizeof(SYNTHRDP_VERSION_REQUEST_MESSAGE));
-        Request.Header.Type = SynthrdpVersionRequest;
-        Request.Header.Size = 0;
-        Request.Version.AsDWORD = SYNTHRDP_VERSION_WINBLUE;
-        Request.Reserved = 0;
-        DWORD NumberOfBytesWritten = 0;
-        if (!::MileWriteFile(
-            ControlChannelHandle,
-            &Request,
-            sizeof(Request),
-            &NumberOfBytesWritten))
+        std::string Key = Backend.Host + "|" + Backend.Port;
+        auto Current = g_BackendStates.find(Key);
+        if (g_BackendStates.end() == Current)
         {
-            Error = ::GetLastError();
-            if (g_InteractiveMode)
-            {
-                std::printf(
-                    "[Error] MileWriteFile failed (%d).\n",
-                    Error);
-            }
-            break;
+            SynthRdpBackendState State;
+            State.ActiveSessions = 0;
+            State.Healthy = true;
+            State.CurrentWeight = 0;
+            Current = g_BackendStates.emplace(Key, State).first;
         }
+        Backend.State = &Current->second;
 
-        if (sizeof(SYNTHRDP_VERSION_REQUEST_MESSAGE) != NumberOfBytesWritten)
+        // The resolved addresses are also compared for dropping the
+        // connections to the previous addresses after the DNS record is
+        // changed.
+        if (!Changed)
         {
-            Error = ERROR_INVALID_DATA;
-            if (g_InteractiveMode)
-            {
-                std::printf(
-                    "[Error] SYNTHRDP_VERSION_REQUEST_MESSAGE Invalid.\n");
-            }
-            break;
+            SynthRdpBackend& Previous = g_ServerConfiguration.Backends[i];
+            Changed =
+                Backend.Host != Previous.Host ||
+                Backend.Port != Previous.Port ||
+                !::SynthRdpIsSameServerAddresses(
+                    Backend.Addresses,
+                    Previous.Addresses);
         }
+    }
 
-        SYNTHRDP_VERSION_RESPONSE_MESSAGE Response;
-        std::memset(
-            &Response,
-            0,
-            sizeof(SYNTHRDP_VERSION_RESPONSE_MESSAGE));
-        DWORD NumberOfBytesRead = 0;
-        if (!::MileReadFile(
-            ControlChannelHandle,
-            &Response,
-            sizeof(Response),
-            &NumberOfBytesRead))
+    Configuration.Version = g_ServerConfiguration.Version;
+    if (Changed)
+    {
+        ++Configuration.Version;
+    }
+    g_ServerConfiguration = Configuration;
+
+    ::LeaveCriticalSection(&g_ServerConfigurationLock);
+}
+
+void SynthRdpRefreshServerConfiguration()
+{
+    SynthRdpServerConfiguration Configuration;
+    ::SynthRdpReadServerConfiguration(Configuration);
+    ::SynthRdpUpdateServerConfiguration(Configuration);
+}
+
+void SynthRdpRefreshServerConfigurationWorker()
+{
+    for (;;)
+    {
+        ::EnterCriticalSection(&g_ServerConfigurationLock);
+        bool NeedRefresh =
+            !g_ServerConfigurationClosing &&
+            g_ServerConfigurationRefreshPending;
+        g_ServerConfigurationRefreshPending = false;
+        if (!NeedRefresh)
         {
-            Error = ::GetLastError();
-            if (g_InteractiveMode)
-            {
-                std::printf(
-                    "[Error] MileReadFile failed (%d).\n",
-                    Error);
-            }
-            break;
+            g_ServerConfigurationRefreshing = false;
+            ::SetEvent(g_ServerConfigurationIdleEvent);
         }
-
-        if (sizeof(SYNTHRDP_VERSION_RESPONSE_MESSAGE) != NumberOfBytesRead ||
-            SYNTHRDP_TRUE_WITH_VERSION_EXCHANGE != Response.IsAccepted)
+        ::LeaveCriticalSection(&g_ServerConfigurationLock);
+        if (!NeedRefresh)
         {
-            Error = ERROR_INVALID_DATA;
-            if (g_InteractiveMode)
-            {
-                std::printf(
-                    "[Error] SYNTHRDP_VERSION_RESPONSE_MESSAGE Invalid.\n");
-            }
             break;
         }
 
-        GUID Instances[] =
-        {
-            SYNTHRDP_DATA_INSTANCE_ID_1,
-            SYNTHRDP_DATA_INSTANCE_ID_2,
-            SYNTHRDP_DATA_INSTANCE_ID_3,
-            SYNTHRDP_DATA_INSTANCE_ID_4,
-            SYNTHRDP_DATA_INSTANCE_ID_5
-        };
-        for (size_t i = 0; g_ServiceIsRunning; ++i)
-        {
-            HANDLE DataChannelHandle = ::VmbusPipeClientTryOpenChannel(
-                &SYNTHRDP_DATA_CLASS_ID,
-                &Instances[i % (sizeof(Instances) / sizeof(*Instances))],
-                50,
-                FILE_FLAG_OVERLAPPED);
-            if (INVALID_HANDLE_VALUE == DataChannelHandle)
-            {
-                continue;
-            }
+        ::SynthRdpRefreshServerConfiguration();
+    }
+}
 
-            ::SynthRdpRedirectionWorker(DataChannelHandle);
+void SynthRdpRequestServerConfigurationRefresh()
+{
+    bool ShouldStart = false;
 
-            ::CloseHandle(DataChannelHandle);
-        }
+    // The pending flag makes the running refresh read the configuration
+    // again, so the latest change will never be missed.
+    ::EnterCriticalSection(&g_ServerConfigurationLock);
+    g_ServerConfigurationRefreshPending = true;
+    if (!g_ServerConfigurationClosing && !g_ServerConfigurationRefreshing)
+    {
+        g_ServerConfigurationRefreshing = true;
+        ::ResetEvent(g_ServerConfigurationIdleEvent);
+        ShouldStart = true;
+    }
+    ::LeaveCriticalSection(&g_ServerConfigurationLock);
 
-    } while (false);
+    if (ShouldStart && !::QueueUserWorkItem(
+        [](LPVOID) -> DWORD
+        {
+            ::SynthRdpRefreshServerConfigurationWorker();
+            return 0;
+        },
+        nullptr,
+        WT_EXECUTELONGFUNCTION))
+    {
+        ::EnterCriticalSection(&g_ServerConfigurationLock);
+        g_ServerConfigurationRefreshing = false;
+        ::SetEvent(g_ServerConfigurationIdleEvent);
+        ::LeaveCriticalSection(&g_ServerConfigurationLock);
+    }
+}
 
-    if (INVALID_HANDLE_VALUE != ControlChannelHandle)
+SynthRdpServerConfiguration SynthRdpGetServerConfiguration()
+{
+    ::EnterCriticalSection(&g_ServerConfigurationLock);
+    SynthRdpServerConfiguration Configuration = g_ServerConfiguration;
+    ::LeaveCriticalSection(&g_ServerConfigurationLock);
+
+    if (::GetTickCount() - Configuration.ResolvedTime >=
+        SynthRdpServerConfigurationMaximumAge)
     {
-        ::CloseHandle(ControlChannelHandle);
+        ::SynthRdpRequestServerConfigurationRefresh();
     }
 
-    ::WSACleanup();
+    return Configuration;
+}
 
-    return Error;
+bool SynthRdpWatchConfigurations()
+{
+    // The notification is removed when the thread which registered it
+    // exits, so register it again in the persistent wait thread.
+    return (ERROR_SUCCESS == ::RegNotifyChangeKeyValue(
+        g_ConfigurationsKey,
+        FALSE,
+        REG_NOTIFY_CHANGE_LAST_SET,
+        g_ConfigurationsChangedEvent,
+        TRUE));
 }
 
-namespace
+void SynthRdpProbeBackends();
+
+DWORD SynthRdpConfigurationStartup(
+    _In_ bool Watch)
 {
-    std::wstring GetCurrentProcessModulePath()
+    g_ServerConfigurationIdleEvent = ::CreateEventW(
+        nullptr,
+        TRUE,
+        TRUE,
+        nullptr);
+    if (!g_ServerConfigurationIdleEvent)
     {
-        // 32767 is the maximum path length without the terminating null
-        // character.
-        std::wstring Path(32767, L'\0');
-        Path.resize(::GetModuleFileNameW(
-            nullptr, &Path[0], static_cast<DWORD>(Path.size())));
-        return Path;
+        return ::GetLastError();
     }
 
-    static std::wstring g_ServiceName =
-        L"SynthRdp";
-    static std::wstring g_DisplayName =
-        L"Hyper-V Enhanced Session Proxy Service";
-}
+    ::InitializeCriticalSection(&g_ServerConfigurationLock);
+    g_ServerConfiguration.Version = 0;
+    g_ServerConfigurationClosing = false;
+    g_ServerConfigurationRefreshing = false;
+    g_ServerConfigurationRefreshPending = false;
 
-void WINAPI SynthRdpServiceHandler(
-    _In_ DWORD dwControl)
-{
-    switch (dwControl)
+    ::SynthRdpRefreshServerConfiguration();
+
+    if (!Watch)
     {
-    case SERVICE_CONTROL_STOP:
+        return ERROR_SUCCESS;
+    }
+
+    DWORD Error = ::RegCreateKeyExW(
+        HKEY_LOCAL_MACHINE,
+        L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
+        0,
+        nullptr,
+        0,
+        KEY_NOTIFY | KEY_WOW64_64KEY,
+        nullptr,
+        &g_ConfigurationsKey,
+        nullptr);
+    if (ERROR_SUCCESS != Error)
     {
-        SERVICE_STATUS ServiceStatus = { 0 };
-        ServiceStatus.dwServiceType = SERVICE_WIN32_OWN_PROCESS;
-        ServiceStatus.dwCurrentState = SERVICE_STOP_PENDING;
-        ServiceStatus.dwControlsAccepted = SERVICE_ACCEPT_STOP;
-        ServiceStatus.dwWin32ExitCode = ERROR_SUCCESS;
-        ServiceStatus.dwServiceSpecificExitCode = 0;
-        ServiceStatus.dwCheckPoint = 0;
-        ServiceStatus.dwWaitHint = 0;
-        ::SetServiceStatus(g_ServiceStatusHandle, &ServiceStatus);
+        return Error;
+    }
 
-        g_ServiceIsRunning = false;
+    g_ConfigurationsChangedEvent = ::CreateEventW(
+        nullptr,
+        FALSE,
+        FALSE,
+        nullptr);
+    if (!g_ConfigurationsChangedEvent)
+    {
+        return ::GetLastError();
+    }
 
-        break;
+    if (!::RegisterWaitForSingleObject(
+        &g_ConfigurationsWaitHandle,
+        g_ConfigurationsChangedEvent,
+        [](PVOID, BOOLEAN)
+        {
+            ::SynthRdpWatchConfigurations();
+            ::SynthRdpRequestServerConfigurationRefresh();
+        },
+        nullptr,
+        INFINITE,
+        WT_EXECUTEINWAITTHREAD))
+    {
+        return ::GetLastError();
     }
-    default:
-        break;
+
+    // Register the first notification in the wait thread as well.
+    ::SetEvent(g_ConfigurationsChangedEvent);
+
+    DWORD ProbeInterval = ::SynthRdpQueryConfigurationDword(
+        L"BackendProbeInterval",
+        SynthRdpDefaultBackendProbeInterval);
+    if (ProbeInterval)
+    {
+        if (ProbeInterval > SynthRdpServerConfigurationMaximumAge / 1000)
+        {
+            ProbeInterval = SynthRdpServerConfigurationMaximumAge / 1000;
+        }
+        ProbeInterval *= 1000;
+
+        if (!::CreateTimerQueueTimer(
+            &g_BackendProbeTimer,
+            nullptr,
+            [](PVOID, BOOLEAN)
+            {
+                ::SynthRdpProbeBackends();
+            },
+            nullptr,
+            ProbeInterval,
+            ProbeInterval,
+            WT_EXECUTELONGFUNCTION))
+        {
+            return ::GetLastError();
+        }
     }
+
+    return ERROR_SUCCESS;
 }
 
-void WINAPI SynthRdpServiceMain(
-    _In_ DWORD dwNumServicesArgs,
-    _In_ LPWSTR* lpServiceArgVectors)
+void SynthRdpConfigurationCleanup()
 {
-    UNREFERENCED_PARAMETER(dwNumServicesArgs);
-    UNREFERENCED_PARAMETER(lpServiceArgVectors);
+    if (!g_ServerConfigurationIdleEvent)
+    {
+        return;
+    }
 
-    g_ServiceStatusHandle = ::RegisterServiceCtrlHandlerW(
-        g_ServiceName.c_str(),
-        ::SynthRdpServiceHandler);
-    if (g_ServiceStatusHandle)
+    if (g_BackendProbeTimer)
     {
-        SERVICE_STATUS ServiceStatus = { 0 };
-        ServiceStatus.dwServiceType = SERVICE_WIN32_OWN_PROCESS;
-        ServiceStatus.dwCurrentState = SERVICE_RUNNING;
-        ServiceStatus.dwControlsAccepted = SERVICE_ACCEPT_STOP;
-        ServiceStatus.dwWin32ExitCode = ERROR_SUCCESS;
-        ServiceStatus.dwServiceSpecificExitCode = 0;
-        ServiceStatus.dwCheckPoint = 0;
-        ServiceStatus.dwWaitHint = 0;
-        if (::SetServiceStatus(g_ServiceStatusHandle, &ServiceStatus))
-        {
-            ServiceStatus.dwCurrentState = SERVICE_STOPPED;
-            ServiceStatus.dwControlsAccepted = 0;
-            ServiceStatus.dwWin32ExitCode = ::SynthRdpMain();
-            ::SetServiceStatus(g_ServiceStatusHandle, &ServiceStatus);
-        }
+        ::DeleteTimerQueueTimer(
+            nullptr,
+            g_BackendProbeTimer,
+            INVALID_HANDLE_VALUE);
+        g_BackendProbeTimer = nullptr;
+    }
+
+    if (g_ConfigurationsWaitHandle)
+    {
+        ::UnregisterWaitEx(g_ConfigurationsWaitHandle, INVALID_HANDLE_VALUE);
+        g_ConfigurationsWaitHandle = nullptr;
     }
+
+    if (g_ConfigurationsKey)
+    {
+        ::RegCloseKey(g_ConfigurationsKey);
+        g_ConfigurationsKey = nullptr;
+    }
+
+    if (g_ConfigurationsChangedEvent)
+    {
+        ::CloseHandle(g_ConfigurationsChangedEvent);
+        g_ConfigurationsChangedEvent = nullptr;
+    }
+
+    ::EnterCriticalSection(&g_ServerConfigurationLock);
+    g_ServerConfigurationClosing = true;
+    ::LeaveCriticalSection(&g_ServerConfigurationLock);
+
+    ::WaitForSingleObject(g_ServerConfigurationIdleEvent, INFINITE);
+    ::CloseHandle(g_ServerConfigurationIdleEvent);
+    g_ServerConfigurationIdleEvent = nullptr;
+
+    g_ServerConfiguration = SynthRdpServerConfiguration();
+    ::DeleteCriticalSection(&g_ServerConfigurationLock);
 }
 
-int SynthRdpInstallService()
+struct SynthRdpConnectAttempt
 {
-    DWORD Error = ERROR_SUCCESS;
+    SOCKET Socket;
+    WSAEVENT Event;
+    DWORD StartTime;
+    std::size_t AddressIndex;
+};
 
-    std::wstring ServiceBinaryPath =
-        ::GetCurrentProcessModulePath() + L" Service";
+// The delay before starting the next connection attempt if the previous one
+// is still pending, which is recommended by RFC 8305.
+const DWORD SynthRdpConnectAttemptDelay = 250;
 
-    SC_HANDLE ServiceControlManagerHandle = ::OpenSCManagerW(
-        nullptr,
-        nullptr,
-        SC_MANAGER_CONNECT | SC_MANAGER_CREATE_SERVICE);
-    if (ServiceControlManagerHandle)
+// Leave one wait slot for the service stop event.
+const std::size_t SynthRdpMaximumConnectAttempts = MAXIMUM_WAIT_OBJECTS - 1;
+
+void SynthRdpFinishConnectAttempt(
+    _In_ SynthRdpConnectAttempt& Attempt,
+    _In_ const sockaddr* Address,
+    _In_ int AddressLength,
+    _In_ int Error,
+    _In_ bool Verbose)
+{
+    if (g_InteractiveMode && Verbose)
     {
-        SC_HANDLE ServiceHandle = ::CreateServiceW(
-            ServiceControlManagerHandle,
-            g_ServiceName.c_str(),
-            g_DisplayName.c_str(),
-            SERVICE_QUERY_STATUS | SERVICE_START,
-            SERVICE_WIN32_OWN_PROCESS,
-            SERVICE_AUTO_START,
-            SERVICE_ERROR_NORMAL,
-            ServiceBinaryPath.c_str(),
-            nullptr,
-            nullptr,
-            nullptr,
-            nullptr,
-            nullptr);
-        if (ServiceHandle)
+        std::string Name;
+        if (AF_UNIX == Address->sa_family)
         {
-            SERVICE_STATUS_PROCESS ServiceStatus = { 0 };
-            if (!::MileStartServiceByHandle(
-                ServiceHandle,
-                0,
-                nullptr,
-                &ServiceStatus))
-            {
-                Error = ::GetLastError();
-            }
-
-            ::CloseServiceHandle(ServiceHandle);
+            Name = SynthRdpUnixSocketPrefix;
+            Name += reinterpret_cast<const sockaddr_un*>(Address)->sun_path;
         }
         else
         {
-            Error = ::GetLastError();
+            char Host[NI_MAXHOST] = { 0 };
+            char Service[NI_MAXSERV] = { 0 };
+            ::getnameinfo(
+                Address,
+                AddressLength,
+                Host,
+                sizeof(Host),
+                Service,
+                sizeof(Service),
+                NI_NUMERICHOST | NI_NUMERICSERV);
+            Name = Mile::FormatString("[%s]:%s", Host, Service);
         }
+        std::printf(
+            "[Info] Connection attempt to %s finished in %d ms (%d).\n",
+            Name.c_str(),
+            ::GetTickCount() - Attempt.StartTime,
+            Error);
+    }
 
-        ::CloseServiceHandle(ServiceControlManagerHandle);
+    if (0 != Error)
+    {
+        ::closesocket(Attempt.Socket);
     }
     else
     {
-        Error = ::GetLastError();
+        // Restore the blocking mode which is required by WSAEventSelect.
+        ::WSAEventSelect(Attempt.Socket, nullptr, 0);
+        u_long NonBlockingMode = 0;
+        ::ioctlsocket(Attempt.Socket, FIONBIO, &NonBlockingMode);
     }
+    Attempt.Socket = INVALID_SOCKET;
 
-    if (ERROR_SUCCESS == Error)
+    ::WSACloseEvent(Attempt.Event);
+    Attempt.Event = WSA_INVALID_EVENT;
+}
+
+bool SynthRdpIsLoopbackAddress(
+    _In_ SynthRdpServerAddress const& Address)
+{
+    if (AF_INET == Address.Family)
     {
-        std::printf("[Success] SynthRdpInstallService\n");
+        return IN4_IS_ADDR_LOOPBACK(
+            &reinterpret_cast<const sockaddr_in*>(&Address.Address)->sin_addr);
     }
-    else
+    else if (AF_INET6 == Address.Family)
     {
-        std::printf("[Error] SynthRdpInstallService (%d)\n", Error);
+        return IN6_IS_ADDR_LOOPBACK(
+            &reinterpret_cast<const sockaddr_in6*>(
+                &Address.Address)->sin6_addr);
     }
-
-    return Error;
+    return false;
 }
 
-int SynthRdpUninstallService()
+// The loopback fast path needs to be enabled on both sides before connecting
+// or listening, otherwise the connection uses the full TCP stack silently.
+void SynthRdpEnableLoopbackFastPath(
+    _In_ SOCKET Socket)
 {
-    DWORD Error = ERROR_SUCCESS;
-
-    SC_HANDLE ServiceControlManagerHandle = ::OpenSCManagerW(
+    int OptionValue = 1;
+    DWORD NumberOfBytesReturned = 0;
+    ::WSAIoctl(
+        Socket,
+        SIO_LOOPBACK_FAST_PATH,
+        &OptionValue,
+        sizeof(OptionValue),
         nullptr,
+        0,
+        &NumberOfBytesReturned,
         nullptr,
-        SC_MANAGER_CONNECT);
-    if (ServiceControlManagerHandle)
-    {
-        SC_HANDLE ServiceHandle = ::OpenServiceW(
-            ServiceControlManagerHandle,
-            g_ServiceName.c_str(),
-            SERVICE_QUERY_STATUS | SERVICE_STOP | DELETE);
-        if (ServiceHandle)
+        nullptr);
+}
+
+SOCKET SynthRdpConnectAddresses(
+    _In_ std::vector<SynthRdpServerAddress> const& Addresses,
+    _In_ DWORD AttemptTimeout,
+    _In_ bool LoopbackFastPath,
+    _In_ bool Verbose,
+    _Out_opt_ PDWORD AttemptCount)
+{
+    SOCKET Result = INVALID_SOCKET;
+    int LastError = WSAHOST_NOT_FOUND;
+
+    std::size_t AddressCount = Addresses.size();
+    if (AddressCount > SynthRdpMaximumConnectAttempts)
+    {
+        AddressCount = SynthRdpMaximumConnectAttempts;
+    }
+
+    // Start the connection attempts in the staggered way, and use the first
+    // established one. So a dead address will not stall the session for the
+    // whole connection timeout.
+    std::vector<SynthRdpConnectAttempt> Attempts;
+    std::size_t NextAddress = 0;
+    DWORD LastStartTime = 0;
+    while (INVALID_SOCKET == Result && g_ServiceIsRunning)
+    {
+        DWORD CurrentTime = ::GetTickCount();
+
+        if (NextAddress < AddressCount && (Attempts.empty() ||
+            CurrentTime - LastStartTime >= SynthRdpConnectAttemptDelay))
         {
-            SERVICE_STATUS_PROCESS ServiceStatus = { 0 };
-            if (::MileStopServiceByHandle(ServiceHandle, &ServiceStatus))
+            SynthRdpServerAddress const& Address = Addresses[NextAddress];
+
+            SynthRdpConnectAttempt Attempt;
+            Attempt.AddressIndex = NextAddress++;
+            Attempt.StartTime = CurrentTime;
+            Attempt.Event = WSA_INVALID_EVENT;
+            Attempt.Socket = ::WSASocketW(
+                Address.Family,
+                Address.SocketType,
+                Address.Protocol,
+                nullptr,
+                0,
+                WSA_FLAG_OVERLAPPED);
+            if (INVALID_SOCKET == Attempt.Socket)
             {
-                if (!::DeleteService(ServiceHandle))
+                LastError = ::WSAGetLastError();
+                continue;
+            }
+            LastStartTime = CurrentTime;
+
+            if (LoopbackFastPath && ::SynthRdpIsLoopbackAddress(Address))
+            {
+                ::SynthRdpEnableLoopbackFastPath(Attempt.Socket);
+            }
+
+            Attempt.Event = ::WSACreateEvent();
+            if (WSA_INVALID_EVENT == Attempt.Event)
+            {
+                LastError = ::WSAGetLastError();
+                ::closesocket(Attempt.Socket);
+                continue;
+            }
+
+            // Use the non-blocking connect to make the service stop request
+            // can cancel the pending connection immediately.
+            int Error = 0;
+            if (SOCKET_ERROR == ::WSAEventSelect(
+                Attempt.Socket,
+                Attempt.Event,
+                FD_CONNECT))
+            {
+                Error = ::WSAGetLastError();
+            }
+            else if (SOCKET_ERROR == ::WSAConnect(
+                Attempt.Socket,
+                reinterpret_cast<const sockaddr*>(&Address.Address),
+                Address.AddressLength,
+                nullptr,
+                nullptr,
+                nullptr,
+                nullptr))
+            {
+                Error = ::WSAGetLastError();
+            }
+
+            if (AttemptCount)
+            {
+                ++*AttemptCount;
+            }
+
+            if (WSAEWOULDBLOCK == Error)
+            {
+                Attempts.push_back(Attempt);
+            }
+            else
+            {
+                ::SynthRdpFinishConnectAttempt(
+                    Attempt,
+                    reinterpret_cast<const sockaddr*>(&Address.Address),
+                    Address.AddressLength,
+                    Error,
+                    Verbose);
+                if (0 == Error)
                 {
-                    Error = ::GetLastError();
+                    Result = Attempt.Socket;
+                }
+                else
+                {
+                    LastError = Error;
                 }
             }
+            continue;
+        }
+
+        if (Attempts.empty())
+        {
+            break;
+        }
+
+        // Wait until the next attempt needs to be started, or the earliest
+        // pending attempt timed out.
+        DWORD WaitTime = INFINITE;
+        if (NextAddress < AddressCount)
+        {
+            WaitTime = SynthRdpConnectAttemptDelay -
+                (CurrentTime - LastStartTime);
+        }
+        std::vector<HANDLE> WaitHandles;
+        for (SynthRdpConnectAttempt& Attempt : Attempts)
+        {
+            DWORD Elapsed = CurrentTime - Attempt.StartTime;
+            DWORD Remaining =
+                (Elapsed < AttemptTimeout) ? AttemptTimeout - Elapsed : 0;
+            if (Remaining < WaitTime)
+            {
+                WaitTime = Remaining;
+            }
+            WaitHandles.push_back(Attempt.Event);
+        }
+        if (g_ServiceStopEvent)
+        {
+            WaitHandles.push_back(g_ServiceStopEvent);
+        }
+
+        DWORD WaitResult = ::WaitForMultipleObjects(
+            static_cast<DWORD>(WaitHandles.size()),
+            &WaitHandles[0],
+            FALSE,
+            WaitTime);
+        if (WaitResult >= WAIT_OBJECT_0 &&
+            WaitResult < WAIT_OBJECT_0 + Attempts.size())
+        {
+            std::size_t Index = WaitResult - WAIT_OBJECT_0;
+            SynthRdpConnectAttempt Attempt = Attempts[Index];
+            Attempts.erase(Attempts.begin() + Index);
+
+            WSANETWORKEVENTS NetworkEvents = { 0 };
+            int Error = 0;
+            if (SOCKET_ERROR == ::WSAEnumNetworkEvents(
+                Attempt.Socket,
+                Attempt.Event,
+                &NetworkEvents))
+            {
+                Error = ::WSAGetLastError();
+            }
             else
             {
-                Error = ::GetLastError();
+                Error = NetworkEvents.iErrorCode[FD_CONNECT_BIT];
             }
 
-            ::CloseServiceHandle(ServiceHandle);
+            SynthRdpServerAddress const& Address =
+                Addresses[Attempt.AddressIndex];
+            ::SynthRdpFinishConnectAttempt(
+                Attempt,
+                reinterpret_cast<const sockaddr*>(&Address.Address),
+                Address.AddressLength,
+                Error,
+                Verbose);
+            if (0 == Error)
+            {
+                Result = Attempt.Socket;
+            }
+            else
+            {
+                LastError = Error;
+            }
+        }
+        else if (WAIT_TIMEOUT == WaitResult)
+        {
+            CurrentTime = ::GetTickCount();
+            for (auto Current = Attempts.begin(); Current != Attempts.end();)
+            {
+                if (CurrentTime - Current->StartTime < AttemptTimeout)
+                {
+                    ++Current;
+                    continue;
+                }
+
+                SynthRdpServerAddress const& Address =
+                    Addresses[Current->AddressIndex];
+                ::SynthRdpFinishConnectAttempt(
+                    *Current,
+                    reinterpret_cast<const sockaddr*>(&Address.Address),
+                    Address.AddressLength,
+                    WSAETIMEDOUT,
+                    Verbose);
+                LastError = WSAETIMEDOUT;
+                Current = Attempts.erase(Current);
+            }
         }
         else
         {
-            Error = ::GetLastError();
+            // The service is stopping.
+            LastError = WSAEINTR;
+            break;
         }
-
-        ::CloseServiceHandle(ServiceControlManagerHandle);
-    }
-    else
-    {
-        Error = ::GetLastError();
     }
 
-    if (ERROR_SUCCESS == Error)
+    // Cancel the remaining attempts.
+    for (SynthRdpConnectAttempt& Attempt : Attempts)
     {
-        std::printf("[Success] SynthRdpUninstallService\n");
+        ::closesocket(Attempt.Socket);
+        ::WSACloseEvent(Attempt.Event);
     }
-    else
+
+    if (INVALID_SOCKET == Result)
     {
-        std::printf("[Error] SynthRdpUninstallService (%d)\n", Error);
+        if (!g_ServiceIsRunning)
+        {
+            LastError = WSAEINTR;
+        }
+        ::WSASetLastError(LastError);
     }
 
-    return Error;
+    return Result;
 }
 
-int SynthRdpStartService()
+// The session slot of the first backend is reserved under the lock if it is
+// healthy, which keeps the concurrent connections from piling up on the same
+// backend.
+std::vector<std::size_t> SynthRdpSelectBackends(
+    _In_ SynthRdpServerConfiguration const& Configuration,
+    _Out_ bool* FirstReserved)
 {
-    DWORD Error = ERROR_SUCCESS;
+    *FirstReserved = false;
 
-    SERVICE_STATUS_PROCESS ServiceStatus = { 0 };
-    if (!::MileStartService(g_ServiceName.c_str(), &ServiceStatus))
+    std::vector<std::size_t> Healthy;
+    std::vector<std::size_t> Unhealthy;
+
+    ::EnterCriticalSection(&g_ServerConfigurationLock);
+
+    for (std::size_t i = 0; i < Configuration.Backends.size(); ++i)
     {
-        Error = ::GetLastError();
+        SynthRdpBackend const& Backend = Configuration.Backends[i];
+        if (Backend.State->Healthy && !Backend.Addresses.empty())
+        {
+            Healthy.push_back(i);
+        }
+        else
+        {
+            Unhealthy.push_back(i);
+        }
     }
 
-    if (ERROR_SUCCESS == Error)
+    if (SynthRdpBalancingPolicy::Weighted == Configuration.BalancingPolicy)
     {
-        std::printf("[Success] SynthRdpStartService\n");
+        // Use the smooth weighted round-robin to select the first backend,
+        // and the others are used for the failover by their weights.
+        std::size_t Selected = 0;
+        LONG TotalWeight = 0;
+        for (std::size_t i = 0; i < Healthy.size(); ++i)
+        {
+            SynthRdpBackend const& Backend =
+                Configuration.Backends[Healthy[i]];
+            Backend.State->CurrentWeight += Backend.Weight;
+            TotalWeight += Backend.Weight;
+            if (Backend.State->CurrentWeight > Configuration.Backends[
+                Healthy[Selected]].State->CurrentWeight)
+            {
+                Selected = i;
+            }
+        }
+        if (!Healthy.empty())
+        {
+            Configuration.Backends[
+                Healthy[Selected]].State->CurrentWeight -= TotalWeight;
+            std::swap(Healthy[0], Healthy[Selected]);
+            std::stable_sort(
+                Healthy.begin() + 1,
+                Healthy.end(),
+                [&](std::size_t Left, std::size_t Right)
+                {
+                    return Configuration.Backends[Left].Weight >
+                        Configuration.Backends[Right].Weight;
+                });
+        }
     }
     else
     {
-        std::printf("[Error] SynthRdpStartService (%d)\n", Error);
+        // The active sessions are changed by other threads without the lock,
+        // so sort by the snapshot to keep the ordering consistent.
+        std::vector<LONG64> ActiveSessions(Configuration.Backends.size(), 0);
+        for (std::size_t& Index : Healthy)
+        {
+            ActiveSessions[Index] =
+                Configuration.Backends[Index].State->ActiveSessions;
+        }
+
+        // Compare the active sessions per weight without the division.
+        std::stable_sort(
+            Healthy.begin(),
+            Healthy.end(),
+            [&](std::size_t Left, std::size_t Right)
+            {
+                return ActiveSessions[Left] *
+                    Configuration.Backends[Right].Weight <
+                    ActiveSessions[Right] *
+                    Configuration.Backends[Left].Weight;
+            });
     }
 
-    return Error;
+    if (!Healthy.empty())
+    {
+        ::InterlockedIncrement(
+            &Configuration.Backends[Healthy[0]].State->ActiveSessions);
+        *FirstReserved = true;
+    }
+
+    ::LeaveCriticalSection(&g_ServerConfigurationLock);
+
+    // The unhealthy backends are still tried at last.
+    Healthy.insert(Healthy.end(), Unhealthy.begin(), Unhealthy.end());
+    return Healthy;
 }
 
-int SynthRdpStopService()
+// Returns the previous state.
+bool SynthRdpSetBackendHealthy(
+    _In_ SynthRdpBackendState* State,
+    _In_ bool Healthy)
 {
-    DWORD Error = ERROR_SUCCESS;
+    ::EnterCriticalSection(&g_ServerConfigurationLock);
+    bool Previous = State->Healthy;
+    State->Healthy = Healthy;
+    ::LeaveCriticalSection(&g_ServerConfigurationLock);
+    return Previous;
+}
 
-    SERVICE_STATUS_PROCESS ServiceStatus = { 0 };
-    if (!::MileStopService(g_ServiceName.c_str(), &ServiceStatus))
+void SynthRdpReleaseBackend(
+    _In_opt_ SynthRdpBackendState* State)
+{
+    if (State)
     {
-        Error = ::GetLastError();
+        ::InterlockedDecrement(&State->ActiveSessions);
     }
+}
 
-    if (ERROR_SUCCESS == Error)
+void SynthRdpProbeBackends()
+{
+    // Skip if the previous probe is still running.
+    if (0 != ::InterlockedCompareExchange(&g_BackendProbing, 1, 0))
     {
-        std::printf("[Success] SynthRdpStopService\n");
+        return;
     }
-    else
+
+    SynthRdpServerConfiguration Configuration =
+        ::SynthRdpGetServerConfiguration();
+    if (Configuration.Backends.size() > 1)
     {
-        std::printf("[Error] SynthRdpStopService (%d)\n", Error);
+        for (SynthRdpBackend& Backend : Configuration.Backends)
+        {
+            if (!g_ServiceIsRunning)
+            {
+                break;
+            }
+
+            // The healthy backends are marked down by the failed connections
+            // of the sessions instead.
+            ::EnterCriticalSection(&g_ServerConfigurationLock);
+            bool Probing = !Backend.State->Healthy;
+            ::LeaveCriticalSection(&g_ServerConfigurationLock);
+            if (!Probing)
+            {
+                continue;
+            }
+
+            SOCKET Socket = ::SynthRdpConnectAddresses(
+                Backend.Addresses,
+                SynthRdpBackendProbeTimeout,
+                Configuration.LoopbackFastPath,
+                false,
+                nullptr);
+            bool Healthy = (INVALID_SOCKET != Socket);
+            if (Healthy)
+            {
+                ::closesocket(Socket);
+            }
+
+            bool Previous = ::SynthRdpSetBackendHealthy(
+                Backend.State,
+                Healthy);
+            if (g_InteractiveMode && Healthy != Previous)
+            {
+                std::printf(
+                    "[Info] Backend %s:%s is %s.\n",
+                    Backend.Host.c_str(),
+                    Backend.Port.c_str(),
+                    Healthy ? "up" : "down");
+            }
+        }
     }
 
-    return Error;
+    ::InterlockedExchange(&g_BackendProbing, 0);
 }
 
-int SynthRdpListConfigurations()
+void SynthRdpSetServerSocketOptions(
+    _In_ SOCKET Socket,
+    _In_ SynthRdpServerConfiguration const& Configuration)
 {
-    DWORD Error = ERROR_SUCCESS;
+    // The TCP options are not supported by the AF_UNIX sockets, and the
+    // failures are harmless.
 
-    DWORD Data = 0;
-    DWORD Length = 0;
+    // Disable the Nagle algorithm by default because the input PDUs are
+    // small and latency sensitive, and the relay will coalesce the queued
+    // PDUs by itself.
+    BOOL NoDelay = Configuration.TcpNoDelay ? TRUE : FALSE;
+    ::setsockopt(
+        Socket,
+        IPPROTO_TCP,
+        TCP_NODELAY,
+        reinterpret_cast<const char*>(&NoDelay),
+        sizeof(NoDelay));
 
-    bool DisableRemoteDesktop = false;
+    if (Configuration.KeepAliveTime)
     {
-        Data = 0;
-        Length = sizeof(DWORD);
-        Error = ::RegGetValueW(
-            HKEY_LOCAL_MACHINE,
-            L"SYSTEM\\CurrentControlSet\\Control\\Terminal Server",
-            L"fDenyTSConnections",
-            RRF_RT_REG_DWORD | RRF_SUBKEY_WOW6464KEY,
+        tcp_keepalive KeepAlive = { 0 };
+        KeepAlive.onoff = 1;
+        KeepAlive.keepalivetime = Configuration.KeepAliveTime;
+        KeepAlive.keepaliveinterval = Configuration.KeepAliveInterval;
+        DWORD NumberOfBytesReturned = 0;
+        ::WSAIoctl(
+            Socket,
+            SIO_KEEPALIVE_VALS,
+            &KeepAlive,
+            sizeof(KeepAlive),
             nullptr,
-            &Data,
-            &Length);
-        if (ERROR_SUCCESS == Error)
-        {
-            DisableRemoteDesktop = Data;
-        }
+            0,
+            &NumberOfBytesReturned,
+            nullptr,
+            nullptr);
     }
+}
 
-    bool EnableUserAuthentication = true;
+SOCKET SynthRdpConnectToServer(
+    _Out_opt_ PDWORD AttemptCount,
+    _Out_opt_ SynthRdpBackendState** Backend)
+{
+    if (AttemptCount)
     {
-        Data = 0;
-        Length = sizeof(DWORD);
-        Error = ::RegGetValueW(
-            HKEY_LOCAL_MACHINE,
-            L"SYSTEM\\CurrentControlSet\\Control\\Terminal Server\\"
-            L"WinStations\\RDP-Tcp",
-            L"UserAuthentication",
-            RRF_RT_REG_DWORD | RRF_SUBKEY_WOW6464KEY,
-            nullptr,
-            &Data,
-            &Length);
-        if (ERROR_SUCCESS == Error)
-        {
-            EnableUserAuthentication = Data;
-        }
+        *AttemptCount = 0;
     }
-
-    bool DisableBlankPassword = false;
+    if (Backend)
     {
-        Data = 0;
-        Length = sizeof(DWORD);
-        Error = ::RegGetValueW(
-            HKEY_LOCAL_MACHINE,
-            L"SYSTEM\\CurrentControlSet\\Control\\Lsa",
-            L"LimitBlankPasswordUse",
-            RRF_RT_REG_DWORD | RRF_SUBKEY_WOW6464KEY,
-            nullptr,
-            &Data,
-            &Length);
-        if (ERROR_SUCCESS == Error)
-        {
-            DisableBlankPassword = Data;
-        }
+        *Backend = nullptr;
     }
 
-    bool OverrideSystemImplementation = false;
+    SynthRdpServerConfiguration Configuration =
+        ::SynthRdpGetServerConfiguration();
+
+    bool Resolved = false;
+    for (SynthRdpBackend& Current : Configuration.Backends)
     {
-        Data = 0;
-        Length = sizeof(DWORD);
-        Error = ::RegGetValueW(
-            HKEY_LOCAL_MACHINE,
-            L"SOFTWARE\\Microsoft\\Virtual Machine\\Guest",
-            L"DisableEnhancedSessionConsoleConnection",
-            RRF_RT_REG_DWORD | RRF_SUBKEY_WOW6464KEY,
-            nullptr,
-            &Data,
-            &Length);
-        if (ERROR_SUCCESS == Error)
-        {
-            OverrideSystemImplementation = Data;
-        }
+        Resolved = Resolved || !Current.Addresses.empty();
+    }
+    if (!Resolved)
+    {
+        // The server hosts may be unresolvable when loading the
+        // configuration, so try again before giving up.
+        ::SynthRdpRefreshServerConfiguration();
+        Configuration = ::SynthRdpGetServerConfiguration();
     }
 
-    std::string ServerHost = "127.0.0.1";
+    SOCKET Result = INVALID_SOCKET;
+    int LastError = WSAHOST_NOT_FOUND;
+
+    // Fail over to the next backend immediately if the connection failed.
+    bool FirstReserved = false;
+    std::vector<std::size_t> Candidates = ::SynthRdpSelectBackends(
+        Configuration,
+        &FirstReserved);
+    for (std::size_t i = 0; i < Candidates.size(); ++i)
     {
-        std::wstring Buffer(32767, L'\0');
+        SynthRdpBackend& Current = Configuration.Backends[Candidates[i]];
+        if (Current.Addresses.empty())
+        {
+            if (0 == i && FirstReserved)
+            {
+                ::SynthRdpReleaseBackend(Current.State);
+            }
+            LastError = Current.ResolveError;
+            continue;
+        }
 
-        Length = static_cast<DWORD>(Buffer.size());
-        Error = ::RegGetValueW(
-            HKEY_LOCAL_MACHINE,
-            L"SYSTEM\\CurrentControlSet\\Services\\"
-            L"SynthRdp\\Configurations",
-            L"ServerHost",
-            RRF_RT_REG_SZ | RRF_SUBKEY_WOW6464KEY,
-            nullptr,
-            const_cast<wchar_t*>(Buffer.c_str()),
-            &Length);
-        if (ERROR_SUCCESS == Error)
+        // Count the pending connection as well to avoid piling up the
+        // concurrent sessions on the same backend, and the slot of the
+        // first one is already reserved by the selection. It is released
+        // if the connection failed.
+        if (0 != i || !FirstReserved)
         {
-            Buffer.resize(std::wcslen(Buffer.c_str()));
-            ServerHost = Mile::ToString(CP_UTF8, Buffer);
+            ::InterlockedIncrement(&Current.State->ActiveSessions);
+        }
+
+        DWORD CurrentAttemptCount = 0;
+        Result = ::SynthRdpConnectAddresses(
+            Current.Addresses,
+            Configuration.ConnectTimeout,
+            Configuration.LoopbackFastPath,
+            true,
+            &CurrentAttemptCount);
+        if (AttemptCount)
+        {
+            *AttemptCount += CurrentAttemptCount;
+        }
+        if (INVALID_SOCKET != Result)
+        {
+            ::SynthRdpSetBackendHealthy(Current.State, true);
+            if (Backend)
+            {
+                *Backend = Current.State;
+            }
+            else
+            {
+                ::SynthRdpReleaseBackend(Current.State);
+            }
+            if (g_InteractiveMode && Configuration.Backends.size() > 1)
+            {
+                std::printf(
+                    "[Info] Backend %s:%s is selected.\n",
+                    Current.Host.c_str(),
+                    Current.Port.c_str());
+            }
+            break;
         }
+
+        LastError = ::WSAGetLastError();
+        ::SynthRdpReleaseBackend(Current.State);
+        if (!g_ServiceIsRunning)
+        {
+            break;
+        }
+        ::SynthRdpSetBackendHealthy(Current.State, false);
     }
 
-    std::uint16_t ServerPort = 3389;
+    if (INVALID_SOCKET == Result)
     {
-        Data = 0;
-        Length = sizeof(DWORD);
-        Error = ::RegGetValueW(
-            HKEY_LOCAL_MACHINE,
-            L"SYSTEM\\CurrentControlSet\\Services\\"
-            L"SynthRdp\\Configurations",
-            L"ServerPort",
-            RRF_RT_REG_DWORD | RRF_SUBKEY_WOW6464KEY,
+        ::WSASetLastError(LastError);
+        return INVALID_SOCKET;
+    }
+
+    ::SynthRdpSetServerSocketOptions(Result, Configuration);
+
+    return Result;
+}
+
+struct SynthRdpPooledConnection
+{
+    SOCKET Socket;
+    DWORD ConnectedTime;
+    DWORD ConfigurationVersion;
+    SynthRdpBackendState* Backend;
+};
+
+// The pooled connection will be replaced after this idle time to avoid
+// being dropped by the server for not sending the X.224 Connection Request.
+const DWORD SynthRdpConnectionPoolMaximumIdleTime = 20000;
+const DWORD SynthRdpConnectionPoolCheckInterval = 5000;
+
+namespace
+{
+    static CRITICAL_SECTION g_ConnectionPoolLock;
+    static std::deque<SynthRdpPooledConnection> g_ConnectionPool;
+    static DWORD g_ConnectionPoolSize = 0;
+    static bool g_ConnectionPoolClosing = false;
+    static bool g_ConnectionPoolRefilling = false;
+    static HANDLE g_ConnectionPoolIdleEvent = nullptr;
+    static HANDLE g_ConnectionPoolTimer = nullptr;
+}
+
+bool SynthRdpIsPooledConnectionHealthy(
+    _In_ SynthRdpPooledConnection const& Connection)
+{
+    if (::GetTickCount() - Connection.ConnectedTime >=
+        SynthRdpConnectionPoolMaximumIdleTime)
+    {
+        return false;
+    }
+
+    // Drop the connection to the previous server endpoint.
+    ::EnterCriticalSection(&g_ServerConfigurationLock);
+    DWORD ConfigurationVersion = g_ServerConfiguration.Version;
+    ::LeaveCriticalSection(&g_ServerConfigurationLock);
+    if (Connection.ConfigurationVersion != ConfigurationVersion)
+    {
+        return false;
+    }
+
+    // The server never sends anything before receiving the X.224 Connection
+    // Request, so the readable idle connection is closed or reset.
+    fd_set ReadSet;
+    FD_ZERO(&ReadSet);
+    FD_SET(Connection.Socket, &ReadSet);
+    timeval Timeout = { 0 };
+    return (0 == ::select(0, &ReadSet, nullptr, nullptr, &Timeout));
+}
+
+void SynthRdpRefillConnectionPool()
+{
+    for (;;)
+    {
+        ::EnterCriticalSection(&g_ConnectionPoolLock);
+        bool NeedMore =
+            !g_ConnectionPoolClosing &&
+            g_ConnectionPool.size() < g_ConnectionPoolSize;
+        if (!NeedMore)
+        {
+            g_ConnectionPoolRefilling = false;
+            ::SetEvent(g_ConnectionPoolIdleEvent);
+        }
+        ::LeaveCriticalSection(&g_ConnectionPoolLock);
+        if (!NeedMore)
+        {
+            break;
+        }
+
+        SynthRdpPooledConnection Connection;
+        ::EnterCriticalSection(&g_ServerConfigurationLock);
+        Connection.ConfigurationVersion = g_ServerConfiguration.Version;
+        ::LeaveCriticalSection(&g_ServerConfigurationLock);
+        Connection.Socket = ::SynthRdpConnectToServer(
             nullptr,
-            &Data,
-            &Length);
-        if (ERROR_SUCCESS == Error)
+            &Connection.Backend);
+        Connection.ConnectedTime = ::GetTickCount();
+
+        ::EnterCriticalSection(&g_ConnectionPoolLock);
+        if (INVALID_SOCKET != Connection.Socket)
         {
-            ServerPort = static_cast<std::uint16_t>(Data);
+            g_ConnectionPool.push_back(Connection);
+        }
+        else
+        {
+            // Try again in the next periodic check.
+            g_ConnectionPoolRefilling = false;
+            ::SetEvent(g_ConnectionPoolIdleEvent);
+        }
+        ::LeaveCriticalSection(&g_ConnectionPoolLock);
+        if (INVALID_SOCKET == Connection.Socket)
+        {
+            break;
         }
     }
+}
 
-    std::printf(
-        "Configurations:\n"
-        "\n"
-        "DisableRemoteDesktop: %s\n"
-        "EnableUserAuthentication: %s\n"
-        "DisableBlankPassword: %s\n"
-        "OverrideSystemImplementation: %s\n"
-        "ServerHost: %s\n"
-        "ServerPort: %hu\n"
-        "\n",
-        DisableRemoteDesktop ? "True" : "False",
-        EnableUserAuthentication ? "True" : "False",
-        DisableBlankPassword ? "True" : "False",
-        OverrideSystemImplementation ? "True" : "False",
-        ServerHost.c_str(),
-        ServerPort);
+void SynthRdpRequestConnectionPoolRefill()
+{
+    bool ShouldStart = false;
+
+    ::EnterCriticalSection(&g_ConnectionPoolLock);
+    if (!g_ConnectionPoolClosing &&
+        !g_ConnectionPoolRefilling &&
+        g_ConnectionPool.size() < g_ConnectionPoolSize)
+    {
+        g_ConnectionPoolRefilling = true;
+        ::ResetEvent(g_ConnectionPoolIdleEvent);
+        ShouldStart = true;
+    }
+    ::LeaveCriticalSection(&g_ConnectionPoolLock);
+
+    if (ShouldStart && !::QueueUserWorkItem(
+        [](LPVOID) -> DWORD
+        {
+            ::SynthRdpRefillConnectionPool();
+            return 0;
+        },
+        nullptr,
+        WT_EXECUTELONGFUNCTION))
+    {
+        ::EnterCriticalSection(&g_ConnectionPoolLock);
+        g_ConnectionPoolRefilling = false;
+        ::SetEvent(g_ConnectionPoolIdleEvent);
+        ::LeaveCriticalSection(&g_ConnectionPoolLock);
+    }
+}
+
+void SynthRdpClosePooledConnection(
+    _In_ SynthRdpPooledConnection const& Connection)
+{
+    ::closesocket(Connection.Socket);
+    ::SynthRdpReleaseBackend(Connection.Backend);
+}
+
+void SynthRdpCheckConnectionPool()
+{
+    std::vector<SynthRdpPooledConnection> StaleConnections;
+
+    ::EnterCriticalSection(&g_ConnectionPoolLock);
+    for (auto Current = g_ConnectionPool.begin();
+        Current != g_ConnectionPool.end();)
+    {
+        if (::SynthRdpIsPooledConnectionHealthy(*Current))
+        {
+            ++Current;
+        }
+        else
+        {
+            StaleConnections.push_back(*Current);
+            Current = g_ConnectionPool.erase(Current);
+        }
+    }
+    ::LeaveCriticalSection(&g_ConnectionPoolLock);
+
+    for (SynthRdpPooledConnection& StaleConnection : StaleConnections)
+    {
+        ::SynthRdpClosePooledConnection(StaleConnection);
+    }
+
+    ::SynthRdpRequestConnectionPoolRefill();
+}
+
+SOCKET SynthRdpAcquireServerConnection(
+    _Out_opt_ PDWORD AttemptCount,
+    _Out_ SynthRdpBackendState** Backend)
+{
+    if (AttemptCount)
+    {
+        *AttemptCount = 0;
+    }
+
+    if (!g_ConnectionPoolSize)
+    {
+        return ::SynthRdpConnectToServer(AttemptCount, Backend);
+    }
+
+    SOCKET Result = INVALID_SOCKET;
+    *Backend = nullptr;
+    std::vector<SynthRdpPooledConnection> StaleConnections;
+
+    ::EnterCriticalSection(&g_ConnectionPoolLock);
+    while (!g_ConnectionPool.empty())
+    {
+        SynthRdpPooledConnection Connection = g_ConnectionPool.front();
+        g_ConnectionPool.pop_front();
+        if (::SynthRdpIsPooledConnectionHealthy(Connection))
+        {
+            Result = Connection.Socket;
+            *Backend = Connection.Backend;
+            break;
+        }
+        StaleConnections.push_back(Connection);
+    }
+    ::LeaveCriticalSection(&g_ConnectionPoolLock);
+
+    for (SynthRdpPooledConnection& StaleConnection : StaleConnections)
+    {
+        ::SynthRdpClosePooledConnection(StaleConnection);
+    }
+
+    ::SynthRdpRequestConnectionPoolRefill();
+
+    if (INVALID_SOCKET == Result)
+    {
+        Result = ::SynthRdpConnectToServer(AttemptCount, Backend);
+    }
+
+    return Result;
+}
+
+DWORD SynthRdpConnectionPoolStartup(
+    _In_ DWORD PoolSize)
+{
+    if (!PoolSize)
+    {
+        return ERROR_SUCCESS;
+    }
+
+    ::InitializeCriticalSection(&g_ConnectionPoolLock);
+    g_ConnectionPoolClosing = false;
+    g_ConnectionPoolRefilling = false;
+
+    g_ConnectionPoolIdleEvent = ::CreateEventW(nullptr, TRUE, TRUE, nullptr);
+    if (!g_ConnectionPoolIdleEvent)
+    {
+        DWORD Error = ::GetLastError();
+        ::DeleteCriticalSection(&g_ConnectionPoolLock);
+        return Error;
+    }
+
+    g_ConnectionPoolSize = PoolSize;
+
+    // The first check fills the pool immediately.
+    if (!::CreateTimerQueueTimer(
+        &g_ConnectionPoolTimer,
+        nullptr,
+        [](PVOID, BOOLEAN)
+        {
+            ::SynthRdpCheckConnectionPool();
+        },
+        nullptr,
+        0,
+        SynthRdpConnectionPoolCheckInterval,
+        WT_EXECUTEDEFAULT))
+    {
+        DWORD Error = ::GetLastError();
+        g_ConnectionPoolSize = 0;
+        ::CloseHandle(g_ConnectionPoolIdleEvent);
+        g_ConnectionPoolIdleEvent = nullptr;
+        ::DeleteCriticalSection(&g_ConnectionPoolLock);
+        return Error;
+    }
+
+    return ERROR_SUCCESS;
+}
+
+void SynthRdpConnectionPoolCleanup()
+{
+    if (!g_ConnectionPoolSize)
+    {
+        return;
+    }
+
+    ::DeleteTimerQueueTimer(
+        nullptr,
+        g_ConnectionPoolTimer,
+        INVALID_HANDLE_VALUE);
+    g_ConnectionPoolTimer = nullptr;
+
+    ::EnterCriticalSection(&g_ConnectionPoolLock);
+    g_ConnectionPoolClosing = true;
+    ::LeaveCriticalSection(&g_ConnectionPoolLock);
+
+    ::WaitForSingleObject(g_ConnectionPoolIdleEvent, INFINITE);
+
+    for (SynthRdpPooledConnection& Connection : g_ConnectionPool)
+    {
+        ::SynthRdpClosePooledConnection(Connection);
+    }
+    g_ConnectionPool.clear();
+
+    g_ConnectionPoolSize = 0;
+    ::CloseHandle(g_ConnectionPoolIdleEvent);
+    g_ConnectionPoolIdleEvent = nullptr;
+    ::DeleteCriticalSection(&g_ConnectionPoolLock);
+}
+
+enum class SynthRdpRelayEndpointType : std::uint32_t
+{
+    Pipe,
+    Socket,
+};
+
+struct SynthRdpRelayEndpoint
+{
+    SynthRdpRelayEndpointType Type;
+    union
+    {
+        HANDLE PipeHandle;
+        SOCKET Socket;
+    };
+};
+
+enum class SynthRdpRelayOperationType : std::uint32_t
+{
+    Read,
+    Write,
+};
+
+// The statistics are published via the named shared memory, so the layout
+// needs to be updated with the version if changed.
+const wchar_t SynthRdpStatisticsMappingName[] = L"Global\\SynthRdpStatistics";
+const DWORD SynthRdpStatisticsSignature = 0x53445253; // 'SRDS'
+const DWORD SynthRdpStatisticsVersion = 7;
+
+// The upper bounds of the chunk size histogram buckets are 64 Bytes, 256
+// Bytes, 1 KB, 4 KB, 16 KB, 64 KB, 256 KB, and the last one is unbounded.
+const std::size_t SynthRdpStatisticsHistogramSize = 8;
+
+enum class SynthRdpPduClass : std::uint32_t
+{
+    // The connection sequence, and the PDUs on the MCS channels which are
+    // not classified further.
+    Control,
+    Input,
+    Cursor,
+    Graphics,
+    VirtualChannel,
+};
+
+const std::size_t SynthRdpPduClassCount = 5;
+
+const char* const SynthRdpPduClassNames[SynthRdpPduClassCount] =
+{
+    "Control",
+    "Input",
+    "Cursor",
+    "Graphics",
+    "Virtual Channel"
+};
+
+enum class SynthRdpTeardownReason : std::uint32_t
+{
+    // The session is not closed yet.
+    None,
+    // Closed or failed by the VMBus pipe or the server connection.
+    PipeClosed,
+    ServerClosed,
+    // Closed by the watchdog.
+    IdleTimeout,
+    Stalled,
+    // Closed because the service is stopping.
+    Stopped,
+    HandedOff,
+    // Failed to issue the I/O requests or to set up the session.
+    Failed,
+};
+
+const std::size_t SynthRdpTeardownReasonCount = 8;
+
+const char* const SynthRdpTeardownReasonNames[SynthRdpTeardownReasonCount] =
+{
+    "None",
+    "VMBus Pipe Closed",
+    "Server Closed",
+    "Idle Timeout",
+    "Stalled",
+    "Stopped",
+    "Handed Off",
+    "Failed"
+};
+
+struct SynthRdpStatisticsDirection
+{
+    LONG64 volatile TransferredBytes;
+    LONG64 volatile Chunks;
+    LONG64 volatile ReadRequests;
+    LONG64 volatile WriteRequests;
+    // The time in microseconds the read and write requests were pending.
+    LONG64 volatile ReadWaitTime;
+    LONG64 volatile WriteWaitTime;
+    LONG64 volatile ChunkSizeHistogram[SynthRdpStatisticsHistogramSize];
+    // Only counted when the PDU framing is enabled.
+    LONG64 volatile ClassPdus[SynthRdpPduClassCount];
+    LONG64 volatile ClassBytes[SynthRdpPduClassCount];
+    // The bytes read from the source but not written to the target yet.
+    LONG64 volatile QueuedBytes;
+    LONG64 volatile PeakQueuedBytes;
+    // The number of the times the reads were paused because the queue
+    // reached the high watermark, and the total paused time in microseconds.
+    LONG64 volatile BackpressureEvents;
+    LONG64 volatile BackpressureTime;
+    // The FILETIME when the current pause is started, or zero if the reads
+    // are not paused.
+    LONG64 volatile BackpressureStartTime;
+    // The number of the times the writes were deferred by the bandwidth
+    // limits, and the total deferred time in microseconds.
+    LONG64 volatile ThrottleEvents;
+    LONG64 volatile ThrottleTime;
+    // The FILETIME when the current deferral is started, or zero if the
+    // writes are not deferred.
+    LONG64 volatile ThrottleStartTime;
+};
+
+struct SynthRdpStatisticsSession
+{
+    // The odd value means the slot is used by an active session, and the
+    // value is changed every time the slot is acquired or released.
+    LONG volatile Generation;
+    // The time in microseconds for connecting to the server.
+    DWORD ConnectLatency;
+    // The number of the connection attempts, which is zero if the pooled
+    // connection is used.
+    DWORD ConnectAttempts;
+    DWORD Reserved;
+    // The FILETIME when the session is started.
+    LONG64 StartTime;
+    SynthRdpStatisticsDirection Vmbus2Tcp;
+    SynthRdpStatisticsDirection Tcp2Vmbus;
+};
+
+struct SynthRdpStatisticsHeader
+{
+    DWORD Signature;
+    DWORD Version;
+    DWORD ProcessId;
+    DWORD SessionSlotCount;
+    // The FILETIME when the service is started.
+    LONG64 StartTime;
+    LONG64 volatile TotalSessions;
+    // The number of the opened data channels, and the total time in
+    // microseconds spent in opening them after the waits return.
+    LONG64 volatile DiscoveredChannels;
+    LONG64 volatile ChannelOpenTime;
+    // The number of the finished sessions by the teardown reason.
+    LONG64 volatile TeardownReasons[SynthRdpTeardownReasonCount];
+    // The summary of all finished sessions.
+    SynthRdpStatisticsDirection FinishedVmbus2Tcp;
+    SynthRdpStatisticsDirection FinishedTcp2Vmbus;
+    // The session slots follow the header.
+};
+
+struct SynthRdpRelaySession;
+struct SynthRdpRelayDirection;
+
+struct SynthRdpRelayOperation
+{
+    OVERLAPPED Overlapped;
+    SynthRdpRelayOperationType Type;
+    SynthRdpRelayDirection* Direction;
+    LONGLONG IssueTime;
+};
+
+struct SynthRdpRelayBuffer
+{
+    // Keep it as the first member because the pool requires the memory
+    // allocation alignment.
+    SLIST_ENTRY PoolEntry;
+    std::uint32_t SizeClass;
+    DWORD Capacity;
+    DWORD Length;
+    DWORD Offset;
+    // The end of the last latency critical PDU in the data, or zero if there
+    // is none. The write request is never extended beyond it.
+    DWORD CriticalEnd;
+    // The tick count before which the chunk is held by the impairment
+    // simulator.
+    DWORD ReleaseTime;
+    std::uint8_t* Data;
+};
+
+// The maximum number of the queued chunks in each direction. The queued bytes
+// are limited by the watermarks, so it only matters for the small chunks.
+const std::size_t SynthRdpRelayRingSize = 64;
+
+// The default watermarks in kilobytes. The reads from the source are paused
+// when the queued bytes reach the high watermark, and resumed when they drop
+// to the low watermark.
+const DWORD SynthRdpRelayDefaultHighWatermark = 256;
+const DWORD SynthRdpRelayDefaultLowWatermark = 64;
+const DWORD SynthRdpRelayMaximumWatermark = 1048576;
+
+// The bandwidth limits are in kilobytes per second, and the burst of the
+// per session limit is in kilobytes.
+const DWORD SynthRdpRelayDefaultSessionBurst = 256;
+const DWORD SynthRdpRelayMaximumBandwidth = 1048576;
+
+const std::uint32_t SynthRdpRelaySizeClassCount = 3;
+
+const DWORD SynthRdpRelaySizeClasses[SynthRdpRelaySizeClassCount] =
+{
+    4096,
+    16384,
+    65536
+};
+
+// Keep the message written to the VMBus pipe not larger than the chunk size
+// used before the adaptive buffer sizes were introduced.
+const DWORD SynthRdpRelayMaximumPipeWriteSize = 16384;
+const std::uint32_t SynthRdpRelayPipeGatherSizeClass = 1;
+
+const DWORD SynthRdpRelayMaximumGatherSize = 262144;
+
+// The maximum number of the cached buffers for each size class, which limits
+// the pool to about 1 MB per size class.
+const USHORT SynthRdpRelayPoolDepths[SynthRdpRelaySizeClassCount] =
+{
+    256,
+    64,
+    16
+};
+
+// The link conditions simulated by the Benchmark command in each direction,
+// which hold the chunks before they are written to the target. The chunks
+// are never dropped or reordered because the relay carries the reliable
+// streams, so a lost packet is simulated as the retransmission delay.
+struct SynthRdpRelayImpairment
+{
+    // In milliseconds.
+    DWORD Latency;
+    DWORD Jitter;
+    // In bytes per second, and zero means unlimited.
+    DWORD Bandwidth;
+    // The probability of the retransmission delay for each chunk in parts
+    // per million.
+    DWORD LossRate;
+    // The link stops delivering for the duration in each interval, which are
+    // in milliseconds.
+    DWORD StallInterval;
+    DWORD StallDuration;
+};
+
+// The minimum retransmission timeout of TCP, which is added to the latency of
+// the chunk simulated as lost.
+const DWORD SynthRdpRelayImpairmentRetransmitTimeout = 200;
+
+enum class SynthRdpConnectionRequestState : std::uint8_t
+{
+    TpktHeader,
+    X224Header,
+    UserData,
+    Token,
+    NegotiationRequest,
+    Done,
+};
+
+// The streaming parser for the X.224 Connection Request PDU, which is the
+// first PDU sent by the client. The data is consumed in the chunks of any
+// size, and requestedProtocols in the RDP Negotiation Request is rewritten
+// in place. The bytes after the PDU are never touched.
+//
+// TPKT Header (4 Bytes): version (0x03), reserved, length (big-endian).
+// X.224 Connection Request (7 Bytes): length indicator, CR CDT (0xE0),
+// DST-REF, SRC-REF, class option.
+// User data: optional routingToken or cookie terminated by CR LF, optional
+// RDP Negotiation Request (8 Bytes): type (0x01), flags, length (8,
+// little-endian), requestedProtocols (little-endian), and optional RDP
+// Correlation Info.
+struct SynthRdpConnectionRequestParser
+{
+    SynthRdpConnectionRequestState State;
+    // Set if requestedProtocols is rewritten.
+    bool Rewritten;
+    // The offset of the next byte in the PDU.
+    std::uint16_t Offset;
+    // The end of the X.224 Connection Request in the PDU.
+    std::uint16_t End;
+    // The offset of the RDP Negotiation Request in the PDU.
+    std::uint16_t NegotiationOffset;
+    std::uint16_t NegotiationLength;
+    std::uint8_t PreviousByte;
+    // The original value of requestedProtocols.
+    std::uint32_t RequestedProtocols;
+};
+
+const std::uint8_t SynthRdpTpktVersion = 0x03;
+const std::uint8_t SynthRdpX224ConnectionRequest = 0xE0;
+const std::uint8_t SynthRdpNegotiationRequestType = 0x01;
+const std::uint16_t SynthRdpNegotiationRequestLength = 8;
+const std::uint16_t SynthRdpX224UserDataOffset = 11;
+
+void SynthRdpConnectionRequestParserInitialize(
+    _Out_ SynthRdpConnectionRequestParser* Parser,
+    _In_ bool Enabled)
+{
+    Parser->State = Enabled
+        ? SynthRdpConnectionRequestState::TpktHeader
+        : SynthRdpConnectionRequestState::Done;
+    Parser->Rewritten = false;
+    Parser->Offset = 0;
+    Parser->End = 0;
+    Parser->NegotiationOffset = 0;
+    Parser->NegotiationLength = 0;
+    Parser->PreviousByte = 0;
+    Parser->RequestedProtocols = 0;
+}
+
+// Consume the next chunk of the stream, and return the number of the bytes
+// which belong to the PDU. Stop parsing if the data is not the expected PDU.
+DWORD SynthRdpConnectionRequestParserConsume(
+    _Inout_ SynthRdpConnectionRequestParser* Parser,
+    _Inout_updates_(Length) std::uint8_t* Data,
+    _In_ DWORD Length)
+{
+    DWORD Consumed = 0;
+    while (Consumed < Length &&
+        SynthRdpConnectionRequestState::Done != Parser->State)
+    {
+        std::uint8_t& Byte = Data[Consumed++];
+        std::uint16_t Offset = Parser->Offset++;
+
+        switch (Parser->State)
+        {
+        case SynthRdpConnectionRequestState::TpktHeader:
+            if (0 == Offset && SynthRdpTpktVersion != Byte)
+            {
+                Parser->State = SynthRdpConnectionRequestState::Done;
+            }
+            else if (2 == Offset)
+            {
+                Parser->End = static_cast<std::uint16_t>(Byte << 8);
+            }
+            else if (3 == Offset)
+            {
+                Parser->End |= Byte;
+                Parser->State = (Parser->End < SynthRdpX224UserDataOffset)
+                    ? SynthRdpConnectionRequestState::Done
+                    : SynthRdpConnectionRequestState::X224Header;
+            }
+            break;
+        case SynthRdpConnectionRequestState::X224Header:
+            if (4 == Offset)
+            {
+                // The length indicator excludes itself, and the TPDU may
+                // not exceed the TPKT packet.
+                std::uint16_t End = static_cast<std::uint16_t>(5 + Byte);
+                if (End < SynthRdpX224UserDataOffset)
+                {
+                    Parser->State = SynthRdpConnectionRequestState::Done;
+                }
+                else if (End < Parser->End)
+                {
+                    Parser->End = End;
+                }
+            }
+            else if (5 == Offset &&
+                SynthRdpX224ConnectionRequest != (Byte & 0xF0))
+            {
+                Parser->State = SynthRdpConnectionRequestState::Done;
+            }
+            else if (SynthRdpX224UserDataOffset - 1 == Offset)
+            {
+                Parser->State = SynthRdpConnectionRequestState::UserData;
+            }
+            break;
+        case SynthRdpConnectionRequestState::UserData:
+            if (SynthRdpNegotiationRequestType == Byte)
+            {
+                Parser->NegotiationOffset = Offset;
+                Parser->State =
+                    SynthRdpConnectionRequestState::NegotiationRequest;
+            }
+            else
+            {
+                Parser->PreviousByte = Byte;
+                Parser->State = SynthRdpConnectionRequestState::Token;
+            }
+            break;
+        case SynthRdpConnectionRequestState::Token:
+            if ('\r' == Parser->PreviousByte && '\n' == Byte)
+            {
+                Parser->State = SynthRdpConnectionRequestState::UserData;
+            }
+            Parser->PreviousByte = Byte;
+            break;
+        case SynthRdpConnectionRequestState::NegotiationRequest:
+        {
+            std::uint16_t Position = static_cast<std::uint16_t>(
+                Offset - Parser->NegotiationOffset);
+            if (2 == Position)
+            {
+                Parser->NegotiationLength = Byte;
+            }
+            else if (3 == Position)
+            {
+                Parser->NegotiationLength |= static_cast<std::uint16_t>(
+                    Byte << 8);
+                if (SynthRdpNegotiationRequestLength !=
+                    Parser->NegotiationLength ||
+                    Parser->NegotiationOffset +
+                    SynthRdpNegotiationRequestLength > Parser->End)
+                {
+                    Parser->State = SynthRdpConnectionRequestState::Done;
+                }
+            }
+            else if (Position >= 4)
+            {
+                // Set requestedProtocols to PROTOCOL_RDP (0x00000000).
+                Parser->RequestedProtocols |=
+                    static_cast<std::uint32_t>(Byte) << (8 * (Position - 4));
+                Byte = 0x00;
+                if (SynthRdpNegotiationRequestLength - 1 == Position)
+                {
+                    Parser->Rewritten = true;
+                    Parser->State = SynthRdpConnectionRequestState::Done;
+                }
+            }
+            break;
+        }
+        default:
+            break;
+        }
+
+        if (Parser->Offset >= Parser->End &&
+            Parser->State > SynthRdpConnectionRequestState::TpktHeader)
+        {
+            Parser->State = SynthRdpConnectionRequestState::Done;
+        }
+    }
+
+    return Consumed;
+}
+
+// The MCS channel ID of the I/O channel (MCS_GLOBAL_CHANNEL). The user
+// channel IDs are smaller, and the virtual channel IDs are larger.
+const std::uint16_t SynthRdpIoChannelId = 1003;
+
+// The TPKT header, the X.224 Data TPDU header and the MCS Send Data Request
+// or Indication header up to the channel ID.
+const DWORD SynthRdpFramingHeaderSize = 12;
+
+// The streaming parser which splits the RDP stream at the boundaries of the
+// TPKT and fast-path PDUs, and classifies the PDUs by their headers. The PDU
+// content is encrypted by the standard RDP security, so only the unencrypted
+// headers are used for the classification.
+struct SynthRdpFramingParser
+{
+    // Cleared if the stream cannot be framed, and the framing stops.
+    bool Synchronized;
+    bool FromClient;
+    std::uint8_t Header[SynthRdpFramingHeaderSize];
+    // The offset of the next byte in the PDU.
+    DWORD Offset;
+    // Zero until the length fields are received.
+    DWORD Length;
+};
+
+void SynthRdpFramingParserInitialize(
+    _Out_ SynthRdpFramingParser* Parser,
+    _In_ bool Enabled,
+    _In_ bool FromClient)
+{
+    Parser->Synchronized = Enabled;
+    Parser->FromClient = FromClient;
+    Parser->Offset = 0;
+    Parser->Length = 0;
+}
+
+bool SynthRdpFramingParseLength(
+    _Inout_ SynthRdpFramingParser* Parser)
+{
+    std::uint8_t* Header = Parser->Header;
+    DWORD HeaderLength = Parser->Offset;
+
+    if (SynthRdpTpktVersion == Header[0])
+    {
+        if (HeaderLength == 4)
+        {
+            Parser->Length = (Header[2] << 8) | Header[3];
+            // The TPKT header and the X.224 TPDU header at least.
+            return Parser->Length >= 7;
+        }
+        return true;
+    }
+
+    // The action field of the fast-path header is zero.
+    if (0 != (Header[0] & 0x03))
+    {
+        return false;
+    }
+    if (HeaderLength == 2 && !(Header[1] & 0x80))
+    {
+        Parser->Length = Header[1];
+        return Parser->Length >= 2;
+    }
+    if (HeaderLength == 3 && (Header[1] & 0x80))
+    {
+        Parser->Length = ((Header[1] & 0x7F) << 8) | Header[2];
+        return Parser->Length >= 3;
+    }
+    return true;
+}
+
+SynthRdpPduClass SynthRdpFramingClassify(
+    _In_ SynthRdpFramingParser* Parser)
+{
+    std::uint8_t* Header = Parser->Header;
+    DWORD HeaderLength = (std::min)(Parser->Offset, SynthRdpFramingHeaderSize);
+
+    if (SynthRdpTpktVersion == Header[0])
+    {
+        // X.224 Data TPDU with the MCS Send Data Request (25) or the MCS
+        // Send Data Indication (26).
+        if (HeaderLength < SynthRdpFramingHeaderSize ||
+            0xF0 != Header[5] ||
+            (25 != (Header[7] >> 2) && 26 != (Header[7] >> 2)))
+        {
+            return SynthRdpPduClass::Control;
+        }
+        std::uint16_t ChannelId = static_cast<std::uint16_t>(
+            (Header[10] << 8) | Header[11]);
+        if (ChannelId > SynthRdpIoChannelId)
+        {
+            return SynthRdpPduClass::VirtualChannel;
+        }
+        if (ChannelId == SynthRdpIoChannelId && !Parser->FromClient)
+        {
+            // The slow-path updates.
+            return SynthRdpPduClass::Graphics;
+        }
+        return SynthRdpPduClass::Control;
+    }
+
+    if (Parser->FromClient)
+    {
+        return SynthRdpPduClass::Input;
+    }
+
+    // The update header is not visible if FASTPATH_OUTPUT_ENCRYPTED is set.
+    DWORD UpdateHeaderOffset = (Header[1] & 0x80) ? 3 : 2;
+    if ((Header[0] & 0x80) || HeaderLength <= UpdateHeaderOffset)
+    {
+        return SynthRdpPduClass::Graphics;
+    }
+    switch (Header[UpdateHeaderOffset] & 0x0F)
+    {
+    case 0x5: // FASTPATH_UPDATETYPE_PTR_NULL
+    case 0x6: // FASTPATH_UPDATETYPE_PTR_DEFAULT
+    case 0x8: // FASTPATH_UPDATETYPE_PTR_POSITION
+    case 0x9: // FASTPATH_UPDATETYPE_COLOR
+    case 0xA: // FASTPATH_UPDATETYPE_CACHED
+    case 0xB: // FASTPATH_UPDATETYPE_POINTER
+    case 0xC: // FASTPATH_UPDATETYPE_LARGE_POINTER
+        return SynthRdpPduClass::Cursor;
+    default:
+        return SynthRdpPduClass::Graphics;
+    }
+}
+
+// Consume the next chunk of the stream, and return the end offset of the
+// last latency critical PDU in the chunk, or zero if there is none.
+DWORD SynthRdpFramingParserConsume(
+    _Inout_ SynthRdpFramingParser* Parser,
+    _In_reads_(Length) const std::uint8_t* Data,
+    _In_ DWORD Length,
+    _Inout_ SynthRdpStatisticsDirection* Statistics)
+{
+    DWORD CriticalEnd = 0;
+
+    DWORD Consumed = 0;
+    while (Consumed < Length && Parser->Synchronized)
+    {
+        if (!Parser->Length || Parser->Offset < (std::min)(
+            Parser->Length,
+            SynthRdpFramingHeaderSize))
+        {
+            Parser->Header[Parser->Offset++] = Data[Consumed++];
+            if (!Parser->Length && !::SynthRdpFramingParseLength(Parser))
+            {
+                Parser->Synchronized = false;
+                break;
+            }
+        }
+        else
+        {
+            DWORD Skipped = (std::min)(
+                Length - Consumed,
+                Parser->Length - Parser->Offset);
+            Consumed += Skipped;
+            Parser->Offset += Skipped;
+        }
+
+        if (Parser->Length && Parser->Offset >= Parser->Length)
+        {
+            SynthRdpPduClass Class = ::SynthRdpFramingClassify(Parser);
+            std::size_t Index = static_cast<std::size_t>(Class);
+            ::InterlockedIncrement64(&Statistics->ClassPdus[Index]);
+            ::InterlockedExchangeAdd64(
+                &Statistics->ClassBytes[Index],
+                Parser->Length);
+            if (SynthRdpPduClass::Input == Class ||
+                SynthRdpPduClass::Cursor == Class)
+            {
+                CriticalEnd = Consumed;
+            }
+            Parser->Offset = 0;
+            Parser->Length = 0;
+        }
+    }
+
+    return CriticalEnd;
+}
+
+struct SynthRdpRelayDirection
+{
+    CRITICAL_SECTION Lock;
+    SynthRdpRelaySession* Session;
+    SynthRdpRelayEndpoint* Source;
+    SynthRdpRelayEndpoint* Target;
+    SynthRdpRelayOperation ReadOperation;
+    SynthRdpRelayOperation WriteOperation;
+    bool ReadPending;
+    bool ReadProbing;
+    bool ReadProbed;
+    bool WritePending;
+    SynthRdpConnectionRequestParser ConnectionRequestParser;
+    SynthRdpFramingParser FramingParser;
+    std::uint32_t SizeClass;
+    std::uint32_t FullReadStreak;
+    std::uint32_t SmallReadStreak;
+    // The number of the chunks read from the source and written to the
+    // target. The chunks in between are queued in the ring.
+    std::size_t ReadCount;
+    std::size_t WriteCount;
+    SynthRdpRelayBuffer* Ring[SynthRdpRelayRingSize];
+    DWORD QueuedBytes;
+    // The tick count when the last chunk is read from the source, and when
+    // the last write is completed or the queue becomes non-empty, which are
+    // checked by the watchdog.
+    DWORD volatile LastReadTime;
+    DWORD volatile LastWriteTime;
+    bool Backpressured;
+    LONGLONG BackpressureStartTime;
+    // The token bucket of the per session bandwidth limit in bytes, which
+    // becomes negative after a write larger than the remaining tokens.
+    LONG64 Tokens;
+    DWORD TokensRefillTime;
+    // The bytes granted by the scheduler from the total bandwidth, which is
+    // protected by g_RelaySchedulerLock.
+    LONG64 Deficit;
+    // The writes are deferred until the scheduler wakes up the direction.
+    bool volatile Throttled;
+    LONGLONG ThrottleStartTime;
+    // Only set by the Benchmark command to simulate the slow links.
+    const SynthRdpRelayImpairment* Impairment;
+    DWORD ImpairmentLinkFreeTime;
+    DWORD ImpairmentReleaseTime;
+    std::uint32_t ImpairmentSeed;
+    SynthRdpRelayBuffer* GatherBuffer;
+    SynthRdpStatisticsDirection* Statistics;
+};
+
+struct SynthRdpRelaySession
+{
+    CRITICAL_SECTION Lock;
+    LONG volatile ReferenceCount;
+    bool Closing;
+    // No read request is issued while the session is being handed off to the
+    // new instance.
+    bool volatile HandingOff;
+    // Set while the handoff waits for the I/O in flight of the session.
+    LONG volatile HandoffBusy;
+    // The first reason which closes the session.
+    SynthRdpTeardownReason TeardownReason;
+    // The VMBus pipe, or the Hyper-V socket of the forwarded connection.
+    SynthRdpRelayEndpoint Pipe;
+    SynthRdpRelayEndpoint Server;
+    SynthRdpRelayDirection Vmbus2Tcp;
+    SynthRdpRelayDirection Tcp2Vmbus;
+    SynthRdpStatisticsSession* Statistics;
+    // Used when the shared memory for the statistics is not available.
+    SynthRdpStatisticsSession LocalStatistics;
+    SynthRdpBackendState* Backend;
+    DWORD CaptureSessionId;
+};
+
+namespace
+{
+    static HANDLE g_RelayCompletionPort = nullptr;
+    static std::vector<HANDLE> g_RelayWorkerThreads;
+    static SLIST_HEADER g_RelayBufferPools[SynthRdpRelaySizeClassCount];
+
+    static CRITICAL_SECTION g_SessionLock;
+    static std::vector<SynthRdpRelaySession*> g_ActiveSessions;
+    static std::deque<HANDLE> g_PendingChannels;
+    static DWORD g_ActiveChannelCount = 0;
+    static DWORD g_MaximumSessions = 16;
+    static HANDLE g_SessionsDrainedEvent = nullptr;
+    // The channels which are connecting to the server, and their sessions
+    // are not in the active sessions yet.
+    static DWORD g_ConnectingChannelCount = 0;
+    static HANDLE g_ChannelsConnectedEvent = nullptr;
+    // The sessions being handed off which still have the I/O in flight, and
+    // one more is held by the handoff until all sessions are counted.
+    static LONG volatile g_RelayHandoffBusyCount = 0;
+    static HANDLE g_RelayHandoffIdleEvent = nullptr;
+    static bool g_RelayPduFraming = false;
+    static DWORD g_RelayHighWatermark =
+        SynthRdpRelayDefaultHighWatermark * 1024;
+    static DWORD g_RelayLowWatermark =
+        SynthRdpRelayDefaultLowWatermark * 1024;
+    // In milliseconds, and zero disables the check.
+    static DWORD g_RelayIdleTimeout = 0;
+    static DWORD g_RelayStallTimeout = 0;
+    static HANDLE g_RelayWatchdogTimer = nullptr;
+    // In bytes per second, and zero disables the limit.
+    static DWORD g_RelaySessionBandwidth = 0;
+    static DWORD g_RelaySessionBurst =
+        SynthRdpRelayDefaultSessionBurst * 1024;
+    static DWORD g_RelayTotalBandwidth = 0;
+    static CRITICAL_SECTION g_RelaySchedulerLock;
+    static std::vector<SynthRdpRelayDirection*> g_RelayThrottledDirections;
+    static std::size_t g_RelaySchedulerCursor = 0;
+    static LONG64 g_RelaySchedulerTokens = 0;
+    static DWORD g_RelaySchedulerRefillTime = 0;
+    static HANDLE g_RelaySchedulerTimer = nullptr;
+    static bool g_RelayImpairmentEnabled = false;
+    static SynthRdpRelayImpairment g_RelayVmbus2TcpImpairment = { 0 };
+    static SynthRdpRelayImpairment g_RelayTcp2VmbusImpairment = { 0 };
+
+    static LARGE_INTEGER g_PerformanceFrequency = { 0 };
+    static HANDLE g_StatisticsMapping = nullptr;
+    static bool g_StatisticsMapped = false;
+    static SynthRdpStatisticsHeader* g_StatisticsHeader = nullptr;
+}
+
+void SynthRdpOnChannelFinished();
+
+LONGLONG SynthRdpStatisticsGetTimestamp()
+{
+    LARGE_INTEGER Counter;
+    ::QueryPerformanceCounter(&Counter);
+    return Counter.QuadPart;
+}
+
+LONG64 SynthRdpStatisticsToMicroseconds(
+    _In_ LONGLONG Ticks)
+{
+    if (!g_PerformanceFrequency.QuadPart)
+    {
+        return 0;
+    }
+
+    return static_cast<LONG64>(
+        Ticks * 1000000 / g_PerformanceFrequency.QuadPart);
+}
+
+LONG64 SynthRdpStatisticsGetElapsedTime(
+    _In_ LONGLONG Timestamp)
+{
+    return ::SynthRdpStatisticsToMicroseconds(
+        ::SynthRdpStatisticsGetTimestamp() - Timestamp);
+}
+
+LONG64 SynthRdpStatisticsGetSystemTime()
+{
+    FILETIME SystemTime;
+    ::GetSystemTimeAsFileTime(&SystemTime);
+    ULARGE_INTEGER Result;
+    Result.LowPart = SystemTime.dwLowDateTime;
+    Result.HighPart = SystemTime.dwHighDateTime;
+    return static_cast<LONG64>(Result.QuadPart);
+}
+
+void SynthRdpStatisticsAddChunk(
+    _In_ SynthRdpStatisticsDirection* Statistics,
+    _In_ DWORD Length)
+{
+    std::size_t Bucket = 0;
+    DWORD UpperBound = 64;
+    while (Bucket + 1 < SynthRdpStatisticsHistogramSize &&
+        Length > UpperBound)
+    {
+        UpperBound <<= 2;
+        ++Bucket;
+    }
+
+    ::InterlockedIncrement64(&Statistics->Chunks);
+    ::InterlockedIncrement64(&Statistics->ChunkSizeHistogram[Bucket]);
+}
+
+void SynthRdpStatisticsUpdateMaximum(
+    _Inout_ LONG64 volatile* Target,
+    _In_ LONG64 Value)
+{
+    LONG64 Current = *Target;
+    while (Current < Value)
+    {
+        LONG64 Previous = ::InterlockedCompareExchange64(
+            Target,
+            Value,
+            Current);
+        if (Previous == Current)
+        {
+            break;
+        }
+        Current = Previous;
+    }
+}
+
+void SynthRdpStatisticsMergeDirection(
+    _Inout_ SynthRdpStatisticsDirection* Target,
+    _In_ SynthRdpStatisticsDirection* Source)
+{
+    ::InterlockedExchangeAdd64(
+        &Target->TransferredBytes,
+        Source->TransferredBytes);
+    ::InterlockedExchangeAdd64(&Target->Chunks, Source->Chunks);
+    ::InterlockedExchangeAdd64(&Target->ReadRequests, Source->ReadRequests);
+    ::InterlockedExchangeAdd64(&Target->WriteRequests, Source->WriteRequests);
+    ::InterlockedExchangeAdd64(&Target->ReadWaitTime, Source->ReadWaitTime);
+    ::InterlockedExchangeAdd64(&Target->WriteWaitTime, Source->WriteWaitTime);
+    for (std::size_t i = 0; i < SynthRdpStatisticsHistogramSize; ++i)
+    {
+        ::InterlockedExchangeAdd64(
+            &Target->ChunkSizeHistogram[i],
+            Source->ChunkSizeHistogram[i]);
+    }
+    for (std::size_t i = 0; i < SynthRdpPduClassCount; ++i)
+    {
+        ::InterlockedExchangeAdd64(&Target->ClassPdus[i], Source->ClassPdus[i]);
+        ::InterlockedExchangeAdd64(
+            &Target->ClassBytes[i],
+            Source->ClassBytes[i]);
+    }
+    ::SynthRdpStatisticsUpdateMaximum(
+        &Target->PeakQueuedBytes,
+        Source->PeakQueuedBytes);
+    ::InterlockedExchangeAdd64(
+        &Target->BackpressureEvents,
+        Source->BackpressureEvents);
+    ::InterlockedExchangeAdd64(
+        &Target->BackpressureTime,
+        Source->BackpressureTime);
+    ::InterlockedExchangeAdd64(
+        &Target->ThrottleEvents,
+        Source->ThrottleEvents);
+    ::InterlockedExchangeAdd64(
+        &Target->ThrottleTime,
+        Source->ThrottleTime);
+}
+
+SynthRdpStatisticsSession* SynthRdpStatisticsGetSessionSlots()
+{
+    return reinterpret_cast<SynthRdpStatisticsSession*>(
+        &g_StatisticsHeader[1]);
+}
+
+DWORD SynthRdpStatisticsStartup(
+    _In_ bool Publish)
+{
+    ::QueryPerformanceFrequency(&g_PerformanceFrequency);
+
+    DWORD MappingSize = static_cast<DWORD>(
+        sizeof(SynthRdpStatisticsHeader) +
+        g_MaximumSessions * sizeof(SynthRdpStatisticsSession));
+
+    if (!Publish)
+    {
+        g_StatisticsHeader = reinterpret_cast<SynthRdpStatisticsHeader*>(
+            ::MileAllocateMemory(MappingSize));
+        if (!g_StatisticsHeader)
+        {
+            return ERROR_NOT_ENOUGH_MEMORY;
+        }
+    }
+    else
+    {
+        g_StatisticsMapping = ::CreateFileMappingW(
+            INVALID_HANDLE_VALUE,
+            nullptr,
+            PAGE_READWRITE,
+            0,
+            MappingSize,
+            SynthRdpStatisticsMappingName);
+        if (!g_StatisticsMapping)
+        {
+            return ::GetLastError();
+        }
+
+        g_StatisticsHeader = reinterpret_cast<SynthRdpStatisticsHeader*>(
+            ::MapViewOfFile(
+                g_StatisticsMapping,
+                FILE_MAP_READ | FILE_MAP_WRITE,
+                0,
+                0,
+                MappingSize));
+        if (!g_StatisticsHeader)
+        {
+            DWORD Error = ::GetLastError();
+            ::CloseHandle(g_StatisticsMapping);
+            g_StatisticsMapping = nullptr;
+            return Error;
+        }
+        g_StatisticsMapped = true;
+    }
+
+    std::memset(g_StatisticsHeader, 0, MappingSize);
+    g_StatisticsHeader->Version = SynthRdpStatisticsVersion;
+    g_StatisticsHeader->ProcessId = ::GetCurrentProcessId();
+    g_StatisticsHeader->SessionSlotCount = g_MaximumSessions;
+    g_StatisticsHeader->StartTime = ::SynthRdpStatisticsGetSystemTime();
+
+    // Publish the signature at last to make the readers see the completed
+    // header.
+    ::InterlockedExchange(
+        reinterpret_cast<LONG volatile*>(&g_StatisticsHeader->Signature),
+        SynthRdpStatisticsSignature);
+
+    return ERROR_SUCCESS;
+}
+
+void SynthRdpStatisticsUnpublish()
+{
+    // The name is released after the last mapping handle is closed, and the
+    // view is still usable until it is unmapped.
+    if (g_StatisticsMapping)
+    {
+        ::CloseHandle(g_StatisticsMapping);
+        g_StatisticsMapping = nullptr;
+    }
+}
+
+void SynthRdpStatisticsCleanup()
+{
+    ::SynthRdpStatisticsUnpublish();
+    if (g_StatisticsMapped)
+    {
+        ::UnmapViewOfFile(g_StatisticsHeader);
+        g_StatisticsMapped = false;
+    }
+    else if (g_StatisticsHeader)
+    {
+        ::MileFreeMemory(g_StatisticsHeader);
+    }
+    g_StatisticsHeader = nullptr;
+}
+
+void SynthRdpStatisticsAcquireSession(
+    _In_ SynthRdpRelaySession* Session)
+{
+    Session->LocalStatistics.Generation = 0;
+    Session->Statistics = &Session->LocalStatistics;
+
+    // The caller holds g_SessionLock, and the number of the active sessions
+    // never exceeds the slot count.
+    if (g_StatisticsHeader)
+    {
+        SynthRdpStatisticsSession* Slots =
+            ::SynthRdpStatisticsGetSessionSlots();
+        for (DWORD i = 0; i < g_StatisticsHeader->SessionSlotCount; ++i)
+        {
+            if (!(Slots[i].Generation & 1))
+            {
+                Session->Statistics = &Slots[i];
+                break;
+            }
+        }
+    }
+
+    LONG Generation = Session->Statistics->Generation;
+    std::memset(Session->Statistics, 0, sizeof(SynthRdpStatisticsSession));
+    Session->Statistics->StartTime = ::SynthRdpStatisticsGetSystemTime();
+    ::InterlockedExchange(&Session->Statistics->Generation, Generation + 1);
+
+    if (g_StatisticsHeader)
+    {
+        ::InterlockedIncrement64(&g_StatisticsHeader->TotalSessions);
+    }
+}
+
+void SynthRdpStatisticsAddDiscovery(
+    _In_ LONG64 OpenTime)
+{
+    if (g_StatisticsHeader)
+    {
+        ::InterlockedIncrement64(&g_StatisticsHeader->DiscoveredChannels);
+        ::InterlockedExchangeAdd64(
+            &g_StatisticsHeader->ChannelOpenTime,
+            OpenTime);
+    }
+}
+
+void SynthRdpStatisticsReleaseSession(
+    _In_ SynthRdpRelaySession* Session)
+{
+    if (g_StatisticsHeader)
+    {
+        ::SynthRdpStatisticsMergeDirection(
+            &g_StatisticsHeader->FinishedVmbus2Tcp,
+            &Session->Statistics->Vmbus2Tcp);
+        ::SynthRdpStatisticsMergeDirection(
+            &g_StatisticsHeader->FinishedTcp2Vmbus,
+            &Session->Statistics->Tcp2Vmbus);
+        ::InterlockedIncrement64(&g_StatisticsHeader->TeardownReasons[
+            static_cast<std::size_t>(Session->TeardownReason)]);
+    }
+
+    ::InterlockedIncrement(&Session->Statistics->Generation);
+}
+
+// The capture file contains the header and the ring of the records, which
+// keeps the chunks crossed the relay in the last RingSize bytes.
+const DWORD SynthRdpCaptureSignature = 0x43445253; // 'SRDC'
+const DWORD SynthRdpCaptureVersion = 1;
+const DWORD SynthRdpCaptureDefaultSize = 64;
+
+struct SynthRdpCaptureHeader
+{
+    DWORD Signature;
+    DWORD Version;
+    LONG64 RingSize;
+    // The number of the bytes reserved by the writers since the capture is
+    // started, which never wraps around.
+    LONG64 volatile WritePosition;
+    // The performance counter frequency and value, and the FILETIME when the
+    // capture is started, for converting the timestamps of the records.
+    LONG64 Frequency;
+    LONG64 StartTimestamp;
+    LONG64 StartTime;
+    std::uint8_t Reserved[16];
+    // The ring follows the header.
+};
+
+enum class SynthRdpCaptureDirection : std::uint32_t
+{
+    Vmbus2Tcp,
+    Tcp2Vmbus,
+};
+
+// The records are 8-byte aligned, and the data follows the record header.
+struct SynthRdpCaptureRecord
+{
+    // The position of the record which is written at last to commit the
+    // record. It is also used by the reader to find the first record after
+    // the ring wraps around.
+    LONG64 volatile Position;
+    LONG64 Timestamp;
+    DWORD SessionId;
+    SynthRdpCaptureDirection Direction;
+    DWORD Length;
+    DWORD Reserved;
+};
+
+namespace
+{
+    static HANDLE g_CaptureFile = INVALID_HANDLE_VALUE;
+    static HANDLE g_CaptureMapping = nullptr;
+    static SynthRdpCaptureHeader* g_CaptureHeader = nullptr;
+    static LONG volatile g_CaptureSessionCount = 0;
+}
+
+LONG64 SynthRdpCaptureGetRecordSize(
+    _In_ DWORD Length)
+{
+    return (sizeof(SynthRdpCaptureRecord) + Length + 7) & ~7LL;
+}
+
+void SynthRdpCaptureWriteRing(
+    _In_ SynthRdpCaptureHeader* Header,
+    _In_ LONG64 Position,
+    _In_reads_(Length) const void* Source,
+    _In_ DWORD Length)
+{
+    std::uint8_t* Ring = reinterpret_cast<std::uint8_t*>(&Header[1]);
+    std::size_t Offset = static_cast<std::size_t>(Position % Header->RingSize);
+    std::size_t Tail = static_cast<std::size_t>(Header->RingSize) - Offset;
+    if (Length <= Tail)
+    {
+        std::memcpy(Ring + Offset, Source, Length);
+    }
+    else
+    {
+        std::memcpy(Ring + Offset, Source, Tail);
+        std::memcpy(
+            Ring,
+            reinterpret_cast<const std::uint8_t*>(Source) + Tail,
+            Length - Tail);
+    }
+}
+
+void SynthRdpCaptureReadRing(
+    _In_ const SynthRdpCaptureHeader* Header,
+    _In_ LONG64 Position,
+    _Out_writes_(Length) void* Target,
+    _In_ DWORD Length)
+{
+    const std::uint8_t* Ring =
+        reinterpret_cast<const std::uint8_t*>(&Header[1]);
+    std::size_t Offset = static_cast<std::size_t>(Position % Header->RingSize);
+    std::size_t Tail = static_cast<std::size_t>(Header->RingSize) - Offset;
+    if (Length <= Tail)
+    {
+        std::memcpy(Target, Ring + Offset, Length);
+    }
+    else
+    {
+        std::memcpy(Target, Ring + Offset, Tail);
+        std::memcpy(
+            reinterpret_cast<std::uint8_t*>(Target) + Tail,
+            Ring,
+            Length - Tail);
+    }
+}
+
+DWORD SynthRdpCaptureStartup(
+    _In_ std::wstring const& Path,
+    _In_ DWORD SizeInMegabytes)
+{
+    if (Path.empty())
+    {
+        return ERROR_SUCCESS;
+    }
+
+    if (!SizeInMegabytes)
+    {
+        SizeInMegabytes = SynthRdpCaptureDefaultSize;
+    }
+    LONG64 RingSize = static_cast<LONG64>(SizeInMegabytes) * 1024 * 1024;
+    ULARGE_INTEGER FileSize;
+    FileSize.QuadPart = sizeof(SynthRdpCaptureHeader) + RingSize;
+
+    // The file is allocated in advance, and the readers can open it while
+    // capturing.
+    g_CaptureFile = ::CreateFileW(
+        Path.c_str(),
+        GENERIC_READ | GENERIC_WRITE,
+        FILE_SHARE_READ,
+        nullptr,
+        CREATE_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr);
+    if (INVALID_HANDLE_VALUE == g_CaptureFile)
+    {
+        return ::GetLastError();
+    }
+
+    g_CaptureMapping = ::CreateFileMappingW(
+        g_CaptureFile,
+        nullptr,
+        PAGE_READWRITE,
+        FileSize.HighPart,
+        FileSize.LowPart,
+        nullptr);
+    if (!g_CaptureMapping)
+    {
+        return ::GetLastError();
+    }
+
+    SynthRdpCaptureHeader* Header = reinterpret_cast<SynthRdpCaptureHeader*>(
+        ::MapViewOfFile(
+            g_CaptureMapping,
+            FILE_MAP_READ | FILE_MAP_WRITE,
+            0,
+            0,
+            0));
+    if (!Header)
+    {
+        return ::GetLastError();
+    }
+
+    LARGE_INTEGER Frequency;
+    ::QueryPerformanceFrequency(&Frequency);
+
+    Header->Version = SynthRdpCaptureVersion;
+    Header->RingSize = RingSize;
+    Header->WritePosition = 0;
+    Header->Frequency = Frequency.QuadPart;
+    Header->StartTimestamp = ::SynthRdpStatisticsGetTimestamp();
+    Header->StartTime = ::SynthRdpStatisticsGetSystemTime();
+    // Publish the signature at last to make the readers see the completed
+    // header.
+    ::InterlockedExchange(
+        reinterpret_cast<LONG volatile*>(&Header->Signature),
+        SynthRdpCaptureSignature);
+
+    g_CaptureHeader = Header;
+
+    return ERROR_SUCCESS;
+}
+
+void SynthRdpCaptureCleanup()
+{
+    if (g_CaptureHeader)
+    {
+        ::UnmapViewOfFile(g_CaptureHeader);
+        g_CaptureHeader = nullptr;
+    }
+
+    if (g_CaptureMapping)
+    {
+        ::CloseHandle(g_CaptureMapping);
+        g_CaptureMapping = nullptr;
+    }
+
+    if (INVALID_HANDLE_VALUE != g_CaptureFile)
+    {
+        ::CloseHandle(g_CaptureFile);
+        g_CaptureFile = INVALID_HANDLE_VALUE;
+    }
+}
+
+DWORD SynthRdpCaptureAcquireSessionId()
+{
+    return static_cast<DWORD>(::InterlockedIncrement(&g_CaptureSessionCount));
+}
+
+// Only one atomic increment for reserving the space and the copies are needed
+// for capturing a chunk, which keeps the timing of the relay undisturbed.
+void SynthRdpCaptureChunk(
+    _In_ DWORD SessionId,
+    _In_ SynthRdpCaptureDirection Direction,
+    _In_reads_(Length) const std::uint8_t* Data,
+    _In_ DWORD Length)
+{
+    SynthRdpCaptureHeader* Header = g_CaptureHeader;
+    if (!Header)
+    {
+        return;
+    }
+
+    LONG64 RecordSize = ::SynthRdpCaptureGetRecordSize(Length);
+    if (RecordSize > Header->RingSize)
+    {
+        return;
+    }
+
+    LONG64 Position = ::InterlockedExchangeAdd64(
+        &Header->WritePosition,
+        RecordSize);
+
+    SynthRdpCaptureRecord Record;
+    Record.Position = -1;
+    Record.Timestamp = ::SynthRdpStatisticsGetTimestamp();
+    Record.SessionId = SessionId;
+    Record.Direction = Direction;
+    Record.Length = Length;
+    Record.Reserved = 0;
+    ::SynthRdpCaptureWriteRing(Header, Position, &Record, sizeof(Record));
+    ::SynthRdpCaptureWriteRing(
+        Header,
+        Position + sizeof(SynthRdpCaptureRecord),
+        Data,
+        Length);
+
+    // Commit the record. The position is 8-byte aligned and never split by
+    // the ring boundary. The x86 and x64 processors never reorder the stores,
+    // so the volatile write is enough for them.
+#if defined(_M_ARM64)
+    ::MemoryBarrier();
+#endif
+    std::uint8_t* Ring = reinterpret_cast<std::uint8_t*>(&Header[1]);
+    *reinterpret_cast<LONG64 volatile*>(
+        Ring + Position % Header->RingSize) = Position;
+}
+
+// The trace keeps the relay threads away from the console. Each thread
+// records the binary events into its own ring without any lock, and the
+// drainer thread formats them into the console or the trace file.
+enum class SynthRdpTraceLevel : DWORD
+{
+    Off,
+    // The events which happen once per session.
+    Info,
+    // The events which happen for each relayed chunk.
+    Verbose,
+};
+
+enum class SynthRdpTraceEventType : std::uint32_t
+{
+    ProtocolRewritten,
+    FramingStopped,
+    // The chunk is read from the source, and the parameters are the
+    // direction and the length of the chunk.
+    ChunkRead,
+};
+
+struct SynthRdpTraceEvent
+{
+    LONG64 Timestamp;
+    SynthRdpTraceLevel Level;
+    SynthRdpTraceEventType Type;
+    DWORD SessionId;
+    DWORD Parameter1;
+    DWORD Parameter2;
+};
+
+const std::size_t SynthRdpTraceRingSize = 4096;
+const DWORD SynthRdpTraceDrainInterval = 50;
+
+// Only the owner thread writes the events and only the drainer thread reads
+// them, so the positions are enough for the synchronization.
+struct SynthRdpTraceRing
+{
+    SynthRdpTraceRing* Next;
+    std::size_t volatile WritePosition;
+    std::size_t volatile ReadPosition;
+    // The events which are not recorded because the ring is full.
+    LONG64 volatile DroppedEvents;
+    // Only accessed by the owner thread.
+    DWORD SampleCount;
+    SynthRdpTraceEvent Events[SynthRdpTraceRingSize];
+};
+
+namespace
+{
+    static SynthRdpTraceLevel volatile g_TraceLevel = SynthRdpTraceLevel::Off;
+    static DWORD g_TraceSampling = 1;
+    static SynthRdpTraceRing* volatile g_TraceRings = nullptr;
+    static DWORD g_TraceGeneration = 0;
+    static thread_local SynthRdpTraceRing* g_TraceThreadRing = nullptr;
+    static thread_local DWORD g_TraceThreadGeneration = 0;
+    static HANDLE g_TraceFile = INVALID_HANDLE_VALUE;
+    static HANDLE g_TraceStopEvent = nullptr;
+    static HANDLE g_TraceDrainerThread = nullptr;
+    static LONG64 g_TraceStartTimestamp = 0;
+}
+
+SynthRdpTraceRing* SynthRdpTraceGetThreadRing()
+{
+    // The ring of the previous trace has been freed if the trace is started
+    // again in this process.
+    SynthRdpTraceRing* Ring = g_TraceThreadRing;
+    if (Ring && g_TraceGeneration == g_TraceThreadGeneration)
+    {
+        return Ring;
+    }
+
+    Ring = reinterpret_cast<SynthRdpTraceRing*>(
+        ::MileAllocateMemory(sizeof(SynthRdpTraceRing)));
+    if (!Ring)
+    {
+        return nullptr;
+    }
+    Ring->WritePosition = 0;
+    Ring->ReadPosition = 0;
+    Ring->DroppedEvents = 0;
+    Ring->SampleCount = 0;
+
+    // The rings are kept until the trace is stopped because the drainer
+    // thread may still read them after the owner thread exits.
+    SynthRdpTraceRing* Head = nullptr;
+    do
+    {
+        Head = g_TraceRings;
+        Ring->Next = Head;
+    } while (Head != ::InterlockedCompareExchangePointer(
+        reinterpret_cast<PVOID volatile*>(&g_TraceRings),
+        Ring,
+        Head));
+
+    g_TraceThreadRing = Ring;
+    g_TraceThreadGeneration = g_TraceGeneration;
+    return Ring;
+}
+
+// Only a timestamp and a few stores are needed for recording an event, and
+// the event is dropped instead of blocking the relay if the ring is full.
+void SynthRdpTraceWrite(
+    _In_ SynthRdpTraceLevel Level,
+    _In_ SynthRdpTraceEventType Type,
+    _In_ DWORD SessionId,
+    _In_ DWORD Parameter1,
+    _In_ DWORD Parameter2)
+{
+    if (Level > g_TraceLevel)
+    {
+        return;
+    }
+
+    SynthRdpTraceRing* Ring = ::SynthRdpTraceGetThreadRing();
+    if (!Ring)
+    {
+        return;
+    }
+
+    // Only record one of each g_TraceSampling verbose events.
+    if (SynthRdpTraceLevel::Verbose == Level)
+    {
+        if (++Ring->SampleCount < g_TraceSampling)
+        {
+            return;
+        }
+        Ring->SampleCount = 0;
+    }
+
+    std::size_t Position = Ring->WritePosition;
+    if (Position - Ring->ReadPosition >= SynthRdpTraceRingSize)
+    {
+        ::InterlockedIncrement64(&Ring->DroppedEvents);
+        return;
+    }
+
+    SynthRdpTraceEvent* Event =
+        &Ring->Events[Position % SynthRdpTraceRingSize];
+    Event->Timestamp = ::SynthRdpStatisticsGetTimestamp();
+    Event->Level = Level;
+    Event->Type = Type;
+    Event->SessionId = SessionId;
+    Event->Parameter1 = Parameter1;
+    Event->Parameter2 = Parameter2;
+
+    // Commit the event. The x86 and x64 processors never reorder the stores,
+    // so the volatile write is enough for them.
+#if defined(_M_ARM64)
+    ::MemoryBarrier();
+#endif
+    Ring->WritePosition = Position + 1;
+}
+
+void SynthRdpTraceFormatEvent(
+    _In_ SynthRdpTraceEvent const& Event,
+    _Inout_ std::string& Output)
+{
+    LONG64 Elapsed = ::SynthRdpStatisticsToMicroseconds(
+        Event.Timestamp - g_TraceStartTimestamp);
+
+    char Buffer[256];
+    int Length = std::snprintf(
+        Buffer,
+        sizeof(Buffer),
+        "[%s] [%lld.%06lld] Session %u: ",
+        (SynthRdpTraceLevel::Verbose == Event.Level) ? "Verbose" : "Info",
+        Elapsed / 1000000,
+        Elapsed % 1000000,
+        Event.SessionId);
+    if (Length > 0)
+    {
+        Output.append(Buffer, Length);
+    }
+
+    switch (Event.Type)
+    {
+    case SynthRdpTraceEventType::ProtocolRewritten:
+        Length = std::snprintf(
+            Buffer,
+            sizeof(Buffer),
+            "requestedProtocols 0x%08X is rewritten to PROTOCOL_RDP.\n",
+            Event.Parameter1);
+        break;
+    case SynthRdpTraceEventType::FramingStopped:
+        Length = std::snprintf(
+            Buffer,
+            sizeof(Buffer),
+            "PDU framing is stopped because of the unknown data.\n");
+        break;
+    case SynthRdpTraceEventType::ChunkRead:
+        Length = std::snprintf(
+            Buffer,
+            sizeof(Buffer),
+            "%s: %u Bytes.\n",
+            (static_cast<DWORD>(SynthRdpCaptureDirection::Vmbus2Tcp) ==
+                Event.Parameter1) ? "ReadFile" : "WSARecv",
+            Event.Parameter2);
+        break;
+    default:
+        Length = std::snprintf(
+            Buffer,
+            sizeof(Buffer),
+            "Unknown event %u.\n",
+            static_cast<DWORD>(Event.Type));
+        break;
+    }
+    if (Length > 0)
+    {
+        Output.append(Buffer, Length);
+    }
+}
+
+void SynthRdpTraceDrain()
+{
+    std::vector<SynthRdpTraceEvent> Events;
+    LONG64 DroppedEvents = 0;
+
+    for (SynthRdpTraceRing* Ring = g_TraceRings; Ring; Ring = Ring->Next)
+    {
+        std::size_t WritePosition = Ring->WritePosition;
+#if defined(_M_ARM64)
+        ::MemoryBarrier();
+#endif
+        for (std::size_t i = Ring->ReadPosition; i != WritePosition; ++i)
+        {
+            Events.push_back(Ring->Events[i % SynthRdpTraceRingSize]);
+        }
+#if defined(_M_ARM64)
+        ::MemoryBarrier();
+#endif
+        Ring->ReadPosition = WritePosition;
+
+        DroppedEvents += ::InterlockedExchange64(&Ring->DroppedEvents, 0);
+    }
+
+    if (Events.empty() && !DroppedEvents)
+    {
+        return;
+    }
+
+    // Merge the events from all threads.
+    std::sort(
+        Events.begin(),
+        Events.end(),
+        [](SynthRdpTraceEvent const& Left, SynthRdpTraceEvent const& Right)
+        {
+            return Left.Timestamp < Right.Timestamp;
+        });
+
+    std::string Output;
+    for (SynthRdpTraceEvent const& Event : Events)
+    {
+        ::SynthRdpTraceFormatEvent(Event, Output);
+    }
+    if (DroppedEvents)
+    {
+        char Buffer[64];
+        int Length = std::snprintf(
+            Buffer,
+            sizeof(Buffer),
+            "[Info] %lld trace events are dropped.\n",
+            DroppedEvents);
+        if (Length > 0)
+        {
+            Output.append(Buffer, Length);
+        }
+    }
+
+    if (INVALID_HANDLE_VALUE != g_TraceFile)
+    {
+        DWORD NumberOfBytesWritten = 0;
+        ::WriteFile(
+            g_TraceFile,
+            Output.c_str(),
+            static_cast<DWORD>(Output.size()),
+            &NumberOfBytesWritten,
+            nullptr);
+    }
+    else
+    {
+        std::fwrite(Output.c_str(), 1, Output.size(), stdout);
+        std::fflush(stdout);
+    }
+}
+
+DWORD SynthRdpTraceStartup(
+    _In_ DWORD Level,
+    _In_ DWORD Sampling,
+    _In_ std::wstring const& Path)
+{
+    // Only trace to the console when running as a console application.
+    if (!Level || (Path.empty() && !g_InteractiveMode))
+    {
+        return ERROR_SUCCESS;
+    }
+
+    if (!Path.empty())
+    {
+        g_TraceFile = ::CreateFileW(
+            Path.c_str(),
+            GENERIC_WRITE,
+            FILE_SHARE_READ,
+            nullptr,
+            CREATE_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL,
+            nullptr);
+        if (INVALID_HANDLE_VALUE == g_TraceFile)
+        {
+            return ::GetLastError();
+        }
+    }
+
+    g_TraceStopEvent = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (!g_TraceStopEvent)
+    {
+        return ::GetLastError();
+    }
+
+    g_TraceSampling = Sampling ? Sampling : 1;
+    ++g_TraceGeneration;
+    g_TraceStartTimestamp = ::SynthRdpStatisticsGetTimestamp();
+
+    g_TraceDrainerThread = Mile::CreateThread([]()
+    {
+        bool Stopping = false;
+        while (!Stopping)
+        {
+            Stopping = WAIT_OBJECT_0 == ::WaitForSingleObject(
+                g_TraceStopEvent,
+                SynthRdpTraceDrainInterval);
+            ::SynthRdpTraceDrain();
+        }
+    });
+    if (!g_TraceDrainerThread)
+    {
+        return ::GetLastError();
+    }
+
+    g_TraceLevel = std::min(
+        static_cast<SynthRdpTraceLevel>(Level),
+        SynthRdpTraceLevel::Verbose);
+
+    return ERROR_SUCCESS;
+}
+
+// Should be called after all threads which record the events are stopped.
+void SynthRdpTraceCleanup()
+{
+    g_TraceLevel = SynthRdpTraceLevel::Off;
+
+    if (g_TraceDrainerThread)
+    {
+        // The drainer thread formats the remaining events before it exits.
+        ::SetEvent(g_TraceStopEvent);
+        ::WaitForSingleObject(g_TraceDrainerThread, INFINITE);
+        ::CloseHandle(g_TraceDrainerThread);
+        g_TraceDrainerThread = nullptr;
+    }
+
+    if (g_TraceStopEvent)
+    {
+        ::CloseHandle(g_TraceStopEvent);
+        g_TraceStopEvent = nullptr;
+    }
+
+    if (INVALID_HANDLE_VALUE != g_TraceFile)
+    {
+        ::CloseHandle(g_TraceFile);
+        g_TraceFile = INVALID_HANDLE_VALUE;
+    }
+
+    SynthRdpTraceRing* Current = reinterpret_cast<SynthRdpTraceRing*>(
+        ::InterlockedExchangePointer(
+            reinterpret_cast<PVOID volatile*>(&g_TraceRings),
+            nullptr));
+    while (Current)
+    {
+        SynthRdpTraceRing* Next = Current->Next;
+        ::MileFreeMemory(Current);
+        Current = Next;
+    }
+}
+
+SynthRdpRelayBuffer* SynthRdpRelayAcquireBuffer(
+    _In_ std::uint32_t SizeClass)
+{
+    SynthRdpRelayBuffer* Buffer = reinterpret_cast<SynthRdpRelayBuffer*>(
+        ::InterlockedPopEntrySList(&g_RelayBufferPools[SizeClass]));
+    if (!Buffer)
+    {
+        DWORD Capacity = SynthRdpRelaySizeClasses[SizeClass];
+        Buffer = reinterpret_cast<SynthRdpRelayBuffer*>(
+            ::MileAllocateMemory(sizeof(SynthRdpRelayBuffer) + Capacity));
+        if (!Buffer)
+        {
+            return nullptr;
+        }
+        Buffer->SizeClass = SizeClass;
+        Buffer->Capacity = Capacity;
+        Buffer->Data = reinterpret_cast<std::uint8_t*>(&Buffer[1]);
+    }
+
+    Buffer->Length = 0;
+    Buffer->Offset = 0;
+    Buffer->CriticalEnd = 0;
+    return Buffer;
+}
+
+void SynthRdpRelayReleaseBuffer(
+    _In_ SynthRdpRelayBuffer* Buffer)
+{
+    // Only cache a bounded amount of memory for each size class, and return
+    // the rest to the system heap.
+    if (::QueryDepthSList(&g_RelayBufferPools[Buffer->SizeClass]) <
+        SynthRdpRelayPoolDepths[Buffer->SizeClass])
+    {
+        ::InterlockedPushEntrySList(
+            &g_RelayBufferPools[Buffer->SizeClass],
+            &Buffer->PoolEntry);
+    }
+    else
+    {
+        ::MileFreeMemory(Buffer);
+    }
+}
+
+void SynthRdpRelayUpdateSizeClass(
+    _In_ SynthRdpRelayDirection* Direction,
+    _In_ SynthRdpRelayBuffer* Buffer)
+{
+    if (Buffer->Length == Buffer->Capacity)
+    {
+        // Use the larger chunk size under sustained bulk traffic.
+        Direction->SmallReadStreak = 0;
+        if (++Direction->FullReadStreak >= 2 &&
+            Direction->SizeClass + 1 < SynthRdpRelaySizeClassCount)
+        {
+            ++Direction->SizeClass;
+            Direction->FullReadStreak = 0;
+        }
+    }
+    else if (Buffer->Length < Buffer->Capacity / 4)
+    {
+        // Shrink back when the traffic becomes interactive or idle.
+        Direction->FullReadStreak = 0;
+        if (++Direction->SmallReadStreak >= 4 && Direction->SizeClass > 0)
+        {
+            --Direction->SizeClass;
+            Direction->SmallReadStreak = 0;
+        }
+    }
+    else
+    {
+        Direction->FullReadStreak = 0;
+        Direction->SmallReadStreak = 0;
+    }
+}
+
+bool SynthRdpRelayEndpointRead(
+    _In_ SynthRdpRelayEndpoint* Endpoint,
+    _In_ LPWSABUF Slice,
+    _Inout_ LPOVERLAPPED Overlapped)
+{
+    if (SynthRdpRelayEndpointType::Pipe == Endpoint->Type)
+    {
+        if (::ReadFile(
+            Endpoint->PipeHandle,
+            Slice->buf,
+            Slice->len,
+            nullptr,
+            Overlapped))
+        {
+            return true;
+        }
+
+        // The completion packet will be queued for the message mode pipe
+        // even if the current message is larger than the buffer.
+        DWORD Error = ::GetLastError();
+        return (ERROR_IO_PENDING == Error || ERROR_MORE_DATA == Error);
+    }
+
+    DWORD Flags = 0;
+    if (SOCKET_ERROR != ::WSARecv(
+        Endpoint->Socket,
+        Slice,
+        1,
+        nullptr,
+        &Flags,
+        Overlapped,
+        nullptr))
+    {
+        return true;
+    }
+
+    return (WSA_IO_PENDING == ::WSAGetLastError());
+}
+
+bool SynthRdpRelayEndpointWrite(
+    _In_ SynthRdpRelayEndpoint* Endpoint,
+    _In_ LPWSABUF Slices,
+    _In_ DWORD SliceCount,
+    _Inout_ LPOVERLAPPED Overlapped)
+{
+    if (SynthRdpRelayEndpointType::Pipe == Endpoint->Type)
+    {
+        // The pipe has no gathered write, so the caller needs to merge the
+        // slices before writing.
+        if (1 != SliceCount)
+        {
+            ::SetLastError(ERROR_INVALID_PARAMETER);
+            return false;
+        }
+
+        if (::WriteFile(
+            Endpoint->PipeHandle,
+            Slices->buf,
+            Slices->len,
+            nullptr,
+            Overlapped))
+        {
+            return true;
+        }
+
+        return (ERROR_IO_PENDING == ::GetLastError());
+    }
+
+    if (SOCKET_ERROR != ::WSASend(
+        Endpoint->Socket,
+        Slices,
+        SliceCount,
+        nullptr,
+        0,
+        Overlapped,
+        nullptr))
+    {
+        return true;
+    }
+
+    return (WSA_IO_PENDING == ::WSAGetLastError());
+}
+
+void SynthRdpRelaySetQueuedBytes(
+    _In_ SynthRdpRelayDirection* Direction,
+    _In_ DWORD QueuedBytes)
+{
+    Direction->QueuedBytes = QueuedBytes;
+    ::InterlockedExchange64(
+        &Direction->Statistics->QueuedBytes,
+        QueuedBytes);
+    ::SynthRdpStatisticsUpdateMaximum(
+        &Direction->Statistics->PeakQueuedBytes,
+        QueuedBytes);
+}
+
+void SynthRdpRelayEndBackpressure(
+    _In_ SynthRdpRelayDirection* Direction)
+{
+    if (Direction->Backpressured)
+    {
+        Direction->Backpressured = false;
+        ::InterlockedExchangeAdd64(
+            &Direction->Statistics->BackpressureTime,
+            ::SynthRdpStatisticsGetElapsedTime(
+                Direction->BackpressureStartTime));
+        ::InterlockedExchange64(
+            &Direction->Statistics->BackpressureStartTime,
+            0);
+    }
+}
+
+// Pause the reads from the source when the queue reaches the high watermark,
+// and resume them when it drops to the low watermark. The paused direction
+// means the target is slower than the source.
+void SynthRdpRelayUpdateBackpressure(
+    _In_ SynthRdpRelayDirection* Direction)
+{
+    std::size_t QueuedChunks = Direction->ReadCount - Direction->WriteCount;
+    if (!Direction->Backpressured)
+    {
+        if (Direction->QueuedBytes >= g_RelayHighWatermark ||
+            QueuedChunks >= SynthRdpRelayRingSize)
+        {
+            Direction->Backpressured = true;
+            Direction->BackpressureStartTime =
+                ::SynthRdpStatisticsGetTimestamp();
+            ::InterlockedIncrement64(
+                &Direction->Statistics->BackpressureEvents);
+            ::InterlockedExchange64(
+                &Direction->Statistics->BackpressureStartTime,
+                ::SynthRdpStatisticsGetSystemTime());
+        }
+    }
+    else if (Direction->QueuedBytes <= g_RelayLowWatermark &&
+        QueuedChunks <= SynthRdpRelayRingSize / 2)
+    {
+        ::SynthRdpRelayEndBackpressure(Direction);
+    }
+}
+
+// Defer the writes of the direction until the scheduler wakes it up, and the
+// scheduler holds a session reference until then.
+void SynthRdpRelayBeginThrottle(
+    _In_ SynthRdpRelayDirection* Direction)
+{
+    Direction->Throttled = true;
+    Direction->ThrottleStartTime = ::SynthRdpStatisticsGetTimestamp();
+    ::InterlockedIncrement64(&Direction->Statistics->ThrottleEvents);
+    ::InterlockedExchange64(
+        &Direction->Statistics->ThrottleStartTime,
+        ::SynthRdpStatisticsGetSystemTime());
+
+    ::InterlockedIncrement(&Direction->Session->ReferenceCount);
+    ::EnterCriticalSection(&g_RelaySchedulerLock);
+    g_RelayThrottledDirections.push_back(Direction);
+    ::LeaveCriticalSection(&g_RelaySchedulerLock);
+}
+
+void SynthRdpRelayEndThrottle(
+    _In_ SynthRdpRelayDirection* Direction)
+{
+    Direction->Throttled = false;
+    ::InterlockedExchangeAdd64(
+        &Direction->Statistics->ThrottleTime,
+        ::SynthRdpStatisticsGetElapsedTime(Direction->ThrottleStartTime));
+    ::InterlockedExchange64(
+        &Direction->Statistics->ThrottleStartTime,
+        0);
+
+    // The writes were deferred by the limits instead of the target, which
+    // should not be treated as stalled by the watchdog.
+    Direction->LastWriteTime = ::GetTickCount();
+}
+
+void SynthRdpRelayCloseEndpoint(
+    _Inout_ SynthRdpRelayEndpoint* Endpoint)
+{
+    if (SynthRdpRelayEndpointType::Pipe == Endpoint->Type)
+    {
+        ::CloseHandle(Endpoint->PipeHandle);
+        Endpoint->PipeHandle = INVALID_HANDLE_VALUE;
+    }
+    else
+    {
+        ::closesocket(Endpoint->Socket);
+        Endpoint->Socket = INVALID_SOCKET;
+    }
+}
+
+void SynthRdpRelayCloseSession(
+    _In_ SynthRdpRelaySession* Session,
+    _In_ SynthRdpTeardownReason Reason)
+{
+    ::EnterCriticalSection(&Session->Lock);
+    if (!Session->Closing)
+    {
+        Session->Closing = true;
+        Session->TeardownReason = Reason;
+
+        // Closing the handles cancels all outstanding I/O of the session, and
+        // the aborted operations will be reported to the completion port.
+        ::SynthRdpRelayCloseEndpoint(&Session->Pipe);
+        ::SynthRdpRelayCloseEndpoint(&Session->Server);
+    }
+    ::LeaveCriticalSection(&Session->Lock);
+}
+
+void SynthRdpRelayReleaseSession(
+    _In_ SynthRdpRelaySession* Session)
+{
+    if (0 == ::InterlockedDecrement(&Session->ReferenceCount))
+    {
+        if (g_InteractiveMode)
+        {
+            SynthRdpStatisticsSession* Statistics = Session->Statistics;
+            std::printf(
+                "[Info] Session finished (%s). "
+                "VMBus to TCP: %lld Bytes, %lld Reads, %lld Writes. "
+                "TCP to VMBus: %lld Bytes, %lld Reads, %lld Writes.\n",
+                SynthRdpTeardownReasonNames[
+                    static_cast<std::size_t>(Session->TeardownReason)],
+                Statistics->Vmbus2Tcp.TransferredBytes,
+                Statistics->Vmbus2Tcp.ReadRequests,
+                Statistics->Vmbus2Tcp.WriteRequests,
+                Statistics->Tcp2Vmbus.TransferredBytes,
+                Statistics->Tcp2Vmbus.ReadRequests,
+                Statistics->Tcp2Vmbus.WriteRequests);
+        }
+
+        // Account the pause which is not ended because of the closing.
+        ::SynthRdpRelayEndBackpressure(&Session->Vmbus2Tcp);
+        ::SynthRdpRelayEndBackpressure(&Session->Tcp2Vmbus);
+
+        ::EnterCriticalSection(&g_SessionLock);
+        for (auto Current = g_ActiveSessions.begin();
+            Current != g_ActiveSessions.end();
+            ++Current)
+        {
+            if (Session == *Current)
+            {
+                g_ActiveSessions.erase(Current);
+                break;
+            }
+        }
+        ::SynthRdpStatisticsReleaseSession(Session);
+        ::LeaveCriticalSection(&g_SessionLock);
+
+        ::SynthRdpReleaseBackend(Session->Backend);
+
+        for (std::size_t i = 0; i < SynthRdpRelayRingSize; ++i)
+        {
+            if (Session->Vmbus2Tcp.Ring[i])
+            {
+                ::SynthRdpRelayReleaseBuffer(Session->Vmbus2Tcp.Ring[i]);
+            }
+            if (Session->Tcp2Vmbus.Ring[i])
+            {
+                ::SynthRdpRelayReleaseBuffer(Session->Tcp2Vmbus.Ring[i]);
+            }
+        }
+
+        ::DeleteCriticalSection(&Session->Vmbus2Tcp.Lock);
+        ::DeleteCriticalSection(&Session->Tcp2Vmbus.Lock);
+        ::DeleteCriticalSection(&Session->Lock);
+        ::MileFreeMemory(Session);
+
+        ::SynthRdpOnChannelFinished();
+    }
+}
+
+bool SynthRdpRelayIssueOperation(
+    _In_ SynthRdpRelayOperation* Operation,
+    _In_ LPWSABUF Slices,
+    _In_ DWORD SliceCount)
+{
+    SynthRdpRelayDirection* Direction = Operation->Direction;
+    SynthRdpRelaySession* Session = Direction->Session;
+
+    bool Result = false;
+
+    // The session lock makes sure the handles will not be closed and reused
+    // by others while issuing the I/O request.
+    ::EnterCriticalSection(&Session->Lock);
+    if (!Session->Closing)
+    {
+        ::InterlockedIncrement(&Session->ReferenceCount);
+        std::memset(&Operation->Overlapped, 0, sizeof(OVERLAPPED));
+        Operation->IssueTime = ::SynthRdpStatisticsGetTimestamp();
+        if (SynthRdpRelayOperationType::Read == Operation->Type)
+        {
+            ::InterlockedIncrement64(&Direction->Statistics->ReadRequests);
+            Result = ::SynthRdpRelayEndpointRead(
+                Direction->Source,
+                Slices,
+                &Operation->Overlapped);
+        }
+        else
+        {
+            ::InterlockedIncrement64(&Direction->Statistics->WriteRequests);
+            Result = ::SynthRdpRelayEndpointWrite(
+                Direction->Target,
+                Slices,
+                SliceCount,
+                &Operation->Overlapped);
+        }
+        if (!Result)
+        {
+            // The caller always holds a reference, so it will not be zero.
+            ::InterlockedDecrement(&Session->ReferenceCount);
+        }
+    }
+    ::LeaveCriticalSection(&Session->Lock);
+
+    return Result;
+}
+
+bool SynthRdpRelayIsChunkReleased(
+    _In_ SynthRdpRelayDirection* Direction,
+    _In_ SynthRdpRelayBuffer* Buffer,
+    _In_ DWORD CurrentTime)
+{
+    return !Direction->Impairment ||
+        static_cast<LONG>(Buffer->ReleaseTime - CurrentTime) <= 0;
+}
+
+bool SynthRdpRelayIssueWrite(
+    _In_ SynthRdpRelayDirection* Direction)
+{
+    bool ToPipe = (SynthRdpRelayEndpointType::Pipe == Direction->Target->Type);
+
+    DWORD Limit = ToPipe
+        ? SynthRdpRelayMaximumPipeWriteSize
+        : SynthRdpRelayMaximumGatherSize;
+
+    // Coalesce all queued chunks into one gathered write request. It never
+    // waits for more data, so it only takes effect when the target is slower
+    // than the source, which keeps the latency unchanged.
+    //
+    // The data order cannot be changed, so the latency critical PDUs are
+    // prioritized by ending the write request right after them, and the bulk
+    // data queued after them will not delay their completions.
+    WSABUF Slices[SynthRdpRelayRingSize];
+    DWORD SliceCount = 0;
+    DWORD TotalLength = 0;
+    bool Critical = false;
+    DWORD CurrentTime = ::GetTickCount();
+    for (std::size_t i = Direction->WriteCount;
+        i < Direction->ReadCount && !Critical;
+        ++i)
+    {
+        SynthRdpRelayBuffer* Current = Direction->Ring[
+            i % SynthRdpRelayRingSize];
+        if (SliceCount &&
+            !::SynthRdpRelayIsChunkReleased(Direction, Current, CurrentTime))
+        {
+            break;
+        }
+        DWORD Length = Current->Length - Current->Offset;
+        if (Current->CriticalEnd > Current->Offset)
+        {
+            Length = Current->CriticalEnd - Current->Offset;
+            Critical = true;
+        }
+        if (TotalLength + Length > Limit)
+        {
+            if (SliceCount)
+            {
+                break;
+            }
+
+            // Split the first chunk if it is larger than the limit.
+            Length = Limit;
+        }
+        Slices[SliceCount].buf = reinterpret_cast<CHAR*>(
+            Current->Data + Current->Offset);
+        Slices[SliceCount].len = Length;
+        ++SliceCount;
+        TotalLength += Length;
+    }
+
+    if (ToPipe && SliceCount > 1)
+    {
+        // Merge the slices for the pipe because it has no gathered write.
+        Direction->GatherBuffer = ::SynthRdpRelayAcquireBuffer(
+            SynthRdpRelayPipeGatherSizeClass);
+        if (!Direction->GatherBuffer)
+        {
+            return false;
+        }
+        for (DWORD i = 0; i < SliceCount; ++i)
+        {
+            std::memcpy(
+                Direction->GatherBuffer->Data + Direction->GatherBuffer->Length,
+                Slices[i].buf,
+                Slices[i].len);
+            Direction->GatherBuffer->Length += Slices[i].len;
+        }
+        Slices[0].buf = reinterpret_cast<CHAR*>(Direction->GatherBuffer->Data);
+        Slices[0].len = Direction->GatherBuffer->Length;
+        SliceCount = 1;
+    }
+
+    if (!::SynthRdpRelayIssueOperation(
+        &Direction->WriteOperation,
+        Slices,
+        SliceCount))
+    {
+        if (Direction->GatherBuffer)
+        {
+            ::SynthRdpRelayReleaseBuffer(Direction->GatherBuffer);
+            Direction->GatherBuffer = nullptr;
+        }
+        return false;
+    }
+
+    return true;
+}
+
+// The per session limit is a token bucket. The total limit is shared by the
+// deficit round robin only when the sessions compete for it, so the writes
+// are not delayed until the total bandwidth is used up.
+bool SynthRdpRelayHasWriteCredit(
+    _In_ SynthRdpRelayDirection* Direction)
+{
+    // The simulated link delivers the chunks to the target after the
+    // impairment, and the scheduler wakes up the direction until then.
+    if (!::SynthRdpRelayIsChunkReleased(
+        Direction,
+        Direction->Ring[Direction->WriteCount % SynthRdpRelayRingSize],
+        ::GetTickCount()))
+    {
+        return false;
+    }
+
+    if (g_RelaySessionBandwidth)
+    {
+        DWORD CurrentTime = ::GetTickCount();
+        LONG64 Refill = static_cast<LONG64>(g_RelaySessionBandwidth) *
+            (CurrentTime - Direction->TokensRefillTime) / 1000;
+        if (Refill)
+        {
+            Direction->Tokens = std::min<LONG64>(
+                Direction->Tokens + Refill,
+                g_RelaySessionBurst);
+            Direction->TokensRefillTime = CurrentTime;
+        }
+        if (Direction->Tokens <= 0)
+        {
+            return false;
+        }
+    }
+
+    bool Result = true;
+    if (g_RelayTotalBandwidth)
+    {
+        ::EnterCriticalSection(&g_RelaySchedulerLock);
+        Result = Direction->Deficit > 0 || (
+            g_RelayThrottledDirections.empty() &&
+            g_RelaySchedulerTokens > 0);
+        ::LeaveCriticalSection(&g_RelaySchedulerLock);
+    }
+    return Result;
+}
+
+void SynthRdpRelayConsumeWriteCredit(
+    _In_ SynthRdpRelayDirection* Direction,
+    _In_ DWORD NumberOfBytesTransferred)
+{
+    if (g_RelaySessionBandwidth)
+    {
+        Direction->Tokens -= NumberOfBytesTransferred;
+    }
+
+    if (g_RelayTotalBandwidth)
+    {
+        ::EnterCriticalSection(&g_RelaySchedulerLock);
+        if (Direction->Deficit > 0)
+        {
+            Direction->Deficit -= NumberOfBytesTransferred;
+        }
+        else
+        {
+            g_RelaySchedulerTokens -= NumberOfBytesTransferred;
+        }
+        // The unused grant is dropped when the queue is drained, otherwise
+        // the idle direction would accumulate it.
+        if (Direction->WriteCount == Direction->ReadCount &&
+            Direction->Deficit > 0)
+        {
+            Direction->Deficit = 0;
+        }
+        ::LeaveCriticalSection(&g_RelaySchedulerLock);
+    }
+}
+
+bool SynthRdpRelayPumpDirection(
+    _In_ SynthRdpRelayDirection* Direction)
+{
+    ::SynthRdpRelayUpdateBackpressure(Direction);
+
+    // Keep one read request in flight as long as the reads are not paused, so
+    // the source is not idle while the previous chunks are being written to
+    // the target.
+    if (!Direction->ReadPending &&
+        !Direction->Backpressured &&
+        !Direction->Session->HandingOff)
+    {
+        SynthRdpRelayBuffer*& Current = Direction->Ring[
+            Direction->ReadCount % SynthRdpRelayRingSize];
+
+        if (SynthRdpRelayEndpointType::Socket == Direction->Source->Type &&
+            0 == Direction->SizeClass &&
+            !Direction->ReadProbed)
+        {
+            // Wait for the incoming data with a zero byte read request when
+            // the direction is idle, so no buffer is held until then.
+            WSABUF Slice = { 0 };
+            if (!::SynthRdpRelayIssueOperation(
+                &Direction->ReadOperation,
+                &Slice,
+                1))
+            {
+                return false;
+            }
+            Direction->ReadProbing = true;
+        }
+        else
+        {
+            Current = ::SynthRdpRelayAcquireBuffer(Direction->SizeClass);
+            if (!Current)
+            {
+                return false;
+            }
+            WSABUF Slice;
+            Slice.len = Current->Capacity;
+            Slice.buf = reinterpret_cast<CHAR*>(Current->Data);
+            if (!::SynthRdpRelayIssueOperation(
+                &Direction->ReadOperation,
+                &Slice,
+                1))
+            {
+                ::SynthRdpRelayReleaseBuffer(Current);
+                Current = nullptr;
+                return false;
+            }
+            Direction->ReadProbed = false;
+        }
+        Direction->ReadPending = true;
+    }
+
+    // Only one write request is in flight to keep the data order.
+    if (!Direction->WritePending &&
+        !Direction->Throttled &&
+        Direction->WriteCount < Direction->ReadCount)
+    {
+        if (!::SynthRdpRelayHasWriteCredit(Direction))
+        {
+            ::SynthRdpRelayBeginThrottle(Direction);
+        }
+        else
+        {
+            if (!::SynthRdpRelayIssueWrite(Direction))
+            {
+                return false;
+            }
+            Direction->WritePending = true;
+        }
+    }
+
+    return true;
+}
+
+bool SynthRdpRelayStartDirection(
+    _In_ SynthRdpRelayDirection* Direction)
+{
+    ::EnterCriticalSection(&Direction->Lock);
+    bool Result = ::SynthRdpRelayPumpDirection(Direction);
+    ::LeaveCriticalSection(&Direction->Lock);
+    return Result;
+}
+
+std::uint32_t SynthRdpRelayImpairmentRandom(
+    _Inout_ std::uint32_t& Seed)
+{
+    // Xorshift, which makes the simulated conditions reproducible.
+    Seed ^= Seed << 13;
+    Seed ^= Seed >> 17;
+    Seed ^= Seed << 5;
+    return Seed;
+}
+
+void SynthRdpRelayImpairChunk(
+    _In_ SynthRdpRelayDirection* Direction,
+    _Inout_ SynthRdpRelayBuffer* Buffer)
+{
+    const SynthRdpRelayImpairment* Impairment = Direction->Impairment;
+    DWORD CurrentTime = ::GetTickCount();
+
+    // The chunks are sent one after another on the link with the limited
+    // bandwidth.
+    DWORD SentTime = CurrentTime;
+    if (Impairment->Bandwidth)
+    {
+        if (static_cast<LONG>(
+            Direction->ImpairmentLinkFreeTime - CurrentTime) > 0)
+        {
+            SentTime = Direction->ImpairmentLinkFreeTime;
+        }
+        SentTime += static_cast<DWORD>(
+            static_cast<ULONG64>(Buffer->Length) * 1000 /
+            Impairment->Bandwidth);
+        Direction->ImpairmentLinkFreeTime = SentTime;
+    }
+
+    DWORD Delay = Impairment->Latency;
+    if (Impairment->Jitter)
+    {
+        Delay += ::SynthRdpRelayImpairmentRandom(Direction->ImpairmentSeed) %
+            (Impairment->Jitter + 1);
+    }
+    if (Impairment->LossRate &&
+        ::SynthRdpRelayImpairmentRandom(Direction->ImpairmentSeed) %
+        1000000 < Impairment->LossRate)
+    {
+        Delay += SynthRdpRelayImpairmentRetransmitTimeout;
+    }
+    DWORD ReleaseTime = SentTime + Delay;
+
+    if (Impairment->StallInterval && Impairment->StallDuration)
+    {
+        DWORD Phase = ReleaseTime % Impairment->StallInterval;
+        if (Phase < Impairment->StallDuration)
+        {
+            ReleaseTime += Impairment->StallDuration - Phase;
+        }
+    }
+
+    // The jitter never reorders the chunks.
+    if (static_cast<LONG>(
+        Direction->ImpairmentReleaseTime - ReleaseTime) > 0)
+    {
+        ReleaseTime = Direction->ImpairmentReleaseTime;
+    }
+    Direction->ImpairmentReleaseTime = ReleaseTime;
+    Buffer->ReleaseTime = ReleaseTime;
+}
+
+void SynthRdpRelayOnReadCompleted(
+    _In_ SynthRdpRelayDirection* Direction,
+    _In_ DWORD Error,
+    _In_ DWORD NumberOfBytesTransferred)
+{
+    SynthRdpRelaySession* Session = Direction->Session;
+
+    bool FromPipe =
+        (SynthRdpRelayEndpointType::Pipe == Direction->Source->Type);
+
+    ::EnterCriticalSection(&Direction->Lock);
+
+    Direction->ReadPending = false;
+
+    ::InterlockedExchangeAdd64(
+        &Direction->Statistics->ReadWaitTime,
+        ::SynthRdpStatisticsGetElapsedTime(Direction->ReadOperation.IssueTime));
+
+    SynthRdpRelayBuffer*& Current = Direction->Ring[
+        Direction->ReadCount % SynthRdpRelayRingSize];
+
+    bool Succeeded = false;
+    SynthRdpTeardownReason Reason = SynthRdpTeardownReason::Failed;
+    do
+    {
+        if (ERROR_OPERATION_ABORTED == Error && Session->HandingOff)
+        {
+            // The read is cancelled for handing off the session before any
+            // data is received, and it will be issued again if the session
+            // is resumed.
+            Direction->ReadProbing = false;
+            if (Current)
+            {
+                ::SynthRdpRelayReleaseBuffer(Current);
+                Current = nullptr;
+            }
+            Succeeded = ::SynthRdpRelayPumpDirection(Direction);
+            break;
+        }
+
+        if (Direction->ReadProbing)
+        {
+            Direction->ReadProbing = false;
+            Direction->ReadProbed = (ERROR_SUCCESS == Error);
+        }
+        else if (ERROR_SUCCESS == Error &&
+            (FromPipe || 0 != NumberOfBytesTransferred))
+        {
+            Current->Length = NumberOfBytesTransferred;
+            ::SynthRdpRelayUpdateSizeClass(Direction, Current);
+        }
+        else
+        {
+            // Treat the zero byte read result from the socket as the
+            // graceful close.
+            Error = (ERROR_SUCCESS == Error) ? ERROR_HANDLE_EOF : Error;
+        }
+
+        if (ERROR_SUCCESS != Error)
+        {
+            if (g_InteractiveMode && !Session->Closing)
+            {
+                std::printf(
+                    "[Error] %s failed (%d).\n",
+                    FromPipe ? "ReadFile" : "WSARecv",
+                    Error);
+            }
+            Reason = FromPipe
+                ? SynthRdpTeardownReason::PipeClosed
+                : SynthRdpTeardownReason::ServerClosed;
+            break;
+        }
+
+        if (Current)
+        {
+            if (!Current->Length)
+            {
+                // Skip the empty message from the VMBus pipe.
+                ::SynthRdpRelayReleaseBuffer(Current);
+                Current = nullptr;
+            }
+            else
+            {
+                SynthRdpConnectionRequestParser* Parser =
+                    &Direction->ConnectionRequestParser;
+                if (SynthRdpConnectionRequestState::Done != Parser->State)
+                {
+                    // The X.224 Connection Request PDU may be split into
+                    // or combined with other reads.
+                    ::SynthRdpConnectionRequestParserConsume(
+                        Parser,
+                        Current->Data,
+                        Current->Length);
+                    if (Parser->Rewritten &&
+                        SynthRdpConnectionRequestState::Done == Parser->State)
+                    {
+                        ::SynthRdpTraceWrite(
+                            SynthRdpTraceLevel::Info,
+                            SynthRdpTraceEventType::ProtocolRewritten,
+                            Session->CaptureSessionId,
+                            Parser->RequestedProtocols,
+                            0);
+                    }
+                }
+
+                ::SynthRdpStatisticsAddChunk(
+                    Direction->Statistics,
+                    Current->Length);
+
+                SynthRdpCaptureDirection CaptureDirection = FromPipe
+                    ? SynthRdpCaptureDirection::Vmbus2Tcp
+                    : SynthRdpCaptureDirection::Tcp2Vmbus;
+                ::SynthRdpCaptureChunk(
+                    Session->CaptureSessionId,
+                    CaptureDirection,
+                    Current->Data,
+                    Current->Length);
+
+                if (Direction->FramingParser.Synchronized)
+                {
+                    Current->CriticalEnd = ::SynthRdpFramingParserConsume(
+                        &Direction->FramingParser,
+                        Current->Data,
+                        Current->Length,
+                        Direction->Statistics);
+                    if (!Direction->FramingParser.Synchronized)
+                    {
+                        ::SynthRdpTraceWrite(
+                            SynthRdpTraceLevel::Info,
+                            SynthRdpTraceEventType::FramingStopped,
+                            Session->CaptureSessionId,
+                            0,
+                            0);
+                    }
+                }
+
+                ::SynthRdpTraceWrite(
+                    SynthRdpTraceLevel::Verbose,
+                    SynthRdpTraceEventType::ChunkRead,
+                    Session->CaptureSessionId,
+                    static_cast<DWORD>(CaptureDirection),
+                    Current->Length);
+
+                DWORD CurrentTime = ::GetTickCount();
+                Direction->LastReadTime = CurrentTime;
+                if (!Direction->QueuedBytes)
+                {
+                    Direction->LastWriteTime = CurrentTime;
+                }
+
+                if (Direction->Impairment)
+                {
+                    ::SynthRdpRelayImpairChunk(Direction, Current);
+                }
+
+                ++Direction->ReadCount;
+                ::SynthRdpRelaySetQueuedBytes(
+                    Direction,
+                    Direction->QueuedBytes + Current->Length);
+            }
+        }
+
+        Succeeded = ::SynthRdpRelayPumpDirection(Direction);
+
+    } while (false);
+
+    if (!Succeeded && Current)
+    {
+        ::SynthRdpRelayReleaseBuffer(Current);
+        Current = nullptr;
+    }
+
+    ::LeaveCriticalSection(&Direction->Lock);
+
+    if (!Succeeded)
+    {
+        ::SynthRdpRelayCloseSession(Session, Reason);
+    }
+}
+
+void SynthRdpRelayOnWriteCompleted(
+    _In_ SynthRdpRelayDirection* Direction,
+    _In_ DWORD Error,
+    _In_ DWORD NumberOfBytesTransferred)
+{
+    SynthRdpRelaySession* Session = Direction->Session;
+
+    ::EnterCriticalSection(&Direction->Lock);
+
+    Direction->WritePending = false;
+
+    ::InterlockedExchangeAdd64(
+        &Direction->Statistics->WriteWaitTime,
+        ::SynthRdpStatisticsGetElapsedTime(
+            Direction->WriteOperation.IssueTime));
+
+    if (Direction->GatherBuffer)
+    {
+        ::SynthRdpRelayReleaseBuffer(Direction->GatherBuffer);
+        Direction->GatherBuffer = nullptr;
+    }
+
+    bool Succeeded = false;
+    SynthRdpTeardownReason Reason = SynthRdpTeardownReason::Failed;
+    do
+    {
+        if (ERROR_SUCCESS != Error || 0 == NumberOfBytesTransferred)
+        {
+            if (g_InteractiveMode && !Session->Closing)
+            {
+                std::printf(
+                    "[Error] %s failed (%d).\n",
+                    (SynthRdpRelayEndpointType::Pipe == Direction->Target->Type)
+                    ? "WriteFile"
+                    : "WSASend",
+                    Error);
+            }
+            Reason =
+                (SynthRdpRelayEndpointType::Pipe == Direction->Target->Type)
+                ? SynthRdpTeardownReason::PipeClosed
+                : SynthRdpTeardownReason::ServerClosed;
+            break;
+        }
+
+        Direction->LastWriteTime = ::GetTickCount();
+
+        ::InterlockedExchangeAdd64(
+            &Direction->Statistics->TransferredBytes,
+            NumberOfBytesTransferred);
+
+        ::SynthRdpRelaySetQueuedBytes(
+            Direction,
+            Direction->QueuedBytes - NumberOfBytesTransferred);
+
+        // Distribute the written bytes to the gathered chunks.
+        DWORD Remaining = NumberOfBytesTransferred;
+        while (Remaining && Direction->WriteCount < Direction->ReadCount)
+        {
+            SynthRdpRelayBuffer*& Current = Direction->Ring[
+                Direction->WriteCount % SynthRdpRelayRingSize];
+            DWORD Length = Current->Length - Current->Offset;
+            if (Length > Remaining)
+            {
+                Length = Remaining;
+            }
+            Current->Offset += Length;
+            Remaining -= Length;
+            if (Current->Offset >= Current->Length)
+            {
+                ::SynthRdpRelayReleaseBuffer(Current);
+                Current = nullptr;
+                ++Direction->WriteCount;
+            }
+        }
+
+        ::SynthRdpRelayConsumeWriteCredit(
+            Direction,
+            NumberOfBytesTransferred);
+
+        Succeeded = ::SynthRdpRelayPumpDirection(Direction);
+
+    } while (false);
+
+    ::LeaveCriticalSection(&Direction->Lock);
+
+    if (!Succeeded)
+    {
+        ::SynthRdpRelayCloseSession(Session, Reason);
+    }
+}
+
+bool SynthRdpHandoffIsSessionQuiesced(
+    _In_ SynthRdpRelaySession* Session);
+
+void SynthRdpRelayReleaseHandoffBusy()
+{
+    if (0 == ::InterlockedDecrement(&g_RelayHandoffBusyCount))
+    {
+        ::SetEvent(g_RelayHandoffIdleEvent);
+    }
+}
+
+// Wake up the handoff when the last session being handed off has no I/O in
+// flight.
+void SynthRdpRelayUpdateHandoff(
+    _In_ SynthRdpRelaySession* Session)
+{
+    if (Session->HandoffBusy &&
+        (Session->Closing || ::SynthRdpHandoffIsSessionQuiesced(Session)) &&
+        1 == ::InterlockedCompareExchange(&Session->HandoffBusy, 0, 1))
+    {
+        ::SynthRdpRelayReleaseHandoffBusy();
+    }
+}
+
+void SynthRdpRelayWorker()
+{
+    for (;;)
+    {
+        DWORD NumberOfBytesTransferred = 0;
+        ULONG_PTR CompletionKey = 0;
+        LPOVERLAPPED Overlapped = nullptr;
+        BOOL Succeeded = ::GetQueuedCompletionStatus(
+            g_RelayCompletionPort,
+            &NumberOfBytesTransferred,
+            &CompletionKey,
+            &Overlapped,
+            INFINITE);
+        if (!Overlapped)
+        {
+            // The exit notification or the completion port is closed.
+            break;
+        }
+
+        DWORD Error = Succeeded ? ERROR_SUCCESS : ::GetLastError();
+        if (ERROR_MORE_DATA == Error)
+        {
+            // The rest of the current message will be read in the next read
+            // request.
+            Error = ERROR_SUCCESS;
+        }
+
+        SynthRdpRelayOperation* Operation = CONTAINING_RECORD(
+            Overlapped,
+            SynthRdpRelayOperation,
+            Overlapped);
+        SynthRdpRelaySession* Session = Operation->Direction->Session;
+        if (SynthRdpRelayOperationType::Read == Operation->Type)
+        {
+            ::SynthRdpRelayOnReadCompleted(
+                Operation->Direction,
+                Error,
+                NumberOfBytesTransferred);
+        }
+        else
+        {
+            ::SynthRdpRelayOnWriteCompleted(
+                Operation->Direction,
+                Error,
+                NumberOfBytesTransferred);
+        }
+        ::SynthRdpRelayUpdateHandoff(Session);
+        ::SynthRdpRelayReleaseSession(Session);
+    }
+}
+
+DWORD SynthRdpRelayStartup()
+{
+    for (std::uint32_t i = 0; i < SynthRdpRelaySizeClassCount; ++i)
+    {
+        ::InitializeSListHead(&g_RelayBufferPools[i]);
+    }
+
+    g_RelayCompletionPort = ::CreateIoCompletionPort(
+        INVALID_HANDLE_VALUE,
+        nullptr,
+        0,
+        0);
+    if (!g_RelayCompletionPort)
+    {
+        return ::GetLastError();
+    }
+
+    g_RelayHandoffIdleEvent = ::CreateEventW(nullptr, TRUE, TRUE, nullptr);
+    if (!g_RelayHandoffIdleEvent)
+    {
+        return ::GetLastError();
+    }
+
+    // A small fixed worker set is enough because the workers never block on
+    // the relay I/O.
+    SYSTEM_INFO SystemInfo = { 0 };
+    ::GetSystemInfo(&SystemInfo);
+    DWORD WorkerCount = SystemInfo.dwNumberOfProcessors;
+    if (WorkerCount < 2)
+    {
+        WorkerCount = 2;
+    }
+    else if (WorkerCount > 4)
+    {
+        WorkerCount = 4;
+    }
+
+    for (DWORD i = 0; i < WorkerCount; ++i)
+    {
+        HANDLE WorkerThread = Mile::CreateThread([]()
+        {
+            ::SynthRdpRelayWorker();
+        });
+        if (!WorkerThread)
+        {
+            return ::GetLastError();
+        }
+        g_RelayWorkerThreads.push_back(WorkerThread);
+    }
+
+    return ERROR_SUCCESS;
+}
+
+void SynthRdpRelayCleanup()
+{
+    if (!g_RelayCompletionPort)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < g_RelayWorkerThreads.size(); ++i)
+    {
+        ::PostQueuedCompletionStatus(g_RelayCompletionPort, 0, 0, nullptr);
+    }
+
+    for (HANDLE& WorkerThread : g_RelayWorkerThreads)
+    {
+        ::WaitForSingleObject(WorkerThread, INFINITE);
+        ::CloseHandle(WorkerThread);
+    }
+    g_RelayWorkerThreads.clear();
+
+    ::CloseHandle(g_RelayCompletionPort);
+    g_RelayCompletionPort = nullptr;
+
+    if (g_RelayHandoffIdleEvent)
+    {
+        ::CloseHandle(g_RelayHandoffIdleEvent);
+        g_RelayHandoffIdleEvent = nullptr;
+    }
+
+    for (std::uint32_t i = 0; i < SynthRdpRelaySizeClassCount; ++i)
+    {
+        PSLIST_ENTRY Current = ::InterlockedFlushSList(&g_RelayBufferPools[i]);
+        while (Current)
+        {
+            PSLIST_ENTRY Next = Current->Next;
+            ::MileFreeMemory(Current);
+            Current = Next;
+        }
+    }
+}
+
+// The interval to check the idle and stalled sessions.
+const DWORD SynthRdpRelayWatchdogInterval = 1000;
+
+// In seconds, and the idle timeout is disabled by default because the idle
+// sessions are usual.
+const DWORD SynthRdpRelayDefaultStallTimeout = 120;
+
+// The idle and stall timeouts are limited to a day.
+const DWORD SynthRdpRelayMaximumTimeout = 86400;
+
+bool SynthRdpRelayIsDirectionStalled(
+    _In_ SynthRdpRelayDirection* Direction)
+{
+    // Read the tick count after the last write time, so it is never earlier.
+    DWORD LastWriteTime = Direction->LastWriteTime;
+    bool Queued = (0 != Direction->QueuedBytes && !Direction->Throttled);
+    return Queued && ::GetTickCount() - LastWriteTime >= g_RelayStallTimeout;
+}
+
+bool SynthRdpRelayIsSessionIdle(
+    _In_ SynthRdpRelaySession* Session)
+{
+    DWORD Vmbus2TcpReadTime = Session->Vmbus2Tcp.LastReadTime;
+    DWORD Tcp2VmbusReadTime = Session->Tcp2Vmbus.LastReadTime;
+    DWORD CurrentTime = ::GetTickCount();
+    return
+        CurrentTime - Vmbus2TcpReadTime >= g_RelayIdleTimeout &&
+        CurrentTime - Tcp2VmbusReadTime >= g_RelayIdleTimeout;
+}
+
+void SynthRdpRelayCheckSessions()
+{
+    ::EnterCriticalSection(&g_SessionLock);
+    for (SynthRdpRelaySession*& Session : g_ActiveSessions)
+    {
+        // The session being handed off has no read request in flight.
+        if (Session->Closing || Session->HandingOff)
+        {
+            continue;
+        }
+
+        // The direction which has the queued data but makes no progress
+        // means the target stops reading without closing the connection.
+        SynthRdpTeardownReason Reason = SynthRdpTeardownReason::None;
+        if (g_RelayStallTimeout &&
+            (::SynthRdpRelayIsDirectionStalled(&Session->Vmbus2Tcp) ||
+                ::SynthRdpRelayIsDirectionStalled(&Session->Tcp2Vmbus)))
+        {
+            Reason = SynthRdpTeardownReason::Stalled;
+        }
+        else if (g_RelayIdleTimeout &&
+            ::SynthRdpRelayIsSessionIdle(Session))
+        {
+            Reason = SynthRdpTeardownReason::IdleTimeout;
+        }
+
+        if (SynthRdpTeardownReason::None != Reason)
+        {
+            if (g_InteractiveMode)
+            {
+                std::printf(
+                    "[Info] Session is closed by the watchdog (%s).\n",
+                    SynthRdpTeardownReasonNames[
+                        static_cast<std::size_t>(Reason)]);
+            }
+            ::SynthRdpRelayCloseSession(Session, Reason);
+        }
+    }
+    ::LeaveCriticalSection(&g_SessionLock);
+}
+
+DWORD SynthRdpRelayWatchdogStartup()
+{
+    if (!g_RelayIdleTimeout && !g_RelayStallTimeout)
+    {
+        return ERROR_SUCCESS;
+    }
+
+    if (!::CreateTimerQueueTimer(
+        &g_RelayWatchdogTimer,
+        nullptr,
+        [](PVOID, BOOLEAN)
+        {
+            ::SynthRdpRelayCheckSessions();
+        },
+        nullptr,
+        SynthRdpRelayWatchdogInterval,
+        SynthRdpRelayWatchdogInterval,
+        WT_EXECUTEDEFAULT))
+    {
+        g_RelayWatchdogTimer = nullptr;
+        return ::GetLastError();
+    }
+
+    return ERROR_SUCCESS;
+}
+
+void SynthRdpRelayWatchdogCleanup()
+{
+    if (g_RelayWatchdogTimer)
+    {
+        ::DeleteTimerQueueTimer(
+            nullptr,
+            g_RelayWatchdogTimer,
+            INVALID_HANDLE_VALUE);
+        g_RelayWatchdogTimer = nullptr;
+    }
+}
+
+// The interval to refill the total bandwidth and to wake up the throttled
+// directions, which bounds the delay added by the limits.
+const DWORD SynthRdpRelaySchedulerInterval = 10;
+
+// The bytes granted to each competing direction per round.
+const LONG64 SynthRdpRelaySchedulerQuantum = 16384;
+
+LONG64 SynthRdpRelayGetSchedulerBurst()
+{
+    // Keep at most 100 ms of the total bandwidth while it is not used up.
+    return std::max<LONG64>(
+        g_RelayTotalBandwidth / 10,
+        SynthRdpRelaySchedulerQuantum);
+}
+
+void SynthRdpRelayRunScheduler()
+{
+    std::vector<SynthRdpRelayDirection*> Directions;
+
+    ::EnterCriticalSection(&g_RelaySchedulerLock);
+    if (g_RelayTotalBandwidth)
+    {
+        DWORD CurrentTime = ::GetTickCount();
+        LONG64 Refill = static_cast<LONG64>(g_RelayTotalBandwidth) *
+            (CurrentTime - g_RelaySchedulerRefillTime) / 1000;
+        if (Refill)
+        {
+            g_RelaySchedulerTokens = std::min<LONG64>(
+                g_RelaySchedulerTokens + Refill,
+                ::SynthRdpRelayGetSchedulerBurst());
+            g_RelaySchedulerRefillTime = CurrentTime;
+        }
+
+        // Grant a quantum to each throttled direction without the remaining
+        // grant in turn until the refilled bandwidth is used up, and start
+        // from the next direction in the next round.
+        std::size_t Count = g_RelayThrottledDirections.size();
+        bool Granted = true;
+        while (Granted && g_RelaySchedulerTokens > 0)
+        {
+            Granted = false;
+            for (std::size_t i = 0;
+                i < Count && g_RelaySchedulerTokens > 0;
+                ++i)
+            {
+                SynthRdpRelayDirection* Current = g_RelayThrottledDirections[
+                    (g_RelaySchedulerCursor + i) % Count];
+                if (Current->Deficit > 0)
+                {
+                    continue;
+                }
+                LONG64 Grant = std::min(
+                    SynthRdpRelaySchedulerQuantum,
+                    g_RelaySchedulerTokens);
+                Current->Deficit += Grant;
+                g_RelaySchedulerTokens -= Grant;
+                Granted = true;
+            }
+        }
+        ++g_RelaySchedulerCursor;
+    }
+    Directions.swap(g_RelayThrottledDirections);
+    ::LeaveCriticalSection(&g_RelaySchedulerLock);
+
+    // The directions which are still out of the credit will be throttled
+    // again.
+    for (SynthRdpRelayDirection*& Direction : Directions)
+    {
+        SynthRdpRelaySession* Session = Direction->Session;
+
+        ::EnterCriticalSection(&Direction->Lock);
+        ::SynthRdpRelayEndThrottle(Direction);
+        bool Succeeded =
+            Session->Closing || ::SynthRdpRelayPumpDirection(Direction);
+        ::LeaveCriticalSection(&Direction->Lock);
+
+        if (!Succeeded)
+        {
+            ::SynthRdpRelayCloseSession(
+                Session,
+                SynthRdpTeardownReason::Failed);
+        }
+        ::SynthRdpRelayReleaseSession(Session);
+    }
+}
+
+DWORD SynthRdpRelaySchedulerStartup()
+{
+    if (!g_RelaySessionBandwidth &&
+        !g_RelayTotalBandwidth &&
+        !g_RelayImpairmentEnabled)
+    {
+        return ERROR_SUCCESS;
+    }
+
+    ::InitializeCriticalSection(&g_RelaySchedulerLock);
+    g_RelaySchedulerTokens = ::SynthRdpRelayGetSchedulerBurst();
+    g_RelaySchedulerRefillTime = ::GetTickCount();
+
+    if (!::CreateTimerQueueTimer(
+        &g_RelaySchedulerTimer,
+        nullptr,
+        [](PVOID, BOOLEAN)
+        {
+            ::SynthRdpRelayRunScheduler();
+        },
+        nullptr,
+        SynthRdpRelaySchedulerInterval,
+        SynthRdpRelaySchedulerInterval,
+        WT_EXECUTEDEFAULT))
+    {
+        DWORD Error = ::GetLastError();
+        g_RelaySchedulerTimer = nullptr;
+        ::DeleteCriticalSection(&g_RelaySchedulerLock);
+        return Error;
+    }
+
+    return ERROR_SUCCESS;
+}
+
+// The throttled directions hold the session references, so it needs to be
+// called after all sessions are finished.
+void SynthRdpRelaySchedulerCleanup()
+{
+    if (g_RelaySchedulerTimer)
+    {
+        ::DeleteTimerQueueTimer(
+            nullptr,
+            g_RelaySchedulerTimer,
+            INVALID_HANDLE_VALUE);
+        g_RelaySchedulerTimer = nullptr;
+        ::DeleteCriticalSection(&g_RelaySchedulerLock);
+    }
+}
+
+void SynthRdpRelayInitializeDirection(
+    _In_ SynthRdpRelaySession* Session,
+    _Out_ SynthRdpRelayDirection* Direction,
+    _In_ SynthRdpRelayEndpoint* Source,
+    _In_ SynthRdpRelayEndpoint* Target,
+    _In_ SynthRdpStatisticsDirection* Statistics)
+{
+    ::InitializeCriticalSection(&Direction->Lock);
+    Direction->Session = Session;
+    Direction->Source = Source;
+    Direction->Target = Target;
+    Direction->ReadOperation.Type = SynthRdpRelayOperationType::Read;
+    Direction->ReadOperation.Direction = Direction;
+    Direction->WriteOperation.Type = SynthRdpRelayOperationType::Write;
+    Direction->WriteOperation.Direction = Direction;
+    Direction->ReadPending = false;
+    Direction->ReadProbing = false;
+    Direction->ReadProbed = false;
+    Direction->WritePending = false;
+    ::SynthRdpConnectionRequestParserInitialize(
+        &Direction->ConnectionRequestParser,
+        false);
+    ::SynthRdpFramingParserInitialize(
+        &Direction->FramingParser,
+        g_RelayPduFraming,
+        SynthRdpRelayEndpointType::Pipe == Source->Type);
+    Direction->SizeClass = 0;
+    Direction->FullReadStreak = 0;
+    Direction->SmallReadStreak = 0;
+    Direction->ReadCount = 0;
+    Direction->WriteCount = 0;
+    for (std::size_t i = 0; i < SynthRdpRelayRingSize; ++i)
+    {
+        Direction->Ring[i] = nullptr;
+    }
+    Direction->QueuedBytes = 0;
+    Direction->LastReadTime = ::GetTickCount();
+    Direction->LastWriteTime = Direction->LastReadTime;
+    Direction->Backpressured = false;
+    Direction->BackpressureStartTime = 0;
+    Direction->Tokens = g_RelaySessionBurst;
+    Direction->TokensRefillTime = Direction->LastReadTime;
+    Direction->Deficit = 0;
+    Direction->Throttled = false;
+    Direction->ThrottleStartTime = 0;
+    Direction->Impairment = nullptr;
+    Direction->ImpairmentLinkFreeTime = Direction->LastReadTime;
+    Direction->ImpairmentReleaseTime = Direction->LastReadTime;
+    Direction->ImpairmentSeed = 0x9E3779B9;
+    Direction->GatherBuffer = nullptr;
+    Direction->Statistics = Statistics;
+}
+
+SynthRdpRelaySession* SynthRdpRelayCreateSession(
+    _Inout_ SynthRdpRelayEndpoint* Channel,
+    _Inout_ SOCKET* Socket,
+    _Inout_ SynthRdpBackendState** Backend)
+{
+    SynthRdpRelaySession* Session = reinterpret_cast<SynthRdpRelaySession*>(
+        ::MileAllocateMemory(sizeof(SynthRdpRelaySession)));
+    if (!Session)
+    {
+        if (g_InteractiveMode)
+        {
+            std::printf(
+                "[Error] MileAllocateMemory failed.\n");
+        }
+        return nullptr;
+    }
+
+    ::InitializeCriticalSection(&Session->Lock);
+    Session->ReferenceCount = 1;
+    Session->Closing = false;
+    Session->HandingOff = false;
+    Session->HandoffBusy = 0;
+    Session->TeardownReason = SynthRdpTeardownReason::None;
+
+    // The session owns the handles from now on.
+    Session->Pipe = *Channel;
+    if (SynthRdpRelayEndpointType::Pipe == Channel->Type)
+    {
+        Channel->PipeHandle = INVALID_HANDLE_VALUE;
+    }
+    else
+    {
+        Channel->Socket = INVALID_SOCKET;
+    }
+    Session->Server.Type = SynthRdpRelayEndpointType::Socket;
+    Session->Server.Socket = *Socket;
+    *Socket = INVALID_SOCKET;
+    Session->Backend = *Backend;
+    *Backend = nullptr;
+    Session->CaptureSessionId = ::SynthRdpCaptureAcquireSessionId();
+
+    ::EnterCriticalSection(&g_SessionLock);
+    ::SynthRdpStatisticsAcquireSession(Session);
+    ::LeaveCriticalSection(&g_SessionLock);
+
+    ::SynthRdpRelayInitializeDirection(
+        Session,
+        &Session->Vmbus2Tcp,
+        &Session->Pipe,
+        &Session->Server,
+        &Session->Statistics->Vmbus2Tcp);
+    ::SynthRdpRelayInitializeDirection(
+        Session,
+        &Session->Tcp2Vmbus,
+        &Session->Server,
+        &Session->Pipe,
+        &Session->Statistics->Tcp2Vmbus);
+    if (g_RelayImpairmentEnabled)
+    {
+        Session->Vmbus2Tcp.Impairment = &g_RelayVmbus2TcpImpairment;
+        Session->Tcp2Vmbus.Impairment = &g_RelayTcp2VmbusImpairment;
+    }
+
+    return Session;
+}
+
+void SynthRdpRelayStartSession(
+    _In_ SynthRdpRelaySession* Session)
+{
+    ::EnterCriticalSection(&g_SessionLock);
+    g_ActiveSessions.push_back(Session);
+    // The sessions which are connected while handing off are handed off as
+    // well, or kept in this instance until they are finished.
+    if (!g_ServiceIsRunning && !g_ServiceHandingOff)
+    {
+        ::SynthRdpRelayCloseSession(
+            Session,
+            SynthRdpTeardownReason::Stopped);
+    }
+    ::LeaveCriticalSection(&g_SessionLock);
+
+    HANDLE ChannelHandle =
+        (SynthRdpRelayEndpointType::Pipe == Session->Pipe.Type)
+        ? Session->Pipe.PipeHandle
+        : reinterpret_cast<HANDLE>(Session->Pipe.Socket);
+    if (!::CreateIoCompletionPort(
+        ChannelHandle,
+        g_RelayCompletionPort,
+        0,
+        0) ||
+        !::CreateIoCompletionPort(
+            reinterpret_cast<HANDLE>(Session->Server.Socket),
+            g_RelayCompletionPort,
+            0,
+            0))
+    {
+        if (g_InteractiveMode && !Session->Closing)
+        {
+            std::printf(
+                "[Error] CreateIoCompletionPort failed (%d).\n",
+                ::GetLastError());
+        }
+        ::SynthRdpRelayCloseSession(Session, SynthRdpTeardownReason::Failed);
+    }
+    else if (
+        !::SynthRdpRelayStartDirection(&Session->Vmbus2Tcp) ||
+        !::SynthRdpRelayStartDirection(&Session->Tcp2Vmbus))
+    {
+        if (g_InteractiveMode && !Session->Closing)
+        {
+            std::printf("[Error] SynthRdpRelayStartDirection failed.\n");
+        }
+        ::SynthRdpRelayCloseSession(Session, SynthRdpTeardownReason::Failed);
+    }
+
+    // Drop the initial reference, and the session will be destroyed after all
+    // outstanding I/O requests are finished.
+    ::SynthRdpRelayReleaseSession(Session);
+}
+
+void SynthRdpBeginConnectingChannel()
+{
+    ::EnterCriticalSection(&g_SessionLock);
+    if (0 == g_ConnectingChannelCount++)
+    {
+        ::ResetEvent(g_ChannelsConnectedEvent);
+    }
+    ::LeaveCriticalSection(&g_SessionLock);
+}
+
+void SynthRdpEndConnectingChannel()
+{
+    ::EnterCriticalSection(&g_SessionLock);
+    if (0 == --g_ConnectingChannelCount)
+    {
+        ::SetEvent(g_ChannelsConnectedEvent);
+    }
+    ::LeaveCriticalSection(&g_SessionLock);
+}
+
+void SynthRdpRedirectionWorker(
+    _In_ HANDLE PipeHandle)
+{
+    SynthRdpRelayEndpoint Channel;
+    Channel.Type = SynthRdpRelayEndpointType::Pipe;
+    Channel.PipeHandle = PipeHandle;
+    SOCKET Socket = INVALID_SOCKET;
+    SynthRdpBackendState* Backend = nullptr;
+    SynthRdpRelaySession* Session = nullptr;
+
+    do
+    {
+        LONGLONG ConnectStartTime = ::SynthRdpStatisticsGetTimestamp();
+        DWORD ConnectAttempts = 0;
+        Socket = ::SynthRdpAcquireServerConnection(
+            &ConnectAttempts,
+            &Backend);
+        if (Socket == INVALID_SOCKET)
+        {
+            if (g_InteractiveMode)
+            {
+                std::printf(
+                    "[Error] SynthRdpAcquireServerConnection failed (%d).\n",
+                    ::WSAGetLastError());
+            }
+            break;
+        }
+
+        Session = ::SynthRdpRelayCreateSession(
+            &Channel,
+            &Socket,
+            &Backend);
+        if (!Session)
+        {
+            break;
+        }
+
+        Session->Statistics->ConnectLatency = static_cast<DWORD>(
+            ::SynthRdpStatisticsGetElapsedTime(ConnectStartTime));
+        Session->Statistics->ConnectAttempts = ConnectAttempts;
+
+        // The first message from the VMBus pipe is the X.224 Connection
+        // Request PDU which needs to be patched.
+        ::SynthRdpConnectionRequestParserInitialize(
+            &Session->Vmbus2Tcp.ConnectionRequestParser,
+            true);
+
+        ::SynthRdpRelayStartSession(Session);
+
+    } while (false);
+
+    // The session is in the active sessions from now on if it is started.
+    ::SynthRdpEndConnectingChannel();
+
+    if (Socket != INVALID_SOCKET)
+    {
+        ::closesocket(Socket);
+    }
+
+    ::SynthRdpReleaseBackend(Backend);
+
+    if (INVALID_HANDLE_VALUE != Channel.PipeHandle)
+    {
+        ::CloseHandle(Channel.PipeHandle);
+
+        // The session is not created, so we need to finish the channel here.
+        ::SynthRdpOnChannelFinished();
+    }
+}
+
+DWORD WINAPI SynthRdpRedirectionWorkerRoutine(
+    _In_ LPVOID Parameter)
+{
+    ::SynthRdpRedirectionWorker(reinterpret_cast<HANDLE>(Parameter));
+    return 0;
+}
+
+void SynthRdpStartChannel(
+    _In_ HANDLE ChannelHandle)
+{
+    // Connecting to the server may block, so use the system thread pool to
+    // make the channel discovery continue.
+    ::SynthRdpBeginConnectingChannel();
+    if (!::QueueUserWorkItem(
+        ::SynthRdpRedirectionWorkerRoutine,
+        ChannelHandle,
+        WT_EXECUTELONGFUNCTION))
+    {
+        if (g_InteractiveMode)
+        {
+            std::printf(
+                "[Error] QueueUserWorkItem failed (%d).\n",
+                ::GetLastError());
+        }
+        ::SynthRdpEndConnectingChannel();
+        ::CloseHandle(ChannelHandle);
+        ::SynthRdpOnChannelFinished();
+    }
+}
+
+void SynthRdpSubmitChannel(
+    _In_ HANDLE ChannelHandle)
+{
+    bool ShouldStart = false;
+
+    ::EnterCriticalSection(&g_SessionLock);
+    if (g_ActiveChannelCount < g_MaximumSessions)
+    {
+        ++g_ActiveChannelCount;
+        ::ResetEvent(g_SessionsDrainedEvent);
+        ShouldStart = true;
+    }
+    else
+    {
+        g_PendingChannels.push_back(ChannelHandle);
+        if (g_InteractiveMode)
+        {
+            std::printf(
+                "[Info] Channel is queued because %d sessions are active.\n",
+                g_ActiveChannelCount);
+        }
+    }
+    ::LeaveCriticalSection(&g_SessionLock);
+
+    if (ShouldStart)
+    {
+        ::SynthRdpStartChannel(ChannelHandle);
+    }
+}
+
+void SynthRdpOnChannelFinished()
+{
+    HANDLE NextChannelHandle = INVALID_HANDLE_VALUE;
+
+    ::EnterCriticalSection(&g_SessionLock);
+    if (g_ServiceIsRunning && !g_PendingChannels.empty())
+    {
+        // Hand over the slot to the pending channel directly.
+        NextChannelHandle = g_PendingChannels.front();
+        g_PendingChannels.pop_front();
+    }
+    else if (0 == --g_ActiveChannelCount)
+    {
+        ::SetEvent(g_SessionsDrainedEvent);
+    }
+    ::LeaveCriticalSection(&g_SessionLock);
+
+    if (INVALID_HANDLE_VALUE != NextChannelHandle)
+    {
+        ::SynthRdpStartChannel(NextChannelHandle);
+    }
+}
+
+struct SynthRdpChannelProvider
+{
+    // Wait until the channel is offered by the host, or fail with
+    // ERROR_TIMEOUT or WAIT_TIMEOUT after the timeout elapses. The time of
+    // the offer is not reported, so the discovery statistics only cover the
+    // open after the wait returns.
+    BOOL (WINAPI* WaitChannel)(
+        _In_ LPCGUID InterfaceType,
+        _In_ LPCGUID InterfaceInstance,
+        _In_ DWORD TimeoutInMsec,
+        _Out_ VMBUS_PIPE_CHANNEL_INFO* ChannelInfo);
+    HANDLE (WINAPI* OpenChannel)(
+        _In_ VMBUS_PIPE_CHANNEL_INFO* ChannelInfo,
+        _In_ DWORD OpenMode);
+};
+
+const SynthRdpChannelProvider SynthRdpVmbusChannelProvider =
+{
+    ::VmbusPipeClientWaitChannel,
+    ::VmbusPipeClientOpenChannel
+};
+
+// Each data channel instance is waited by its own thread, and the timeout
+// only bounds the time to notice the stop request.
+const DWORD SynthRdpDiscoveryWaitTimeout = 1000;
+
+// Back off after failures which are not timeouts to avoid spinning.
+const DWORD SynthRdpDiscoveryRetryInterval = 50;
+
+namespace
+{
+    static std::vector<HANDLE> g_DiscoveryThreads;
+    // Signaled when the discovery needs to stop, which is not the service
+    // stop event because the discovery is also stopped when handing off.
+    static HANDLE g_DiscoveryStopEvent = nullptr;
+}
+
+void SynthRdpDiscoverChannel(
+    _In_ SynthRdpChannelProvider const* Provider,
+    _In_ GUID const& InterfaceInstance)
+{
+    while (WAIT_TIMEOUT == ::WaitForSingleObject(g_DiscoveryStopEvent, 0))
+    {
+        VMBUS_PIPE_CHANNEL_INFO ChannelInfo = { 0 };
+        if (!Provider->WaitChannel(
+            &SYNTHRDP_DATA_CLASS_ID,
+            &InterfaceInstance,
+            SynthRdpDiscoveryWaitTimeout,
+            &ChannelInfo))
+        {
+            DWORD LastError = ::GetLastError();
+            if (ERROR_TIMEOUT != LastError && WAIT_TIMEOUT != LastError)
+            {
+                ::WaitForSingleObject(
+                    g_DiscoveryStopEvent,
+                    SynthRdpDiscoveryRetryInterval);
+            }
+            continue;
+        }
+
+        // Leave the channel offered after the discovery is stopped, which
+        // will be opened by the new instance when handing off.
+        if (WAIT_TIMEOUT != ::WaitForSingleObject(g_DiscoveryStopEvent, 0))
+        {
+            break;
+        }
+
+        // The provider doesn't report when the host offered the channel, so
+        // only the time to open the channel after the wait returns is
+        // measured.
+        LONGLONG OpenStartTime = ::SynthRdpStatisticsGetTimestamp();
+        HANDLE ChannelHandle = Provider->OpenChannel(
+            &ChannelInfo,
+            FILE_FLAG_OVERLAPPED);
+        if (INVALID_HANDLE_VALUE == ChannelHandle)
+        {
+            ::WaitForSingleObject(
+                g_DiscoveryStopEvent,
+                SynthRdpDiscoveryRetryInterval);
+            continue;
+        }
+
+        LONG64 OpenTime = ::SynthRdpStatisticsGetElapsedTime(OpenStartTime);
+        ::SynthRdpStatisticsAddDiscovery(OpenTime);
+        if (g_InteractiveMode)
+        {
+            std::printf(
+                "[Info] Channel is opened in %lld us.\n",
+                OpenTime);
+        }
+
+        ::SynthRdpSubmitChannel(ChannelHandle);
+    }
+}
+
+DWORD SynthRdpDiscoveryStartup(
+    _In_ SynthRdpChannelProvider const* Provider,
+    _In_ GUID const* InterfaceInstances,
+    _In_ std::size_t InterfaceInstanceCount)
+{
+    g_DiscoveryStopEvent = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (!g_DiscoveryStopEvent)
+    {
+        return ::GetLastError();
+    }
+
+    for (std::size_t i = 0; i < InterfaceInstanceCount; ++i)
+    {
+        GUID InterfaceInstance = InterfaceInstances[i];
+        HANDLE DiscoveryThread = Mile::CreateThread([=]()
+        {
+            ::SynthRdpDiscoverChannel(Provider, InterfaceInstance);
+        });
+        if (!DiscoveryThread)
+        {
+            return ::GetLastError();
+        }
+        g_DiscoveryThreads.push_back(DiscoveryThread);
+    }
+
+    return ERROR_SUCCESS;
+}
+
+// The channel wait can't be cancelled, so the discovery threads exit by
+// themselves after the current wait times out without opening any channel.
+void SynthRdpDiscoveryStop()
+{
+    if (g_DiscoveryStopEvent)
+    {
+        ::SetEvent(g_DiscoveryStopEvent);
+    }
+}
+
+// Joining the discovery threads takes up to SynthRdpDiscoveryWaitTimeout, so
+// it should be done after the sessions are drained.
+void SynthRdpDiscoveryCleanup()
+{
+    ::SynthRdpDiscoveryStop();
+
+    for (HANDLE& DiscoveryThread : g_DiscoveryThreads)
+    {
+        ::WaitForSingleObject(DiscoveryThread, INFINITE);
+        ::CloseHandle(DiscoveryThread);
+    }
+    g_DiscoveryThreads.clear();
+
+    if (g_DiscoveryStopEvent)
+    {
+        ::CloseHandle(g_DiscoveryStopEvent);
+        g_DiscoveryStopEvent = nullptr;
+    }
+}
+
+// Forward the Hyper-V socket connections to the configured service IDs to
+// the TCP ports, which only reuses the relay without the RDP specific parts.
+struct SynthRdpForward
+{
+    GUID ServiceId;
+    SynthRdpBackend Target;
+    SOCKET ListenSocket;
+    HANDLE ListenThread;
+};
+
+struct SynthRdpForwardConnection
+{
+    SynthRdpForward* Forward;
+    SOCKET Socket;
+};
+
+namespace
+{
+    // The elements are referenced by the listening threads, so the container
+    // needs to keep them in place.
+    static std::deque<SynthRdpForward> g_Forwards;
+    // Signaled when the listening threads need to exit, which is not the
+    // service stop event because the listeners are also stopped when
+    // handing off.
+    static HANDLE g_ForwardStopEvent = nullptr;
+}
+
+bool SynthRdpParseGuid(
+    _In_ std::string const& Text,
+    _Out_ GUID& Guid)
+{
+    std::string Value = Text;
+    if (38 == Value.size() && '{' == Value.front() && '}' == Value.back())
+    {
+        Value = Value.substr(1, 36);
+    }
+    if (36 != Value.size() ||
+        '-' != Value[8] ||
+        '-' != Value[13] ||
+        '-' != Value[18] ||
+        '-' != Value[23] ||
+        std::string::npos != Value.find_first_not_of(
+            "0123456789abcdefABCDEF-"))
+    {
+        return false;
+    }
+
+    unsigned long Data1 = 0;
+    unsigned int Data2 = 0;
+    unsigned int Data3 = 0;
+    unsigned int Data4[8] = { 0 };
+    if (11 != std::sscanf(
+        Value.c_str(),
+        "%8lx-%4x-%4x-%2x%2x-%2x%2x%2x%2x%2x%2x",
+        &Data1,
+        &Data2,
+        &Data3,
+        &Data4[0],
+        &Data4[1],
+        &Data4[2],
+        &Data4[3],
+        &Data4[4],
+        &Data4[5],
+        &Data4[6],
+        &Data4[7]))
+    {
+        return false;
+    }
+
+    Guid.Data1 = Data1;
+    Guid.Data2 = static_cast<unsigned short>(Data2);
+    Guid.Data3 = static_cast<unsigned short>(Data3);
+    for (std::size_t i = 0; i < 8; ++i)
+    {
+        Guid.Data4[i] = static_cast<unsigned char>(Data4[i]);
+    }
+    return true;
+}
+
+void SynthRdpParseForwards(
+    _In_ std::string const& List,
+    _Out_ std::vector<SynthRdpForward>& Forwards)
+{
+    Forwards.clear();
+
+    // The format is "ServiceId=[Host:]Port;...", and the target host is the
+    // guest itself if not specified.
+    std::size_t Start = 0;
+    while (Start < List.size())
+    {
+        std::size_t End = List.find(';', Start);
+        if (std::string::npos == End)
+        {
+            End = List.size();
+        }
+        std::string Entry = List.substr(Start, End - Start);
+        Start = End + 1;
+
+        std::size_t Separator = Entry.find('=');
+        if (std::string::npos == Separator)
+        {
+            continue;
+        }
+        std::string ServiceId = Entry.substr(0, Separator);
+        std::string Target = Entry.substr(Separator + 1);
+        ServiceId.erase(0, ServiceId.find_first_not_of(" \t"));
+        ServiceId.erase(ServiceId.find_last_not_of(" \t") + 1);
+        Target.erase(0, Target.find_first_not_of(" \t"));
+        Target.erase(Target.find_last_not_of(" \t") + 1);
+
+        SynthRdpForward Forward;
+        if (!::SynthRdpParseGuid(ServiceId, Forward.ServiceId))
+        {
+            continue;
+        }
+
+        if (!Target.empty() &&
+            std::string::npos == Target.find_first_not_of("0123456789"))
+        {
+            Forward.Target = ::SynthRdpMakeBackend("127.0.0.1", Target, 1);
+        }
+        else
+        {
+            std::vector<SynthRdpBackend> Targets;
+            ::SynthRdpParseBackends(Target, std::string(), Targets);
+            if (1 != Targets.size() || Targets[0].Port.empty())
+            {
+                continue;
+            }
+            Forward.Target = Targets[0];
+        }
+
+        Forward.ListenSocket = INVALID_SOCKET;
+        Forward.ListenThread = nullptr;
+        Forwards.push_back(Forward);
+    }
+}
+
+void SynthRdpForwardWorker(
+    _In_ SynthRdpForward* Forward,
+    _In_ SOCKET ChannelSocket)
+{
+    SynthRdpServerConfiguration Configuration =
+        ::SynthRdpGetServerConfiguration();
+
+    SOCKET Socket = ::SynthRdpConnectAddresses(
+        Forward->Target.Addresses,
+        Configuration.ConnectTimeout,
+        Configuration.LoopbackFastPath,
+        true,
+        nullptr);
+    if (INVALID_SOCKET == Socket)
+    {
+        if (g_InteractiveMode)
+        {
+            std::printf(
+                "[Error] SynthRdpConnectAddresses failed (%d).\n",
+                ::WSAGetLastError());
+        }
+        ::closesocket(ChannelSocket);
+        ::SynthRdpOnChannelFinished();
+        return;
+    }
+    ::SynthRdpSetServerSocketOptions(Socket, Configuration);
+
+    SynthRdpRelayEndpoint Channel;
+    Channel.Type = SynthRdpRelayEndpointType::Socket;
+    Channel.Socket = ChannelSocket;
+    SynthRdpBackendState* Backend = nullptr;
+    SynthRdpRelaySession* Session = ::SynthRdpRelayCreateSession(
+        &Channel,
+        &Socket,
+        &Backend);
+    if (!Session)
+    {
+        ::closesocket(Socket);
+        ::closesocket(ChannelSocket);
+        ::SynthRdpOnChannelFinished();
+        return;
+    }
+
+    // The forwarded data is not RDP.
+    ::SynthRdpFramingParserInitialize(
+        &Session->Vmbus2Tcp.FramingParser,
+        false,
+        false);
+    ::SynthRdpFramingParserInitialize(
+        &Session->Tcp2Vmbus.FramingParser,
+        false,
+        false);
+
+    ::SynthRdpRelayStartSession(Session);
+}
+
+DWORD WINAPI SynthRdpForwardWorkerRoutine(
+    _In_ LPVOID Parameter)
+{
+    SynthRdpForwardConnection* Connection =
+        reinterpret_cast<SynthRdpForwardConnection*>(Parameter);
+    ::SynthRdpForwardWorker(Connection->Forward, Connection->Socket);
+    ::MileFreeMemory(Connection);
+    return 0;
+}
+
+void SynthRdpForwardSubmit(
+    _In_ SynthRdpForward* Forward,
+    _In_ SOCKET Socket)
+{
+    // The forwarded connections share the session limit with the RDP
+    // channels, and are refused instead of queued when it is reached.
+    bool Accepted = false;
+    ::EnterCriticalSection(&g_SessionLock);
+    if (g_ActiveChannelCount < g_MaximumSessions)
+    {
+        ++g_ActiveChannelCount;
+        ::ResetEvent(g_SessionsDrainedEvent);
+        Accepted = true;
+    }
+    ::LeaveCriticalSection(&g_SessionLock);
+
+    if (!Accepted)
+    {
+        if (g_InteractiveMode)
+        {
+            std::printf(
+                "[Info] Forwarded connection is refused because the "
+                "maximum sessions are active.\n");
+        }
+        ::closesocket(Socket);
+        return;
+    }
+
+    SynthRdpForwardConnection* Connection =
+        reinterpret_cast<SynthRdpForwardConnection*>(
+            ::MileAllocateMemory(sizeof(SynthRdpForwardConnection)));
+    if (Connection)
+    {
+        Connection->Forward = Forward;
+        Connection->Socket = Socket;
+
+        // Connecting to the target may block as the RDP channels.
+        if (::QueueUserWorkItem(
+            ::SynthRdpForwardWorkerRoutine,
+            Connection,
+            WT_EXECUTELONGFUNCTION))
+        {
+            return;
+        }
+
+        if (g_InteractiveMode)
+        {
+            std::printf(
+                "[Error] QueueUserWorkItem failed (%d).\n",
+                ::GetLastError());
+        }
+        ::MileFreeMemory(Connection);
+    }
+
+    ::closesocket(Socket);
+    ::SynthRdpOnChannelFinished();
+}
+
+void SynthRdpForwardListen(
+    _In_ SynthRdpForward* Forward)
+{
+    HANDLE AcceptEvent = ::CreateEventW(nullptr, FALSE, FALSE, nullptr);
+    if (!AcceptEvent)
+    {
+        if (g_InteractiveMode)
+        {
+            std::printf(
+                "[Error] CreateEventW failed (%d).\n",
+                ::GetLastError());
+        }
+        return;
+    }
+
+    // Wait for the incoming connections and the stop request together
+    // instead of waking up periodically.
+    if (SOCKET_ERROR == ::WSAEventSelect(
+        Forward->ListenSocket,
+        AcceptEvent,
+        FD_ACCEPT))
+    {
+        if (g_InteractiveMode)
+        {
+            std::printf(
+                "[Error] WSAEventSelect failed (%d).\n",
+                ::WSAGetLastError());
+        }
+        ::CloseHandle(AcceptEvent);
+        return;
+    }
+
+    HANDLE WaitHandles[] = { g_ForwardStopEvent, AcceptEvent };
+    while (WAIT_OBJECT_0 + 1 == ::WaitForMultipleObjects(
+        2,
+        WaitHandles,
+        FALSE,
+        INFINITE))
+    {
+        // The event is only signaled again after accept fails with
+        // WSAEWOULDBLOCK.
+        for (;;)
+        {
+            SOCKET Socket = ::accept(Forward->ListenSocket, nullptr, nullptr);
+            if (INVALID_SOCKET == Socket)
+            {
+                if (WSAEWOULDBLOCK != ::WSAGetLastError())
+                {
+                    ::WaitForSingleObject(
+                        g_ForwardStopEvent,
+                        SynthRdpDiscoveryRetryInterval);
+                    ::SetEvent(AcceptEvent);
+                }
+                break;
+            }
+
+            // The accepted socket inherits the event selection and the
+            // non-blocking mode from the listening socket.
+            u_long NonBlocking = 0;
+            ::WSAEventSelect(Socket, nullptr, 0);
+            ::ioctlsocket(Socket, FIONBIO, &NonBlocking);
+
+            ::SynthRdpForwardSubmit(Forward, Socket);
+        }
+    }
+
+    ::CloseHandle(AcceptEvent);
+}
+
+DWORD SynthRdpForwardStartup()
+{
+    std::vector<SynthRdpForward> Forwards;
+    ::SynthRdpParseForwards(
+        ::SynthRdpQueryConfigurationString(L"Forwards", std::string()),
+        Forwards);
+    if (Forwards.empty())
+    {
+        return ERROR_SUCCESS;
+    }
+
+    g_ForwardStopEvent = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (!g_ForwardStopEvent)
+    {
+        return ::GetLastError();
+    }
+
+    // The mapping which can't be set up is skipped, and the others still
+    // work.
+    for (SynthRdpForward& Current : Forwards)
+    {
+        if (0 != ::SynthRdpResolveBackend(Current.Target))
+        {
+            if (g_InteractiveMode)
+            {
+                std::printf(
+                    "[Error] SynthRdpResolveBackend failed (%d).\n",
+                    Current.Target.ResolveError);
+            }
+            continue;
+        }
+
+        SOCKET ListenSocket = ::socket(
+            AF_HYPERV,
+            SOCK_STREAM,
+            HV_PROTOCOL_RAW);
+        if (INVALID_SOCKET == ListenSocket)
+        {
+            if (g_InteractiveMode)
+            {
+                std::printf(
+                    "[Error] socket failed (%d).\n",
+                    ::WSAGetLastError());
+            }
+            continue;
+        }
+
+        SOCKADDR_HV Address = { 0 };
+        Address.Family = AF_HYPERV;
+        Address.VmId = HV_GUID_WILDCARD;
+        Address.ServiceId = Current.ServiceId;
+        if (SOCKET_ERROR == ::bind(
+            ListenSocket,
+            reinterpret_cast<sockaddr*>(&Address),
+            sizeof(Address)) ||
+            SOCKET_ERROR == ::listen(ListenSocket, SOMAXCONN))
+        {
+            if (g_InteractiveMode)
+            {
+                std::printf(
+                    "[Error] bind or listen failed (%d).\n",
+                    ::WSAGetLastError());
+            }
+            ::closesocket(ListenSocket);
+            continue;
+        }
+
+        g_Forwards.push_back(Current);
+        SynthRdpForward* Forward = &g_Forwards.back();
+        Forward->ListenSocket = ListenSocket;
+
+        Forward->ListenThread = Mile::CreateThread([=]()
+        {
+            ::SynthRdpForwardListen(Forward);
+        });
+        if (!Forward->ListenThread)
+        {
+            return ::GetLastError();
+        }
+    }
+
+    return ERROR_SUCCESS;
+}
+
+// Stop accepting the forwarded connections. The mappings are still used by
+// the connections being set up until the sessions are drained.
+void SynthRdpForwardStop()
+{
+    if (g_ForwardStopEvent)
+    {
+        ::SetEvent(g_ForwardStopEvent);
+    }
+
+    for (SynthRdpForward& Forward : g_Forwards)
+    {
+        if (Forward.ListenThread)
+        {
+            ::WaitForSingleObject(Forward.ListenThread, INFINITE);
+            ::CloseHandle(Forward.ListenThread);
+            Forward.ListenThread = nullptr;
+        }
+        if (INVALID_SOCKET != Forward.ListenSocket)
+        {
+            ::closesocket(Forward.ListenSocket);
+            Forward.ListenSocket = INVALID_SOCKET;
+        }
+    }
+}
+
+// Should be called after the sessions are drained.
+void SynthRdpForwardCleanup()
+{
+    ::SynthRdpForwardStop();
+    g_Forwards.clear();
+
+    if (g_ForwardStopEvent)
+    {
+        ::CloseHandle(g_ForwardStopEvent);
+        g_ForwardStopEvent = nullptr;
+    }
+}
+
+void SynthRdpCloseAllChannels()
+{
+    ::EnterCriticalSection(&g_SessionLock);
+    for (HANDLE& PendingChannel : g_PendingChannels)
+    {
+        ::CloseHandle(PendingChannel);
+    }
+    g_PendingChannels.clear();
+    for (SynthRdpRelaySession*& ActiveSession : g_ActiveSessions)
+    {
+        ::SynthRdpRelayCloseSession(
+            ActiveSession,
+            SynthRdpTeardownReason::Stopped);
+    }
+    ::LeaveCriticalSection(&g_SessionLock);
+}
+
+// The user-defined service control code which asks the running service to
+// hand off the control channel and the active sessions to the new instance.
+const DWORD SynthRdpServiceControlHandoff = 128;
+
+const wchar_t SynthRdpHandoffPipeName[] = L"\\\\.\\pipe\\SynthRdpHandoff";
+const DWORD SynthRdpHandoffSignature = 0x48445253; // 'SRDH'
+// The previous instance refuses to hand off if the version is different, so
+// it needs to be updated if the messages are changed.
+const DWORD SynthRdpHandoffVersion = 1;
+
+// Bounds the wait for the new instance to connect, and for each message.
+const DWORD SynthRdpHandoffTimeout = 30000;
+
+// The sessions which still have the outstanding I/O requests after the timeout
+// stay in the previous instance until they are finished.
+const DWORD SynthRdpHandoffQuiesceTimeout = 2000;
+
+// The sessions which are still connecting to the server after the timeout
+// stay in the previous instance until they are finished.
+const DWORD SynthRdpHandoffConnectTimeout = 10000;
+
+struct SynthRdpHandoffRequest
+{
+    DWORD Signature;
+    DWORD Version;
+    DWORD ProcessId;
+    DWORD Reserved;
+};
+
+enum class SynthRdpHandoffItemType : std::uint32_t
+{
+    End,
+    ControlChannel,
+    Session,
+    Channel,
+};
+
+struct SynthRdpHandoffItem
+{
+    SynthRdpHandoffItemType Type;
+    DWORD Reserved;
+    // The handle value which is duplicated into the new instance.
+    std::uint64_t Handle;
+    // Only used by the session item.
+    WSAPROTOCOL_INFOW SocketInformation;
+};
+
+// FILE_COMPLETION_INFORMATION
+struct SynthRdpFileCompletionInformation
+{
+    HANDLE Port;
+    PVOID Key;
+};
+
+struct SynthRdpIoStatusBlock
+{
+    union
+    {
+        LONG Status;
+        PVOID Pointer;
+    };
+    ULONG_PTR Information;
+};
+
+// FileReplaceCompletionInformation in FILE_INFORMATION_CLASS, which detaches
+// the file from its completion port, and it is only available since Windows
+// 8.1 and Windows Server 2012 R2.
+const ULONG SynthRdpFileReplaceCompletionInformation = 61;
+
+typedef LONG (NTAPI* SynthRdpNtSetInformationFileType)(
+    _In_ HANDLE FileHandle,
+    _Out_ SynthRdpIoStatusBlock* IoStatusBlock,
+    _In_ PVOID FileInformation,
+    _In_ ULONG Length,
+    _In_ ULONG FileInformationClass);
+
+typedef BOOL (WINAPI* SynthRdpCancelIoExType)(
+    _In_ HANDLE hFile,
+    _In_opt_ LPOVERLAPPED lpOverlapped);
+
+BOOL SynthRdpHandoffTransfer(
+    _In_ HANDLE HandoffPipe,
+    _In_ bool Write,
+    _Inout_ LPVOID Buffer,
+    _In_ DWORD Length,
+    _Out_ LPDWORD NumberOfBytesTransferred)
+{
+    *NumberOfBytesTransferred = 0;
+
+    OVERLAPPED Overlapped = { 0 };
+    Overlapped.hEvent = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (!Overlapped.hEvent)
+    {
+        return FALSE;
+    }
+
+    BOOL Result = Write
+        ? ::WriteFile(HandoffPipe, Buffer, Length, nullptr, &Overlapped)
+        : ::ReadFile(HandoffPipe, Buffer, Length, nullptr, &Overlapped);
+    if (Result || ERROR_IO_PENDING == ::GetLastError())
+    {
+        if (WAIT_TIMEOUT == ::WaitForSingleObject(
+            Overlapped.hEvent,
+            SynthRdpHandoffTimeout))
+        {
+            ::CancelIo(HandoffPipe);
+        }
+        Result = ::GetOverlappedResult(
+            HandoffPipe,
+            &Overlapped,
+            NumberOfBytesTransferred,
+            TRUE);
+    }
+
+    DWORD Error = ::GetLastError();
+    ::CloseHandle(Overlapped.hEvent);
+    ::SetLastError(Error);
+    return Result;
+}
+
+bool SynthRdpHandoffSendItem(
+    _In_ HANDLE HandoffPipe,
+    _In_ HANDLE TargetProcess,
+    _Inout_ SynthRdpHandoffItem* Item,
+    _In_opt_ HANDLE Handle)
+{
+    HANDLE TargetHandle = nullptr;
+    if (Handle && !::DuplicateHandle(
+        ::GetCurrentProcess(),
+        Handle,
+        TargetProcess,
+        &TargetHandle,
+        0,
+        FALSE,
+        DUPLICATE_SAME_ACCESS))
+    {
+        return false;
+    }
+    Item->Handle = reinterpret_cast<ULONG_PTR>(TargetHandle);
+
+    DWORD NumberOfBytesWritten = 0;
+    if (!::SynthRdpHandoffTransfer(
+        HandoffPipe,
+        true,
+        Item,
+        sizeof(SynthRdpHandoffItem),
+        &NumberOfBytesWritten) ||
+        sizeof(SynthRdpHandoffItem) != NumberOfBytesWritten)
+    {
+        if (TargetHandle)
+        {
+            // The new instance doesn't know the duplicated handle.
+            ::DuplicateHandle(
+                TargetProcess,
+                TargetHandle,
+                nullptr,
+                nullptr,
+                0,
+                FALSE,
+                DUPLICATE_CLOSE_SOURCE);
+        }
+        return false;
+    }
+
+    return true;
+}
+
+bool SynthRdpHandoffDetachHandle(
+    _In_ HANDLE Handle)
+{
+    static SynthRdpNtSetInformationFileType NtSetInformationFile =
+        reinterpret_cast<SynthRdpNtSetInformationFileType>(::GetProcAddress(
+            ::GetModuleHandleW(L"ntdll.dll"),
+            "NtSetInformationFile"));
+
+    // The handle can't be associated with the completion port of the new
+    // instance until it is detached from ours.
+    // STATUS_NOT_IMPLEMENTED if NtSetInformationFile is not available.
+    LONG Status = static_cast<LONG>(0xC0000002L);
+    if (NtSetInformationFile)
+    {
+        SynthRdpIoStatusBlock IoStatusBlock = { 0 };
+        SynthRdpFileCompletionInformation Information = { nullptr, nullptr };
+        Status = NtSetInformationFile(
+            Handle,
+            &IoStatusBlock,
+            &Information,
+            sizeof(Information),
+            SynthRdpFileReplaceCompletionInformation);
+    }
+    if (Status < 0)
+    {
+        // The session falls back to stay in this instance with the handles
+        // associated again, and the handoff goes on with the others.
+        if (g_InteractiveMode)
+        {
+            std::printf(
+                "[Warning] NtSetInformationFile failed (0x%08X), and the "
+                "session stays in this instance.\n",
+                static_cast<unsigned int>(Status));
+        }
+        return false;
+    }
+
+    return true;
+}
+
+bool SynthRdpHandoffReferenceSession(
+    _In_ SynthRdpRelaySession* Session)
+{
+    // The session which is being destroyed can't be referenced again.
+    LONG Current = Session->ReferenceCount;
+    while (Current)
+    {
+        LONG Previous = ::InterlockedCompareExchange(
+            &Session->ReferenceCount,
+            Current + 1,
+            Current);
+        if (Previous == Current)
+        {
+            return true;
+        }
+        Current = Previous;
+    }
+    return false;
+}
+
+void SynthRdpHandoffQuiesceDirection(
+    _In_ SynthRdpRelayDirection* Direction,
+    _In_ SynthRdpCancelIoExType CancelIoEx)
+{
+    SynthRdpRelaySession* Session = Direction->Session;
+
+    ::EnterCriticalSection(&Direction->Lock);
+    ::EnterCriticalSection(&Session->Lock);
+    if (Direction->ReadPending && !Session->Closing)
+    {
+        // The read request waits for the data which may never come, and
+        // nothing is lost by cancelling it.
+        CancelIoEx(
+            SynthRdpRelayEndpointType::Pipe == Direction->Source->Type
+                ? Direction->Source->PipeHandle
+                : reinterpret_cast<HANDLE>(Direction->Source->Socket),
+            &Direction->ReadOperation.Overlapped);
+    }
+    ::LeaveCriticalSection(&Session->Lock);
+    ::LeaveCriticalSection(&Direction->Lock);
+}
+
+bool SynthRdpHandoffIsDirectionQuiesced(
+    _In_ SynthRdpRelayDirection* Direction)
+{
+    ::EnterCriticalSection(&Direction->Lock);
+    bool Result =
+        !Direction->ReadPending &&
+        !Direction->WritePending &&
+        Direction->WriteCount == Direction->ReadCount;
+    ::LeaveCriticalSection(&Direction->Lock);
+    return Result;
+}
+
+bool SynthRdpHandoffIsSessionQuiesced(
+    _In_ SynthRdpRelaySession* Session)
+{
+    return
+        ::SynthRdpHandoffIsDirectionQuiesced(&Session->Vmbus2Tcp) &&
+        ::SynthRdpHandoffIsDirectionQuiesced(&Session->Tcp2Vmbus);
+}
+
+void SynthRdpHandoffResumeSession(
+    _In_ SynthRdpRelaySession* Session)
+{
+    Session->HandingOff = false;
+    // The session which is closed while handing off has no I/O in flight,
+    // and it will be destroyed when the last reference is released.
+    if (Session->Closing)
+    {
+        return;
+    }
+    if (!::SynthRdpRelayStartDirection(&Session->Vmbus2Tcp) ||
+        !::SynthRdpRelayStartDirection(&Session->Tcp2Vmbus))
+    {
+        ::SynthRdpRelayCloseSession(Session, SynthRdpTeardownReason::Failed);
+    }
+}
+
+bool SynthRdpHandoffSendSession(
+    _In_ HANDLE HandoffPipe,
+    _In_ HANDLE TargetProcess,
+    _In_ DWORD TargetProcessId,
+    _In_ SynthRdpRelaySession* Session)
+{
+    bool PipeDetached = false;
+    bool SocketDetached = false;
+    bool Resumable = true;
+    bool Succeeded = false;
+
+    ::EnterCriticalSection(&Session->Lock);
+    do
+    {
+        if (Session->Closing)
+        {
+            break;
+        }
+
+        PipeDetached = ::SynthRdpHandoffDetachHandle(
+            Session->Pipe.PipeHandle);
+        if (!PipeDetached)
+        {
+            break;
+        }
+        SocketDetached = ::SynthRdpHandoffDetachHandle(
+            reinterpret_cast<HANDLE>(Session->Server.Socket));
+        if (!SocketDetached)
+        {
+            break;
+        }
+
+        SynthRdpHandoffItem Item;
+        std::memset(&Item, 0, sizeof(SynthRdpHandoffItem));
+        Item.Type = SynthRdpHandoffItemType::Session;
+        if (SOCKET_ERROR == ::WSADuplicateSocketW(
+            Session->Server.Socket,
+            TargetProcessId,
+            &Item.SocketInformation))
+        {
+            break;
+        }
+
+        // The new instance may own the connection by the duplicated socket
+        // after this point, so the session can't be resumed anymore.
+        Resumable = false;
+
+        Succeeded = ::SynthRdpHandoffSendItem(
+            HandoffPipe,
+            TargetProcess,
+            &Item,
+            Session->Pipe.PipeHandle);
+
+    } while (false);
+
+    if (!Succeeded && Resumable)
+    {
+        // Associate the handles again for resuming the session, and the
+        // reads of the session would never complete if it fails.
+        if (PipeDetached && !::CreateIoCompletionPort(
+            Session->Pipe.PipeHandle,
+            g_RelayCompletionPort,
+            0,
+            0))
+        {
+            Resumable = false;
+        }
+        if (SocketDetached && !::CreateIoCompletionPort(
+            reinterpret_cast<HANDLE>(Session->Server.Socket),
+            g_RelayCompletionPort,
+            0,
+            0))
+        {
+            Resumable = false;
+        }
+        if (!Resumable && g_InteractiveMode)
+        {
+            std::printf(
+                "[Error] CreateIoCompletionPort failed (%d).\n",
+                ::GetLastError());
+        }
+    }
+    ::LeaveCriticalSection(&Session->Lock);
+
+    if (Succeeded)
+    {
+        // The connections are kept by the duplicated handles in the new
+        // instance.
+        ::SynthRdpRelayCloseSession(
+            Session,
+            SynthRdpTeardownReason::HandedOff);
+    }
+    else if (!Resumable)
+    {
+        ::SynthRdpRelayCloseSession(
+            Session,
+            SynthRdpTeardownReason::Failed);
+    }
+
+    return Succeeded;
+}
+
+DWORD SynthRdpHandoffListenerStartup(
+    _Out_ HANDLE* HandoffPipe)
+{
+    *HandoffPipe = INVALID_HANDLE_VALUE;
+
+    // Only allow the new instance running as LocalSystem to connect.
+    PSECURITY_DESCRIPTOR SecurityDescriptor = nullptr;
+    if (!::ConvertStringSecurityDescriptorToSecurityDescriptorW(
+        L"D:P(A;;GA;;;SY)",
+        SDDL_REVISION_1,
+        &SecurityDescriptor,
+        nullptr))
+    {
+        return ::GetLastError();
+    }
+
+    SECURITY_ATTRIBUTES SecurityAttributes;
+    SecurityAttributes.nLength = sizeof(SECURITY_ATTRIBUTES);
+    SecurityAttributes.lpSecurityDescriptor = SecurityDescriptor;
+    SecurityAttributes.bInheritHandle = FALSE;
+
+    *HandoffPipe = ::CreateNamedPipeW(
+        SynthRdpHandoffPipeName,
+        PIPE_ACCESS_DUPLEX |
+        FILE_FLAG_FIRST_PIPE_INSTANCE |
+        FILE_FLAG_OVERLAPPED,
+        PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT,
+        1,
+        sizeof(SynthRdpHandoffItem),
+        sizeof(SynthRdpHandoffItem),
+        0,
+        &SecurityAttributes);
+    DWORD Error = (INVALID_HANDLE_VALUE == *HandoffPipe)
+        ? ::GetLastError()
+        : ERROR_SUCCESS;
+
+    ::LocalFree(SecurityDescriptor);
+
+    return Error;
+}
+
+DWORD SynthRdpHandoffAccept(
+    _In_ HANDLE HandoffPipe)
+{
+    OVERLAPPED Overlapped = { 0 };
+    Overlapped.hEvent = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (!Overlapped.hEvent)
+    {
+        return ::GetLastError();
+    }
+
+    DWORD Error = ERROR_SUCCESS;
+    if (!::ConnectNamedPipe(HandoffPipe, &Overlapped))
+    {
+        Error = ::GetLastError();
+        if (ERROR_PIPE_CONNECTED == Error)
+        {
+            Error = ERROR_SUCCESS;
+        }
+        else if (ERROR_IO_PENDING == Error)
+        {
+            if (WAIT_TIMEOUT == ::WaitForSingleObject(
+                Overlapped.hEvent,
+                SynthRdpHandoffTimeout))
+            {
+                ::CancelIo(HandoffPipe);
+            }
+            DWORD NumberOfBytesTransferred = 0;
+            Error = ::GetOverlappedResult(
+                HandoffPipe,
+                &Overlapped,
+                &NumberOfBytesTransferred,
+                TRUE)
+                ? ERROR_SUCCESS
+                : ::GetLastError();
+        }
+    }
+
+    ::CloseHandle(Overlapped.hEvent);
+
+    return Error;
+}
+
+DWORD SynthRdpHandoffSend(
+    _In_ HANDLE HandoffPipe,
+    _Inout_ HANDLE* ControlChannelHandle)
+{
+    // No channel will be started after the discovery is stopped, so the
+    // pending channels and the active sessions can be taken here after the
+    // started channels are connected.
+    ::WaitForSingleObject(
+        g_ChannelsConnectedEvent,
+        SynthRdpHandoffConnectTimeout);
+
+    std::deque<HANDLE> PendingChannels;
+    std::vector<SynthRdpRelaySession*> Sessions;
+    ::EnterCriticalSection(&g_SessionLock);
+    PendingChannels.swap(g_PendingChannels);
+    for (SynthRdpRelaySession*& ActiveSession : g_ActiveSessions)
+    {
+        // The forwarded connections stay in this instance until they finish.
+        if (SynthRdpRelayEndpointType::Pipe == ActiveSession->Pipe.Type &&
+            ::SynthRdpHandoffReferenceSession(ActiveSession))
+        {
+            Sessions.push_back(ActiveSession);
+        }
+    }
+    ::LeaveCriticalSection(&g_SessionLock);
+
+    std::vector<bool> HandedOff(Sessions.size(), false);
+    DWORD HandedOffCount = 0;
+
+    DWORD Error = ERROR_SUCCESS;
+    HANDLE TargetProcess = nullptr;
+
+    do
+    {
+        Error = ::SynthRdpHandoffAccept(HandoffPipe);
+        if (ERROR_SUCCESS != Error)
+        {
+            break;
+        }
+
+        SynthRdpHandoffRequest Request = { 0 };
+        DWORD NumberOfBytesRead = 0;
+        if (!::SynthRdpHandoffTransfer(
+            HandoffPipe,
+            false,
+            &Request,
+            sizeof(SynthRdpHandoffRequest),
+            &NumberOfBytesRead))
+        {
+            Error = ::GetLastError();
+            break;
+        }
+        if (sizeof(SynthRdpHandoffRequest) != NumberOfBytesRead ||
+            SynthRdpHandoffSignature != Request.Signature ||
+            SynthRdpHandoffVersion != Request.Version)
+        {
+            Error = ERROR_REVISION_MISMATCH;
+            break;
+        }
+
+        TargetProcess = ::OpenProcess(
+            PROCESS_DUP_HANDLE,
+            FALSE,
+            Request.ProcessId);
+        if (!TargetProcess)
+        {
+            Error = ::GetLastError();
+            break;
+        }
+
+        if (INVALID_HANDLE_VALUE != *ControlChannelHandle)
+        {
+            SynthRdpHandoffItem Item;
+            std::memset(&Item, 0, sizeof(SynthRdpHandoffItem));
+            Item.Type = SynthRdpHandoffItemType::ControlChannel;
+            if (!::SynthRdpHandoffSendItem(
+                HandoffPipe,
+                TargetProcess,
+                &Item,
+                *ControlChannelHandle))
+            {
+                Error = ::GetLastError();
+                break;
+            }
+            ::CloseHandle(*ControlChannelHandle);
+            *ControlChannelHandle = INVALID_HANDLE_VALUE;
+        }
+
+        // The outstanding reads need to be cancelled from other threads, so
+        // the sessions stay in this instance if CancelIoEx is not available.
+        SynthRdpCancelIoExType CancelIoEx =
+            reinterpret_cast<SynthRdpCancelIoExType>(::GetProcAddress(
+                ::GetModuleHandleW(L"kernel32.dll"),
+                "CancelIoEx"));
+        if (CancelIoEx && !Sessions.empty())
+        {
+            g_RelayHandoffBusyCount = 1;
+            ::ResetEvent(g_RelayHandoffIdleEvent);
+            for (SynthRdpRelaySession*& Session : Sessions)
+            {
+                Session->HandingOff = true;
+                ::InterlockedIncrement(&g_RelayHandoffBusyCount);
+                ::InterlockedExchange(&Session->HandoffBusy, 1);
+                ::SynthRdpHandoffQuiesceDirection(
+                    &Session->Vmbus2Tcp,
+                    CancelIoEx);
+                ::SynthRdpHandoffQuiesceDirection(
+                    &Session->Tcp2Vmbus,
+                    CancelIoEx);
+            }
+
+            // The sessions which are already quiesced have no completion to
+            // update them.
+            for (SynthRdpRelaySession*& Session : Sessions)
+            {
+                ::SynthRdpRelayUpdateHandoff(Session);
+            }
+            ::SynthRdpRelayReleaseHandoffBusy();
+
+            // Wait for the queued chunks to be written to the targets.
+            ::WaitForSingleObject(
+                g_RelayHandoffIdleEvent,
+                SynthRdpHandoffQuiesceTimeout);
+            for (SynthRdpRelaySession*& Session : Sessions)
+            {
+                ::InterlockedExchange(&Session->HandoffBusy, 0);
+            }
+
+            for (std::size_t i = 0; i < Sessions.size(); ++i)
+            {
+                if (::SynthRdpHandoffIsSessionQuiesced(Sessions[i]) &&
+                    ::SynthRdpHandoffSendSession(
+                        HandoffPipe,
+                        TargetProcess,
+                        Request.ProcessId,
+                        Sessions[i]))
+                {
+                    HandedOff[i] = true;
+                    ++HandedOffCount;
+                }
+            }
+        }
+
+        for (HANDLE& PendingChannel : PendingChannels)
+        {
+            SynthRdpHandoffItem Item;
+            std::memset(&Item, 0, sizeof(SynthRdpHandoffItem));
+            Item.Type = SynthRdpHandoffItemType::Channel;
+            if (::SynthRdpHandoffSendItem(
+                HandoffPipe,
+                TargetProcess,
+                &Item,
+                PendingChannel))
+            {
+                ::CloseHandle(PendingChannel);
+                PendingChannel = INVALID_HANDLE_VALUE;
+            }
+        }
+
+        SynthRdpHandoffItem Item;
+        std::memset(&Item, 0, sizeof(SynthRdpHandoffItem));
+        Item.Type = SynthRdpHandoffItemType::End;
+        if (!::SynthRdpHandoffSendItem(
+            HandoffPipe,
+            TargetProcess,
+            &Item,
+            nullptr))
+        {
+            Error = ::GetLastError();
+            break;
+        }
+
+    } while (false);
+
+    for (std::size_t i = 0; i < Sessions.size(); ++i)
+    {
+        if (Sessions[i]->HandingOff && !HandedOff[i])
+        {
+            ::SynthRdpHandoffResumeSession(Sessions[i]);
+        }
+        ::SynthRdpRelayReleaseSession(Sessions[i]);
+    }
+
+    // The pending channels which are not handed off can't be started anymore.
+    for (HANDLE& PendingChannel : PendingChannels)
+    {
+        if (INVALID_HANDLE_VALUE != PendingChannel)
+        {
+            ::CloseHandle(PendingChannel);
+        }
+    }
+
+    if (TargetProcess)
+    {
+        ::CloseHandle(TargetProcess);
+    }
+
+    if (g_InteractiveMode)
+    {
+        std::printf(
+            "[Info] %d of %d sessions are handed off to the new instance.\n",
+            HandedOffCount,
+            static_cast<DWORD>(Sessions.size()));
+    }
+
+    return Error;
+}
+
+void SynthRdpHandoffAdoptSession(
+    _In_ HANDLE PipeHandle,
+    _In_ SOCKET Socket)
+{
+    // The handed off session always takes a slot because it is connected
+    // already, even if the maximum sessions is exceeded.
+    ::EnterCriticalSection(&g_SessionLock);
+    ++g_ActiveChannelCount;
+    ::ResetEvent(g_SessionsDrainedEvent);
+    ::LeaveCriticalSection(&g_SessionLock);
+
+    SynthRdpRelayEndpoint Channel;
+    Channel.Type = SynthRdpRelayEndpointType::Pipe;
+    Channel.PipeHandle = PipeHandle;
+    SynthRdpBackendState* Backend = nullptr;
+    SynthRdpRelaySession* Session = ::SynthRdpRelayCreateSession(
+        &Channel,
+        &Socket,
+        &Backend);
+    if (!Session)
+    {
+        ::closesocket(Socket);
+        ::CloseHandle(Channel.PipeHandle);
+        ::SynthRdpOnChannelFinished();
+        return;
+    }
+
+    // The streams are taken over in the middle, so the X.224 Connection
+    // Request PDU is already patched, and the PDU boundaries are unknown.
+    ::SynthRdpFramingParserInitialize(
+        &Session->Vmbus2Tcp.FramingParser,
+        false,
+        true);
+    ::SynthRdpFramingParserInitialize(
+        &Session->Tcp2Vmbus.FramingParser,
+        false,
+        false);
+
+    ::SynthRdpRelayStartSession(Session);
+}
+
+DWORD SynthRdpHandoffReceive(
+    _Inout_ HANDLE* ControlChannelHandle)
+{
+    HANDLE HandoffPipe = ::CreateFileW(
+        SynthRdpHandoffPipeName,
+        GENERIC_READ | GENERIC_WRITE,
+        0,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_FLAG_OVERLAPPED,
+        nullptr);
+    if (INVALID_HANDLE_VALUE == HandoffPipe)
+    {
+        // ERROR_FILE_NOT_FOUND if no previous instance is handing off.
+        return ::GetLastError();
+    }
+
+    DWORD Error = ERROR_SUCCESS;
+    DWORD AdoptedCount = 0;
+
+    do
+    {
+        DWORD Mode = PIPE_READMODE_MESSAGE;
+        if (!::SetNamedPipeHandleState(HandoffPipe, &Mode, nullptr, nullptr))
+        {
+            Error = ::GetLastError();
+            break;
+        }
+
+        SynthRdpHandoffRequest Request = { 0 };
+        Request.Signature = SynthRdpHandoffSignature;
+        Request.Version = SynthRdpHandoffVersion;
+        Request.ProcessId = ::GetCurrentProcessId();
+        DWORD NumberOfBytesWritten = 0;
+        if (!::SynthRdpHandoffTransfer(
+            HandoffPipe,
+            true,
+            &Request,
+            sizeof(SynthRdpHandoffRequest),
+            &NumberOfBytesWritten))
+        {
+            Error = ::GetLastError();
+            break;
+        }
+
+        for (;;)
+        {
+            SynthRdpHandoffItem Item;
+            DWORD NumberOfBytesRead = 0;
+            if (!::SynthRdpHandoffTransfer(
+                HandoffPipe,
+                false,
+                &Item,
+                sizeof(SynthRdpHandoffItem),
+                &NumberOfBytesRead))
+            {
+                Error = ::GetLastError();
+                break;
+            }
+            if (sizeof(SynthRdpHandoffItem) != NumberOfBytesRead)
+            {
+                Error = ERROR_INVALID_DATA;
+                break;
+            }
+
+            HANDLE Handle = reinterpret_cast<HANDLE>(
+                static_cast<ULONG_PTR>(Item.Handle));
+            if (SynthRdpHandoffItemType::End == Item.Type)
+            {
+                break;
+            }
+            else if (SynthRdpHandoffItemType::ControlChannel == Item.Type)
+            {
+                *ControlChannelHandle = Handle;
+            }
+            else if (SynthRdpHandoffItemType::Channel == Item.Type)
+            {
+                ::SynthRdpSubmitChannel(Handle);
+            }
+            else if (SynthRdpHandoffItemType::Session == Item.Type)
+            {
+                SOCKET Socket = ::WSASocketW(
+                    FROM_PROTOCOL_INFO,
+                    FROM_PROTOCOL_INFO,
+                    FROM_PROTOCOL_INFO,
+                    &Item.SocketInformation,
+                    0,
+                    WSA_FLAG_OVERLAPPED);
+                if (INVALID_SOCKET == Socket)
+                {
+                    if (g_InteractiveMode)
+                    {
+                        std::printf(
+                            "[Error] WSASocketW failed (%d).\n",
+                            ::WSAGetLastError());
+                    }
+                    ::CloseHandle(Handle);
+                    continue;
+                }
+                ::SynthRdpHandoffAdoptSession(Handle, Socket);
+                ++AdoptedCount;
+            }
+            else
+            {
+                Error = ERROR_INVALID_DATA;
+                break;
+            }
+        }
+
+    } while (false);
+
+    ::CloseHandle(HandoffPipe);
+
+    if (g_InteractiveMode)
+    {
+        std::printf(
+            "[Info] %d sessions are handed off from the previous instance.\n",
+            AdoptedCount);
+    }
+
+    return Error;
+}
+
+DWORD SynthRdpOpenControlChannel(
+    _Out_ HANDLE* ControlChannelHandle)
+{
+    DWORD Error = ERROR_SUCCESS;
+
+    // Keep ERROR_SUCCESS if the stop is requested while waiting.
+    while (g_ServiceIsRunning)
+    {
+        *ControlChannelHandle = ::VmbusPipeClientTryOpenChannel(
+            &SYNTHRDP_CONTROL_CLASS_ID,
+            &SYNTHRDP_CONTROL_INSTANCE_ID,
+            100,
+            FILE_FLAG_OVERLAPPED);
+        if (INVALID_HANDLE_VALUE != *ControlChannelHandle)
+        {
+            break;
+        }
+
+        DWORD LastError = ::GetLastError();
+        if (ERROR_TIMEOUT != LastError && WAIT_TIMEOUT != LastError)
+        {
+            break;
+        }
+    }
+    if (!g_ServiceIsRunning)
+    {
+        return Error;
+    }
+    if (INVALID_HANDLE_VALUE == *ControlChannelHandle)
+    {
+        Error = ::GetLastError();
+        if (g_InteractiveMode)
+        {
+            std::printf(
+                "[Error] VmbusPipeClientTryOpenChannel failed (%d).\n",
+                Error);
+        }
+        return Error;
+    }
+
+    SYNTHRDP_VERSION_REQUEST_MESSAGE Request;
+    std::memset(
+        &Request,
+        0,
+        sizeof(SYNTHRDP_VERSION_REQUEST_MESSAGE));
+    Request.Header.Type = SynthrdpVersionRequest;
+    Request.Header.Size = 0;
+    Request.Version.AsDWORD = SYNTHRDP_VERSION_WINBLUE;
+    Request.Reserved = 0;
+    DWORD NumberOfBytesWritten = 0;
+    if (!::MileWriteFile(
+        *ControlChannelHandle,
+        &Request,
+        sizeof(Request),
+        &NumberOfBytesWritten))
+    {
+        Error = ::GetLastError();
+        if (g_InteractiveMode)
+        {
+            std::printf(
+                "[Error] MileWriteFile failed (%d).\n",
+                Error);
+        }
+        return Error;
+    }
+
+    if (sizeof(SYNTHRDP_VERSION_REQUEST_MESSAGE) != NumberOfBytesWritten)
+    {
+        Error = ERROR_INVALID_DATA;
+        if (g_InteractiveMode)
+        {
+            std::printf(
+                "[Error] SYNTHRDP_VERSION_REQUEST_MESSAGE Invalid.\n");
+        }
+        return Error;
+    }
+
+    SYNTHRDP_VERSION_RESPONSE_MESSAGE Response;
+    std::memset(
+        &Response,
+        0,
+        sizeof(SYNTHRDP_VERSION_RESPONSE_MESSAGE));
+    DWORD NumberOfBytesRead = 0;
+    if (!::MileReadFile(
+        *ControlChannelHandle,
+        &Response,
+        sizeof(Response),
+        &NumberOfBytesRead))
+    {
+        Error = ::GetLastError();
+        if (g_InteractiveMode)
+        {
+            std::printf(
+                "[Error] MileReadFile failed (%d).\n",
+                Error);
+        }
+        return Error;
+    }
+
+    if (sizeof(SYNTHRDP_VERSION_RESPONSE_MESSAGE) != NumberOfBytesRead ||
+        SYNTHRDP_TRUE_WITH_VERSION_EXCHANGE != Response.IsAccepted)
+    {
+        Error = ERROR_INVALID_DATA;
+        if (g_InteractiveMode)
+        {
+            std::printf(
+                "[Error] SYNTHRDP_VERSION_RESPONSE_MESSAGE Invalid.\n");
+        }
+        return Error;
+    }
+
+    return ERROR_SUCCESS;
+}
+
+DWORD SynthRdpMain()
+{
+    WSADATA WSAData = { 0 };
+    {
+        int WSAError = ::WSAStartup(MAKEWORD(2, 2), &WSAData);
+        if (NO_ERROR != WSAError)
+        {
+            if (g_InteractiveMode)
+            {
+                std::printf(
+                    "[Error] WSAStartup failed (%d).\n",
+                    WSAError);
+            }
+            return WSAError;
+        }
+    }
+
+    DWORD Error = ERROR_SUCCESS;
+
+    HANDLE ControlChannelHandle = INVALID_HANDLE_VALUE;
+    HANDLE StopWaitHandle = nullptr;
+    bool HandingOff = false;
+
+    ::InitializeCriticalSection(&g_SessionLock);
+
+    g_MaximumSessions = ::SynthRdpQueryConfigurationDword(
+        L"MaximumSessions",
+        g_MaximumSessions);
+    if (!g_MaximumSessions)
+    {
+        g_MaximumSessions = 1;
+    }
+
+    g_RelayPduFraming = (0 != ::SynthRdpQueryConfigurationDword(
+        L"PduFraming",
+        FALSE));
+
+    g_RelayHighWatermark = ::SynthRdpQueryConfigurationDword(
+        L"QueueHighWatermark",
+        SynthRdpRelayDefaultHighWatermark);
+    if (!g_RelayHighWatermark)
+    {
+        g_RelayHighWatermark = 1;
+    }
+    else if (g_RelayHighWatermark > SynthRdpRelayMaximumWatermark)
+    {
+        g_RelayHighWatermark = SynthRdpRelayMaximumWatermark;
+    }
+    g_RelayLowWatermark = ::SynthRdpQueryConfigurationDword(
+        L"QueueLowWatermark",
+        SynthRdpRelayDefaultLowWatermark);
+    if (g_RelayLowWatermark > g_RelayHighWatermark)
+    {
+        g_RelayLowWatermark = g_RelayHighWatermark;
+    }
+    g_RelayHighWatermark *= 1024;
+    g_RelayLowWatermark *= 1024;
+
+    g_RelayIdleTimeout = ::SynthRdpQueryConfigurationDword(
+        L"IdleTimeout",
+        0);
+    if (g_RelayIdleTimeout > SynthRdpRelayMaximumTimeout)
+    {
+        g_RelayIdleTimeout = SynthRdpRelayMaximumTimeout;
+    }
+    g_RelayIdleTimeout *= 1000;
+    g_RelayStallTimeout = ::SynthRdpQueryConfigurationDword(
+        L"StallTimeout",
+        SynthRdpRelayDefaultStallTimeout);
+    if (g_RelayStallTimeout > SynthRdpRelayMaximumTimeout)
+    {
+        g_RelayStallTimeout = SynthRdpRelayMaximumTimeout;
+    }
+    g_RelayStallTimeout *= 1000;
+
+    g_RelaySessionBandwidth = ::SynthRdpQueryConfigurationDword(
+        L"SessionBandwidth",
+        0);
+    if (g_RelaySessionBandwidth > SynthRdpRelayMaximumBandwidth)
+    {
+        g_RelaySessionBandwidth = SynthRdpRelayMaximumBandwidth;
+    }
+    g_RelaySessionBandwidth *= 1024;
+    g_RelaySessionBurst = ::SynthRdpQueryConfigurationDword(
+        L"SessionBurst",
+        SynthRdpRelayDefaultSessionBurst);
+    if (!g_RelaySessionBurst)
+    {
+        g_RelaySessionBurst = 1;
+    }
+    else if (g_RelaySessionBurst > SynthRdpRelayMaximumBandwidth)
+    {
+        g_RelaySessionBurst = SynthRdpRelayMaximumBandwidth;
+    }
+    g_RelaySessionBurst *= 1024;
+    g_RelayTotalBandwidth = ::SynthRdpQueryConfigurationDword(
+        L"TotalBandwidth",
+        0);
+    if (g_RelayTotalBandwidth > SynthRdpRelayMaximumBandwidth)
+    {
+        g_RelayTotalBandwidth = SynthRdpRelayMaximumBandwidth;
+    }
+    g_RelayTotalBandwidth *= 1024;
+
+    DWORD ConnectionPoolSize = ::SynthRdpQueryConfigurationDword(
+        L"ConnectionPoolSize",
+        0);
+    if (ConnectionPoolSize > g_MaximumSessions)
+    {
+        ConnectionPoolSize = g_MaximumSessions;
+    }
+
+    do
+    {
+        g_SessionsDrainedEvent = ::CreateEventW(
+            nullptr,
+            TRUE,
+            TRUE,
+            nullptr);
+        g_ChannelsConnectedEvent = ::CreateEventW(
+            nullptr,
+            TRUE,
+            TRUE,
+            nullptr);
+        if (!g_SessionsDrainedEvent || !g_ChannelsConnectedEvent)
+        {
+            Error = ::GetLastError();
+            if (g_InteractiveMode)
+            {
+                std::printf(
+                    "[Error] CreateEventW failed (%d).\n",
+                    Error);
+            }
+            break;
+        }
+
+        // The relay still works without the shared memory, and the
+        // statistics will only be kept in each session in that case.
+        DWORD StatisticsError = ::SynthRdpStatisticsStartup(true);
+        if (ERROR_SUCCESS != StatisticsError && g_InteractiveMode)
+        {
+            std::printf(
+                "[Error] SynthRdpStatisticsStartup failed (%d).\n",
+                StatisticsError);
+        }
+
+        // Capture the relayed chunks only if the capture file is specified.
+        DWORD CaptureError = ::SynthRdpCaptureStartup(
+            Mile::ToWideString(
+                CP_UTF8,
+                ::SynthRdpQueryConfigurationString(
+                    L"CaptureFile",
+                    std::string())),
+            ::SynthRdpQueryConfigurationDword(
+                L"CaptureSize",
+                SynthRdpCaptureDefaultSize));
+        if (ERROR_SUCCESS != CaptureError)
+        {
+            if (g_InteractiveMode)
+            {
+                std::printf(
+                    "[Error] SynthRdpCaptureStartup failed (%d).\n",
+                    CaptureError);
+            }
+            ::SynthRdpCaptureCleanup();
+        }
+
+        // Trace the relay events in the background, which keeps the relay
+        // threads away from the console.
+        DWORD TraceError = ::SynthRdpTraceStartup(
+            ::SynthRdpQueryConfigurationDword(
+                L"TraceLevel",
+                static_cast<DWORD>(SynthRdpTraceLevel::Info)),
+            ::SynthRdpQueryConfigurationDword(L"TraceSampling", 1),
+            Mile::ToWideString(
+                CP_UTF8,
+                ::SynthRdpQueryConfigurationString(
+                    L"TraceFile",
+                    std::string())));
+        if (ERROR_SUCCESS != TraceError)
+        {
+            if (g_InteractiveMode)
+            {
+                std::printf(
+                    "[Error] SynthRdpTraceStartup failed (%d).\n",
+                    TraceError);
+            }
+            ::SynthRdpTraceCleanup();
+        }
+
+        Error = ::SynthRdpRelayStartup();
+        if (ERROR_SUCCESS != Error)
+        {
+            if (g_InteractiveMode)
+            {
+                std::printf(
+                    "[Error] SynthRdpRelayStartup failed (%d).\n",
+                    Error);
+            }
+            break;
+        }
+
+        // Close the idle and stalled sessions which would be kept forever
+        // otherwise.
+        Error = ::SynthRdpRelayWatchdogStartup();
+        if (ERROR_SUCCESS != Error)
+        {
+            if (g_InteractiveMode)
+            {
+                std::printf(
+                    "[Error] SynthRdpRelayWatchdogStartup failed (%d).\n",
+                    Error);
+            }
+            break;
+        }
+
+        // Share the bandwidth across the sessions if it is limited.
+        Error = ::SynthRdpRelaySchedulerStartup();
+        if (ERROR_SUCCESS != Error)
+        {
+            if (g_InteractiveMode)
+            {
+                std::printf(
+                    "[Error] SynthRdpRelaySchedulerStartup failed (%d).\n",
+                    Error);
+            }
+            break;
+        }
+
+        // Load the server configuration once, and reload it only when the
+        // configurations are changed.
+        Error = ::SynthRdpConfigurationStartup(true);
+        if (ERROR_SUCCESS != Error)
+        {
+            if (g_InteractiveMode)
+            {
+                std::printf(
+                    "[Error] SynthRdpConfigurationStartup failed (%d).\n",
+                    Error);
+            }
+            break;
+        }
+
+        // Pre-connect to the server for reducing the time to the first frame.
+        DWORD ConnectionPoolError = ::SynthRdpConnectionPoolStartup(
+            ConnectionPoolSize);
+        if (ERROR_SUCCESS != ConnectionPoolError && g_InteractiveMode)
+        {
+            std::printf(
+                "[Error] SynthRdpConnectionPoolStartup failed (%d).\n",
+                ConnectionPoolError);
+        }
+
+        // Cancel all sessions as soon as the stop request arrives instead of
+        // waiting for the channel discovery loop to notice it.
+        if (!::RegisterWaitForSingleObject(
+            &StopWaitHandle,
+            g_ServiceStopEvent,
+            [](PVOID, BOOLEAN)
+            {
+                ::SynthRdpCloseAllChannels();
+            },
+            nullptr,
+            INFINITE,
+            WT_EXECUTEONLYONCE))
+        {
+            Error = ::GetLastError();
+            if (g_InteractiveMode)
+            {
+                std::printf(
+                    "[Error] RegisterWaitForSingleObject failed (%d).\n",
+                    Error);
+            }
+            break;
+        }
+
+        // Take over the control channel and the sessions if the previous
+        // instance is handing off them, and the version exchange is done.
+        DWORD HandoffError = ::SynthRdpHandoffReceive(&ControlChannelHandle);
+        if (ERROR_SUCCESS != HandoffError &&
+            ERROR_FILE_NOT_FOUND != HandoffError &&
+            g_InteractiveMode)
+        {
+            std::printf(
+                "[Error] SynthRdpHandoffReceive failed (%d).\n",
+                HandoffError);
+        }
+
+        if (INVALID_HANDLE_VALUE == ControlChannelHandle)
+        {
+            Error = ::SynthRdpOpenControlChannel(&ControlChannelHandle);
+            if (ERROR_SUCCESS != Error || !g_ServiceIsRunning)
+            {
+                break;
+            }
+        }
+
+        GUID Instances[] =
+        {
+            SYNTHRDP_DATA_INSTANCE_ID_1,
+            SYNTHRDP_DATA_INSTANCE_ID_2,
+            SYNTHRDP_DATA_INSTANCE_ID_3,
+            SYNTHRDP_DATA_INSTANCE_ID_4,
+            SYNTHRDP_DATA_INSTANCE_ID_5
+        };
+        // Wait for all data channel instances at the same time, which makes
+        // the channel offered on any instance opened immediately.
+        Error = ::SynthRdpDiscoveryStartup(
+            &SynthRdpVmbusChannelProvider,
+            Instances,
+            sizeof(Instances) / sizeof(*Instances));
+        if (ERROR_SUCCESS != Error)
+        {
+            if (g_InteractiveMode)
+            {
+                std::printf(
+                    "[Error] SynthRdpDiscoveryStartup failed (%d).\n",
+                    Error);
+            }
+            ::SynthRdpRequestStop();
+            break;
+        }
+
+        DWORD ForwardError = ::SynthRdpForwardStartup();
+        if (ERROR_SUCCESS != ForwardError && g_InteractiveMode)
+        {
+            std::printf(
+                "[Error] SynthRdpForwardStartup failed (%d).\n",
+                ForwardError);
+        }
+
+        HANDLE WaitHandles[] = { g_ServiceStopEvent, g_ServiceHandoffEvent };
+        if (WAIT_OBJECT_0 + 1 == ::WaitForMultipleObjects(
+            g_ServiceHandoffEvent ? 2 : 1,
+            WaitHandles,
+            FALSE,
+            INFINITE))
+        {
+            HandingOff = true;
+
+            // Stop the discovery without closing the sessions, and release
+            // the names which will be used by the new instance.
+            g_ServiceHandingOff = true;
+            g_ServiceIsRunning = false;
+            ::SynthRdpDiscoveryStop();
+            ::SynthRdpForwardStop();
+            ::SynthRdpStatisticsUnpublish();
+
+            HANDLE HandoffPipe = INVALID_HANDLE_VALUE;
+            DWORD HandoffError = ::SynthRdpHandoffListenerStartup(
+                &HandoffPipe);
+
+            // The new instance can be started after the service is reported
+            // as stopped, and this process exits after the remaining
+            // sessions are finished.
+            ::SynthRdpReportServiceStopped(ERROR_SUCCESS);
+
+            if (ERROR_SUCCESS == HandoffError)
+            {
+                HandoffError = ::SynthRdpHandoffSend(
+                    HandoffPipe,
+                    &ControlChannelHandle);
+                ::CloseHandle(HandoffPipe);
+            }
+            if (ERROR_SUCCESS != HandoffError && g_InteractiveMode)
+            {
+                std::printf(
+                    "[Error] SynthRdpHandoffSend failed (%d).\n",
+                    HandoffError);
+            }
+        }
+
+    } while (false);
+
+    ::SynthRdpDiscoveryStop();
+
+    ::SynthRdpForwardStop();
+
+    if (g_SessionsDrainedEvent)
+    {
+        // The sessions which are not handed off are kept until they finish.
+        if (!HandingOff)
+        {
+            ::SynthRdpCloseAllChannels();
+        }
+        ::WaitForSingleObject(g_SessionsDrainedEvent, INFINITE);
+        ::CloseHandle(g_SessionsDrainedEvent);
+        g_SessionsDrainedEvent = nullptr;
+
+        if (g_InteractiveMode && !g_ServiceIsRunning)
+        {
+            std::printf(
+                "[Info] All sessions are released in %d ms after the stop "
+                "request.\n",
+                ::GetTickCount() - g_StopRequestedTime);
+        }
+    }
+
+    if (g_ChannelsConnectedEvent)
+    {
+        ::CloseHandle(g_ChannelsConnectedEvent);
+        g_ChannelsConnectedEvent = nullptr;
+    }
+
+    ::SynthRdpDiscoveryCleanup();
+
+    // The forwarded connections being set up use the mappings until they
+    // are finished.
+    ::SynthRdpForwardCleanup();
+
+    if (StopWaitHandle)
+    {
+        ::UnregisterWaitEx(StopWaitHandle, INVALID_HANDLE_VALUE);
+    }
+
+    if (INVALID_HANDLE_VALUE != ControlChannelHandle)
+    {
+        ::CloseHandle(ControlChannelHandle);
+    }
+
+    ::SynthRdpConnectionPoolCleanup();
+
+    ::SynthRdpConfigurationCleanup();
+
+    ::SynthRdpRelayWatchdogCleanup();
+
+    ::SynthRdpRelaySchedulerCleanup();
+
+    ::SynthRdpRelayCleanup();
+
+    ::SynthRdpTraceCleanup();
+
+    ::SynthRdpCaptureCleanup();
+
+    ::SynthRdpStatisticsCleanup();
+
+    ::DeleteCriticalSection(&g_SessionLock);
+
+    ::WSACleanup();
+
+    return Error;
+}
+
+struct SynthRdpBenchmarkStream
+{
+    SynthRdpRelayEndpoint* Sender;
+    SynthRdpRelayEndpoint* Receiver;
+    DWORD FrameSize;
+    DWORD FrameCount;
+    // Send the next frame only after the previous one is received, which
+    // simulates the interactive input.
+    bool Lockstep;
+    HANDLE FrameReceivedEvent;
+    bool Succeeded;
+    LONGLONG StartTime;
+    LONGLONG FinishTime;
+    std::vector<LONG64> Latencies;
+};
+
+// The stub threads reuse one event for all overlapped pipe operations, which
+// keeps creating the events out of the measurement.
+HANDLE SynthRdpBenchmarkCreateStubThread(
+    _In_ std::function<void(HANDLE)> const& Routine)
+{
+    return Mile::CreateThread([Routine]()
+    {
+        HANDLE Event = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
+        if (Event)
+        {
+            Routine(Event);
+            ::CloseHandle(Event);
+        }
+    });
+}
+
+bool SynthRdpBenchmarkTransfer(
+    _In_ SynthRdpRelayEndpoint* Endpoint,
+    _In_ HANDLE Event,
+    _In_ bool Write,
+    _In_ std::uint8_t* Buffer,
+    _In_ DWORD Length,
+    _Out_ LPDWORD Transferred)
+{
+    *Transferred = 0;
+
+    if (SynthRdpRelayEndpointType::Socket == Endpoint->Type)
+    {
+        int Result = Write
+            ? ::send(
+                Endpoint->Socket,
+                reinterpret_cast<const char*>(Buffer),
+                static_cast<int>(Length),
+                0)
+            : ::recv(
+                Endpoint->Socket,
+                reinterpret_cast<char*>(Buffer),
+                static_cast<int>(Length),
+                0);
+        if (SOCKET_ERROR == Result)
+        {
+            return false;
+        }
+        *Transferred = static_cast<DWORD>(Result);
+        return true;
+    }
+
+    // The pipe handle is opened for the overlapped I/O because the reading
+    // and writing are done in different threads.
+    OVERLAPPED Overlapped = { 0 };
+    Overlapped.hEvent = Event;
+
+    BOOL Result = Write
+        ? ::WriteFile(
+            Endpoint->PipeHandle,
+            Buffer,
+            Length,
+            nullptr,
+            &Overlapped)
+        : ::ReadFile(
+            Endpoint->PipeHandle,
+            Buffer,
+            Length,
+            nullptr,
+            &Overlapped);
+    if (Result || ERROR_IO_PENDING == ::GetLastError())
+    {
+        Result = ::GetOverlappedResult(
+            Endpoint->PipeHandle,
+            &Overlapped,
+            Transferred,
+            TRUE);
+    }
+    if (!Result && ERROR_MORE_DATA == ::GetLastError())
+    {
+        // The rest of the message will be returned by the next read.
+        Result = TRUE;
+    }
+
+    return Result;
+}
+
+void SynthRdpBenchmarkSend(
+    _Inout_ SynthRdpBenchmarkStream* Stream,
+    _In_ HANDLE Event)
+{
+    std::vector<std::uint8_t> Frame(Stream->FrameSize, 0xCC);
+
+    Stream->StartTime = ::SynthRdpStatisticsGetTimestamp();
+
+    for (DWORD i = 0; i < Stream->FrameCount; ++i)
+    {
+        // The frame starts with the timestamp for measuring the latency.
+        LONGLONG Timestamp = ::SynthRdpStatisticsGetTimestamp();
+        std::memcpy(&Frame[0], &Timestamp, sizeof(Timestamp));
+
+        DWORD Offset = 0;
+        while (Offset < Stream->FrameSize)
+        {
+            DWORD Transferred = 0;
+            if (!::SynthRdpBenchmarkTransfer(
+                Stream->Sender,
+                Event,
+                true,
+                &Frame[Offset],
+                Stream->FrameSize - Offset,
+                &Transferred) || !Transferred)
+            {
+                return;
+            }
+            Offset += Transferred;
+        }
+
+        if (Stream->Lockstep &&
+            WAIT_OBJECT_0 != ::WaitForSingleObject(
+                Stream->FrameReceivedEvent,
+                10000))
+        {
+            return;
+        }
+    }
+}
+
+void SynthRdpBenchmarkReceive(
+    _Inout_ SynthRdpBenchmarkStream* Stream,
+    _In_ HANDLE Event)
+{
+    std::vector<std::uint8_t> Buffer(65536);
+
+    DWORD ReceivedFrames = 0;
+    DWORD FrameOffset = 0;
+    LONGLONG Timestamp = 0;
+
+    Stream->Latencies.reserve(Stream->FrameCount);
+
+    while (ReceivedFrames < Stream->FrameCount)
+    {
+        DWORD Transferred = 0;
+        if (!::SynthRdpBenchmarkTransfer(
+            Stream->Receiver,
+            Event,
+            false,
+            &Buffer[0],
+            static_cast<DWORD>(Buffer.size()),
+            &Transferred))
+        {
+            return;
+        }
+        if (!Transferred &&
+            SynthRdpRelayEndpointType::Socket == Stream->Receiver->Type)
+        {
+            return;
+        }
+
+        // The relay may split or merge the frames, so parse them from the
+        // byte stream.
+        DWORD Position = 0;
+        while (Position < Transferred)
+        {
+            DWORD Length = Stream->FrameSize - FrameOffset;
+            if (Length > Transferred - Position)
+            {
+                Length = Transferred - Position;
+            }
+            if (FrameOffset < sizeof(Timestamp))
+            {
+                DWORD TimestampLength =
+                    static_cast<DWORD>(sizeof(Timestamp)) - FrameOffset;
+                std::memcpy(
+                    reinterpret_cast<std::uint8_t*>(&Timestamp) + FrameOffset,
+                    &Buffer[Position],
+                    (Length < TimestampLength) ? Length : TimestampLength);
+            }
+            FrameOffset += Length;
+            Position += Length;
+
+            if (FrameOffset == Stream->FrameSize)
+            {
+                Stream->Latencies.push_back(
+                    ::SynthRdpStatisticsGetElapsedTime(Timestamp));
+                FrameOffset = 0;
+                ++ReceivedFrames;
+                if (Stream->Lockstep)
+                {
+                    ::SetEvent(Stream->FrameReceivedEvent);
+                }
+            }
+        }
+    }
+
+    Stream->FinishTime = ::SynthRdpStatisticsGetTimestamp();
+    Stream->Succeeded = true;
+}
+
+void SynthRdpBenchmarkPrintStream(
+    _In_ const char* Name,
+    _Inout_ SynthRdpBenchmarkStream* Stream)
+{
+    if (!Stream->Succeeded)
+    {
+        std::printf("  %s: Failed.\n", Name);
+        return;
+    }
+
+    std::sort(Stream->Latencies.begin(), Stream->Latencies.end());
+    std::size_t Count = Stream->Latencies.size();
+    LONG64 P50 = Count ? Stream->Latencies[Count * 50 / 100] : 0;
+    LONG64 P99 = Count ? Stream->Latencies[Count * 99 / 100] : 0;
+
+    LONG64 Elapsed = ::SynthRdpStatisticsToMicroseconds(
+        Stream->FinishTime - Stream->StartTime);
+    double Megabytes = static_cast<double>(Stream->FrameSize) *
+        Stream->FrameCount / (1024 * 1024);
+
+    std::printf(
+        "  %s: %u x %u Bytes, %.2f MB/s, "
+        "Latency p50 %lld us, p99 %lld us.\n",
+        Name,
+        Stream->FrameCount,
+        Stream->FrameSize,
+        Elapsed ? Megabytes * 1000000 / Elapsed : 0.0,
+        P50,
+        P99);
+}
+
+// Only the relay workers are measured because the stub threads of the
+// benchmark take more processor time than the relay.
+LONG64 SynthRdpBenchmarkGetRelayProcessorTime()
+{
+    LONG64 Result = 0;
+    for (HANDLE& WorkerThread : g_RelayWorkerThreads)
+    {
+        FILETIME CreationTime;
+        FILETIME ExitTime;
+        FILETIME KernelTime;
+        FILETIME UserTime;
+        if (!::GetThreadTimes(
+            WorkerThread,
+            &CreationTime,
+            &ExitTime,
+            &KernelTime,
+            &UserTime))
+        {
+            continue;
+        }
+
+        ULARGE_INTEGER Kernel;
+        Kernel.LowPart = KernelTime.dwLowDateTime;
+        Kernel.HighPart = KernelTime.dwHighDateTime;
+        ULARGE_INTEGER User;
+        User.LowPart = UserTime.dwLowDateTime;
+        User.HighPart = UserTime.dwHighDateTime;
+        Result += static_cast<LONG64>(Kernel.QuadPart + User.QuadPart);
+    }
+    return Result;
+}
+
+enum class SynthRdpBenchmarkTransport : std::uint32_t
+{
+    TcpLoopback,
+    LoopbackFastPath,
+    UnixSocket,
+};
+
+std::string SynthRdpBenchmarkGetUnixSocketPath()
+{
+    // The AF_UNIX socket path is limited to 108 characters, so use the
+    // temporary directory which is usually short enough.
+    char TempPath[MAX_PATH] = { 0 };
+    ::GetTempPathA(MAX_PATH, TempPath);
+    return Mile::FormatString(
+        "%sSynthRdpBenchmark_%u.sock",
+        TempPath,
+        ::GetCurrentProcessId());
+}
+
+// Open the stand-in endpoints of a relay session. The guest endpoint is a
+// message mode named pipe which is submitted as the VMBus data channel, and
+// the server endpoint is accepted from a local stub server which the relay
+// is redirected to via the specified transport.
+DWORD SynthRdpBenchmarkOpenEndpoints(
+    _In_ SynthRdpBenchmarkTransport Transport,
+    _Out_ SOCKET* ListenSocket,
+    _Out_ SynthRdpRelayEndpoint* Guest,
+    _Out_ SynthRdpRelayEndpoint* Server)
+{
+    DWORD Error = ERROR_SUCCESS;
+
+    *ListenSocket = INVALID_SOCKET;
+    Guest->Type = SynthRdpRelayEndpointType::Pipe;
+    Guest->PipeHandle = INVALID_HANDLE_VALUE;
+    Server->Type = SynthRdpRelayEndpointType::Socket;
+    Server->Socket = INVALID_SOCKET;
+
+    do
+    {
+        // The stub server which stands in for the remote desktop server.
+        std::string Host;
+        std::string Port;
+        if (SynthRdpBenchmarkTransport::UnixSocket == Transport)
+        {
+            std::string Path = ::SynthRdpBenchmarkGetUnixSocketPath();
+            ::DeleteFileA(Path.c_str());
+
+            *ListenSocket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+            if (INVALID_SOCKET == *ListenSocket)
+            {
+                Error = ::WSAGetLastError();
+                break;
+            }
+
+            sockaddr_un Address = { 0 };
+            Address.sun_family = AF_UNIX;
+            if (Path.size() >= sizeof(Address.sun_path))
+            {
+                Error = ERROR_BUFFER_OVERFLOW;
+                break;
+            }
+            std::memcpy(Address.sun_path, Path.c_str(), Path.size());
+            if (SOCKET_ERROR == ::bind(
+                *ListenSocket,
+                reinterpret_cast<sockaddr*>(&Address),
+                sizeof(Address)) ||
+                SOCKET_ERROR == ::listen(*ListenSocket, 1))
+            {
+                Error = ::WSAGetLastError();
+                break;
+            }
+
+            Host = SynthRdpUnixSocketPrefix + Path;
+        }
+        else
+        {
+            *ListenSocket = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+            if (INVALID_SOCKET == *ListenSocket)
+            {
+                Error = ::WSAGetLastError();
+                break;
+            }
+
+            if (SynthRdpBenchmarkTransport::LoopbackFastPath == Transport)
+            {
+                ::SynthRdpEnableLoopbackFastPath(*ListenSocket);
+            }
+
+            sockaddr_in Address = { 0 };
+            Address.sin_family = AF_INET;
+            Address.sin_addr.s_addr = ::htonl(INADDR_LOOPBACK);
+            Address.sin_port = 0;
+            int AddressLength = sizeof(Address);
+            if (SOCKET_ERROR == ::bind(
+                *ListenSocket,
+                reinterpret_cast<sockaddr*>(&Address),
+                AddressLength) ||
+                SOCKET_ERROR == ::listen(*ListenSocket, 1) ||
+                SOCKET_ERROR == ::getsockname(
+                    *ListenSocket,
+                    reinterpret_cast<sockaddr*>(&Address),
+                    &AddressLength))
+            {
+                Error = ::WSAGetLastError();
+                break;
+            }
+
+            Host = "127.0.0.1";
+            Port = Mile::FormatString("%hu", ::ntohs(Address.sin_port));
+        }
+
+        // Redirect the relay to the stub server.
+        SynthRdpServerConfiguration Configuration;
+        ::SynthRdpReadServerConfiguration(Configuration);
+        Configuration.Backends.clear();
+        Configuration.Backends.push_back(::SynthRdpMakeBackend(
+            Host,
+            Port,
+            1));
+        Configuration.LoopbackFastPath =
+            (SynthRdpBenchmarkTransport::LoopbackFastPath == Transport);
+        ::SynthRdpUpdateServerConfiguration(Configuration);
+
+        // The message mode named pipe which stands in for the VMBus pipe.
+        std::wstring PipeName = Mile::FormatWideString(
+            L"\\\\.\\pipe\\SynthRdpBenchmark_%u",
+            ::GetCurrentProcessId());
+        Guest->PipeHandle = ::CreateNamedPipeW(
+            PipeName.c_str(),
+            PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED |
+            FILE_FLAG_FIRST_PIPE_INSTANCE,
+            PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT,
+            1,
+            65536,
+            65536,
+            0,
+            nullptr);
+        if (INVALID_HANDLE_VALUE == Guest->PipeHandle)
+        {
+            Error = ::GetLastError();
+            break;
+        }
+
+        HANDLE ChannelHandle = ::CreateFileW(
+            PipeName.c_str(),
+            GENERIC_READ | GENERIC_WRITE,
+            0,
+            nullptr,
+            OPEN_EXISTING,
+            FILE_FLAG_OVERLAPPED,
+            nullptr);
+        if (INVALID_HANDLE_VALUE == ChannelHandle)
+        {
+            Error = ::GetLastError();
+            break;
+        }
+        DWORD PipeMode = PIPE_READMODE_MESSAGE;
+        ::SetNamedPipeHandleState(ChannelHandle, &PipeMode, nullptr, nullptr);
+
+        // Run the same data path as the VMBus data channel.
+        ::SynthRdpSubmitChannel(ChannelHandle);
+
+        Server->Socket = ::accept(*ListenSocket, nullptr, nullptr);
+        if (INVALID_SOCKET == Server->Socket)
+        {
+            Error = ::WSAGetLastError();
+            break;
+        }
+
+    } while (false);
+
+    return Error;
+}
+
+// Close the stand-in endpoints to finish the relay session.
+void SynthRdpBenchmarkCloseEndpoints(
+    _In_ SOCKET ListenSocket,
+    _In_ SynthRdpRelayEndpoint* Guest,
+    _In_ SynthRdpRelayEndpoint* Server)
+{
+    if (INVALID_SOCKET != Server->Socket)
+    {
+        ::closesocket(Server->Socket);
+        Server->Socket = INVALID_SOCKET;
+    }
+    if (INVALID_HANDLE_VALUE != Guest->PipeHandle)
+    {
+        ::CloseHandle(Guest->PipeHandle);
+        Guest->PipeHandle = INVALID_HANDLE_VALUE;
+    }
+    if (INVALID_SOCKET != ListenSocket)
+    {
+        ::closesocket(ListenSocket);
+    }
+    // The AF_UNIX socket file is not removed when the socket is closed.
+    ::DeleteFileA(::SynthRdpBenchmarkGetUnixSocketPath().c_str());
+    ::WaitForSingleObject(g_SessionsDrainedEvent, INFINITE);
+}
+
+DWORD SynthRdpBenchmarkRunProfile(
+    _In_ const char* Name,
+    _In_ SynthRdpBenchmarkTransport Transport,
+    _In_ DWORD UpstreamFrameSize,
+    _In_ DWORD UpstreamFrameCount,
+    _In_ DWORD DownstreamFrameSize,
+    _In_ DWORD DownstreamFrameCount)
+{
+    DWORD Error = ERROR_SUCCESS;
+
+    SOCKET ListenSocket = INVALID_SOCKET;
+    SynthRdpRelayEndpoint Guest;
+    SynthRdpRelayEndpoint Server;
+
+    SynthRdpBenchmarkStream Upstream;
+    Upstream.Sender = &Guest;
+    Upstream.Receiver = &Server;
+    Upstream.FrameSize = UpstreamFrameSize;
+    Upstream.FrameCount = UpstreamFrameCount;
+    Upstream.Lockstep = true;
+    Upstream.FrameReceivedEvent = nullptr;
+    Upstream.Succeeded = false;
+    Upstream.StartTime = 0;
+    Upstream.FinishTime = 0;
+
+    SynthRdpBenchmarkStream Downstream;
+    Downstream.Sender = &Server;
+    Downstream.Receiver = &Guest;
+    Downstream.FrameSize = DownstreamFrameSize;
+    Downstream.FrameCount = DownstreamFrameCount;
+    Downstream.Lockstep = false;
+    Downstream.FrameReceivedEvent = nullptr;
+    Downstream.Succeeded = false;
+    Downstream.StartTime = 0;
+    Downstream.FinishTime = 0;
+
+    std::vector<HANDLE> Threads;
+
+    SynthRdpStatisticsDirection Vmbus2Tcp =
+        g_StatisticsHeader->FinishedVmbus2Tcp;
+    SynthRdpStatisticsDirection Tcp2Vmbus =
+        g_StatisticsHeader->FinishedTcp2Vmbus;
+    LONG64 ProcessorTime = ::SynthRdpBenchmarkGetRelayProcessorTime();
+
+    do
+    {
+        Error = ::SynthRdpBenchmarkOpenEndpoints(
+            Transport,
+            &ListenSocket,
+            &Guest,
+            &Server);
+        if (ERROR_SUCCESS != Error)
+        {
+            break;
+        }
+
+        Upstream.FrameReceivedEvent = ::CreateEventW(
+            nullptr,
+            FALSE,
+            FALSE,
+            nullptr);
+        if (!Upstream.FrameReceivedEvent)
+        {
+            Error = ::GetLastError();
+            break;
+        }
+
+        ProcessorTime = ::SynthRdpBenchmarkGetRelayProcessorTime();
+
+        if (Upstream.FrameCount)
+        {
+            Threads.push_back(::SynthRdpBenchmarkCreateStubThread(
+                [&](HANDLE Event)
+                {
+                    ::SynthRdpBenchmarkReceive(&Upstream, Event);
+                }));
+            Threads.push_back(::SynthRdpBenchmarkCreateStubThread(
+                [&](HANDLE Event)
+                {
+                    ::SynthRdpBenchmarkSend(&Upstream, Event);
+                }));
+        }
+        if (Downstream.FrameCount)
+        {
+            Threads.push_back(::SynthRdpBenchmarkCreateStubThread(
+                [&](HANDLE Event)
+                {
+                    ::SynthRdpBenchmarkReceive(&Downstream, Event);
+                }));
+            Threads.push_back(::SynthRdpBenchmarkCreateStubThread(
+                [&](HANDLE Event)
+                {
+                    ::SynthRdpBenchmarkSend(&Downstream, Event);
+                }));
+        }
+
+    } while (false);
+
+    for (HANDLE& Thread : Threads)
+    {
+        if (Thread)
+        {
+            ::WaitForSingleObject(Thread, INFINITE);
+            ::CloseHandle(Thread);
+        }
+    }
+
+    ProcessorTime = ::SynthRdpBenchmarkGetRelayProcessorTime() - ProcessorTime;
+
+    ::SynthRdpBenchmarkCloseEndpoints(ListenSocket, &Guest, &Server);
+    if (Upstream.FrameReceivedEvent)
+    {
+        ::CloseHandle(Upstream.FrameReceivedEvent);
+    }
+
+    if (ERROR_SUCCESS != Error)
+    {
+        return Error;
+    }
+
+    SynthRdpStatisticsDirection* Finished[] =
+    {
+        &g_StatisticsHeader->FinishedVmbus2Tcp,
+        &g_StatisticsHeader->FinishedTcp2Vmbus
+    };
+    SynthRdpStatisticsDirection* Previous[] =
+    {
+        &Vmbus2Tcp,
+        &Tcp2Vmbus
+    };
+    LONG64 Bytes = 0;
+    LONG64 Requests = 0;
+    for (std::size_t i = 0; i < 2; ++i)
+    {
+        Bytes += Finished[i]->TransferredBytes - Previous[i]->TransferredBytes;
+        Requests += Finished[i]->ReadRequests - Previous[i]->ReadRequests;
+        Requests += Finished[i]->WriteRequests - Previous[i]->WriteRequests;
+    }
+    double Megabytes = static_cast<double>(Bytes) / (1024 * 1024);
+
+    std::printf("%s:\n", Name);
+    if (Upstream.FrameCount)
+    {
+        ::SynthRdpBenchmarkPrintStream("VMBus to TCP", &Upstream);
+    }
+    if (Downstream.FrameCount)
+    {
+        ::SynthRdpBenchmarkPrintStream("TCP to VMBus", &Downstream);
+    }
+    std::printf(
+        "  Relay: %.2f MB, %.1f I/O Requests per MB, "
+        "%.1f ms Processor Time per GB.\n"
+        "\n",
+        Megabytes,
+        Megabytes > 0 ? Requests / Megabytes : 0.0,
+        Megabytes > 0 ? ProcessorTime / 10000.0 * 1024 / Megabytes : 0.0);
+
+    return ERROR_SUCCESS;
+}
+
+struct SynthRdpBenchmarkParserCase
+{
+    const char* Name;
+    const char* Token;
+    bool Negotiation;
+    bool Correlation;
+    // Append the bytes of the next PDU to simulate the coalesced reads.
+    bool Coalesced;
+    // Corrupt the byte at the offset if not zero.
+    std::size_t CorruptOffset;
+    bool Rewritten;
+};
+
+const SynthRdpBenchmarkParserCase SynthRdpBenchmarkParserCorpus[] =
+{
+    { "Cookie", "Cookie: mstshash=user\r\n", true, false, false, 0, true },
+    { "Negotiation", "", true, false, false, 0, true },
+    { "Correlation", "", true, true, false, 0, true },
+    {
+        "RoutingToken",
+        "Cookie: msts=3640205228.15629.0000\r\n",
+        true,
+        false,
+        false,
+        0,
+        true
+    },
+    { "Coalesced", "Cookie: mstshash=user\r\n", true, false, true, 0, true },
+    { "Legacy", "Cookie: mstshash=user\r\n", false, false, false, 0, false },
+    { "NotTpkt", "", true, false, false, 0, false },
+    { "NotConnectionRequest", "", true, false, false, 5, false },
+    { "BadNegotiationLength", "", true, false, false, 13, false },
+};
+
+std::vector<std::uint8_t> SynthRdpBenchmarkMakeConnectionRequest(
+    _In_ SynthRdpBenchmarkParserCase const& Case,
+    _Out_ std::vector<std::uint8_t>& Expected)
+{
+    std::vector<std::uint8_t> Result(SynthRdpX224UserDataOffset, 0x00);
+    Result[0] = SynthRdpTpktVersion;
+    Result[5] = SynthRdpX224ConnectionRequest;
+    Result.insert(
+        Result.end(),
+        Case.Token,
+        Case.Token + std::strlen(Case.Token));
+    std::size_t ProtocolsOffset = 0;
+    if (Case.Negotiation)
+    {
+        // PROTOCOL_SSL | PROTOCOL_HYBRID | PROTOCOL_HYBRID_EX
+        const std::uint8_t Negotiation[] =
+        {
+            SynthRdpNegotiationRequestType, 0x00, 0x08, 0x00,
+            0x0B, 0x00, 0x00, 0x00
+        };
+        ProtocolsOffset = Result.size() + 4;
+        Result.insert(
+            Result.end(),
+            Negotiation,
+            Negotiation + sizeof(Negotiation));
+    }
+    if (Case.Correlation)
+    {
+        Result.push_back(0x06);
+        Result.push_back(0x00);
+        Result.push_back(0x24);
+        Result.push_back(0x00);
+        for (std::uint8_t i = 0; i < 32; ++i)
+        {
+            Result.push_back(i < 16 ? i + 1 : 0x00);
+        }
+    }
+    Result[2] = static_cast<std::uint8_t>(Result.size() >> 8);
+    Result[3] = static_cast<std::uint8_t>(Result.size());
+    Result[4] = static_cast<std::uint8_t>(Result.size() - 5);
+    if (Case.CorruptOffset)
+    {
+        Result[Case.CorruptOffset] ^= 0xFF;
+    }
+    if (0 == std::strcmp(Case.Name, "NotTpkt"))
+    {
+        // The TLS handshake record.
+        Result[0] = 0x16;
+    }
+
+    Expected = Result;
+    if (Case.Rewritten)
+    {
+        std::memset(&Expected[ProtocolsOffset], 0, 4);
+    }
+
+    if (Case.Coalesced)
+    {
+        // X.224 Data TPDU
+        const std::uint8_t Next[] =
+        {
+            0x03, 0x00, 0x00, 0x0C, 0x02, 0xF0, 0x80,
+            0x01, 0x00, 0x08, 0x00, 0x0B
+        };
+        Result.insert(Result.end(), Next, Next + sizeof(Next));
+        Expected.insert(Expected.end(), Next, Next + sizeof(Next));
+    }
+
+    return Result;
+}
+
+// Feed the data to the parser in the chunks of the specific size, and
+// return the number of the bytes consumed by the parser.
+DWORD SynthRdpBenchmarkParseConnectionRequest(
+    _Inout_ std::vector<std::uint8_t>& Data,
+    _In_ std::size_t ChunkSize,
+    _Out_ SynthRdpConnectionRequestParser* Parser)
+{
+    ::SynthRdpConnectionRequestParserInitialize(Parser, true);
+
+    DWORD Consumed = 0;
+    for (std::size_t i = 0; i < Data.size(); i += ChunkSize)
+    {
+        Consumed += ::SynthRdpConnectionRequestParserConsume(
+            Parser,
+            &Data[i],
+            static_cast<DWORD>((std::min)(ChunkSize, Data.size() - i)));
+    }
+    return Consumed;
+}
+
+DWORD SynthRdpBenchmarkParser()
+{
+    const std::size_t ChunkSizes[] = { 1, 2, 3, 5, 7, 0 };
+    const DWORD MutationCount = 2000;
+    const DWORD IterationCount = 1000000;
+
+    std::size_t CaseCount = sizeof(SynthRdpBenchmarkParserCorpus) /
+        sizeof(*SynthRdpBenchmarkParserCorpus);
+    DWORD Mutations = 0;
+    // The linear congruential generator makes the mutations reproducible.
+    std::uint32_t Seed = 0x53445253;
+
+    for (std::size_t i = 0; i < CaseCount; ++i)
+    {
+        SynthRdpBenchmarkParserCase const& Case =
+            SynthRdpBenchmarkParserCorpus[i];
+        std::vector<std::uint8_t> Expected;
+        std::vector<std::uint8_t> Input =
+            ::SynthRdpBenchmarkMakeConnectionRequest(Case, Expected);
+
+        // The result should not depend on how the data is split.
+        for (std::size_t ChunkSize : ChunkSizes)
+        {
+            std::vector<std::uint8_t> Output = Input;
+            SynthRdpConnectionRequestParser Parser;
+            ::SynthRdpBenchmarkParseConnectionRequest(
+                Output,
+                ChunkSize ? ChunkSize : Output.size(),
+                &Parser);
+            if (Output != Expected || Parser.Rewritten != Case.Rewritten)
+            {
+                std::printf(
+                    "  Parser: %s failed with %zu Bytes chunks.\n",
+                    Case.Name,
+                    ChunkSize ? ChunkSize : Output.size());
+                return ERROR_INVALID_DATA;
+            }
+        }
+
+        // Only requestedProtocols in the consumed bytes can be changed
+        // whatever the mutated input is.
+        for (DWORD j = 0; j < MutationCount; ++j)
+        {
+            std::vector<std::uint8_t> Mutated = Input;
+            DWORD FlipCount = 1 + j % 3;
+            for (DWORD k = 0; k < FlipCount; ++k)
+            {
+                Seed = Seed * 1103515245 + 12345;
+                Mutated[(Seed >> 8) % Mutated.size()] =
+                    static_cast<std::uint8_t>(Seed >> 24);
+            }
+
+            std::vector<std::uint8_t> Whole = Mutated;
+            SynthRdpConnectionRequestParser WholeParser;
+            DWORD Consumed = ::SynthRdpBenchmarkParseConnectionRequest(
+                Whole,
+                Whole.size(),
+                &WholeParser);
+            std::vector<std::uint8_t> Split = Mutated;
+            SynthRdpConnectionRequestParser SplitParser;
+            bool Succeeded = (Consumed ==
+                ::SynthRdpBenchmarkParseConnectionRequest(
+                    Split,
+                    1,
+                    &SplitParser)) && Whole == Split;
+            for (std::size_t k = 0; Succeeded && k < Whole.size(); ++k)
+            {
+                Succeeded = (Whole[k] == Mutated[k]) ||
+                    (0x00 == Whole[k] && k < Consumed);
+            }
+            if (!Succeeded)
+            {
+                std::printf(
+                    "  Parser: %s failed with mutation %u.\n",
+                    Case.Name,
+                    j);
+                return ERROR_INVALID_DATA;
+            }
+            ++Mutations;
+        }
+    }
+
+    std::vector<std::uint8_t> Expected;
+    std::vector<std::uint8_t> Input = ::SynthRdpBenchmarkMakeConnectionRequest(
+        SynthRdpBenchmarkParserCorpus[0],
+        Expected);
+    SynthRdpConnectionRequestParser Parser;
+    LONGLONG StartTime = ::SynthRdpStatisticsGetTimestamp();
+    for (DWORD i = 0; i < IterationCount; ++i)
+    {
+        ::SynthRdpConnectionRequestParserInitialize(&Parser, true);
+        ::SynthRdpConnectionRequestParserConsume(
+            &Parser,
+            &Input[0],
+            static_cast<DWORD>(Input.size()));
+    }
+    LONG64 Elapsed = ::SynthRdpStatisticsGetElapsedTime(StartTime);
+
+    std::printf(
+        "Parser:\n"
+        "  %zu Cases, %u Mutations, %u x %zu Bytes, %.1f ns per PDU.\n"
+        "\n",
+        CaseCount,
+        Mutations,
+        IterationCount,
+        Input.size(),
+        static_cast<double>(Elapsed) * 1000 / IterationCount);
+
+    return ERROR_SUCCESS;
+}
+
+// Measure the cost of recording a trace event without the drops, and the
+// Bulk profile with each chunk traced. The trace is written to the NUL device
+// for excluding the disk.
+DWORD SynthRdpBenchmarkTrace()
+{
+    const DWORD BatchCount = 64;
+
+    DWORD Error = ::SynthRdpBenchmarkRunProfile(
+        "Bulk",
+        SynthRdpBenchmarkTransport::TcpLoopback,
+        0,
+        0,
+        65536,
+        4096);
+    if (ERROR_SUCCESS != Error)
+    {
+        return Error;
+    }
+
+    Error = ::SynthRdpTraceStartup(
+        static_cast<DWORD>(SynthRdpTraceLevel::Verbose),
+        1,
+        L"NUL");
+    if (ERROR_SUCCESS != Error)
+    {
+        ::SynthRdpTraceCleanup();
+        return Error;
+    }
+
+    LONG64 Elapsed = 0;
+    for (DWORD i = 0; i < BatchCount; ++i)
+    {
+        // Each batch fills the ring, and the drainer thread empties it
+        // between the batches.
+        SynthRdpTraceRing* Ring = g_TraceThreadRing;
+        while (i && Ring->ReadPosition != Ring->WritePosition)
+        {
+            ::Sleep(1);
+        }
+
+        LONGLONG StartTime = ::SynthRdpStatisticsGetTimestamp();
+        for (std::size_t j = 0; j < SynthRdpTraceRingSize; ++j)
+        {
+            ::SynthRdpTraceWrite(
+                SynthRdpTraceLevel::Verbose,
+                SynthRdpTraceEventType::ChunkRead,
+                0,
+                static_cast<DWORD>(SynthRdpCaptureDirection::Vmbus2Tcp),
+                static_cast<DWORD>(j));
+        }
+        Elapsed += ::SynthRdpStatisticsGetElapsedTime(StartTime);
+    }
+
+    std::printf(
+        "Trace:\n"
+        "  %u x %zu Events, %.1f ns per event.\n"
+        "\n",
+        BatchCount,
+        SynthRdpTraceRingSize,
+        static_cast<double>(Elapsed) * 1000 /
+            (BatchCount * SynthRdpTraceRingSize));
+
+    Error = ::SynthRdpBenchmarkRunProfile(
+        "Bulk (Traced)",
+        SynthRdpBenchmarkTransport::TcpLoopback,
+        0,
+        0,
+        65536,
+        4096);
+
+    ::SynthRdpTraceCleanup();
+
+    return Error;
+}
+
+void SynthRdpBenchmarkCleanup()
+{
+    ::SynthRdpRelaySchedulerCleanup();
+
+    ::SynthRdpRelayCleanup();
+
+    ::SynthRdpTraceCleanup();
+
+    ::SynthRdpStatisticsCleanup();
+
+    ::SynthRdpConfigurationCleanup();
+
+    if (g_SessionsDrainedEvent)
+    {
+        ::CloseHandle(g_SessionsDrainedEvent);
+        g_SessionsDrainedEvent = nullptr;
+    }
+
+    if (g_ServiceStopEvent)
+    {
+        ::CloseHandle(g_ServiceStopEvent);
+        g_ServiceStopEvent = nullptr;
+    }
+
+    ::DeleteCriticalSection(&g_SessionLock);
+
+    ::WSACleanup();
+}
+
+// Start the relay in the current process with the stand-in endpoints, which
+// is shared by the Benchmark and Replay commands.
+DWORD SynthRdpBenchmarkStartup()
+{
+    WSADATA WSAData = { 0 };
+    {
+        int WSAError = ::WSAStartup(MAKEWORD(2, 2), &WSAData);
+        if (NO_ERROR != WSAError)
+        {
+            return WSAError;
+        }
+    }
+
+    DWORD Error = ERROR_SUCCESS;
+
+    ::InitializeCriticalSection(&g_SessionLock);
+
+    do
+    {
+        g_ServiceStopEvent = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
+        g_SessionsDrainedEvent = ::CreateEventW(nullptr, TRUE, TRUE, nullptr);
+        if (!g_ServiceStopEvent || !g_SessionsDrainedEvent)
+        {
+            Error = ::GetLastError();
+            break;
+        }
+
+        Error = ::SynthRdpConfigurationStartup(false);
+        if (ERROR_SUCCESS != Error)
+        {
+            break;
+        }
+
+        // Keep the statistics private to not disturb the running service.
+        Error = ::SynthRdpStatisticsStartup(false);
+        if (ERROR_SUCCESS != Error)
+        {
+            break;
+        }
+
+        Error = ::SynthRdpRelayStartup();
+        if (ERROR_SUCCESS != Error)
+        {
+            break;
+        }
+
+        // Only started if the Benchmark command simulates the slow links.
+        Error = ::SynthRdpRelaySchedulerStartup();
+        if (ERROR_SUCCESS != Error)
+        {
+            break;
+        }
+
+    } while (false);
+
+    if (ERROR_SUCCESS != Error)
+    {
+        ::SynthRdpBenchmarkCleanup();
+    }
+
+    return Error;
+}
+
+bool SynthRdpParseImpairment(
+    _In_ std::string const& List,
+    _Out_ SynthRdpRelayImpairment& Vmbus2Tcp,
+    _Out_ SynthRdpRelayImpairment& Tcp2Vmbus)
+{
+    Vmbus2Tcp = { 0 };
+    Tcp2Vmbus = { 0 };
+
+    // The format is "[Upstream.|Downstream.]Name=Value;...", and the value
+    // applies to both directions if the direction is not specified. Upstream
+    // is from the VMBus pipe to the server.
+    std::size_t Start = 0;
+    while (Start < List.size())
+    {
+        std::size_t End = List.find(';', Start);
+        if (std::string::npos == End)
+        {
+            End = List.size();
+        }
+        std::string Entry = List.substr(Start, End - Start);
+        Start = End + 1;
+
+        Entry.erase(0, Entry.find_first_not_of(" \t"));
+        Entry.erase(Entry.find_last_not_of(" \t") + 1);
+        if (Entry.empty())
+        {
+            continue;
+        }
+
+        std::size_t Separator = Entry.find('=');
+        if (std::string::npos == Separator)
+        {
+            return false;
+        }
+        std::string Name = Entry.substr(0, Separator);
+        std::string Value = Entry.substr(Separator + 1);
+
+        bool ApplyVmbus2Tcp = true;
+        bool ApplyTcp2Vmbus = true;
+        if (0 == ::_strnicmp(Name.c_str(), "Upstream.", 9))
+        {
+            ApplyTcp2Vmbus = false;
+            Name.erase(0, 9);
+        }
+        else if (0 == ::_strnicmp(Name.c_str(), "Downstream.", 11))
+        {
+            ApplyVmbus2Tcp = false;
+            Name.erase(0, 11);
+        }
+
+        char* ValueEnd = nullptr;
+        double Number = std::strtod(Value.c_str(), &ValueEnd);
+        if (Value.empty() ||
+            '\0' != *ValueEnd ||
+            !(Number >= 0.0) ||
+            Number > 4294967.0)
+        {
+            return false;
+        }
+
+        std::size_t Offset = 0;
+        DWORD Converted = static_cast<DWORD>(Number);
+        if (0 == ::_stricmp(Name.c_str(), "Latency"))
+        {
+            Offset = offsetof(SynthRdpRelayImpairment, Latency);
+        }
+        else if (0 == ::_stricmp(Name.c_str(), "Jitter"))
+        {
+            Offset = offsetof(SynthRdpRelayImpairment, Jitter);
+        }
+        else if (0 == ::_stricmp(Name.c_str(), "Bandwidth"))
+        {
+            // In kilobytes per second.
+            Offset = offsetof(SynthRdpRelayImpairment, Bandwidth);
+            Converted = static_cast<DWORD>(Number * 1024);
+        }
+        else if (0 == ::_stricmp(Name.c_str(), "Loss"))
+        {
+            // In percent.
+            if (Number > 100.0)
+            {
+                return false;
+            }
+            Offset = offsetof(SynthRdpRelayImpairment, LossRate);
+            Converted = static_cast<DWORD>(Number * 10000);
+        }
+        else if (0 == ::_stricmp(Name.c_str(), "StallInterval"))
+        {
+            Offset = offsetof(SynthRdpRelayImpairment, StallInterval);
+        }
+        else if (0 == ::_stricmp(Name.c_str(), "StallDuration"))
+        {
+            Offset = offsetof(SynthRdpRelayImpairment, StallDuration);
+        }
+        else
+        {
+            return false;
+        }
+
+        if (ApplyVmbus2Tcp)
+        {
+            *reinterpret_cast<DWORD*>(
+                reinterpret_cast<std::uint8_t*>(&Vmbus2Tcp) + Offset) =
+                Converted;
+        }
+        if (ApplyTcp2Vmbus)
+        {
+            *reinterpret_cast<DWORD*>(
+                reinterpret_cast<std::uint8_t*>(&Tcp2Vmbus) + Offset) =
+                Converted;
+        }
+    }
+
+    return true;
+}
+
+void SynthRdpBenchmarkPrintImpairment(
+    _In_ const char* Name,
+    _In_ SynthRdpRelayImpairment const& Impairment)
+{
+    std::printf(
+        "%s: %u ms latency, %u ms jitter, %u KB/s, %.4f%% loss, "
+        "%u/%u ms stall\n",
+        Name,
+        Impairment.Latency,
+        Impairment.Jitter,
+        Impairment.Bandwidth / 1024,
+        static_cast<double>(Impairment.LossRate) / 10000,
+        Impairment.StallDuration,
+        Impairment.StallInterval);
+}
+
+int SynthRdpBenchmark(
+    _In_ std::string const& Profile,
+    _In_ std::string const& Impairment)
+{
+    bool RunBulk = Profile.empty() || 0 == ::_stricmp(Profile.c_str(), "Bulk");
+    bool RunInteractive =
+        Profile.empty() || 0 == ::_stricmp(Profile.c_str(), "Interactive");
+    bool RunMixed = Profile.empty() || 0 == ::_stricmp(Profile.c_str(), "Mixed");
+    bool RunParser =
+        Profile.empty() || 0 == ::_stricmp(Profile.c_str(), "Parser");
+    // Only run if specified because AF_UNIX needs Windows 10 Version 1803 or
+    // later.
+    bool RunTransport = 0 == ::_stricmp(Profile.c_str(), "Transport");
+    // Only run if specified because it takes minutes with the slow links.
+    bool RunLinks = 0 == ::_stricmp(Profile.c_str(), "Links");
+    // Only run if specified because it runs the Bulk profile twice.
+    bool RunTrace = 0 == ::_stricmp(Profile.c_str(), "Trace");
+    if ((!RunBulk &&
+        !RunInteractive &&
+        !RunMixed &&
+        !RunParser &&
+        !RunTransport &&
+        !RunLinks &&
+        !RunTrace) ||
+        !::SynthRdpParseImpairment(
+            Impairment,
+            g_RelayVmbus2TcpImpairment,
+            g_RelayTcp2VmbusImpairment))
+    {
+        std::printf(
+            "[Error] SynthRdpBenchmark (%d)\n",
+            ERROR_INVALID_PARAMETER);
+        return ERROR_INVALID_PARAMETER;
+    }
+    g_RelayImpairmentEnabled = RunLinks || !Impairment.empty();
+
+    DWORD Error = ::SynthRdpBenchmarkStartup();
+    if (ERROR_SUCCESS != Error)
+    {
+        std::printf("[Error] SynthRdpBenchmark (%d)\n", Error);
+        return Error;
+    }
+
+    do
+    {
+        std::printf(
+            "Benchmark:\n"
+            "\n");
+
+        if (!Impairment.empty())
+        {
+            ::SynthRdpBenchmarkPrintImpairment(
+                "Upstream",
+                g_RelayVmbus2TcpImpairment);
+            ::SynthRdpBenchmarkPrintImpairment(
+                "Downstream",
+                g_RelayTcp2VmbusImpairment);
+            std::printf("\n");
+        }
+
+        if (RunParser)
+        {
+            Error = ::SynthRdpBenchmarkParser();
+            if (ERROR_SUCCESS != Error)
+            {
+                break;
+            }
+        }
+
+        if (RunBulk)
+        {
+            Error = ::SynthRdpBenchmarkRunProfile(
+                "Bulk",
+                SynthRdpBenchmarkTransport::TcpLoopback,
+                0,
+                0,
+                65536,
+                4096);
+            if (ERROR_SUCCESS != Error)
+            {
+                break;
+            }
+        }
+
+        if (RunInteractive)
+        {
+            Error = ::SynthRdpBenchmarkRunProfile(
+                "Interactive",
+                SynthRdpBenchmarkTransport::TcpLoopback,
+                64,
+                10000,
+                0,
+                0);
+            if (ERROR_SUCCESS != Error)
+            {
+                break;
+            }
+        }
+
+        if (RunMixed)
+        {
+            Error = ::SynthRdpBenchmarkRunProfile(
+                "Mixed",
+                SynthRdpBenchmarkTransport::TcpLoopback,
+                64,
+                10000,
+                65536,
+                4096);
+            if (ERROR_SUCCESS != Error)
+            {
+                break;
+            }
+        }
+
+        if (RunTransport)
+        {
+            // Run the Mixed profile via each transport to the local server,
+            // and continue with the next one if the transport is not
+            // supported.
+            const struct
+            {
+                const char* Name;
+                SynthRdpBenchmarkTransport Transport;
+            } Transports[] =
+            {
+                { "TCP Loopback", SynthRdpBenchmarkTransport::TcpLoopback },
+                {
+                    "Loopback Fast Path",
+                    SynthRdpBenchmarkTransport::LoopbackFastPath
+                },
+                { "AF_UNIX", SynthRdpBenchmarkTransport::UnixSocket },
+            };
+            for (auto const& Current : Transports)
+            {
+                DWORD TransportError = ::SynthRdpBenchmarkRunProfile(
+                    Current.Name,
+                    Current.Transport,
+                    64,
+                    10000,
+                    65536,
+                    4096);
+                if (ERROR_SUCCESS != TransportError)
+                {
+                    std::printf(
+                        "%s: Failed (%d).\n"
+                        "\n",
+                        Current.Name,
+                        TransportError);
+                }
+            }
+        }
+
+        if (RunTrace)
+        {
+            Error = ::SynthRdpBenchmarkTrace();
+            if (ERROR_SUCCESS != Error)
+            {
+                break;
+            }
+        }
+
+        if (RunLinks)
+        {
+            // Run the interactive input together with the bulk output over
+            // the typical links, and the impairment specified replaces the
+            // presets.
+            const struct
+            {
+                const char* Name;
+                const char* Impairment;
+            } Links[] =
+            {
+                { "LAN", "Latency=1" },
+                {
+                    "Broadband",
+                    "Latency=20;Jitter=5;"
+                    "Upstream.Bandwidth=1280;Downstream.Bandwidth=12800"
+                },
+                { "WAN", "Latency=80;Jitter=20;Bandwidth=2560;Loss=0.1" },
+                {
+                    "Lossy",
+                    "Latency=150;Jitter=50;Bandwidth=1024;Loss=1;"
+                    "StallInterval=10000;StallDuration=500"
+                },
+            };
+            for (auto const& Current : Links)
+            {
+                if (Impairment.empty())
+                {
+                    ::SynthRdpParseImpairment(
+                        Current.Impairment,
+                        g_RelayVmbus2TcpImpairment,
+                        g_RelayTcp2VmbusImpairment);
+                }
+                Error = ::SynthRdpBenchmarkRunProfile(
+                    Current.Name,
+                    SynthRdpBenchmarkTransport::TcpLoopback,
+                    64,
+                    50,
+                    65536,
+                    64);
+                if (ERROR_SUCCESS != Error)
+                {
+                    break;
+                }
+            }
+            if (ERROR_SUCCESS != Error)
+            {
+                break;
+            }
+        }
+
+    } while (false);
+
+    if (ERROR_SUCCESS != Error)
+    {
+        std::printf("[Error] SynthRdpBenchmark (%d)\n", Error);
+    }
+
+    ::SynthRdpBenchmarkCleanup();
+    g_RelayImpairmentEnabled = false;
+
+    return Error;
+}
+
+namespace
+{
+    std::wstring GetCurrentProcessModulePath()
+    {
+        // 32767 is the maximum path length without the terminating null
+        // character.
+        std::wstring Path(32767, L'\0');
+        Path.resize(::GetModuleFileNameW(
+            nullptr, &Path[0], static_cast<DWORD>(Path.size())));
+        return Path;
+    }
+
+    static std::wstring g_ServiceName =
+        L"SynthRdp";
+    static std::wstring g_DisplayName =
+        L"Hyper-V Enhanced Session Proxy Service";
+
+    static HANDLE g_ServiceMainFinishedEvent = nullptr;
+}
+
+void WINAPI SynthRdpServiceHandler(
+    _In_ DWORD dwControl)
+{
+    switch (dwControl)
+    {
+    case SERVICE_CONTROL_STOP:
+    {
+        SERVICE_STATUS ServiceStatus = { 0 };
+        ServiceStatus.dwServiceType = SERVICE_WIN32_OWN_PROCESS;
+        ServiceStatus.dwCurrentState = SERVICE_STOP_PENDING;
+        ServiceStatus.dwControlsAccepted = SERVICE_ACCEPT_STOP;
+        ServiceStatus.dwWin32ExitCode = ERROR_SUCCESS;
+        ServiceStatus.dwServiceSpecificExitCode = 0;
+        ServiceStatus.dwCheckPoint = 0;
+        ServiceStatus.dwWaitHint = 0;
+        ::SetServiceStatus(g_ServiceStatusHandle, &ServiceStatus);
+
+        ::SynthRdpRequestStop();
+
+        break;
+    }
+    case SynthRdpServiceControlHandoff:
+    {
+        // The service is reported as stopped after it is ready to hand off.
+        if (g_ServiceHandoffEvent)
+        {
+            ::SetEvent(g_ServiceHandoffEvent);
+        }
+
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+void WINAPI SynthRdpServiceMain(
+    _In_ DWORD dwNumServicesArgs,
+    _In_ LPWSTR* lpServiceArgVectors)
+{
+    UNREFERENCED_PARAMETER(dwNumServicesArgs);
+    UNREFERENCED_PARAMETER(lpServiceArgVectors);
+
+    g_ServiceStopEvent = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    g_ServiceHandoffEvent = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
+
+    g_ServiceStatusHandle = ::RegisterServiceCtrlHandlerW(
+        g_ServiceName.c_str(),
+        ::SynthRdpServiceHandler);
+    if (g_ServiceStatusHandle)
+    {
+        SERVICE_STATUS ServiceStatus = { 0 };
+        ServiceStatus.dwServiceType = SERVICE_WIN32_OWN_PROCESS;
+        ServiceStatus.dwCurrentState = SERVICE_RUNNING;
+        ServiceStatus.dwControlsAccepted = SERVICE_ACCEPT_STOP;
+        ServiceStatus.dwWin32ExitCode = ERROR_SUCCESS;
+        ServiceStatus.dwServiceSpecificExitCode = 0;
+        ServiceStatus.dwCheckPoint = 0;
+        ServiceStatus.dwWaitHint = 0;
+        if (::SetServiceStatus(g_ServiceStatusHandle, &ServiceStatus))
+        {
+            ::SynthRdpReportServiceStopped(::SynthRdpMain());
+        }
+    }
+
+    if (g_ServiceMainFinishedEvent)
+    {
+        ::SetEvent(g_ServiceMainFinishedEvent);
+    }
+}
+
+int SynthRdpInstallService()
+{
+    DWORD Error = ERROR_SUCCESS;
+
+    std::wstring ServiceBinaryPath =
+        ::GetCurrentProcessModulePath() + L" Service";
+
+    SC_HANDLE ServiceControlManagerHandle = ::OpenSCManagerW(
+        nullptr,
+        nullptr,
+        SC_MANAGER_CONNECT | SC_MANAGER_CREATE_SERVICE);
+    if (ServiceControlManagerHandle)
+    {
+        SC_HANDLE ServiceHandle = ::CreateServiceW(
+            ServiceControlManagerHandle,
+            g_ServiceName.c_str(),
+            g_DisplayName.c_str(),
+            SERVICE_QUERY_STATUS | SERVICE_START,
+            SERVICE_WIN32_OWN_PROCESS,
+            SERVICE_AUTO_START,
+            SERVICE_ERROR_NORMAL,
+            ServiceBinaryPath.c_str(),
+            nullptr,
+            nullptr,
+            nullptr,
+            nullptr,
+            nullptr);
+        if (ServiceHandle)
+        {
+            SERVICE_STATUS_PROCESS ServiceStatus = { 0 };
+            if (!::MileStartServiceByHandle(
+                ServiceHandle,
+                0,
+                nullptr,
+                &ServiceStatus))
+            {
+                Error = ::GetLastError();
+            }
+
+            ::CloseServiceHandle(ServiceHandle);
+        }
+        else
+        {
+            Error = ::GetLastError();
+        }
+
+        ::CloseServiceHandle(ServiceControlManagerHandle);
+    }
+    else
+    {
+        Error = ::GetLastError();
+    }
+
+    if (ERROR_SUCCESS == Error)
+    {
+        std::printf("[Success] SynthRdpInstallService\n");
+    }
+    else
+    {
+        std::printf("[Error] SynthRdpInstallService (%d)\n", Error);
+    }
+
+    return Error;
+}
+
+int SynthRdpUninstallService()
+{
+    DWORD Error = ERROR_SUCCESS;
+
+    SC_HANDLE ServiceControlManagerHandle = ::OpenSCManagerW(
+        nullptr,
+        nullptr,
+        SC_MANAGER_CONNECT);
+    if (ServiceControlManagerHandle)
+    {
+        SC_HANDLE ServiceHandle = ::OpenServiceW(
+            ServiceControlManagerHandle,
+            g_ServiceName.c_str(),
+            SERVICE_QUERY_STATUS | SERVICE_STOP | DELETE);
+        if (ServiceHandle)
+        {
+            SERVICE_STATUS_PROCESS ServiceStatus = { 0 };
+            if (::MileStopServiceByHandle(ServiceHandle, &ServiceStatus))
+            {
+                if (!::DeleteService(ServiceHandle))
+                {
+                    Error = ::GetLastError();
+                }
+            }
+            else
+            {
+                Error = ::GetLastError();
+            }
+
+            ::CloseServiceHandle(ServiceHandle);
+        }
+        else
+        {
+            Error = ::GetLastError();
+        }
+
+        ::CloseServiceHandle(ServiceControlManagerHandle);
+    }
+    else
+    {
+        Error = ::GetLastError();
+    }
+
+    if (ERROR_SUCCESS == Error)
+    {
+        std::printf("[Success] SynthRdpUninstallService\n");
+    }
+    else
+    {
+        std::printf("[Error] SynthRdpUninstallService (%d)\n", Error);
+    }
+
+    return Error;
+}
+
+int SynthRdpStartService()
+{
+    DWORD Error = ERROR_SUCCESS;
+
+    SERVICE_STATUS_PROCESS ServiceStatus = { 0 };
+    if (!::MileStartService(g_ServiceName.c_str(), &ServiceStatus))
+    {
+        Error = ::GetLastError();
+    }
+
+    if (ERROR_SUCCESS == Error)
+    {
+        std::printf("[Success] SynthRdpStartService\n");
+    }
+    else
+    {
+        std::printf("[Error] SynthRdpStartService (%d)\n", Error);
+    }
+
+    return Error;
+}
+
+int SynthRdpStopService()
+{
+    DWORD Error = ERROR_SUCCESS;
+
+    SERVICE_STATUS_PROCESS ServiceStatus = { 0 };
+    if (!::MileStopService(g_ServiceName.c_str(), &ServiceStatus))
+    {
+        Error = ::GetLastError();
+    }
+
+    if (ERROR_SUCCESS == Error)
+    {
+        std::printf("[Success] SynthRdpStopService\n");
+    }
+    else
+    {
+        std::printf("[Error] SynthRdpStopService (%d)\n", Error);
+    }
+
+    return Error;
+}
+
+int SynthRdpUpgradeService()
+{
+    DWORD Error = ERROR_SUCCESS;
+
+    std::wstring ServiceBinaryPath =
+        ::GetCurrentProcessModulePath() + L" Service";
+
+    SC_HANDLE ServiceControlManagerHandle = ::OpenSCManagerW(
+        nullptr,
+        nullptr,
+        SC_MANAGER_CONNECT);
+    if (ServiceControlManagerHandle)
+    {
+        SC_HANDLE ServiceHandle = ::OpenServiceW(
+            ServiceControlManagerHandle,
+            g_ServiceName.c_str(),
+            SERVICE_CHANGE_CONFIG |
+            SERVICE_QUERY_STATUS |
+            SERVICE_START |
+            SERVICE_USER_DEFINED_CONTROL);
+        if (ServiceHandle)
+        {
+            do
+            {
+                if (!::ChangeServiceConfigW(
+                    ServiceHandle,
+                    SERVICE_NO_CHANGE,
+                    SERVICE_NO_CHANGE,
+                    SERVICE_NO_CHANGE,
+                    ServiceBinaryPath.c_str(),
+                    nullptr,
+                    nullptr,
+                    nullptr,
+                    nullptr,
+                    nullptr,
+                    nullptr))
+                {
+                    Error = ::GetLastError();
+                    break;
+                }
+
+                SERVICE_STATUS_PROCESS ServiceStatus = { 0 };
+                DWORD BytesNeeded = 0;
+                if (!::QueryServiceStatusEx(
+                    ServiceHandle,
+                    SC_STATUS_PROCESS_INFO,
+                    reinterpret_cast<LPBYTE>(&ServiceStatus),
+                    sizeof(SERVICE_STATUS_PROCESS),
+                    &BytesNeeded))
+                {
+                    Error = ::GetLastError();
+                    break;
+                }
+
+                if (SERVICE_RUNNING == ServiceStatus.dwCurrentState)
+                {
+                    // The running instance keeps serving the sessions until
+                    // the new instance takes over them.
+                    SERVICE_STATUS ControlStatus = { 0 };
+                    if (!::ControlService(
+                        ServiceHandle,
+                        SynthRdpServiceControlHandoff,
+                        &ControlStatus))
+                    {
+                        Error = ::GetLastError();
+                        break;
+                    }
+
+                    DWORD StartTime = ::GetTickCount();
+                    while (SERVICE_STOPPED != ServiceStatus.dwCurrentState)
+                    {
+                        if (::GetTickCount() - StartTime >=
+                            SynthRdpHandoffTimeout)
+                        {
+                            Error = ERROR_TIMEOUT;
+                            break;
+                        }
+                        ::Sleep(100);
+                        if (!::QueryServiceStatusEx(
+                            ServiceHandle,
+                            SC_STATUS_PROCESS_INFO,
+                            reinterpret_cast<LPBYTE>(&ServiceStatus),
+                            sizeof(SERVICE_STATUS_PROCESS),
+                            &BytesNeeded))
+                        {
+                            Error = ::GetLastError();
+                            break;
+                        }
+                    }
+                    if (ERROR_SUCCESS != Error)
+                    {
+                        break;
+                    }
+                }
+
+                if (!::MileStartServiceByHandle(
+                    ServiceHandle,
+                    0,
+                    nullptr,
+                    &ServiceStatus))
+                {
+                    Error = ::GetLastError();
+                    break;
+                }
+
+            } while (false);
+
+            ::CloseServiceHandle(ServiceHandle);
+        }
+        else
+        {
+            Error = ::GetLastError();
+        }
+
+        ::CloseServiceHandle(ServiceControlManagerHandle);
+    }
+    else
+    {
+        Error = ::GetLastError();
+    }
+
+    if (ERROR_SUCCESS == Error)
+    {
+        std::printf("[Success] SynthRdpUpgradeService\n");
+    }
+    else
+    {
+        std::printf("[Error] SynthRdpUpgradeService (%d)\n", Error);
+    }
+
+    return Error;
+}
+
+int SynthRdpListConfigurations()
+{
+    DWORD Error = ERROR_SUCCESS;
+
+    DWORD Data = 0;
+    DWORD Length = 0;
+
+    bool DisableRemoteDesktop = false;
+    {
+        Data = 0;
+        Length = sizeof(DWORD);
+        Error = ::RegGetValueW(
+            HKEY_LOCAL_MACHINE,
+            L"SYSTEM\\CurrentControlSet\\Control\\Terminal Server",
+            L"fDenyTSConnections",
+            RRF_RT_REG_DWORD | RRF_SUBKEY_WOW6464KEY,
+            nullptr,
+            &Data,
+            &Length);
+        if (ERROR_SUCCESS == Error)
+        {
+            DisableRemoteDesktop = Data;
+        }
+    }
+
+    bool EnableUserAuthentication = true;
+    {
+        Data = 0;
+        Length = sizeof(DWORD);
+        Error = ::RegGetValueW(
+            HKEY_LOCAL_MACHINE,
+            L"SYSTEM\\CurrentControlSet\\Control\\Terminal Server\\"
+            L"WinStations\\RDP-Tcp",
+            L"UserAuthentication",
+            RRF_RT_REG_DWORD | RRF_SUBKEY_WOW6464KEY,
+            nullptr,
+            &Data,
+            &Length);
+        if (ERROR_SUCCESS == Error)
+        {
+            EnableUserAuthentication = Data;
+        }
+    }
+
+    bool DisableBlankPassword = false;
+    {
+        Data = 0;
+        Length = sizeof(DWORD);
+        Error = ::RegGetValueW(
+            HKEY_LOCAL_MACHINE,
+            L"SYSTEM\\CurrentControlSet\\Control\\Lsa",
+            L"LimitBlankPasswordUse",
+            RRF_RT_REG_DWORD | RRF_SUBKEY_WOW6464KEY,
+            nullptr,
+            &Data,
+            &Length);
+        if (ERROR_SUCCESS == Error)
+        {
+            DisableBlankPassword = Data;
+        }
+    }
+
+    bool OverrideSystemImplementation = false;
+    {
+        Data = 0;
+        Length = sizeof(DWORD);
+        Error = ::RegGetValueW(
+            HKEY_LOCAL_MACHINE,
+            L"SOFTWARE\\Microsoft\\Virtual Machine\\Guest",
+            L"DisableEnhancedSessionConsoleConnection",
+            RRF_RT_REG_DWORD | RRF_SUBKEY_WOW6464KEY,
+            nullptr,
+            &Data,
+            &Length);
+        if (ERROR_SUCCESS == Error)
+        {
+            OverrideSystemImplementation = Data;
+        }
+    }
+
+    std::string ServerHost = "127.0.0.1";
+    {
+        std::wstring Buffer(32767, L'\0');
+
+        Length = static_cast<DWORD>(Buffer.size());
+        Error = ::RegGetValueW(
+            HKEY_LOCAL_MACHINE,
+            L"SYSTEM\\CurrentControlSet\\Services\\"
+            L"SynthRdp\\Configurations",
+            L"ServerHost",
+            RRF_RT_REG_SZ | RRF_SUBKEY_WOW6464KEY,
+            nullptr,
+            const_cast<wchar_t*>(Buffer.c_str()),
+            &Length);
+        if (ERROR_SUCCESS == Error)
+        {
+            Buffer.resize(std::wcslen(Buffer.c_str()));
+            ServerHost = Mile::ToString(CP_UTF8, Buffer);
+        }
+    }
+
+    std::uint16_t ServerPort = 3389;
+    {
+        Data = 0;
+        Length = sizeof(DWORD);
+        Error = ::RegGetValueW(
+            HKEY_LOCAL_MACHINE,
+            L"SYSTEM\\CurrentControlSet\\Services\\"
+            L"SynthRdp\\Configurations",
+            L"ServerPort",
+            RRF_RT_REG_DWORD | RRF_SUBKEY_WOW6464KEY,
+            nullptr,
+            &Data,
+            &Length);
+        if (ERROR_SUCCESS == Error)
+        {
+            ServerPort = static_cast<std::uint16_t>(Data);
+        }
+    }
+
+    DWORD MaximumSessions = 16;
+    {
+        Data = 0;
+        Length = sizeof(DWORD);
+        Error = ::RegGetValueW(
+            HKEY_LOCAL_MACHINE,
+            L"SYSTEM\\CurrentControlSet\\Services\\"
+            L"SynthRdp\\Configurations",
+            L"MaximumSessions",
+            RRF_RT_REG_DWORD | RRF_SUBKEY_WOW6464KEY,
+            nullptr,
+            &Data,
+            &Length);
+        if (ERROR_SUCCESS == Error)
+        {
+            MaximumSessions = Data;
+        }
+    }
+
+    bool TcpNoDelay = true;
+    {
+        Data = 0;
+        Length = sizeof(DWORD);
+        Error = ::RegGetValueW(
+            HKEY_LOCAL_MACHINE,
+            L"SYSTEM\\CurrentControlSet\\Services\\"
+            L"SynthRdp\\Configurations",
+            L"TcpNoDelay",
+            RRF_RT_REG_DWORD | RRF_SUBKEY_WOW6464KEY,
+            nullptr,
+            &Data,
+            &Length);
+        if (ERROR_SUCCESS == Error)
+        {
+            TcpNoDelay = Data;
+        }
+    }
+
+    DWORD ConnectionPoolSize = 0;
+    {
+        Data = 0;
+        Length = sizeof(DWORD);
+        Error = ::RegGetValueW(
+            HKEY_LOCAL_MACHINE,
+            L"SYSTEM\\CurrentControlSet\\Services\\"
+            L"SynthRdp\\Configurations",
+            L"ConnectionPoolSize",
+            RRF_RT_REG_DWORD | RRF_SUBKEY_WOW6464KEY,
+            nullptr,
+            &Data,
+            &Length);
+        if (ERROR_SUCCESS == Error)
+        {
+            ConnectionPoolSize = Data;
+        }
+    }
+
+    DWORD ConnectTimeout = 10000;
+    {
+        Data = 0;
+        Length = sizeof(DWORD);
+        Error = ::RegGetValueW(
+            HKEY_LOCAL_MACHINE,
+            L"SYSTEM\\CurrentControlSet\\Services\\"
+            L"SynthRdp\\Configurations",
+            L"ConnectTimeout",
+            RRF_RT_REG_DWORD | RRF_SUBKEY_WOW6464KEY,
+            nullptr,
+            &Data,
+            &Length);
+        if (ERROR_SUCCESS == Error)
+        {
+            ConnectTimeout = Data;
+        }
+    }
+
+    std::string Backends = "";
+    {
+        std::wstring Buffer(32767, L'\0');
+
+        Length = static_cast<DWORD>(Buffer.size());
+        Error = ::RegGetValueW(
+            HKEY_LOCAL_MACHINE,
+            L"SYSTEM\\CurrentControlSet\\Services\\"
+            L"SynthRdp\\Configurations",
+            L"Backends",
+            RRF_RT_REG_SZ | RRF_SUBKEY_WOW6464KEY,
+            nullptr,
+            const_cast<wchar_t*>(Buffer.c_str()),
+            &Length);
+        if (ERROR_SUCCESS == Error)
+        {
+            Buffer.resize(std::wcslen(Buffer.c_str()));
+            Backends = Mile::ToString(CP_UTF8, Buffer);
+        }
+    }
+
+    std::string BalancingPolicy = "LeastSessions";
+    {
+        std::wstring Buffer(32767, L'\0');
+
+        Length = static_cast<DWORD>(Buffer.size());
+        Error = ::RegGetValueW(
+            HKEY_LOCAL_MACHINE,
+            L"SYSTEM\\CurrentControlSet\\Services\\"
+            L"SynthRdp\\Configurations",
+            L"BalancingPolicy",
+            RRF_RT_REG_SZ | RRF_SUBKEY_WOW6464KEY,
+            nullptr,
+            const_cast<wchar_t*>(Buffer.c_str()),
+            &Length);
+        if (ERROR_SUCCESS == Error)
+        {
+            Buffer.resize(std::wcslen(Buffer.c_str()));
+            BalancingPolicy = Mile::ToString(CP_UTF8, Buffer);
+        }
+    }
+
+    DWORD BackendProbeInterval = SynthRdpDefaultBackendProbeInterval;
+    {
+        Data = 0;
+        Length = sizeof(DWORD);
+        Error = ::RegGetValueW(
+            HKEY_LOCAL_MACHINE,
+            L"SYSTEM\\CurrentControlSet\\Services\\"
+            L"SynthRdp\\Configurations",
+            L"BackendProbeInterval",
+            RRF_RT_REG_DWORD | RRF_SUBKEY_WOW6464KEY,
+            nullptr,
+            &Data,
+            &Length);
+        if (ERROR_SUCCESS == Error)
+        {
+            BackendProbeInterval = Data;
+        }
+    }
+
+    bool PduFraming = false;
+    {
+        Data = 0;
+        Length = sizeof(DWORD);
+        Error = ::RegGetValueW(
+            HKEY_LOCAL_MACHINE,
+            L"SYSTEM\\CurrentControlSet\\Services\\"
+            L"SynthRdp\\Configurations",
+            L"PduFraming",
+            RRF_RT_REG_DWORD | RRF_SUBKEY_WOW6464KEY,
+            nullptr,
+            &Data,
+            &Length);
+        if (ERROR_SUCCESS == Error)
+        {
+            PduFraming = Data;
+        }
+    }
+
+    std::string CaptureFile = "";
+    {
+        std::wstring Buffer(32767, L'\0');
+
+        Length = static_cast<DWORD>(Buffer.size());
+        Error = ::RegGetValueW(
+            HKEY_LOCAL_MACHINE,
+            L"SYSTEM\\CurrentControlSet\\Services\\"
+            L"SynthRdp\\Configurations",
+            L"CaptureFile",
+            RRF_RT_REG_SZ | RRF_SUBKEY_WOW6464KEY,
+            nullptr,
+            const_cast<wchar_t*>(Buffer.c_str()),
+            &Length);
+        if (ERROR_SUCCESS == Error)
+        {
+            Buffer.resize(std::wcslen(Buffer.c_str()));
+            CaptureFile = Mile::ToString(CP_UTF8, Buffer);
+        }
+    }
+    DWORD CaptureSize = SynthRdpCaptureDefaultSize;
+    {
+        Data = 0;
+        Length = sizeof(DWORD);
+        Error = ::RegGetValueW(
+            HKEY_LOCAL_MACHINE,
+            L"SYSTEM\\CurrentControlSet\\Services\\"
+            L"SynthRdp\\Configurations",
+            L"CaptureSize",
+            RRF_RT_REG_DWORD | RRF_SUBKEY_WOW6464KEY,
+            nullptr,
+            &Data,
+            &Length);
+        if (ERROR_SUCCESS == Error)
+        {
+            CaptureSize = Data;
+        }
+    }
+
+    DWORD QueueHighWatermark = SynthRdpRelayDefaultHighWatermark;
+    {
+        Data = 0;
+        Length = sizeof(DWORD);
+        Error = ::RegGetValueW(
+            HKEY_LOCAL_MACHINE,
+            L"SYSTEM\\CurrentControlSet\\Services\\"
+            L"SynthRdp\\Configurations",
+            L"QueueHighWatermark",
+            RRF_RT_REG_DWORD | RRF_SUBKEY_WOW6464KEY,
+            nullptr,
+            &Data,
+            &Length);
+        if (ERROR_SUCCESS == Error)
+        {
+            QueueHighWatermark = Data;
+        }
+    }
+
+    DWORD QueueLowWatermark = SynthRdpRelayDefaultLowWatermark;
+    {
+        Data = 0;
+        Length = sizeof(DWORD);
+        Error = ::RegGetValueW(
+            HKEY_LOCAL_MACHINE,
+            L"SYSTEM\\CurrentControlSet\\Services\\"
+            L"SynthRdp\\Configurations",
+            L"QueueLowWatermark",
+            RRF_RT_REG_DWORD | RRF_SUBKEY_WOW6464KEY,
+            nullptr,
+            &Data,
+            &Length);
+        if (ERROR_SUCCESS == Error)
+        {
+            QueueLowWatermark = Data;
+        }
+    }
+
+    DWORD KeepAliveTime = SynthRdpDefaultKeepAliveTime;
+    {
+        Data = 0;
+        Length = sizeof(DWORD);
+        Error = ::RegGetValueW(
+            HKEY_LOCAL_MACHINE,
+            L"SYSTEM\\CurrentControlSet\\Services\\"
+            L"SynthRdp\\Configurations",
+            L"KeepAliveTime",
+            RRF_RT_REG_DWORD | RRF_SUBKEY_WOW6464KEY,
+            nullptr,
+            &Data,
+            &Length);
+        if (ERROR_SUCCESS == Error)
+        {
+            KeepAliveTime = Data;
+        }
+    }
+
+    DWORD KeepAliveInterval = SynthRdpDefaultKeepAliveInterval;
+    {
+        Data = 0;
+        Length = sizeof(DWORD);
+        Error = ::RegGetValueW(
+            HKEY_LOCAL_MACHINE,
+            L"SYSTEM\\CurrentControlSet\\Services\\"
+            L"SynthRdp\\Configurations",
+            L"KeepAliveInterval",
+            RRF_RT_REG_DWORD | RRF_SUBKEY_WOW6464KEY,
+            nullptr,
+            &Data,
+            &Length);
+        if (ERROR_SUCCESS == Error)
+        {
+            KeepAliveInterval = Data;
+        }
+    }
+
+    DWORD IdleTimeout = 0;
+    {
+        Data = 0;
+        Length = sizeof(DWORD);
+        Error = ::RegGetValueW(
+            HKEY_LOCAL_MACHINE,
+            L"SYSTEM\\CurrentControlSet\\Services\\"
+            L"SynthRdp\\Configurations",
+            L"IdleTimeout",
+            RRF_RT_REG_DWORD | RRF_SUBKEY_WOW6464KEY,
+            nullptr,
+            &Data,
+            &Length);
+        if (ERROR_SUCCESS == Error)
+        {
+            IdleTimeout = Data;
+        }
+    }
+
+    DWORD StallTimeout = SynthRdpRelayDefaultStallTimeout;
+    {
+        Data = 0;
+        Length = sizeof(DWORD);
+        Error = ::RegGetValueW(
+            HKEY_LOCAL_MACHINE,
+            L"SYSTEM\\CurrentControlSet\\Services\\"
+            L"SynthRdp\\Configurations",
+            L"StallTimeout",
+            RRF_RT_REG_DWORD | RRF_SUBKEY_WOW6464KEY,
+            nullptr,
+            &Data,
+            &Length);
+        if (ERROR_SUCCESS == Error)
+        {
+            StallTimeout = Data;
+        }
+    }
+
+    std::string Forwards = "";
+    {
+        std::wstring Buffer(32767, L'\0');
+
+        Length = static_cast<DWORD>(Buffer.size());
+        Error = ::RegGetValueW(
+            HKEY_LOCAL_MACHINE,
+            L"SYSTEM\\CurrentControlSet\\Services\\"
+            L"SynthRdp\\Configurations",
+            L"Forwards",
+            RRF_RT_REG_SZ | RRF_SUBKEY_WOW6464KEY,
+            nullptr,
+            const_cast<wchar_t*>(Buffer.c_str()),
+            &Length);
+        if (ERROR_SUCCESS == Error)
+        {
+            Buffer.resize(std::wcslen(Buffer.c_str()));
+            Forwards = Mile::ToString(CP_UTF8, Buffer);
+        }
+    }
+    bool LoopbackFastPath = false;
+    {
+        Data = 0;
+        Length = sizeof(DWORD);
+        Error = ::RegGetValueW(
+            HKEY_LOCAL_MACHINE,
+            L"SYSTEM\\CurrentControlSet\\Services\\"
+            L"SynthRdp\\Configurations",
+            L"LoopbackFastPath",
+            RRF_RT_REG_DWORD | RRF_SUBKEY_WOW6464KEY,
+            nullptr,
+            &Data,
+            &Length);
+        if (ERROR_SUCCESS == Error)
+        {
+            LoopbackFastPath = Data;
+        }
+    }
+
+    DWORD SessionBandwidth = 0;
+    {
+        Data = 0;
+        Length = sizeof(DWORD);
+        Error = ::RegGetValueW(
+            HKEY_LOCAL_MACHINE,
+            L"SYSTEM\\CurrentControlSet\\Services\\"
+            L"SynthRdp\\Configurations",
+            L"SessionBandwidth",
+            RRF_RT_REG_DWORD | RRF_SUBKEY_WOW6464KEY,
+            nullptr,
+            &Data,
+            &Length);
+        if (ERROR_SUCCESS == Error)
+        {
+            SessionBandwidth = Data;
+        }
+    }
+
+    DWORD SessionBurst = 256;
+    {
+        Data = 0;
+        Length = sizeof(DWORD);
+        Error = ::RegGetValueW(
+            HKEY_LOCAL_MACHINE,
+            L"SYSTEM\\CurrentControlSet\\Services\\"
+            L"SynthRdp\\Configurations",
+            L"SessionBurst",
+            RRF_RT_REG_DWORD | RRF_SUBKEY_WOW6464KEY,
+            nullptr,
+            &Data,
+            &Length);
+        if (ERROR_SUCCESS == Error)
+        {
+            SessionBurst = Data;
+        }
+    }
+
+    DWORD TotalBandwidth = 0;
+    {
+        Data = 0;
+        Length = sizeof(DWORD);
+        Error = ::RegGetValueW(
+            HKEY_LOCAL_MACHINE,
+            L"SYSTEM\\CurrentControlSet\\Services\\"
+            L"SynthRdp\\Configurations",
+            L"TotalBandwidth",
+            RRF_RT_REG_DWORD | RRF_SUBKEY_WOW6464KEY,
+            nullptr,
+            &Data,
+            &Length);
+        if (ERROR_SUCCESS == Error)
+        {
+            TotalBandwidth = Data;
+        }
+    }
+
+    DWORD TraceLevel = 1;
+    {
+        Data = 0;
+        Length = sizeof(DWORD);
+        Error = ::RegGetValueW(
+            HKEY_LOCAL_MACHINE,
+            L"SYSTEM\\CurrentControlSet\\Services\\"
+            L"SynthRdp\\Configurations",
+            L"TraceLevel",
+            RRF_RT_REG_DWORD | RRF_SUBKEY_WOW6464KEY,
+            nullptr,
+            &Data,
+            &Length);
+        if (ERROR_SUCCESS == Error)
+        {
+            TraceLevel = Data;
+        }
+    }
+
+    DWORD TraceSampling = 1;
+    {
+        Data = 0;
+        Length = sizeof(DWORD);
+        Error = ::RegGetValueW(
+            HKEY_LOCAL_MACHINE,
+            L"SYSTEM\\CurrentControlSet\\Services\\"
+            L"SynthRdp\\Configurations",
+            L"TraceSampling",
+            RRF_RT_REG_DWORD | RRF_SUBKEY_WOW6464KEY,
+            nullptr,
+            &Data,
+            &Length);
+        if (ERROR_SUCCESS == Error)
+        {
+            TraceSampling = Data;
+        }
+    }
+
+    std::string TraceFile = "";
+    {
+        std::wstring Buffer(32767, L'\0');
+
+        Length = static_cast<DWORD>(Buffer.size());
+        Error = ::RegGetValueW(
+            HKEY_LOCAL_MACHINE,
+            L"SYSTEM\\CurrentControlSet\\Services\\"
+            L"SynthRdp\\Configurations",
+            L"TraceFile",
+            RRF_RT_REG_SZ | RRF_SUBKEY_WOW6464KEY,
+            nullptr,
+            const_cast<wchar_t*>(Buffer.c_str()),
+            &Length);
+        if (ERROR_SUCCESS == Error)
+        {
+            Buffer.resize(std::wcslen(Buffer.c_str()));
+            TraceFile = Mile::ToString(CP_UTF8, Buffer);
+        }
+    }
+    std::printf(
+        "Configurations:\n"
+        "\n"
+        "DisableRemoteDesktop: %s\n"
+        "EnableUserAuthentication: %s\n"
+        "DisableBlankPassword: %s\n"
+        "OverrideSystemImplementation: %s\n"
+        "ServerHost: %s\n"
+        "ServerPort: %hu\n"
+        "MaximumSessions: %u\n"
+        "TcpNoDelay: %s\n"
+        "ConnectionPoolSize: %u\n"
+        "ConnectTimeout: %u\n"
+        "Backends: %s\n"
+        "BalancingPolicy: %s\n"
+        "BackendProbeInterval: %u\n"
+        "PduFraming: %s\n"
+        "CaptureFile: %s\n"
+        "CaptureSize: %u\n"
+        "QueueHighWatermark: %u\n"
+        "QueueLowWatermark: %u\n"
+        "KeepAliveTime: %u\n"
+        "KeepAliveInterval: %u\n"
+        "IdleTimeout: %u\n"
+        "StallTimeout: %u\n"
+        "Forwards: %s\n"
+        "LoopbackFastPath: %s\n"
+        "SessionBandwidth: %u\n"
+        "SessionBurst: %u\n"
+        "TotalBandwidth: %u\n"
+        "TraceLevel: %u\n"
+        "TraceSampling: %u\n"
+        "TraceFile: %s\n"
+        "\n",
+        DisableRemoteDesktop ? "True" : "False",
+        EnableUserAuthentication ? "True" : "False",
+        DisableBlankPassword ? "True" : "False",
+        OverrideSystemImplementation ? "True" : "False",
+        ServerHost.c_str(),
+        ServerPort,
+        MaximumSessions,
+        TcpNoDelay ? "True" : "False",
+        ConnectionPoolSize,
+        ConnectTimeout,
+        Backends.c_str(),
+        BalancingPolicy.c_str(),
+        BackendProbeInterval,
+        PduFraming ? "True" : "False",
+        CaptureFile.c_str(),
+        CaptureSize,
+        QueueHighWatermark,
+        QueueLowWatermark,
+        KeepAliveTime,
+        KeepAliveInterval,
+        IdleTimeout,
+        StallTimeout,
+        Forwards.c_str(),
+        LoopbackFastPath ? "True" : "False",
+        SessionBandwidth,
+        SessionBurst,
+        TotalBandwidth,
+        TraceLevel,
+        TraceSampling,
+        TraceFile.c_str());
+
+    return Error;
+}
+
+int SynthRdpUpdateConfiguration(
+    std::string const& Key,
+    std::string const& Value)
+{
+    DWORD Error = ERROR_SUCCESS;
+
+    if (0 == ::_stricmp(Key.c_str(), "DisableRemoteDesktop"))
+    {
+        DWORD Data = 1;
+        if (Value.empty() ||
+            0 == ::_stricmp(Value.c_str(), "True"))
+        {
+            // Use the default value.
+        }
+        else if (0 == ::_stricmp(Value.c_str(), "False"))
+        {
+            Data = 0;
+        }
+        else
+        {
+            Error = ERROR_INVALID_PARAMETER;
+        }
+
+        if (ERROR_SUCCESS == Error)
+        {
+            Error = ::RegSetKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Control\\Terminal Server",
+                L"fDenyTSConnections",
+                REG_DWORD,
+                &Data,
+                sizeof(DWORD));
+        }
+    }
+    else if (0 == ::_stricmp(Key.c_str(), "EnableUserAuthentication"))
+    {
+        DWORD Data = 1;
+        if (Value.empty() ||
+            0 == ::_stricmp(Value.c_str(), "True"))
+        {
+            // Use the default value.
+        }
+        else if (0 == ::_stricmp(Value.c_str(), "False"))
+        {
+            Data = 0;
+        }
+        else
+        {
+            Error = ERROR_INVALID_PARAMETER;
+        }
+
+        if (ERROR_SUCCESS == Error)
+        {
+            Error = ::RegSetKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Control\\Terminal Server\\"
+                L"WinStations\\RDP-Tcp",
+                L"UserAuthentication",
+                REG_DWORD,
+                &Data,
+                sizeof(DWORD));
+        }
+    }
+    else if (0 == ::_stricmp(Key.c_str(), "DisableBlankPassword"))
+    {
+        DWORD Data = 1;
+        if (Value.empty() ||
+            0 == ::_stricmp(Value.c_str(), "True"))
+        {
+            // Use the default value.
+        }
+        else if (0 == ::_stricmp(Value.c_str(), "False"))
+        {
+            Data = 0;
+        }
+        else
+        {
+            Error = ERROR_INVALID_PARAMETER;
+        }
+
+        if (ERROR_SUCCESS == Error)
+        {
+            Error = ::RegSetKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Control\\Lsa",
+                L"LimitBlankPasswordUse",
+                REG_DWORD,
+                &Data,
+                sizeof(DWORD));
+        }
+    }
+    else if (0 == ::_stricmp(Key.c_str(), "OverrideSystemImplementation"))
+    {
+        if (Value.empty() ||
+            0 == ::_stricmp(Value.c_str(), "False"))
+        {
+            Error = ::RegDeleteKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SOFTWARE\\Microsoft\\Virtual Machine\\Guest",
+                L"DisableEnhancedSessionConsoleConnection");
+        }
+        else if (0 == ::_stricmp(Value.c_str(), "True"))
+        {
+            DWORD Data = 1;
+            Error = ::RegSetKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SOFTWARE\\Microsoft\\Virtual Machine\\Guest",
+                L"DisableEnhancedSessionConsoleConnection",
+                REG_DWORD,
+                &Data,
+                sizeof(DWORD));
+        }
+        else
+        {
+            Error = ERROR_INVALID_PARAMETER;
+        }
+    }
+    else if (0 == ::_stricmp(Key.c_str(), "ServerHost"))
+    {
+        if (Value.empty())
+        {
+            Error = ::RegDeleteKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\"
+                L"SynthRdp\\Configurations",
+                L"ServerHost");
+        }
+        else
+        {
+            std::wstring ServerHost = Mile::ToWideString(CP_UTF8, Value);
+
+            Error = ::RegSetKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\"
+                L"SynthRdp\\Configurations",
+                L"ServerHost",
+                REG_SZ,
+                ServerHost.c_str(),
+                static_cast<DWORD>((ServerHost.size() + 1) * sizeof(wchar_t)));
+        }
+    }
+    else if (0 == ::_stricmp(Key.c_str(), "Backends"))
+    {
+        if (Value.empty())
+        {
+            Error = ::RegDeleteKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\"
+                L"SynthRdp\\Configurations",
+                L"Backends");
+        }
+        else
+        {
+            std::wstring Backends = Mile::ToWideString(CP_UTF8, Value);
+
+            Error = ::RegSetKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\"
+                L"SynthRdp\\Configurations",
+                L"Backends",
+                REG_SZ,
+                Backends.c_str(),
+                static_cast<DWORD>((Backends.size() + 1) * sizeof(wchar_t)));
+        }
+    }
+    else if (0 == ::_stricmp(Key.c_str(), "BalancingPolicy"))
+    {
+        if (Value.empty() ||
+            0 == ::_stricmp(Value.c_str(), "LeastSessions"))
+        {
+            Error = ::RegDeleteKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\"
+                L"SynthRdp\\Configurations",
+                L"BalancingPolicy");
+        }
+        else if (0 == ::_stricmp(Value.c_str(), "Weighted"))
+        {
+            std::wstring BalancingPolicy = L"Weighted";
+
+            Error = ::RegSetKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\"
+                L"SynthRdp\\Configurations",
+                L"BalancingPolicy",
+                REG_SZ,
+                BalancingPolicy.c_str(),
+                static_cast<DWORD>(
+                    (BalancingPolicy.size() + 1) * sizeof(wchar_t)));
+        }
+        else
+        {
+            Error = ERROR_INVALID_PARAMETER;
+        }
+    }
+    else if (0 == ::_stricmp(Key.c_str(), "BackendProbeInterval"))
+    {
+        if (Value.empty())
+        {
+            Error = ::RegDeleteKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
+                L"BackendProbeInterval");
+        }
+        else
+        {
+            DWORD Data = Mile::ToUInt32(Value);
+            Error = ::RegSetKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
+                L"BackendProbeInterval",
+                REG_DWORD,
+                &Data,
+                sizeof(DWORD));
+        }
+    }
+    else if (0 == ::_stricmp(Key.c_str(), "ServerPort"))
+    {
+        if (Value.empty())
+        {
+            Error = ::RegDeleteKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
+                L"ServerPort");
+        }
+        else
+        {
+            DWORD Data = static_cast<std::uint16_t>(Mile::ToUInt32(Value));
+            Error = ::RegSetKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
+                L"ServerPort",
+                REG_DWORD,
+                &Data,
+                sizeof(DWORD));
+        }
+    }
+    else if (0 == ::_stricmp(Key.c_str(), "MaximumSessions"))
+    {
+        if (Value.empty())
+        {
+            Error = ::RegDeleteKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
+                L"MaximumSessions");
+        }
+        else
+        {
+            DWORD Data = Mile::ToUInt32(Value);
+            Error = ::RegSetKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
+                L"MaximumSessions",
+                REG_DWORD,
+                &Data,
+                sizeof(DWORD));
+        }
+    }
+    else if (0 == ::_stricmp(Key.c_str(), "ConnectionPoolSize"))
+    {
+        if (Value.empty())
+        {
+            Error = ::RegDeleteKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
+                L"ConnectionPoolSize");
+        }
+        else
+        {
+            DWORD Data = Mile::ToUInt32(Value);
+            Error = ::RegSetKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
+                L"ConnectionPoolSize",
+                REG_DWORD,
+                &Data,
+                sizeof(DWORD));
+        }
+    }
+    else if (0 == ::_stricmp(Key.c_str(), "ConnectTimeout"))
+    {
+        if (Value.empty())
+        {
+            Error = ::RegDeleteKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
+                L"ConnectTimeout");
+        }
+        else
+        {
+            DWORD Data = Mile::ToUInt32(Value);
+            Error = ::RegSetKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
+                L"ConnectTimeout",
+                REG_DWORD,
+                &Data,
+                sizeof(DWORD));
+        }
+    }
+    else if (0 == ::_stricmp(Key.c_str(), "PduFraming"))
+    {
+        if (Value.empty() ||
+            0 == ::_stricmp(Value.c_str(), "False"))
+        {
+            Error = ::RegDeleteKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
+                L"PduFraming");
+        }
+        else if (0 == ::_stricmp(Value.c_str(), "True"))
+        {
+            DWORD Data = 1;
+            Error = ::RegSetKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
+                L"PduFraming",
+                REG_DWORD,
+                &Data,
+                sizeof(DWORD));
+        }
+        else
+        {
+            Error = ERROR_INVALID_PARAMETER;
+        }
+    }
+    else if (0 == ::_stricmp(Key.c_str(), "CaptureFile"))
+    {
+        if (Value.empty())
+        {
+            Error = ::RegDeleteKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\"
+                L"SynthRdp\\Configurations",
+                L"CaptureFile");
+        }
+        else
+        {
+            std::wstring CaptureFile = Mile::ToWideString(CP_UTF8, Value);
+
+            Error = ::RegSetKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\"
+                L"SynthRdp\\Configurations",
+                L"CaptureFile",
+                REG_SZ,
+                CaptureFile.c_str(),
+                static_cast<DWORD>(
+                    (CaptureFile.size() + 1) * sizeof(wchar_t)));
+        }
+    }
+    else if (0 == ::_stricmp(Key.c_str(), "CaptureSize"))
+    {
+        if (Value.empty())
+        {
+            Error = ::RegDeleteKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
+                L"CaptureSize");
+        }
+        else
+        {
+            DWORD Data = Mile::ToUInt32(Value);
+            Error = ::RegSetKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
+                L"CaptureSize",
+                REG_DWORD,
+                &Data,
+                sizeof(DWORD));
+        }
+    }
+    else if (0 == ::_stricmp(Key.c_str(), "QueueHighWatermark"))
+    {
+        if (Value.empty())
+        {
+            Error = ::RegDeleteKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
+                L"QueueHighWatermark");
+        }
+        else
+        {
+            DWORD Data = Mile::ToUInt32(Value);
+            Error = ::RegSetKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
+                L"QueueHighWatermark",
+                REG_DWORD,
+                &Data,
+                sizeof(DWORD));
+        }
+    }
+    else if (0 == ::_stricmp(Key.c_str(), "QueueLowWatermark"))
+    {
+        if (Value.empty())
+        {
+            Error = ::RegDeleteKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
+                L"QueueLowWatermark");
+        }
+        else
+        {
+            DWORD Data = Mile::ToUInt32(Value);
+            Error = ::RegSetKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
+                L"QueueLowWatermark",
+                REG_DWORD,
+                &Data,
+                sizeof(DWORD));
+        }
+    }
+    else if (0 == ::_stricmp(Key.c_str(), "KeepAliveTime"))
+    {
+        if (Value.empty())
+        {
+            Error = ::RegDeleteKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
+                L"KeepAliveTime");
+        }
+        else
+        {
+            DWORD Data = Mile::ToUInt32(Value);
+            Error = ::RegSetKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
+                L"KeepAliveTime",
+                REG_DWORD,
+                &Data,
+                sizeof(DWORD));
+        }
+    }
+    else if (0 == ::_stricmp(Key.c_str(), "KeepAliveInterval"))
+    {
+        if (Value.empty())
+        {
+            Error = ::RegDeleteKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
+                L"KeepAliveInterval");
+        }
+        else
+        {
+            DWORD Data = Mile::ToUInt32(Value);
+            Error = ::RegSetKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
+                L"KeepAliveInterval",
+                REG_DWORD,
+                &Data,
+                sizeof(DWORD));
+        }
+    }
+    else if (0 == ::_stricmp(Key.c_str(), "IdleTimeout"))
+    {
+        if (Value.empty())
+        {
+            Error = ::RegDeleteKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
+                L"IdleTimeout");
+        }
+        else
+        {
+            DWORD Data = Mile::ToUInt32(Value);
+            Error = ::RegSetKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
+                L"IdleTimeout",
+                REG_DWORD,
+                &Data,
+                sizeof(DWORD));
+        }
+    }
+    else if (0 == ::_stricmp(Key.c_str(), "StallTimeout"))
+    {
+        if (Value.empty())
+        {
+            Error = ::RegDeleteKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
+                L"StallTimeout");
+        }
+        else
+        {
+            DWORD Data = Mile::ToUInt32(Value);
+            Error = ::RegSetKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
+                L"StallTimeout",
+                REG_DWORD,
+                &Data,
+                sizeof(DWORD));
+        }
+    }
+    else if (0 == ::_stricmp(Key.c_str(), "Forwards"))
+    {
+        if (Value.empty())
+        {
+            Error = ::RegDeleteKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\"
+                L"SynthRdp\\Configurations",
+                L"Forwards");
+        }
+        else
+        {
+            std::wstring Forwards = Mile::ToWideString(CP_UTF8, Value);
+
+            Error = ::RegSetKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\"
+                L"SynthRdp\\Configurations",
+                L"Forwards",
+                REG_SZ,
+                Forwards.c_str(),
+                static_cast<DWORD>((Forwards.size() + 1) * sizeof(wchar_t)));
+        }
+    }
+    else if (0 == ::_stricmp(Key.c_str(), "LoopbackFastPath"))
+    {
+        if (Value.empty() ||
+            0 == ::_stricmp(Value.c_str(), "False"))
+        {
+            Error = ::RegDeleteKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
+                L"LoopbackFastPath");
+        }
+        else if (0 == ::_stricmp(Value.c_str(), "True"))
+        {
+            DWORD Data = 1;
+            Error = ::RegSetKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
+                L"LoopbackFastPath",
+                REG_DWORD,
+                &Data,
+                sizeof(DWORD));
+        }
+        else
+        {
+            Error = ERROR_INVALID_PARAMETER;
+        }
+    }
+    else if (0 == ::_stricmp(Key.c_str(), "SessionBandwidth"))
+    {
+        if (Value.empty())
+        {
+            Error = ::RegDeleteKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
+                L"SessionBandwidth");
+        }
+        else
+        {
+            DWORD Data = Mile::ToUInt32(Value);
+            Error = ::RegSetKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
+                L"SessionBandwidth",
+                REG_DWORD,
+                &Data,
+                sizeof(DWORD));
+        }
+    }
+    else if (0 == ::_stricmp(Key.c_str(), "SessionBurst"))
+    {
+        if (Value.empty())
+        {
+            Error = ::RegDeleteKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
+                L"SessionBurst");
+        }
+        else
+        {
+            DWORD Data = Mile::ToUInt32(Value);
+            Error = ::RegSetKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
+                L"SessionBurst",
+                REG_DWORD,
+                &Data,
+                sizeof(DWORD));
+        }
+    }
+    else if (0 == ::_stricmp(Key.c_str(), "TotalBandwidth"))
+    {
+        if (Value.empty())
+        {
+            Error = ::RegDeleteKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
+                L"TotalBandwidth");
+        }
+        else
+        {
+            DWORD Data = Mile::ToUInt32(Value);
+            Error = ::RegSetKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
+                L"TotalBandwidth",
+                REG_DWORD,
+                &Data,
+                sizeof(DWORD));
+        }
+    }
+    else if (0 == ::_stricmp(Key.c_str(), "TraceLevel"))
+    {
+        if (Value.empty())
+        {
+            Error = ::RegDeleteKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
+                L"TraceLevel");
+        }
+        else
+        {
+            DWORD Data = Mile::ToUInt32(Value);
+            Error = ::RegSetKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
+                L"TraceLevel",
+                REG_DWORD,
+                &Data,
+                sizeof(DWORD));
+        }
+    }
+    else if (0 == ::_stricmp(Key.c_str(), "TraceSampling"))
+    {
+        if (Value.empty())
+        {
+            Error = ::RegDeleteKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
+                L"TraceSampling");
+        }
+        else
+        {
+            DWORD Data = Mile::ToUInt32(Value);
+            Error = ::RegSetKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
+                L"TraceSampling",
+                REG_DWORD,
+                &Data,
+                sizeof(DWORD));
+        }
+    }
+    else if (0 == ::_stricmp(Key.c_str(), "TraceFile"))
+    {
+        if (Value.empty())
+        {
+            Error = ::RegDeleteKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\"
+                L"SynthRdp\\Configurations",
+                L"TraceFile");
+        }
+        else
+        {
+            std::wstring TraceFile = Mile::ToWideString(CP_UTF8, Value);
+
+            Error = ::RegSetKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\"
+                L"SynthRdp\\Configurations",
+                L"TraceFile",
+                REG_SZ,
+                TraceFile.c_str(),
+                static_cast<DWORD>((TraceFile.size() + 1) * sizeof(wchar_t)));
+        }
+    }
+    else if (0 == ::_stricmp(Key.c_str(), "TcpNoDelay"))
+    {
+        if (Value.empty() ||
+            0 == ::_stricmp(Value.c_str(), "True"))
+        {
+            Error = ::RegDeleteKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
+                L"TcpNoDelay");
+        }
+        else if (0 == ::_stricmp(Value.c_str(), "False"))
+        {
+            DWORD Data = 0;
+            Error = ::RegSetKeyValueW(
+                HKEY_LOCAL_MACHINE,
+                L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
+                L"TcpNoDelay",
+                REG_DWORD,
+                &Data,
+                sizeof(DWORD));
+        }
+        else
+        {
+            Error = ERROR_INVALID_PARAMETER;
+        }
+    }
+    else
+    {
+        Error = ERROR_INVALID_PARAMETER;
+    }
+
+    if (ERROR_SUCCESS == Error)
+    {
+        std::printf(
+            "[Success] SynthRdpUpdateConfiguration %s\n",
+            Key.c_str());
+    }
+    else
+    {
+        std::printf(
+            "[Error] SynthRdpUpdateConfiguration %s (%d)\n",
+            Key.c_str(),
+            Error);
+    }
+
+    return Error;
+}
+
+LONG64 SynthRdpGetOngoingTime(
+    _In_ LONG64 Time,
+    _In_ LONG64 StartTime)
+{
+    if (StartTime)
+    {
+        // Include the current period which is not ended yet.
+        Time += (::SynthRdpStatisticsGetSystemTime() - StartTime) / 10;
+    }
+    return Time;
+}
+
+LONG64 SynthRdpGetBackpressureTime(
+    _In_ const SynthRdpStatisticsDirection* Statistics)
+{
+    return ::SynthRdpGetOngoingTime(
+        Statistics->BackpressureTime,
+        Statistics->BackpressureStartTime);
+}
+
+// The reads from the VMBus pipe are paused when the server is slower, and the
+// reads from the server are paused when the VMBus peer on the host is slower.
+const char* SynthRdpGetLimitingSide(
+    _In_ const SynthRdpStatisticsDirection* Vmbus2Tcp,
+    _In_ const SynthRdpStatisticsDirection* Tcp2Vmbus)
+{
+    LONG64 ServerTime = ::SynthRdpGetBackpressureTime(Vmbus2Tcp);
+    LONG64 HostTime = ::SynthRdpGetBackpressureTime(Tcp2Vmbus);
+    if (!ServerTime && !HostTime)
+    {
+        return "None";
+    }
+    return (ServerTime >= HostTime) ? "Server" : "Host";
+}
+
+void SynthRdpPrintStatisticsDirection(
+    _In_ const char* Name,
+    _In_ const SynthRdpStatisticsDirection* Statistics)
+{
+    std::printf(
+        "  %s:\n"
+        "    Bytes: %lld\n"
+        "    Chunks: %lld\n"
+        "    Read Requests: %lld (%lld us pending)\n"
+        "    Write Requests: %lld (%lld us pending)\n"
+        "    Queued Bytes: %lld (%lld peak)\n"
+        "    Backpressure: %lld times (%lld us paused)\n"
+        "    Throttle: %lld times (%lld us deferred)\n"
+        "    Chunk Sizes: <=64B %lld, <=256B %lld, <=1K %lld, <=4K %lld,\n"
+        "                 <=16K %lld, <=64K %lld, <=256K %lld, >256K %lld\n",
+        Name,
+        Statistics->TransferredBytes,
+        Statistics->Chunks,
+        Statistics->ReadRequests,
+        Statistics->ReadWaitTime,
+        Statistics->WriteRequests,
+        Statistics->WriteWaitTime,
+        Statistics->QueuedBytes,
+        Statistics->PeakQueuedBytes,
+        Statistics->BackpressureEvents,
+        ::SynthRdpGetBackpressureTime(Statistics),
+        Statistics->ThrottleEvents,
+        ::SynthRdpGetOngoingTime(
+            Statistics->ThrottleTime,
+            Statistics->ThrottleStartTime),
+        Statistics->ChunkSizeHistogram[0],
+        Statistics->ChunkSizeHistogram[1],
+        Statistics->ChunkSizeHistogram[2],
+        Statistics->ChunkSizeHistogram[3],
+        Statistics->ChunkSizeHistogram[4],
+        Statistics->ChunkSizeHistogram[5],
+        Statistics->ChunkSizeHistogram[6],
+        Statistics->ChunkSizeHistogram[7]);
+
+    bool Framed = false;
+    for (std::size_t i = 0; i < SynthRdpPduClassCount; ++i)
+    {
+        Framed = Framed || 0 != Statistics->ClassPdus[i];
+    }
+    if (Framed)
+    {
+        std::printf("    PDU Classes:\n");
+        for (std::size_t i = 0; i < SynthRdpPduClassCount; ++i)
+        {
+            std::printf(
+                "      %s: %lld PDUs, %lld Bytes\n",
+                SynthRdpPduClassNames[i],
+                Statistics->ClassPdus[i],
+                Statistics->ClassBytes[i]);
+        }
+    }
+}
+
+struct SynthRdpCaptureReader
+{
+    HANDLE File;
+    HANDLE Mapping;
+    const SynthRdpCaptureHeader* Header;
+};
+
+void SynthRdpCaptureCloseReader(
+    _Inout_ SynthRdpCaptureReader& Reader)
+{
+    if (Reader.Header)
+    {
+        ::UnmapViewOfFile(Reader.Header);
+        Reader.Header = nullptr;
+    }
+
+    if (Reader.Mapping)
+    {
+        ::CloseHandle(Reader.Mapping);
+        Reader.Mapping = nullptr;
+    }
+
+    if (INVALID_HANDLE_VALUE != Reader.File)
+    {
+        ::CloseHandle(Reader.File);
+        Reader.File = INVALID_HANDLE_VALUE;
+    }
+}
+
+DWORD SynthRdpCaptureOpenReader(
+    _In_ std::string const& Path,
+    _Out_ SynthRdpCaptureReader& Reader)
+{
+    Reader.File = INVALID_HANDLE_VALUE;
+    Reader.Mapping = nullptr;
+    Reader.Header = nullptr;
+
+    DWORD Error = ERROR_SUCCESS;
+
+    do
+    {
+        // The capture file may be still written by the running service.
+        Reader.File = ::CreateFileW(
+            Mile::ToWideString(CP_UTF8, Path).c_str(),
+            GENERIC_READ,
+            FILE_SHARE_READ | FILE_SHARE_WRITE,
+            nullptr,
+            OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL,
+            nullptr);
+        if (INVALID_HANDLE_VALUE == Reader.File)
+        {
+            Error = ::GetLastError();
+            break;
+        }
+
+        Reader.Mapping = ::CreateFileMappingW(
+            Reader.File,
+            nullptr,
+            PAGE_READONLY,
+            0,
+            0,
+            nullptr);
+        if (!Reader.Mapping)
+        {
+            Error = ::GetLastError();
+            break;
+        }
+
+        Reader.Header = reinterpret_cast<const SynthRdpCaptureHeader*>(
+            ::MapViewOfFile(Reader.Mapping, FILE_MAP_READ, 0, 0, 0));
+        if (!Reader.Header)
+        {
+            Error = ::GetLastError();
+            break;
+        }
+
+        LARGE_INTEGER FileSize;
+        if (!::GetFileSizeEx(Reader.File, &FileSize))
+        {
+            Error = ::GetLastError();
+            break;
+        }
+
+        if (SynthRdpCaptureSignature != Reader.Header->Signature ||
+            SynthRdpCaptureVersion != Reader.Header->Version ||
+            Reader.Header->RingSize <= 0 ||
+            Reader.Header->RingSize % 8 ||
+            static_cast<LONG64>(sizeof(SynthRdpCaptureHeader)) +
+            Reader.Header->RingSize > FileSize.QuadPart)
+        {
+            Error = ERROR_REVISION_MISMATCH;
+            break;
+        }
+
+    } while (false);
+
+    if (ERROR_SUCCESS != Error)
+    {
+        ::SynthRdpCaptureCloseReader(Reader);
+    }
+
+    return Error;
+}
+
+// Return the position of the oldest committed record which is not overwritten,
+// or -1 if there is none.
+LONG64 SynthRdpCaptureFindFirstRecord(
+    _In_ SynthRdpCaptureReader const& Reader)
+{
+    const SynthRdpCaptureHeader* Header = Reader.Header;
+    LONG64 WritePosition = Header->WritePosition;
+    LONG64 Position = WritePosition - Header->RingSize;
+    if (Position <= 0)
+    {
+        return WritePosition ? 0 : -1;
+    }
+
+    // The records are 8-byte aligned, and each record contains its own
+    // position, so the first complete record can be found by scanning.
+    for (; Position < WritePosition; Position += 8)
+    {
+        LONG64 Current = 0;
+        ::SynthRdpCaptureReadRing(Header, Position, &Current, sizeof(Current));
+        if (Current == Position)
+        {
+            return Position;
+        }
+    }
+
+    return -1;
+}
+
+// Read the record at the position and move the position to the next record.
+// Return false if the record is not committed yet or overwritten while
+// reading.
+bool SynthRdpCaptureReadRecord(
+    _In_ SynthRdpCaptureReader const& Reader,
+    _Inout_ LONG64& Position,
+    _Out_ SynthRdpCaptureRecord& Record,
+    _Out_ std::vector<std::uint8_t>& Data)
+{
+    const SynthRdpCaptureHeader* Header = Reader.Header;
+
+    LONG64 WritePosition = Header->WritePosition;
+    if (Position < 0 ||
+        Position + static_cast<LONG64>(sizeof(Record)) > WritePosition)
+    {
+        return false;
+    }
+
+    ::SynthRdpCaptureReadRing(Header, Position, &Record, sizeof(Record));
+    LONG64 RecordSize = ::SynthRdpCaptureGetRecordSize(Record.Length);
+    if (Record.Position != Position ||
+        (SynthRdpCaptureDirection::Vmbus2Tcp != Record.Direction &&
+            SynthRdpCaptureDirection::Tcp2Vmbus != Record.Direction) ||
+        RecordSize > Header->RingSize ||
+        Position + RecordSize > WritePosition)
+    {
+        return false;
+    }
+
+    Data.resize(Record.Length);
+    if (Record.Length)
+    {
+        ::SynthRdpCaptureReadRing(
+            Header,
+            Position + sizeof(SynthRdpCaptureRecord),
+            &Data[0],
+            Record.Length);
+    }
+
+    // Drop the record if the writers have wrapped around it while copying.
+    if (Header->WritePosition - Header->RingSize > Position)
+    {
+        return false;
+    }
+
+    Position += RecordSize;
+    return true;
+}
+
+void SynthRdpAppendBigEndian(
+    _Inout_ std::vector<std::uint8_t>& Buffer,
+    _In_ std::uint32_t Value,
+    _In_ std::size_t Size)
+{
+    for (std::size_t i = Size; i > 0; --i)
+    {
+        Buffer.push_back(static_cast<std::uint8_t>(Value >> (8 * (i - 1))));
+    }
+}
+
+void SynthRdpAppendLittleEndian(
+    _Inout_ std::vector<std::uint8_t>& Buffer,
+    _In_ std::uint32_t Value,
+    _In_ std::size_t Size)
+{
+    for (std::size_t i = 0; i < Size; ++i)
+    {
+        Buffer.push_back(static_cast<std::uint8_t>(Value >> (8 * i)));
+    }
+}
+
+// The maximum TCP payload in the IPv4 packet.
+const DWORD SynthRdpPcapMaximumSegmentSize = 65535 - 40;
+
+// LINKTYPE_RAW, which means the packets start with the IPv4 header.
+const std::uint32_t SynthRdpPcapLinkType = 101;
+
+// Export the capture as the pcap file with the synthesized IPv4 and TCP
+// headers, which makes the RDP dissectors can be used. The VMBus side is
+// 10.0.0.1 and the server side is 10.0.0.2:3389.
+int SynthRdpExportCapture(
+    _In_ std::string const& CapturePath,
+    _In_ std::string const& OutputPath)
+{
+    DWORD Error = ERROR_SUCCESS;
+
+    SynthRdpCaptureReader Reader;
+    HANDLE OutputFile = INVALID_HANDLE_VALUE;
+
+    do
+    {
+        Error = ::SynthRdpCaptureOpenReader(CapturePath, Reader);
+        if (ERROR_SUCCESS != Error)
+        {
+            break;
+        }
+        const SynthRdpCaptureHeader* Header = Reader.Header;
+
+        OutputFile = ::CreateFileW(
+            Mile::ToWideString(CP_UTF8, OutputPath).c_str(),
+            GENERIC_WRITE,
+            0,
+            nullptr,
+            CREATE_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL,
+            nullptr);
+        if (INVALID_HANDLE_VALUE == OutputFile)
+        {
+            Error = ::GetLastError();
+            break;
+        }
+
+        std::vector<std::uint8_t> Buffer;
+        SynthRdpAppendLittleEndian(Buffer, 0xA1B2C3D4, 4);
+        SynthRdpAppendLittleEndian(Buffer, 2, 2);
+        SynthRdpAppendLittleEndian(Buffer, 4, 2);
+        SynthRdpAppendLittleEndian(Buffer, 0, 4);
+        SynthRdpAppendLittleEndian(Buffer, 0, 4);
+        SynthRdpAppendLittleEndian(Buffer, 65535, 4);
+        SynthRdpAppendLittleEndian(Buffer, SynthRdpPcapLinkType, 4);
+
+        // The next TCP sequence number of each session and direction.
+        std::map<std::uint64_t, std::uint32_t> Sequences;
+        std::uint64_t RecordCount = 0;
+        std::uint64_t TotalBytes = 0;
+        std::uint32_t SessionCount = 0;
+
+        // The FILETIME epoch is 1601, and the pcap epoch is 1970.
+        LONG64 StartTime =
+            (Header->StartTime - 116444736000000000LL) / 10;
+
+        SynthRdpCaptureRecord Record;
+        std::vector<std::uint8_t> Data;
+        LONG64 Position = ::SynthRdpCaptureFindFirstRecord(Reader);
+        while (ERROR_SUCCESS == Error &&
+            ::SynthRdpCaptureReadRecord(Reader, Position, Record, Data))
+        {
+            bool FromGuest =
+                (SynthRdpCaptureDirection::Vmbus2Tcp == Record.Direction);
+            std::uint64_t Key =
+                (static_cast<std::uint64_t>(Record.SessionId) << 1) |
+                (FromGuest ? 0 : 1);
+            if (Sequences.end() == Sequences.find(Key & ~1ULL) &&
+                Sequences.end() == Sequences.find(Key | 1ULL))
+            {
+                ++SessionCount;
+            }
+            std::uint32_t& Sequence = Sequences[Key];
+            std::uint32_t Acknowledgement = Sequences[Key ^ 1];
+
+            LONG64 Elapsed = Record.Timestamp - Header->StartTimestamp;
+            LONG64 Time = StartTime +
+                Elapsed / Header->Frequency * 1000000 +
+                Elapsed % Header->Frequency * 1000000 / Header->Frequency;
+
+            std::uint16_t GuestPort = static_cast<std::uint16_t>(
+                49152 + Record.SessionId % 16384);
+
+            for (DWORD Offset = 0; Offset < Record.Length || !Offset;)
+            {
+                DWORD Length = (std::min)(
+                    Record.Length - Offset,
+                    SynthRdpPcapMaximumSegmentSize);
+                std::uint32_t PacketLength = 40 + Length;
+
+                SynthRdpAppendLittleEndian(
+                    Buffer,
+                    static_cast<std::uint32_t>(Time / 1000000),
+                    4);
+                SynthRdpAppendLittleEndian(
+                    Buffer,
+                    static_cast<std::uint32_t>(Time % 1000000),
+                    4);
+                SynthRdpAppendLittleEndian(Buffer, PacketLength, 4);
+                SynthRdpAppendLittleEndian(Buffer, PacketLength, 4);
+
+                // IPv4 header with DF, TTL 128 and TCP.
+                std::size_t IpHeaderOffset = Buffer.size();
+                SynthRdpAppendBigEndian(Buffer, 0x4500, 2);
+                SynthRdpAppendBigEndian(Buffer, PacketLength, 2);
+                SynthRdpAppendBigEndian(Buffer, 0x00004000, 4);
+                SynthRdpAppendBigEndian(Buffer, 0x8006, 2);
+                SynthRdpAppendBigEndian(Buffer, 0, 2);
+                SynthRdpAppendBigEndian(
+                    Buffer,
+                    FromGuest ? 0x0A000001 : 0x0A000002,
+                    4);
+                SynthRdpAppendBigEndian(
+                    Buffer,
+                    FromGuest ? 0x0A000002 : 0x0A000001,
+                    4);
+                std::uint32_t Checksum = 0;
+                for (std::size_t i = 0; i < 20; i += 2)
+                {
+                    Checksum += (Buffer[IpHeaderOffset + i] << 8) |
+                        Buffer[IpHeaderOffset + i + 1];
+                }
+                Checksum = (Checksum & 0xFFFF) + (Checksum >> 16);
+                Checksum = ~(Checksum + (Checksum >> 16)) & 0xFFFF;
+                Buffer[IpHeaderOffset + 10] =
+                    static_cast<std::uint8_t>(Checksum >> 8);
+                Buffer[IpHeaderOffset + 11] =
+                    static_cast<std::uint8_t>(Checksum);
+
+                // TCP header with PSH and ACK, and the checksum is omitted.
+                SynthRdpAppendBigEndian(
+                    Buffer,
+                    FromGuest ? GuestPort : 3389,
+                    2);
+                SynthRdpAppendBigEndian(
+                    Buffer,
+                    FromGuest ? 3389 : GuestPort,
+                    2);
+                SynthRdpAppendBigEndian(Buffer, Sequence, 4);
+                SynthRdpAppendBigEndian(Buffer, Acknowledgement, 4);
+                SynthRdpAppendBigEndian(Buffer, 0x5018, 2);
+                SynthRdpAppendBigEndian(Buffer, 0xFFFF, 2);
+                SynthRdpAppendBigEndian(Buffer, 0, 4);
+
+                if (Length)
+                {
+                    Buffer.insert(
+                        Buffer.end(),
+                        Data.begin() + Offset,
+                        Data.begin() + Offset + Length);
+                }
+
+                Sequence += Length;
+                Offset += Length;
+                if (!Length)
+                {
+                    break;
+                }
+            }
+
+            ++RecordCount;
+            TotalBytes += Record.Length;
+
+            // Flush the buffer periodically to limit the memory usage.
+            if (Buffer.size() >= 1024 * 1024)
+            {
+                DWORD NumberOfBytesWritten = 0;
+                if (!::MileWriteFile(
+                    OutputFile,
+                    &Buffer[0],
+                    static_cast<DWORD>(Buffer.size()),
+                    &NumberOfBytesWritten))
+                {
+                    Error = ::GetLastError();
+                }
+                Buffer.clear();
+            }
+        }
+        if (ERROR_SUCCESS != Error)
+        {
+            break;
+        }
+
+        if (!Buffer.empty())
+        {
+            DWORD NumberOfBytesWritten = 0;
+            if (!::MileWriteFile(
+                OutputFile,
+                &Buffer[0],
+                static_cast<DWORD>(Buffer.size()),
+                &NumberOfBytesWritten))
+            {
+                Error = ::GetLastError();
+                break;
+            }
+        }
+
+        std::printf(
+            "Exported %llu records (%llu Bytes) of %u sessions.\n"
+            "\n",
+            RecordCount,
+            TotalBytes,
+            SessionCount);
+
+    } while (false);
+
+    if (INVALID_HANDLE_VALUE != OutputFile)
+    {
+        ::CloseHandle(OutputFile);
+    }
+
+    ::SynthRdpCaptureCloseReader(Reader);
+
+    if (ERROR_SUCCESS != Error)
+    {
+        std::printf("[Error] SynthRdpExportCapture (%d)\n", Error);
+    }
+
+    return Error;
+}
+
+struct SynthRdpReplayChunk
+{
+    DWORD Offset;
+    DWORD Length;
+    // The capture timestamp, which is converted to the microseconds since the
+    // start of the session before replaying.
+    LONG64 Time;
+    LONG64 volatile SendTimestamp;
+};
+
+struct SynthRdpReplayStream
+{
+    SynthRdpRelayEndpoint* Sender;
+    SynthRdpRelayEndpoint* Receiver;
+    std::vector<std::uint8_t> Data;
+    std::vector<SynthRdpReplayChunk> Chunks;
+    bool Timed;
+    bool Succeeded;
+    bool Mismatched;
+    LONGLONG StartTime;
+    LONGLONG FinishTime;
+    std::vector<LONG64> Latencies;
+};
+
+struct SynthRdpReplaySession
+{
+    // Indexed by SynthRdpCaptureDirection.
+    SynthRdpReplayStream Streams[2];
+};
+
+struct SynthRdpReplayResult
+{
+    double Throughput[2];
+    LONG64 P50[2];
+    LONG64 P99[2];
+    double ProcessorTime;
+};
+
+// The relative change of the throughput or the p50 latency which is treated
+// as the regression when comparing with the baseline.
+const double SynthRdpReplayTolerance = 10.0;
+
+void SynthRdpReplaySend(
+    _Inout_ SynthRdpReplayStream* Stream,
+    _In_ HANDLE Event)
+{
+    for (SynthRdpReplayChunk& Chunk : Stream->Chunks)
+    {
+        if (Stream->Timed)
+        {
+            // Sleep for the coarse part because of the timer resolution, and
+            // yield for the rest to keep the original timing.
+            for (;;)
+            {
+                LONG64 Delay = Chunk.Time -
+                    ::SynthRdpStatisticsGetElapsedTime(Stream->StartTime);
+                if (Delay <= 0)
+                {
+                    break;
+                }
+                if (Delay > 20000)
+                {
+                    ::Sleep(static_cast<DWORD>((Delay - 20000) / 1000));
+                }
+                else
+                {
+                    ::SwitchToThread();
+                }
+            }
+        }
+
+        Chunk.SendTimestamp = ::SynthRdpStatisticsGetTimestamp();
+
+        DWORD Offset = 0;
+        while (Offset < Chunk.Length)
+        {
+            DWORD Transferred = 0;
+            if (!::SynthRdpBenchmarkTransfer(
+                Stream->Sender,
+                Event,
+                true,
+                &Stream->Data[Chunk.Offset + Offset],
+                Chunk.Length - Offset,
+                &Transferred) || !Transferred)
+            {
+                return;
+            }
+            Offset += Transferred;
+        }
+    }
+}
+
+void SynthRdpReplayReceive(
+    _Inout_ SynthRdpReplayStream* Stream,
+    _In_ HANDLE Event)
+{
+    std::vector<std::uint8_t> Buffer(65536);
+
+    std::size_t Total = Stream->Data.size();
+    std::size_t Received = 0;
+    std::size_t NextChunk = 0;
+
+    Stream->Latencies.reserve(Stream->Chunks.size());
+
+    while (Received < Total)
+    {
+        DWORD Transferred = 0;
+        if (!::SynthRdpBenchmarkTransfer(
+            Stream->Receiver,
+            Event,
+            false,
+            &Buffer[0],
+            static_cast<DWORD>(Buffer.size()),
+            &Transferred))
+        {
+            return;
+        }
+        if (!Transferred &&
+            SynthRdpRelayEndpointType::Socket == Stream->Receiver->Type)
+        {
+            return;
+        }
+        LONGLONG Now = ::SynthRdpStatisticsGetTimestamp();
+
+        // The relay must deliver the same byte stream as the capture.
+        if (Transferred > Total - Received)
+        {
+            Stream->Mismatched = true;
+            Transferred = static_cast<DWORD>(Total - Received);
+        }
+        if (0 != std::memcmp(&Buffer[0], &Stream->Data[Received], Transferred))
+        {
+            Stream->Mismatched = true;
+        }
+        Received += Transferred;
+
+        // The relay may split or merge the chunks, so the latency of a chunk
+        // is measured when its last byte is received.
+        while (NextChunk < Stream->Chunks.size())
+        {
+            SynthRdpReplayChunk& Chunk = Stream->Chunks[NextChunk];
+            if (Chunk.Offset + Chunk.Length > Received)
+            {
+                break;
+            }
+            Stream->Latencies.push_back(::SynthRdpStatisticsToMicroseconds(
+                Now - Chunk.SendTimestamp));
+            ++NextChunk;
+        }
+
+        Stream->FinishTime = Now;
+    }
+
+    Stream->Succeeded = true;
+}
+
+DWORD SynthRdpReplayRunSession(
+    _Inout_ SynthRdpReplaySession* Session)
+{
+    DWORD Error = ERROR_SUCCESS;
+
+    SOCKET ListenSocket = INVALID_SOCKET;
+    SynthRdpRelayEndpoint Guest;
+    SynthRdpRelayEndpoint Server;
+
+    std::vector<HANDLE> Threads;
+
+    do
+    {
+        Error = ::SynthRdpBenchmarkOpenEndpoints(
+            SynthRdpBenchmarkTransport::TcpLoopback,
+            &ListenSocket,
+            &Guest,
+            &Server);
+        if (ERROR_SUCCESS != Error)
+        {
+            break;
+        }
+
+        LONGLONG StartTime = ::SynthRdpStatisticsGetTimestamp();
+
+        for (SynthRdpReplayStream& Stream : Session->Streams)
+        {
+            bool FromGuest = (&Stream == &Session->Streams[static_cast<
+                std::size_t>(SynthRdpCaptureDirection::Vmbus2Tcp)]);
+            Stream.Sender = FromGuest ? &Guest : &Server;
+            Stream.Receiver = FromGuest ? &Server : &Guest;
+            Stream.StartTime = StartTime;
+            Stream.FinishTime = StartTime;
+            if (Stream.Data.empty())
+            {
+                Stream.Succeeded = true;
+                continue;
+            }
+
+            SynthRdpReplayStream* Current = &Stream;
+            Threads.push_back(::SynthRdpBenchmarkCreateStubThread(
+                [Current](HANDLE Event)
+                {
+                    ::SynthRdpReplayReceive(Current, Event);
+                }));
+            Threads.push_back(::SynthRdpBenchmarkCreateStubThread(
+                [Current](HANDLE Event)
+                {
+                    ::SynthRdpReplaySend(Current, Event);
+                }));
+        }
+
+    } while (false);
+
+    for (HANDLE& Thread : Threads)
+    {
+        if (Thread)
+        {
+            ::WaitForSingleObject(Thread, INFINITE);
+            ::CloseHandle(Thread);
+        }
+    }
+
+    ::SynthRdpBenchmarkCloseEndpoints(ListenSocket, &Guest, &Server);
+
+    return Error;
+}
+
+DWORD SynthRdpReplayLoadCapture(
+    _In_ std::string const& CapturePath,
+    _In_ bool Timed,
+    _Out_ std::map<DWORD, SynthRdpReplaySession>& Sessions)
+{
+    Sessions.clear();
+
+    SynthRdpCaptureReader Reader;
+    DWORD Error = ::SynthRdpCaptureOpenReader(CapturePath, Reader);
+    if (ERROR_SUCCESS != Error)
+    {
+        return Error;
+    }
+
+    SynthRdpCaptureRecord Record;
+    std::vector<std::uint8_t> Data;
+    LONG64 Position = ::SynthRdpCaptureFindFirstRecord(Reader);
+    while (::SynthRdpCaptureReadRecord(Reader, Position, Record, Data))
+    {
+        if (!Record.Length)
+        {
+            continue;
+        }
+
+        SynthRdpReplayStream& Stream = Sessions[Record.SessionId].Streams[
+            static_cast<std::size_t>(Record.Direction)];
+
+        SynthRdpReplayChunk Chunk;
+        Chunk.Offset = static_cast<DWORD>(Stream.Data.size());
+        Chunk.Length = Record.Length;
+        Chunk.Time = Record.Timestamp;
+        Chunk.SendTimestamp = 0;
+        Stream.Chunks.push_back(Chunk);
+        Stream.Data.insert(Stream.Data.end(), Data.begin(), Data.end());
+    }
+
+    LONG64 Frequency = Reader.Header->Frequency;
+
+    ::SynthRdpCaptureCloseReader(Reader);
+
+    for (auto& Current : Sessions)
+    {
+        SynthRdpReplaySession& Session = Current.second;
+
+        LONG64 FirstTimestamp = MAXLONG64;
+        for (SynthRdpReplayStream& Stream : Session.Streams)
+        {
+            if (!Stream.Chunks.empty())
+            {
+                FirstTimestamp = (std::min)(
+                    FirstTimestamp,
+                    Stream.Chunks.front().Time);
+            }
+        }
+
+        for (SynthRdpReplayStream& Stream : Session.Streams)
+        {
+            Stream.Timed = Timed;
+            Stream.Succeeded = false;
+            Stream.Mismatched = false;
+            for (SynthRdpReplayChunk& Chunk : Stream.Chunks)
+            {
+                LONG64 Elapsed = Chunk.Time - FirstTimestamp;
+                Chunk.Time = Elapsed / Frequency * 1000000 +
+                    Elapsed % Frequency * 1000000 / Frequency;
+            }
+        }
+    }
+
+    return ERROR_SUCCESS;
+}
+
+DWORD SynthRdpReplayReadBaseline(
+    _In_ std::string const& Path,
+    _Out_ std::string& Mode,
+    _Out_ SynthRdpReplayResult& Result)
+{
+    HANDLE FileHandle = ::CreateFileW(
+        Mile::ToWideString(CP_UTF8, Path).c_str(),
+        GENERIC_READ,
+        FILE_SHARE_READ,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr);
+    if (INVALID_HANDLE_VALUE == FileHandle)
+    {
+        return ::GetLastError();
+    }
+
+    DWORD Error = ERROR_SUCCESS;
+
+    char Content[512] = { 0 };
+    DWORD NumberOfBytesRead = 0;
+    if (!::MileReadFile(
+        FileHandle,
+        Content,
+        sizeof(Content) - 1,
+        &NumberOfBytesRead))
+    {
+        Error = ::GetLastError();
+    }
+
+    ::CloseHandle(FileHandle);
+
+    char ModeBuffer[16] = { 0 };
+    if (ERROR_SUCCESS == Error && 8 != std::sscanf(
+        Content,
+        "SynthRdpReplay %15s %lf %lld %lld %lf %lld %lld %lf",
+        ModeBuffer,
+        &Result.Throughput[0],
+        &Result.P50[0],
+        &Result.P99[0],
+        &Result.Throughput[1],
+        &Result.P50[1],
+        &Result.P99[1],
+        &Result.ProcessorTime))
+    {
+        Error = ERROR_INVALID_DATA;
+    }
+    Mode = ModeBuffer;
+
+    return Error;
+}
+
+DWORD SynthRdpReplayWriteBaseline(
+    _In_ std::string const& Path,
+    _In_ std::string const& Mode,
+    _In_ SynthRdpReplayResult const& Result)
+{
+    HANDLE FileHandle = ::CreateFileW(
+        Mile::ToWideString(CP_UTF8, Path).c_str(),
+        GENERIC_WRITE,
+        0,
+        nullptr,
+        CREATE_NEW,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr);
+    if (INVALID_HANDLE_VALUE == FileHandle)
+    {
+        return ::GetLastError();
+    }
+
+    DWORD Error = ERROR_SUCCESS;
+
+    std::string Content = Mile::FormatString(
+        "SynthRdpReplay %s %.3f %lld %lld %.3f %lld %lld %.3f\n",
+        Mode.c_str(),
+        Result.Throughput[0],
+        Result.P50[0],
+        Result.P99[0],
+        Result.Throughput[1],
+        Result.P50[1],
+        Result.P99[1],
+        Result.ProcessorTime);
+    DWORD NumberOfBytesWritten = 0;
+    if (!::MileWriteFile(
+        FileHandle,
+        Content.c_str(),
+        static_cast<DWORD>(Content.size()),
+        &NumberOfBytesWritten))
+    {
+        Error = ::GetLastError();
+    }
+
+    ::CloseHandle(FileHandle);
 
     return Error;
 }
 
-int SynthRdpUpdateConfiguration(
-    std::string const& Key,
-    std::string const& Value)
+double SynthRdpReplayGetDelta(
+    _In_ double Current,
+    _In_ double Baseline)
 {
-    DWORD Error = ERROR_SUCCESS;
+    return Baseline > 0 ? (Current - Baseline) * 100 / Baseline : 0.0;
+}
 
-    if (0 == ::_stricmp(Key.c_str(), "DisableRemoteDesktop"))
+// Replay the captured sessions one by one through the relay with the stand-in
+// endpoints, and compare the result with the baseline file if specified. The
+// baseline file is created if it doesn't exist.
+int SynthRdpReplayCapture(
+    _In_ std::string const& CapturePath,
+    _In_ std::string const& Mode,
+    _In_ std::string const& BaselinePath)
+{
+    bool Timed = (0 == ::_stricmp(Mode.c_str(), "Timed"));
+    if (!Timed && !Mode.empty() && 0 != ::_stricmp(Mode.c_str(), "Fast"))
     {
-        DWORD Data = 1;
-        if (Value.empty() ||
-            0 == ::_stricmp(Value.c_str(), "True"))
-        {
-            // Use the default value.
-        }
-        else if (0 == ::_stricmp(Value.c_str(), "False"))
-        {
-            Data = 0;
-        }
-        else
-        {
-            Error = ERROR_INVALID_PARAMETER;
-        }
+        std::printf(
+            "[Error] SynthRdpReplayCapture (%d)\n",
+            ERROR_INVALID_PARAMETER);
+        return ERROR_INVALID_PARAMETER;
+    }
+    std::string ModeName = Timed ? "Timed" : "Fast";
 
-        if (ERROR_SUCCESS == Error)
-        {
-            Error = ::RegSetKeyValueW(
-                HKEY_LOCAL_MACHINE,
-                L"SYSTEM\\CurrentControlSet\\Control\\Terminal Server",
-                L"fDenyTSConnections",
-                REG_DWORD,
-                &Data,
-                sizeof(DWORD));
-        }
+    std::map<DWORD, SynthRdpReplaySession> Sessions;
+    DWORD Error = ::SynthRdpReplayLoadCapture(CapturePath, Timed, Sessions);
+    if (ERROR_SUCCESS != Error)
+    {
+        std::printf("[Error] SynthRdpReplayCapture (%d)\n", Error);
+        return Error;
     }
-    else if (0 == ::_stricmp(Key.c_str(), "EnableUserAuthentication"))
+
+    Error = ::SynthRdpBenchmarkStartup();
+    if (ERROR_SUCCESS != Error)
     {
-        DWORD Data = 1;
-        if (Value.empty() ||
-            0 == ::_stricmp(Value.c_str(), "True"))
+        std::printf("[Error] SynthRdpReplayCapture (%d)\n", Error);
+        return Error;
+    }
+
+    LONG64 Bytes[2] = { 0 };
+    LONG64 Elapsed[2] = { 0 };
+    std::vector<LONG64> Latencies[2];
+    bool Mismatched = false;
+    LONG64 ProcessorTime = ::SynthRdpBenchmarkGetRelayProcessorTime();
+
+    for (auto& Current : Sessions)
+    {
+        SynthRdpReplaySession& Session = Current.second;
+
+        Error = ::SynthRdpReplayRunSession(&Session);
+        if (ERROR_SUCCESS != Error)
         {
-            // Use the default value.
+            break;
         }
-        else if (0 == ::_stricmp(Value.c_str(), "False"))
+
+        for (std::size_t i = 0; i < 2; ++i)
         {
-            Data = 0;
+            SynthRdpReplayStream& Stream = Session.Streams[i];
+            if (!Stream.Succeeded)
+            {
+                Error = ERROR_BROKEN_PIPE;
+                break;
+            }
+            Mismatched = Mismatched || Stream.Mismatched;
+            Bytes[i] += Stream.Data.size();
+            Elapsed[i] += ::SynthRdpStatisticsToMicroseconds(
+                Stream.FinishTime - Stream.StartTime);
+            Latencies[i].insert(
+                Latencies[i].end(),
+                Stream.Latencies.begin(),
+                Stream.Latencies.end());
         }
-        else
+        if (ERROR_SUCCESS != Error)
         {
-            Error = ERROR_INVALID_PARAMETER;
+            break;
         }
+    }
 
-        if (ERROR_SUCCESS == Error)
-        {
-            Error = ::RegSetKeyValueW(
-                HKEY_LOCAL_MACHINE,
-                L"SYSTEM\\CurrentControlSet\\Control\\Terminal Server\\"
-                L"WinStations\\RDP-Tcp",
-                L"UserAuthentication",
-                REG_DWORD,
-                &Data,
-                sizeof(DWORD));
-        }
+    ProcessorTime = ::SynthRdpBenchmarkGetRelayProcessorTime() - ProcessorTime;
+
+    ::SynthRdpBenchmarkCleanup();
+
+    if (ERROR_SUCCESS != Error)
+    {
+        std::printf("[Error] SynthRdpReplayCapture (%d)\n", Error);
+        return Error;
     }
-    else if (0 == ::_stricmp(Key.c_str(), "DisableBlankPassword"))
+
+    SynthRdpReplayResult Result;
+    double TotalMegabytes = 0.0;
+    for (std::size_t i = 0; i < 2; ++i)
     {
-        DWORD Data = 1;
-        if (Value.empty() ||
-            0 == ::_stricmp(Value.c_str(), "True"))
-        {
-            // Use the default value.
-        }
-        else if (0 == ::_stricmp(Value.c_str(), "False"))
+        double Megabytes = static_cast<double>(Bytes[i]) / (1024 * 1024);
+        TotalMegabytes += Megabytes;
+        Result.Throughput[i] =
+            Elapsed[i] ? Megabytes * 1000000 / Elapsed[i] : 0.0;
+
+        std::sort(Latencies[i].begin(), Latencies[i].end());
+        std::size_t Count = Latencies[i].size();
+        Result.P50[i] = Count ? Latencies[i][Count * 50 / 100] : 0;
+        Result.P99[i] = Count ? Latencies[i][Count * 99 / 100] : 0;
+    }
+    Result.ProcessorTime = TotalMegabytes > 0
+        ? ProcessorTime / 10000.0 * 1024 / TotalMegabytes
+        : 0.0;
+
+    SynthRdpReplayResult Baseline;
+    bool HasBaseline = false;
+    if (!BaselinePath.empty())
+    {
+        std::string BaselineMode;
+        Error = ::SynthRdpReplayReadBaseline(
+            BaselinePath,
+            BaselineMode,
+            Baseline);
+        if (ERROR_SUCCESS == Error)
         {
-            Data = 0;
+            if (0 != ::_stricmp(BaselineMode.c_str(), ModeName.c_str()))
+            {
+                Error = ERROR_INVALID_PARAMETER;
+            }
+            HasBaseline = true;
         }
-        else
+        else if (ERROR_FILE_NOT_FOUND == Error)
         {
-            Error = ERROR_INVALID_PARAMETER;
+            Error = ::SynthRdpReplayWriteBaseline(
+                BaselinePath,
+                ModeName,
+                Result);
         }
-
-        if (ERROR_SUCCESS == Error)
+        if (ERROR_SUCCESS != Error)
         {
-            Error = ::RegSetKeyValueW(
-                HKEY_LOCAL_MACHINE,
-                L"SYSTEM\\CurrentControlSet\\Control\\Lsa",
-                L"LimitBlankPasswordUse",
-                REG_DWORD,
-                &Data,
-                sizeof(DWORD));
+            std::printf("[Error] SynthRdpReplayCapture (%d)\n", Error);
+            return Error;
         }
     }
-    else if (0 == ::_stricmp(Key.c_str(), "OverrideSystemImplementation"))
+
+    std::printf(
+        "Replay (%s, %u sessions):\n",
+        ModeName.c_str(),
+        static_cast<std::uint32_t>(Sessions.size()));
+
+    const char* Names[] =
     {
-        if (Value.empty() ||
-            0 == ::_stricmp(Value.c_str(), "False"))
-        {
-            Error = ::RegDeleteKeyValueW(
-                HKEY_LOCAL_MACHINE,
-                L"SOFTWARE\\Microsoft\\Virtual Machine\\Guest",
-                L"DisableEnhancedSessionConsoleConnection");
-        }
-        else if (0 == ::_stricmp(Value.c_str(), "True"))
+        "VMBus to TCP",
+        "TCP to VMBus"
+    };
+    bool Regressed = false;
+    for (std::size_t i = 0; i < 2; ++i)
+    {
+        std::printf(
+            "  %s: %lld Bytes, %.2f MB/s, Latency p50 %lld us, "
+            "p99 %lld us.\n",
+            Names[i],
+            Bytes[i],
+            Result.Throughput[i],
+            Result.P50[i],
+            Result.P99[i]);
+        if (!HasBaseline)
         {
-            DWORD Data = 1;
-            Error = ::RegSetKeyValueW(
-                HKEY_LOCAL_MACHINE,
-                L"SOFTWARE\\Microsoft\\Virtual Machine\\Guest",
-                L"DisableEnhancedSessionConsoleConnection",
-                REG_DWORD,
-                &Data,
-                sizeof(DWORD));
+            continue;
         }
-        else
+
+        double ThroughputDelta = ::SynthRdpReplayGetDelta(
+            Result.Throughput[i],
+            Baseline.Throughput[i]);
+        double P50Delta = ::SynthRdpReplayGetDelta(
+            static_cast<double>(Result.P50[i]),
+            static_cast<double>(Baseline.P50[i]));
+        double P99Delta = ::SynthRdpReplayGetDelta(
+            static_cast<double>(Result.P99[i]),
+            static_cast<double>(Baseline.P99[i]));
+        std::printf(
+            "    Baseline: %.2f MB/s (%+.1f%%), Latency p50 %lld us "
+            "(%+.1f%%), p99 %lld us (%+.1f%%).\n",
+            Baseline.Throughput[i],
+            ThroughputDelta,
+            Baseline.P50[i],
+            P50Delta,
+            Baseline.P99[i],
+            P99Delta);
+        if (ThroughputDelta < -SynthRdpReplayTolerance ||
+            P50Delta > SynthRdpReplayTolerance)
         {
-            Error = ERROR_INVALID_PARAMETER;
+            Regressed = true;
         }
     }
-    else if (0 == ::_stricmp(Key.c_str(), "ServerHost"))
+    std::printf(
+        "  Relay: %.1f ms Processor Time per GB.\n",
+        Result.ProcessorTime);
+    if (HasBaseline)
     {
-        if (Value.empty())
+        std::printf(
+            "    Baseline: %.1f ms Processor Time per GB (%+.1f%%).\n",
+            Baseline.ProcessorTime,
+            ::SynthRdpReplayGetDelta(
+                Result.ProcessorTime,
+                Baseline.ProcessorTime));
+    }
+    std::printf(
+        "  Data: %s.\n"
+        "\n",
+        Mismatched ? "Mismatched" : "Matched");
+
+    if (Mismatched)
+    {
+        Error = ERROR_INVALID_DATA;
+    }
+    else if (Regressed)
+    {
+        Error = ERROR_TIMEOUT;
+    }
+    if (ERROR_SUCCESS != Error)
+    {
+        std::printf("[Error] SynthRdpReplayCapture (%d)\n", Error);
+    }
+
+    return Error;
+}
+
+int SynthRdpShowStatistics()
+{
+    DWORD Error = ERROR_SUCCESS;
+
+    HANDLE Mapping = nullptr;
+    SynthRdpStatisticsHeader* Header = nullptr;
+
+    do
+    {
+        Mapping = ::OpenFileMappingW(
+            FILE_MAP_READ,
+            FALSE,
+            SynthRdpStatisticsMappingName);
+        if (!Mapping)
         {
-            Error = ::RegDeleteKeyValueW(
-                HKEY_LOCAL_MACHINE,
-                L"SYSTEM\\CurrentControlSet\\Services\\"
-                L"SynthRdp\\Configurations",
-                L"ServerHost");
+            Error = ::GetLastError();
+            break;
         }
-        else
+
+        Header = reinterpret_cast<SynthRdpStatisticsHeader*>(
+            ::MapViewOfFile(Mapping, FILE_MAP_READ, 0, 0, 0));
+        if (!Header)
         {
-            std::wstring ServerHost = Mile::ToWideString(CP_UTF8, Value);
+            Error = ::GetLastError();
+            break;
+        }
 
-            Error = ::RegSetKeyValueW(
-                HKEY_LOCAL_MACHINE,
-                L"SYSTEM\\CurrentControlSet\\Services\\"
-                L"SynthRdp\\Configurations",
-                L"ServerHost",
-                REG_SZ,
-                ServerHost.c_str(),
-                static_cast<DWORD>((ServerHost.size() + 1) * sizeof(wchar_t)));
+        if (SynthRdpStatisticsSignature != Header->Signature ||
+            SynthRdpStatisticsVersion != Header->Version)
+        {
+            Error = ERROR_REVISION_MISMATCH;
+            break;
         }
-    }
-    else if (0 == ::_stricmp(Key.c_str(), "ServerPort"))
-    {
-        if (Value.empty())
+
+        LONG64 CurrentTime = ::SynthRdpStatisticsGetSystemTime();
+
+        std::printf(
+            "Statistics:\n"
+            "\n"
+            "Process ID: %u\n"
+            "Uptime: %lld ms\n"
+            "Total Sessions: %lld\n"
+            "Discovered Channels: %lld (%lld us average open time)\n"
+            "\n",
+            Header->ProcessId,
+            (CurrentTime - Header->StartTime) / 10000,
+            Header->TotalSessions,
+            Header->DiscoveredChannels,
+            Header->DiscoveredChannels
+                ? Header->ChannelOpenTime / Header->DiscoveredChannels
+                : 0);
+
+        SynthRdpStatisticsSession* Slots =
+            reinterpret_cast<SynthRdpStatisticsSession*>(&Header[1]);
+        for (DWORD i = 0; i < Header->SessionSlotCount; ++i)
         {
-            Error = ::RegDeleteKeyValueW(
-                HKEY_LOCAL_MACHINE,
-                L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
-                L"ServerPort");
+            // Take a snapshot and drop it if the slot is not used or reused
+            // by another session while copying.
+            LONG Generation = Slots[i].Generation;
+            if (!(Generation & 1))
+            {
+                continue;
+            }
+            SynthRdpStatisticsSession Snapshot;
+            std::memcpy(
+                &Snapshot,
+                &Slots[i],
+                sizeof(SynthRdpStatisticsSession));
+            if (Generation != Slots[i].Generation)
+            {
+                continue;
+            }
+
+            std::printf(
+                "Session Slot %u:\n"
+                "  Duration: %lld ms\n"
+                "  Connect Latency: %u us (%u attempts)\n",
+                i,
+                (CurrentTime - Snapshot.StartTime) / 10000,
+                Snapshot.ConnectLatency,
+                Snapshot.ConnectAttempts);
+            ::SynthRdpPrintStatisticsDirection(
+                "VMBus to TCP",
+                &Snapshot.Vmbus2Tcp);
+            ::SynthRdpPrintStatisticsDirection(
+                "TCP to VMBus",
+                &Snapshot.Tcp2Vmbus);
+            std::printf(
+                "  Limiting Side: %s\n"
+                "\n",
+                ::SynthRdpGetLimitingSide(
+                    &Snapshot.Vmbus2Tcp,
+                    &Snapshot.Tcp2Vmbus));
         }
-        else
+
+        std::printf("Finished Sessions:\n");
+        ::SynthRdpPrintStatisticsDirection(
+            "VMBus to TCP",
+            &Header->FinishedVmbus2Tcp);
+        ::SynthRdpPrintStatisticsDirection(
+            "TCP to VMBus",
+            &Header->FinishedTcp2Vmbus);
+        std::printf(
+            "  Limiting Side: %s\n"
+            "\n",
+            ::SynthRdpGetLimitingSide(
+                &Header->FinishedVmbus2Tcp,
+                &Header->FinishedTcp2Vmbus));
+
+        std::printf("Teardown Reasons:\n");
+        for (std::size_t i = 1; i < SynthRdpTeardownReasonCount; ++i)
         {
-            DWORD Data = static_cast<std::uint16_t>(Mile::ToUInt32(Value));
-            Error = ::RegSetKeyValueW(
-                HKEY_LOCAL_MACHINE,
-                L"SYSTEM\\CurrentControlSet\\Services\\SynthRdp\\Configurations",
-                L"ServerPort",
-                REG_DWORD,
-                &Data,
-                sizeof(DWORD));
+            std::printf(
+                "  %s: %lld\n",
+                SynthRdpTeardownReasonNames[i],
+                Header->TeardownReasons[i]);
         }
-    }
-    else
+        std::printf("\n");
+
+    } while (false);
+
+    if (Header)
     {
-        Error = ERROR_INVALID_PARAMETER;
+        ::UnmapViewOfFile(Header);
     }
 
-    if (ERROR_SUCCESS == Error)
+    if (Mapping)
     {
-        std::printf(
-            "[Success] SynthRdpUpdateConfiguration %s\n",
-            Key.c_str());
+        ::CloseHandle(Mapping);
     }
-    else
+
+    if (ERROR_SUCCESS != Error)
     {
-        std::printf(
-            "[Error] SynthRdpUpdateConfiguration %s (%d)\n",
-            Key.c_str(),
-            Error);
+        std::printf("[Error] SynthRdpShowStatistics (%d)\n", Error);
     }
 
     return Error;
@@ -1106,8 +11650,21 @@ int main()
             "[Info] SynthRdp will run as a console application instead of "
             "service.\n"
             "[Info] Use \"SynthRdp Help\" for more commands.\n"
+            "[Info] Press Ctrl+C to stop.\n"
             "\n");
 
+        g_ServiceStopEvent = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
+
+        ::SetConsoleCtrlHandler([](DWORD dwCtrlType) -> BOOL
+        {
+            if (CTRL_C_EVENT == dwCtrlType || CTRL_BREAK_EVENT == dwCtrlType)
+            {
+                ::SynthRdpRequestStop();
+                return TRUE;
+            }
+            return FALSE;
+        }, TRUE);
+
         return ::SynthRdpMain();
     }
 
@@ -1132,9 +11689,25 @@ int main()
             }
         };
 
-        return ::StartServiceCtrlDispatcherW(ServiceStartTable)
-            ? ERROR_SUCCESS :
-            ::GetLastError();
+        // The service may be reported as stopped before the service main
+        // returns when it is handing off, so wait for the remaining sessions.
+        g_ServiceMainFinishedEvent = ::CreateEventW(
+            nullptr,
+            TRUE,
+            FALSE,
+            nullptr);
+
+        if (!::StartServiceCtrlDispatcherW(ServiceStartTable))
+        {
+            return ::GetLastError();
+        }
+
+        if (g_ServiceMainFinishedEvent)
+        {
+            ::WaitForSingleObject(g_ServiceMainFinishedEvent, INFINITE);
+        }
+
+        return ERROR_SUCCESS;
     }
     else if (0 == ::_stricmp(Arguments[1].c_str(), "Install"))
     {
@@ -1152,6 +11725,40 @@ int main()
     {
         Result = ::SynthRdpStopService();
     }
+    else if (0 == ::_stricmp(Arguments[1].c_str(), "Upgrade"))
+    {
+        Result = ::SynthRdpUpgradeService();
+    }
+    else if (0 == ::_stricmp(Arguments[1].c_str(), "Benchmark"))
+    {
+        Result = ::SynthRdpBenchmark(
+            (Arguments.size() > 2) ? Arguments[2] : std::string(),
+            (Arguments.size() > 3) ? Arguments[3] : std::string());
+    }
+    else if (0 == ::_stricmp(Arguments[1].c_str(), "Stats"))
+    {
+        Result = ::SynthRdpShowStatistics();
+    }
+    else if (0 == ::_stricmp(Arguments[1].c_str(), "Replay"))
+    {
+        ParseError = !(Arguments.size() > 2);
+        if (!ParseError)
+        {
+            Result = ::SynthRdpReplayCapture(
+                Arguments[2],
+                (Arguments.size() > 3) ? Arguments[3] : std::string(),
+                (Arguments.size() > 4) ? Arguments[4] : std::string());
+        }
+    }
+    else if (0 == ::_stricmp(Arguments[1].c_str(), "Capture"))
+    {
+        ParseError = !(Arguments.size() > 4 &&
+            0 == ::_stricmp(Arguments[2].c_str(), "Export"));
+        if (!ParseError)
+        {
+            Result = ::SynthRdpExportCapture(Arguments[3], Arguments[4]);
+        }
+    }
     else if (0 == ::_stricmp(Arguments[1].c_str(), "Config"))
     {
         ParseError = !(Arguments.size() > 2);
@@ -1198,6 +11805,44 @@ int main()
             "  Uninstall - Uninstall SynthRdp service.\n"
             "  Start - Start SynthRdp service.\n"
             "  Stop - Stop SynthRdp service.\n"
+            "  Upgrade - Restart SynthRdp service with this binary, and\n"
+            "            hand off the active sessions from the running\n"
+            "            instance to it.\n"
+            "  Stats - Show the relay statistics of the running SynthRdp\n"
+            "          service, or console application.\n"
+            "  Benchmark <Profile> [Impairment] - Measure the relay\n"
+            "                        throughput and latency with the local\n"
+            "                        stub endpoints. Profile can be Bulk,\n"
+            "                        Interactive, Mixed, Parser, Transport,\n"
+            "                        Links or Trace, and all profiles except\n"
+            "                        Transport, Links and Trace will be used\n"
+            "                        if not specified. Parser checks and\n"
+            "                        measures the X.224 Connection Request\n"
+            "                        parser. Transport compares the TCP\n"
+            "                        loopback, the loopback fast path and the\n"
+            "                        AF_UNIX socket to the local server.\n"
+            "                        Links compares the LAN, broadband, WAN\n"
+            "                        and lossy links. Trace measures the cost\n"
+            "                        of each trace event, and compares the\n"
+            "                        Bulk profile with and without the trace.\n"
+            "                        Impairment simulates the link in the\n"
+            "                        format Name=Value;... and Name can be\n"
+            "                        Latency, Jitter, StallInterval and\n"
+            "                        StallDuration in milliseconds, Bandwidth\n"
+            "                        in KB/s or Loss in percent, with the\n"
+            "                        optional Upstream. or Downstream. prefix\n"
+            "                        for one direction only.\n"
+            "  Capture Export <CaptureFile> <PcapFile> - Export the session\n"
+            "                                            capture file to the\n"
+            "                                            pcap file.\n"
+            "  Replay <CaptureFile> <Fast|Timed> <BaselineFile> - Replay the\n"
+            "      captured sessions through the relay with the local stub\n"
+            "      endpoints, as fast as possible or at the original\n"
+            "      timing, and verify the relayed data. The throughput and\n"
+            "      latency are compared with the baseline file if it\n"
+            "      exists, or saved to it. The command fails if the data is\n"
+            "      mismatched, or the throughput or p50 latency is\n"
+            "      regressed by more than 10 percent.\n"
             "\n"
             "  Config List - List all configurations related to SynthRdp.\n"
             "  Config Set [Key] <Value> - Set the specific configuration\n"
@@ -1242,11 +11887,164 @@ int main()
             "    Set the server port for the remote desktop connection you\n"
             "    want to use in the Hyper-V Enhanced Session. The default\n"
             "    setting is 3389.\n"
+            "  MaximumSessions <Count>\n"
+            "    Set the maximum number of the concurrent sessions. The\n"
+            "    data channels opened beyond this limit will be queued\n"
+            "    until an active session is finished. The default setting\n"
+            "    is 16. You need to restart the SynthRdp service for\n"
+            "    applying this configuration option change.\n"
+            "  TcpNoDelay <True|False>\n"
+            "    Set False to enable the Nagle algorithm for the connection to\n"
+            "    the remote desktop server. The default setting is True, which\n"
+            "    reduces the input latency because SynthRdp coalesces the\n"
+            "    queued data by itself.\n"
+            "  ConnectionPoolSize <Count>\n"
+            "    Set the number of the idle connections to the remote desktop\n"
+            "    server which are connected in advance for reducing the time\n"
+            "    to the first frame. The default setting is 0, which disables\n"
+            "    the connection pool. You need to restart the SynthRdp service\n"
+            "    for applying this configuration option change.\n"
+            "  ConnectTimeout <Milliseconds>\n"
+            "    Set the timeout of each connection attempt to the remote\n"
+            "    desktop server. SynthRdp tries all IPv4 and IPv6 addresses of\n"
+            "    the server host in parallel with a 250 ms stagger, and uses\n"
+            "    the first established connection. The default setting is\n"
+            "    10000.\n"
+            "  Backends <Host[:Port][@Weight];...>\n"
+            "    Set the remote desktop servers which the sessions are\n"
+            "    balanced across, separated by semicolons. Use the brackets\n"
+            "    for the IPv6 address with the port, like [fe80::1]:3389. The\n"
+            "    port defaults to ServerPort and the weight defaults to 1.\n"
+            "    SynthRdp marks the server down and fails over to the next\n"
+            "    server if the connection fails. The default setting is\n"
+            "    empty, which uses ServerHost and ServerPort.\n"
+            "  BalancingPolicy <LeastSessions|Weighted>\n"
+            "    Set LeastSessions to select the server with the fewest\n"
+            "    active sessions relative to its weight, or Weighted to select\n"
+            "    the servers in a smooth weighted round-robin order. The\n"
+            "    default setting is LeastSessions.\n"
+            "  BackendProbeInterval <Seconds>\n"
+            "    Set the interval of probing the remote desktop servers which\n"
+            "    are marked down when more than one server is set, and the\n"
+            "    servers are used again once they are up. Set 0 to disable\n"
+            "    the probe. The default setting is 10. You need to restart\n"
+            "    the SynthRdp service for applying this configuration option\n"
+            "    change.\n"
+            "  PduFraming <True|False>\n"
+            "    Set True to split the RDP stream at the PDU boundaries, and\n"
+            "    classify the PDUs as input, cursor, graphics, virtual channel\n"
+            "    or control traffic. The write requests end right after the\n"
+            "    input and cursor PDUs to make them not wait behind the bulk\n"
+            "    data, and the per-class counters are shown in the Stats\n"
+            "    command. The default setting is False. You need to restart\n"
+            "    the SynthRdp service for applying this configuration option\n"
+            "    change.\n"
+            "  CaptureFile <Path>\n"
+            "    Set the file which SynthRdp records the relayed data of all\n"
+            "    sessions into, which can be exported by the Capture Export\n"
+            "    command. The file is used as a ring buffer, so the oldest\n"
+            "    records are overwritten when it is full. The default setting\n"
+            "    is empty, which disables the capture. You need to restart\n"
+            "    the SynthRdp service for applying this configuration option\n"
+            "    change.\n"
+            "  CaptureSize <Megabytes>\n"
+            "    Set the size of the ring buffer in the capture file. The\n"
+            "    default setting is 64. You need to restart the SynthRdp\n"
+            "    service for applying this configuration option change.\n"
+            "  QueueHighWatermark <Kilobytes>\n"
+            "    Set the queued bytes in each direction which pause the reads\n"
+            "    from the source until the target catches up. The default\n"
+            "    setting is 256. You need to restart the SynthRdp service for\n"
+            "    applying this configuration option change.\n"
+            "  QueueLowWatermark <Kilobytes>\n"
+            "    Set the queued bytes in each direction which resume the\n"
+            "    paused reads. The default setting is 64. The Stats command\n"
+            "    shows the queued bytes and the paused time, which tell\n"
+            "    whether the server or the host is the limiting side. You\n"
+            "    need to restart the SynthRdp service for applying this\n"
+            "    configuration option change.\n"
+            "  KeepAliveTime <Milliseconds>\n"
+            "    Set the idle time before SynthRdp sends the TCP keepalive\n"
+            "    probes on the connection to the remote desktop server, which\n"
+            "    closes the session if the server is gone. Set 0 to disable\n"
+            "    the TCP keepalive. The default setting is 60000.\n"
+            "  KeepAliveInterval <Milliseconds>\n"
+            "    Set the interval between the TCP keepalive probes which are\n"
+            "    not acknowledged. The default setting is 1000.\n"
+            "  IdleTimeout <Seconds>\n"
+            "    Set the time after which the session without any data in\n"
+            "    both directions is closed. The default setting is 0, which\n"
+            "    disables the idle timeout. You need to restart the SynthRdp\n"
+            "    service for applying this configuration option change.\n"
+            "  StallTimeout <Seconds>\n"
+            "    Set the time after which the session is closed if the queued\n"
+            "    data in either direction is not written to the target. Set 0\n"
+            "    to disable the check. The default setting is 120. The Stats\n"
+            "    command shows the reasons why the sessions were closed. You\n"
+            "    need to restart the SynthRdp service for applying this\n"
+            "    configuration option change.\n"
+            "  Forwards <ServiceId=[Host:]Port;...>\n"
+            "    Set the Hyper-V socket service IDs which are forwarded to\n"
+            "    the TCP ports, and the host is 127.0.0.1 if not specified.\n"
+            "    The service IDs need to be registered on the Hyper-V host,\n"
+            "    and the forwarded connections are counted in\n"
+            "    MaximumSessions. The default setting is empty. You need to\n"
+            "    restart the SynthRdp service for applying this\n"
+            "    configuration option change.\n"
+            "  LoopbackFastPath <True|False>\n"
+            "    Set True to enable the TCP loopback fast path for the\n"
+            "    connection to the remote desktop server on this virtual\n"
+            "    machine, which only takes effect if the server enables it\n"
+            "    too. The default setting is False. Use unix:<Path> as the\n"
+            "    server host instead if the server listens on the AF_UNIX\n"
+            "    socket, which bypasses the TCP stack on Windows 10 Version\n"
+            "    1803 or later.\n"
+            "  SessionBandwidth <KilobytesPerSecond>\n"
+            "    Set the bandwidth limit of each session in each direction,\n"
+            "    which keeps a single session from saturating the Hyper-V\n"
+            "    host. The default setting is 0, which disables the limit.\n"
+            "    You need to restart the SynthRdp service for applying this\n"
+            "    configuration option change.\n"
+            "  SessionBurst <Kilobytes>\n"
+            "    Set the data which each session can send at once under\n"
+            "    SessionBandwidth after it is idle. The default setting is\n"
+            "    256. You need to restart the SynthRdp service for applying\n"
+            "    this configuration option change.\n"
+            "  TotalBandwidth <KilobytesPerSecond>\n"
+            "    Set the bandwidth limit of all sessions. The sessions which\n"
+            "    compete for it take turns with 16 KB each, so the\n"
+            "    interactive sessions are not starved by the bulk transfers.\n"
+            "    The default setting is 0, which disables the limit. The\n"
+            "    Stats command shows how often and how long the writes were\n"
+            "    deferred by the limits. You need to restart the SynthRdp\n"
+            "    service for applying this configuration option change.\n"
+            "  TraceLevel <0|1|2>\n"
+            "    Set the level of the relay events which are traced when\n"
+            "    SynthRdp runs as a console application or TraceFile is set.\n"
+            "    0 disables the trace, 1 traces the events of each session,\n"
+            "    and 2 also traces each relayed chunk. The events are\n"
+            "    recorded by the relay threads without any lock and formatted\n"
+            "    in the background. The default setting is 1. You need to\n"
+            "    restart the SynthRdp service for applying this configuration\n"
+            "    option change.\n"
+            "  TraceSampling <Count>\n"
+            "    Set to trace only one of each Count relayed chunks. The\n"
+            "    default setting is 1. You need to restart the SynthRdp\n"
+            "    service for applying this configuration option change.\n"
+            "  TraceFile <Path>\n"
+            "    Set the file which the trace is written into instead of the\n"
+            "    console, which also enables the trace for the SynthRdp\n"
+            "    service. The default setting is empty. You need to restart\n"
+            "    the SynthRdp service for applying this configuration option\n"
+            "    change.\n"
             "\n"
             "Notes:\n"
             "  - All command options are case-insensitive.\n"
             "  - SynthRdp will run as a console application instead of\n"
             "    service if you don't specify another command.\n"
+            "  - The active sessions are only handed off by Upgrade on\n"
+            "    Windows 8.1 or later, and the sessions which are not handed\n"
+            "    off stay in the previous instance until they are finished.\n"
             "\n"
             "Examples:\n"
             "\n"
@@ -1254,6 +12052,18 @@ int main()
             "  SynthRdp Uninstall\n"
             "  SynthRdp Start\n"
             "  SynthRdp Stop\n"
+            "  SynthRdp Upgrade\n"
+            "  SynthRdp Stats\n"
+            "  SynthRdp Benchmark\n"
+            "  SynthRdp Benchmark Mixed\n"
+            "  SynthRdp Benchmark Parser\n"
+            "  SynthRdp Benchmark Transport\n"
+            "  SynthRdp Benchmark Links\n"
+            "  SynthRdp Benchmark Trace\n"
+            "  SynthRdp Benchmark Mixed Latency=50;Jitter=10\n"
+            "  SynthRdp Capture Export C:\\SynthRdp.cap C:\\SynthRdp.pcap\n"
+            "  SynthRdp Replay C:\\SynthRdp.cap\n"
+            "  SynthRdp Replay C:\\SynthRdp.cap Timed C:\\SynthRdp.baseline\n"
             "\n"
             "  SynthRdp Config List\n"
             "\n"
@@ -1263,6 +12073,31 @@ int main()
             "  SynthRdp Config Set OverrideSystemImplementation False\n"
             "  SynthRdp Config Set ServerHost 127.0.0.1\n"
             "  SynthRdp Config Set ServerPort 3389\n"
+            "  SynthRdp Config Set MaximumSessions 16\n"
+            "  SynthRdp Config Set TcpNoDelay True\n"
+            "  SynthRdp Config Set ConnectionPoolSize 2\n"
+            "  SynthRdp Config Set ConnectTimeout 10000\n"
+            "  SynthRdp Config Set Backends 10.0.0.1;10.0.0.2@2\n"
+            "  SynthRdp Config Set BalancingPolicy Weighted\n"
+            "  SynthRdp Config Set BackendProbeInterval 30\n"
+            "  SynthRdp Config Set PduFraming True\n"
+            "  SynthRdp Config Set CaptureFile C:\\SynthRdp.cap\n"
+            "  SynthRdp Config Set CaptureSize 256\n"
+            "  SynthRdp Config Set QueueHighWatermark 1024\n"
+            "  SynthRdp Config Set QueueLowWatermark 256\n"
+            "  SynthRdp Config Set KeepAliveTime 60000\n"
+            "  SynthRdp Config Set KeepAliveInterval 1000\n"
+            "  SynthRdp Config Set IdleTimeout 3600\n"
+            "  SynthRdp Config Set StallTimeout 120\n"
+            "  SynthRdp Config Set Forwards "
+            "00000016-facb-11e6-bd58-64006a7986d3=22\n"
+            "  SynthRdp Config Set LoopbackFastPath True\n"
+            "  SynthRdp Config Set SessionBandwidth 4096\n"
+            "  SynthRdp Config Set SessionBurst 512\n"
+            "  SynthRdp Config Set TotalBandwidth 16384\n"
+            "  SynthRdp Config Set TraceLevel 2\n"
+            "  SynthRdp Config Set TraceSampling 100\n"
+            "  SynthRdp Config Set TraceFile C:\\SynthRdp.log\n"
             "\n"
             "  SynthRdp Config Set DisableRemoteDesktop\n"
             "  SynthRdp Config Set EnableUserAuthentication\n"
@@ -1270,6 +12105,30 @@ int main()
             "  SynthRdp Config Set OverrideSystemImplementation\n"
             "  SynthRdp Config Set ServerHost\n"
             "  SynthRdp Config Set ServerPort\n"
+            "  SynthRdp Config Set MaximumSessions\n"
+            "  SynthRdp Config Set TcpNoDelay\n"
+            "  SynthRdp Config Set ConnectionPoolSize\n"
+            "  SynthRdp Config Set ConnectTimeout\n"
+            "  SynthRdp Config Set Backends\n"
+            "  SynthRdp Config Set BalancingPolicy\n"
+            "  SynthRdp Config Set BackendProbeInterval\n"
+            "  SynthRdp Config Set PduFraming\n"
+            "  SynthRdp Config Set CaptureFile\n"
+            "  SynthRdp Config Set CaptureSize\n"
+            "  SynthRdp Config Set QueueHighWatermark\n"
+            "  SynthRdp Config Set QueueLowWatermark\n"
+            "  SynthRdp Config Set KeepAliveTime\n"
+            "  SynthRdp Config Set KeepAliveInterval\n"
+            "  SynthRdp Config Set IdleTimeout\n"
+            "  SynthRdp Config Set StallTimeout\n"
+            "  SynthRdp Config Set Forwards\n"
+            "  SynthRdp Config Set LoopbackFastPath\n"
+            "  SynthRdp Config Set SessionBandwidth\n"
+            "  SynthRdp Config Set SessionBurst\n"
+            "  SynthRdp Config Set TotalBandwidth\n"
+            "  SynthRdp Config Set TraceLevel\n"
+            "  SynthRdp Config Set TraceSampling\n"
+            "  SynthRdp Config Set TraceFile\n"
             "\n");
     }
 